@@ -0,0 +1,618 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The bench program is a load generator for a running server. It opens many
+ * connections spread over a few threads, each thread driving its own
+ * io_service, and issues a configurable mix of GET, PUT, and DEL requests
+ * against a fixed key space chosen uniformly or by a Zipfian distribution.
+ *
+ * In closed loop (the default) each connection keeps --pipeline requests
+ * outstanding and sends the next as soon as one completes. In open loop
+ * (--rate) requests arrive as a Poisson process at the given total rate
+ * whether or not earlier ones have completed, and each latency is measured
+ * from when its request was due rather than when it was sent, so a stalled
+ * server is charged for the requests it held up.
+ *
+ * With --replica, connections are spread evenly over the server and its
+ * replicas, and connections to a replica issue only GETs, so read
+ * throughput can be measured as replicas are added.
+ *
+ * Latencies are recorded in histograms per thread and merged at the end;
+ * the results are printed as a table, or as JSON with --json.
+ */
+
+#ifndef BENCH_H
+#define BENCH_H
+
+#include "histogram.hpp"
+#include "kvclient.cc"
+#include "message.hpp"
+#include "workload.hpp"
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstdlib>
+#include <deque>
+#include <iomanip>
+#include <iostream>
+#include <memory>
+#include <random>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+struct bench_options {
+  std::string host;
+  std::string port;
+  int connections = 16;
+  int threads = 1;
+  double duration = 10;   // Seconds measured
+  double warmup = 1;      // Seconds run before measuring
+  int get_percent = 90;   // The rest of the mix is PUT, then DEL
+  int put_percent = 10;
+  size_t keys = 100000;
+  size_t value_min = 32;  // Value sizes are uniform over [min, max]
+  size_t value_max = 32;
+  double zipf = 0;        // Zipfian skew in (0, 1); 0 picks keys uniformly
+  double rate = 0;        // Total requests per second; 0 is closed loop
+  int pipeline = 1;       // Requests each connection keeps outstanding
+  protocol_type protocol = TEXT_PROTOCOL;
+  bool preload = true;
+  bool json = false;
+  std::vector<std::string> replicas; // host:port of each, read from only
+};
+
+// Results of one thread, merged once every thread has stopped
+struct bench_results {
+  histogram latency[3]; // GET, PUT, DEL, in nanoseconds
+  uint64_t misses = 0;  // GETs and DELs of absent keys
+  uint64_t errors = 0;  // Failed PUTs and broken connections
+  uint64_t unanswered = 0;
+
+  static int slot(message_type type) {
+    return type == GET ? 0 : type == PUT ? 1 : 2;
+  }
+
+  void merge(const bench_results &other) {
+    for (int i = 0; i < 3; i++) {
+      latency[i].merge(other.latency[i]);
+    }
+    misses += other.misses;
+    errors += other.errors;
+    unanswered += other.unanswered;
+  }
+};
+
+class bench_connection {
+public:
+  using clock = std::chrono::steady_clock;
+
+  bench_connection(boost::asio::io_service &io_service,
+                   const bench_options &options,
+                   const key_chooser &chooser,
+                   const std::string &values,
+                   bench_results &results,
+                   unsigned seed,
+                   bool reads_only = false)
+      : socket(io_service),
+        timer(io_service),
+        options(options),
+        chooser(chooser),
+        values(values),
+        results(results),
+        random(seed),
+        reads_only(reads_only) {}
+
+  // Connect and negotiate the protocol before any load is generated
+  void connect(tcp::resolver::results_type endpoints) {
+    boost::asio::connect(socket, endpoints);
+    socket.set_option(tcp::no_delay(true));
+    if (options.protocol == BINARY_PROTOCOL) {
+      boost::asio::write(socket, boost::asio::buffer("PROTO BINARY\n", 13));
+      boost::asio::read_until(
+          socket, boost::asio::dynamic_buffer(incoming), '\n');
+      if (incoming.compare(0, 2, "OK") != 0) {
+        throw std::runtime_error("bench: server refused binary protocol");
+      }
+      incoming.clear();
+    }
+  }
+
+  // Start generating load; measurement covers requests due in
+  // [measure_start, measure_end)
+  void start(clock::time_point measure_start, clock::time_point measure_end) {
+    this->measure_start = measure_start;
+    this->measure_end = measure_end;
+    read();
+    if (options.rate > 0) {
+      mean_gap = options.connections / options.rate;
+      next_due = clock::now();
+      schedule();
+    } else {
+      for (int i = 0; i < options.pipeline; i++) {
+        issue(clock::now());
+      }
+    }
+  }
+
+  // Stop issuing requests; the connection closes once the rest complete
+  void stop() {
+    stopping = true;
+    timer.cancel();
+    close_if_idle();
+  }
+
+  // Give up on requests still outstanding
+  void abandon() {
+    results.unanswered += in_flight.size();
+    in_flight.clear();
+    close();
+  }
+
+private:
+  struct pending {
+    message_type type;
+    clock::time_point due;
+  };
+
+  tcp::socket socket;
+  boost::asio::steady_timer timer;
+  const bench_options &options;
+  const key_chooser &chooser;
+  const std::string &values;
+  bench_results &results;
+  std::mt19937_64 random;
+  bool reads_only; // Connected to a replica, which refuses writes
+
+  clock::time_point measure_start;
+  clock::time_point measure_end;
+  clock::time_point next_due; // Open loop: when the next request arrives
+  double mean_gap = 0;        // Open loop: mean seconds between arrivals
+  std::deque<pending> in_flight;
+  std::string outgoing; // Encoded requests waiting for the current write
+  std::string writing;  // Requests being written
+  std::string incoming; // Response bytes not yet parsed
+  uint32_t request_id = 0;
+  bool stopping = false;
+  bool closed = false;
+
+  // Queue one request due at due, choosing its type, key, and value size
+  void issue(clock::time_point due) {
+    int roll = std::uniform_int_distribution<int>(0, 99)(random);
+    message_type type = roll < options.get_percent || reads_only ? GET
+                        : roll < options.get_percent + options.put_percent
+                            ? PUT
+                            : DEL;
+    std::string key = key_chooser::key(chooser.next(random));
+    size_t length = std::uniform_int_distribution<size_t>(
+        options.value_min, options.value_max)(random);
+    encode_request(outgoing,
+                   options.protocol,
+                   type,
+                   key,
+                   std::string_view(values).substr(0, length),
+                   ++request_id);
+    in_flight.push_back({type, due});
+    if (writing.empty()) {
+      write();
+    }
+  }
+
+  void write() {
+    writing.swap(outgoing);
+    boost::asio::async_write(
+        socket,
+        boost::asio::buffer(writing),
+        [this](const boost::system::error_code &error, size_t) {
+          writing.clear();
+          if (error) {
+            fail();
+          } else if (!outgoing.empty()) {
+            write();
+          }
+        });
+  }
+
+  // Open loop: issue every request that has come due, then sleep until
+  // the next arrival
+  void schedule() {
+    timer.expires_at(next_due);
+    timer.async_wait([this](const boost::system::error_code &error) {
+      if (error || stopping) {
+        return;
+      }
+      std::exponential_distribution<double> gap(1 / mean_gap);
+      for (clock::time_point now = clock::now(); next_due <= now;) {
+        issue(next_due);
+        next_due += std::chrono::duration_cast<clock::duration>(
+            std::chrono::duration<double>(gap(random)));
+      }
+      schedule();
+    });
+  }
+
+  void read() {
+    size_t offset = incoming.size();
+    incoming.resize(offset + 64 * 1024);
+    socket.async_read_some(
+        boost::asio::buffer(&incoming[offset], incoming.size() - offset),
+        [this, offset](const boost::system::error_code &error, size_t n) {
+          incoming.resize(offset + n);
+          if (error) {
+            if (error != boost::asio::error::operation_aborted) {
+              fail();
+            }
+            return;
+          }
+          complete_responses();
+          if (!closed) {
+            read();
+          }
+        });
+  }
+
+  // Parse every complete response buffered and record its latency
+  void complete_responses() {
+    size_t consumed = 0;
+    while (!in_flight.empty()) {
+      bool ok;
+      if (options.protocol == BINARY_PROTOCOL) {
+        binary_header header;
+        if (incoming.size() - consumed < BINARY_HEADER_SIZE) {
+          break;
+        }
+        if (!header.read(&incoming[consumed])) {
+          fail();
+          return;
+        }
+        size_t frame = BINARY_HEADER_SIZE + header.body_length();
+        if (incoming.size() - consumed < frame) {
+          break;
+        }
+        ok = header.opcode == OK;
+        consumed += frame;
+      } else {
+        size_t newline = incoming.find('\n', consumed);
+        if (newline == std::string::npos) {
+          break;
+        }
+        ok = incoming.compare(consumed, 2, "OK") == 0;
+        consumed = newline + 1;
+      }
+      record(in_flight.front(), ok);
+      in_flight.pop_front();
+      if (options.rate <= 0 && !stopping) {
+        issue(clock::now());
+      }
+    }
+    incoming.erase(0, consumed);
+    close_if_idle();
+  }
+
+  void record(const pending &request, bool ok) {
+    if (request.due < measure_start || request.due >= measure_end) {
+      return;
+    }
+    if (!ok && request.type == PUT) {
+      results.errors++;
+    } else if (!ok) {
+      results.misses++;
+    }
+    results.latency[bench_results::slot(request.type)].record(
+        std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() -
+                                                             request.due)
+            .count());
+  }
+
+  void close_if_idle() {
+    if (stopping && in_flight.empty()) {
+      close();
+    }
+  }
+
+  void fail() {
+    if (!closed) {
+      results.errors++;
+      abandon();
+    }
+  }
+
+  void close() {
+    closed = true;
+    timer.cancel();
+    boost::system::error_code ignored;
+    socket.close(ignored);
+  }
+};
+
+static void usage() {
+  std::cerr
+      << "Usage: bench <host> <port> [--connections n] [--threads n]\n"
+         "             [--duration s] [--warmup s] [--mix get:put:del]\n"
+         "             [--keys n] [--value-size n|min-max] [--zipf theta]\n"
+         "             [--rate ops/s | --pipeline depth] [--binary]\n"
+         "             [--no-preload] [--json] [--replica host:port]..."
+      << std::endl;
+}
+
+static bool parse_options(int argc, char *argv[], bench_options &options) {
+  if (argc < 3) {
+    return false;
+  }
+  options.host = argv[1];
+  options.port = argv[2];
+  for (int i = 3; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--binary") {
+      options.protocol = BINARY_PROTOCOL;
+      continue;
+    } else if (arg == "--no-preload") {
+      options.preload = false;
+      continue;
+    } else if (arg == "--json") {
+      options.json = true;
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    std::string value = argv[++i];
+    if (arg == "--connections") {
+      options.connections = std::max(1, atoi(value.c_str()));
+    } else if (arg == "--threads") {
+      options.threads = std::max(1, atoi(value.c_str()));
+    } else if (arg == "--duration") {
+      options.duration = atof(value.c_str());
+    } else if (arg == "--warmup") {
+      options.warmup = atof(value.c_str());
+    } else if (arg == "--keys") {
+      options.keys = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+    } else if (arg == "--zipf") {
+      options.zipf = atof(value.c_str());
+    } else if (arg == "--rate") {
+      options.rate = atof(value.c_str());
+    } else if (arg == "--pipeline") {
+      options.pipeline = std::max(1, atoi(value.c_str()));
+    } else if (arg == "--mix") {
+      int get, put, del;
+      if (sscanf(value.c_str(), "%d:%d:%d", &get, &put, &del) != 3 ||
+          get < 0 || put < 0 || del < 0 || get + put + del != 100) {
+        return false;
+      }
+      options.get_percent = get;
+      options.put_percent = put;
+    } else if (arg == "--replica" && value.rfind(':') != std::string::npos) {
+      options.replicas.push_back(value);
+    } else if (arg == "--value-size") {
+      size_t dash = value.find('-');
+      options.value_min = strtoull(value.c_str(), nullptr, 10);
+      options.value_max =
+          dash == std::string::npos
+              ? options.value_min
+              : strtoull(value.c_str() + dash + 1, nullptr, 10);
+      if (options.value_min == 0 || options.value_max < options.value_min) {
+        return false;
+      }
+    } else {
+      return false;
+    }
+  }
+  return options.zipf >= 0 && options.zipf < 1 && options.duration > 0;
+}
+
+// Store every key once so GETs hit, in batches over one connection
+static void preload(const bench_options &options, const std::string &values) {
+  boost::asio::io_service io_service;
+  kvclient client(io_service, options.host, options.port, options.protocol);
+  std::mt19937_64 random(1);
+  std::vector<std::string> keys, batch_values;
+  std::vector<bool> stored;
+  for (size_t i = 0; i < options.keys; i++) {
+    keys.push_back(key_chooser::key(i));
+    size_t length = std::uniform_int_distribution<size_t>(
+        options.value_min, options.value_max)(random);
+    batch_values.push_back(values.substr(0, length));
+    if (keys.size() == 1000 || i + 1 == options.keys) {
+      client.async_mput(keys,
+                        batch_values,
+                        [](const std::vector<bool> &,
+                           const std::vector<std::string> &) {});
+      keys.clear();
+      batch_values.clear();
+    }
+  }
+  client.wait();
+}
+
+static void print_text(const bench_options &options,
+                       const bench_results &results,
+                       const histogram &all) {
+  std::cout << "bench: " << options.connections << " connections on "
+            << options.threads << " threads, "
+            << (options.rate > 0
+                    ? "open loop at " + std::to_string(int64_t(options.rate)) +
+                          " ops/s"
+                    : "closed loop, pipeline " +
+                          std::to_string(options.pipeline))
+            << ", " << options.keys << " keys "
+            << (options.zipf > 0 ? "zipf " + std::to_string(options.zipf)
+                                 : std::string("uniform"))
+            << (options.replicas.empty()
+                    ? std::string()
+                    : ", " + std::to_string(options.replicas.size()) +
+                          " replicas")
+            << std::endl;
+  std::cout << std::fixed << std::setprecision(1) << "throughput "
+            << all.count() / options.duration << " ops/s, " << results.misses
+            << " misses, " << results.errors << " errors, "
+            << results.unanswered << " unanswered" << std::endl;
+
+  const char *names[] = {"all", "get", "put", "del"};
+  std::cout << std::left << std::setw(6) << "op" << std::right
+            << std::setw(12) << "count" << std::setw(10) << "p50 us"
+            << std::setw(10) << "p99 us" << std::setw(10) << "p99.9 us"
+            << std::setw(10) << "max us" << std::endl;
+  for (int i = 0; i < 4; i++) {
+    const histogram &h = i == 0 ? all : results.latency[i - 1];
+    std::cout << std::left << std::setw(6) << names[i] << std::right
+              << std::setw(12) << h.count() << std::setprecision(1)
+              << std::setw(10) << h.percentile(0.5) / 1e3 << std::setw(10)
+              << h.percentile(0.99) / 1e3 << std::setw(10)
+              << h.percentile(0.999) / 1e3 << std::setw(10) << h.max() / 1e3
+              << std::endl;
+  }
+}
+
+static void print_json(const bench_options &options,
+                       const bench_results &results,
+                       const histogram &all) {
+  auto latency = [](const histogram &h) {
+    std::ostringstream out;
+    out << std::fixed << std::setprecision(3) << "{\"count\": " << h.count()
+        << ", \"mean_us\": " << h.mean() / 1e3
+        << ", \"p50_us\": " << h.percentile(0.5) / 1e3
+        << ", \"p99_us\": " << h.percentile(0.99) / 1e3
+        << ", \"p999_us\": " << h.percentile(0.999) / 1e3
+        << ", \"max_us\": " << h.max() / 1e3 << "}";
+    return out.str();
+  };
+  std::cout << std::fixed << std::setprecision(3) << "{\n"
+            << "  \"config\": {\"connections\": " << options.connections
+            << ", \"threads\": " << options.threads
+            << ", \"duration_s\": " << options.duration
+            << ", \"mode\": \"" << (options.rate > 0 ? "open" : "closed")
+            << "\", \"rate\": " << options.rate
+            << ", \"pipeline\": " << options.pipeline
+            << ", \"mix\": [" << options.get_percent << ", "
+            << options.put_percent << ", "
+            << 100 - options.get_percent - options.put_percent
+            << "], \"keys\": " << options.keys
+            << ", \"zipf\": " << options.zipf
+            << ", \"value_min\": " << options.value_min
+            << ", \"value_max\": " << options.value_max
+            << ", \"protocol\": \""
+            << (options.protocol == BINARY_PROTOCOL ? "binary" : "text")
+            << "\", \"replicas\": " << options.replicas.size() << "},\n"
+            << "  \"ops_per_sec\": " << all.count() / options.duration
+            << ",\n"
+            << "  \"misses\": " << results.misses << ",\n"
+            << "  \"errors\": " << results.errors << ",\n"
+            << "  \"unanswered\": " << results.unanswered << ",\n"
+            << "  \"latency\": {\n"
+            << "    \"all\": " << latency(all) << ",\n"
+            << "    \"get\": " << latency(results.latency[0]) << ",\n"
+            << "    \"put\": " << latency(results.latency[1]) << ",\n"
+            << "    \"del\": " << latency(results.latency[2]) << "\n"
+            << "  }\n"
+            << "}" << std::endl;
+}
+
+int main(int argc, char *argv[]) {
+  using clock = bench_connection::clock;
+
+  bench_options options;
+  if (!parse_options(argc, argv, options)) {
+    usage();
+    return 1;
+  }
+  options.threads = std::min(options.threads, options.connections);
+
+  try {
+    // Values are slices of one printable buffer, valid in either protocol
+    std::string values(options.value_max, '\0');
+    for (size_t i = 0; i < values.size(); i++) {
+      values[i] = 'a' + i % 26;
+    }
+    key_chooser chooser(options.keys, options.zipf);
+    if (options.preload) {
+      preload(options, values);
+    }
+
+    std::vector<std::unique_ptr<boost::asio::io_service>> services;
+    std::vector<bench_results> results(options.threads);
+    std::vector<std::unique_ptr<bench_connection>> connections;
+    boost::asio::io_service resolver_service;
+    tcp::resolver resolver(resolver_service);
+    // The server first, then each replica
+    std::vector<tcp::resolver::results_type> endpoints = {
+        resolver.resolve(options.host, options.port)};
+    for (const std::string &replica : options.replicas) {
+      size_t colon = replica.rfind(':');
+      endpoints.push_back(resolver.resolve(replica.substr(0, colon),
+                                           replica.substr(colon + 1)));
+    }
+    for (int t = 0; t < options.threads; t++) {
+      services.push_back(std::make_unique<boost::asio::io_service>());
+    }
+    for (int c = 0; c < options.connections; c++) {
+      int t = c % options.threads;
+      size_t server = c % endpoints.size();
+      connections.push_back(
+          std::make_unique<bench_connection>(*services[t],
+                                             options,
+                                             chooser,
+                                             values,
+                                             results[t],
+                                             c + 1,
+                                             server > 0));
+      connections.back()->connect(endpoints[server]);
+    }
+
+    clock::time_point measure_start =
+        clock::now() + std::chrono::duration_cast<clock::duration>(
+                           std::chrono::duration<double>(options.warmup));
+    clock::time_point measure_end =
+        measure_start + std::chrono::duration_cast<clock::duration>(
+                            std::chrono::duration<double>(options.duration));
+    for (size_t c = 0; c < connections.size(); c++) {
+      connections[c]->start(measure_start, measure_end);
+    }
+
+    std::vector<std::thread> threads;
+    for (int t = 0; t < options.threads; t++) {
+      threads.emplace_back([&services, t]() { services[t]->run(); });
+    }
+
+    // Stop issuing at the end of the window, give outstanding requests a
+    // second to complete, then abandon the rest
+    std::this_thread::sleep_until(measure_end);
+    for (size_t c = 0; c < connections.size(); c++) {
+      bench_connection *connection = connections[c].get();
+      boost::asio::post(*services[c % options.threads],
+                        [connection]() { connection->stop(); });
+    }
+    std::this_thread::sleep_for(std::chrono::seconds(1));
+    for (size_t c = 0; c < connections.size(); c++) {
+      bench_connection *connection = connections[c].get();
+      boost::asio::post(*services[c % options.threads],
+                        [connection]() { connection->abandon(); });
+    }
+    for (int t = 0; t < options.threads; t++) {
+      threads[t].join();
+    }
+
+    bench_results total;
+    for (int t = 0; t < options.threads; t++) {
+      total.merge(results[t]);
+    }
+    histogram all;
+    for (int i = 0; i < 3; i++) {
+      all.merge(total.latency[i]);
+    }
+    if (options.json) {
+      print_json(options, total, all);
+    } else {
+      print_text(options, total, all);
+    }
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,210 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The cluster program drives a set of running servers through kvcluster. It
+ * writes --keys keys with batched puts fanned out over the servers, reports
+ * how the ring spread them and the batch throughput, and reads them all
+ * back. With --add it then adds another server to the ring and reads the
+ * keys again: the ones now missing are exactly those remapped to the new
+ * server, which should be about 1/N of them and none elsewhere.
+ */
+
+#ifndef CLUSTER_H
+#define CLUSTER_H
+
+#include "kvcluster.cc"
+#include "workload.hpp"
+
+#include <boost/asio.hpp>
+#include <algorithm>
+#include <chrono>
+#include <cstdlib>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+struct cluster_options {
+  std::vector<std::string> nodes; // host:port of each
+  std::string added;              // Added after loading, if set
+  size_t keys = 100000;
+  size_t batch = 1000;
+  size_t connections = 2; // Per node
+  int virtual_nodes = hash_ring::DEFAULT_VIRTUAL_NODES;
+  size_t value_size = 32;
+  protocol_type protocol = TEXT_PROTOCOL;
+};
+
+static void usage() {
+  std::cerr << "Usage: cluster <host:port>... [--add host:port] [--keys n]\n"
+               "               [--batch n] [--connections n]\n"
+               "               [--virtual-nodes n] [--value-size n] [--binary]"
+            << std::endl;
+}
+
+static bool parse_options(int argc, char *argv[], cluster_options &options) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "--binary") {
+      options.protocol = BINARY_PROTOCOL;
+      continue;
+    } else if (arg.rfind("--", 0) != 0) {
+      if (arg.rfind(':') == std::string::npos) {
+        return false;
+      }
+      options.nodes.push_back(arg);
+      continue;
+    }
+    if (i + 1 >= argc) {
+      return false;
+    }
+    std::string value = argv[++i];
+    if (arg == "--add" && value.rfind(':') != std::string::npos) {
+      options.added = value;
+    } else if (arg == "--keys") {
+      options.keys = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+    } else if (arg == "--batch") {
+      options.batch = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+    } else if (arg == "--connections") {
+      options.connections = std::max(1, atoi(value.c_str()));
+    } else if (arg == "--virtual-nodes") {
+      options.virtual_nodes = std::max(1, atoi(value.c_str()));
+    } else if (arg == "--value-size") {
+      options.value_size = std::max(1ull, strtoull(value.c_str(), nullptr, 10));
+    } else {
+      return false;
+    }
+  }
+  return !options.nodes.empty();
+}
+
+// Batches queued before waiting, so several are on the wire at once
+static constexpr size_t BATCHES_IN_FLIGHT = 16;
+
+// Run op on every batch of keys, counting the keys it reports true for, and
+// return the keys per second
+static double run_batches(
+    kvcluster &cluster,
+    const std::vector<std::string> &keys,
+    size_t batch,
+    size_t &counted,
+    std::function<bool(const std::vector<std::string> &,
+                       kvclient::batch_callback)> op) {
+  counted = 0;
+  kvclient::batch_callback count = [&](const std::vector<bool> &ok,
+                                       const std::vector<std::string> &) {
+    counted += std::count(ok.begin(), ok.end(), true);
+  };
+  std::chrono::steady_clock::time_point start =
+      std::chrono::steady_clock::now();
+  size_t queued = 0;
+  for (size_t from = 0; from < keys.size(); from += batch) {
+    std::vector<std::string> part(
+        keys.begin() + from,
+        keys.begin() + std::min(from + batch, keys.size()));
+    if (!op(part, count)) {
+      throw std::runtime_error("cluster: batch could not be sent");
+    }
+    if (++queued % BATCHES_IN_FLIGHT == 0) {
+      cluster.wait();
+    }
+  }
+  cluster.wait();
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return keys.size() / elapsed.count();
+}
+
+int main(int argc, char *argv[]) {
+  cluster_options options;
+  if (!parse_options(argc, argv, options)) {
+    usage();
+    return 1;
+  }
+
+  try {
+    boost::asio::io_service io_service;
+    kvcluster cluster(io_service,
+                      options.nodes,
+                      options.protocol,
+                      options.connections,
+                      options.virtual_nodes);
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < options.keys; i++) {
+      keys.push_back(key_chooser::key(i));
+    }
+    std::string value(options.value_size, 'v');
+
+    size_t stored, found;
+    double put_rate = run_batches(
+        cluster,
+        keys,
+        options.batch,
+        stored,
+        [&](const std::vector<std::string> &part,
+            kvclient::batch_callback done) {
+          return cluster.async_mput(
+              part, std::vector<std::string>(part.size(), value), done);
+        });
+    double get_rate = run_batches(
+        cluster,
+        keys,
+        options.batch,
+        found,
+        [&](const std::vector<std::string> &part,
+            kvclient::batch_callback done) {
+          return cluster.async_mget(part, done);
+        });
+
+    std::cout << std::fixed << std::setprecision(1) << options.nodes.size()
+              << " nodes, " << options.virtual_nodes
+              << " virtual nodes each, " << options.connections
+              << " connections per node\n";
+    for (const std::string &node : cluster.nodes()) {
+      size_t owned = 0;
+      for (const std::string &key : keys) {
+        owned += cluster.node_for(key) == node;
+      }
+      std::cout << "  " << std::left << std::setw(24) << node << std::right
+                << std::setw(10) << owned << " keys  " << std::setw(5)
+                << 100.0 * owned / keys.size() << "%\n";
+    }
+    std::cout << "MPUT  " << std::setw(12) << put_rate << " keys/s  "
+              << stored << " stored\n"
+              << "MGET  " << std::setw(12) << get_rate << " keys/s  " << found
+              << " found\n";
+
+    if (!options.added.empty()) {
+      cluster.add_node(options.added);
+      std::vector<std::string> values;
+      std::vector<bool> ok;
+      size_t remapped = 0, unexpected = 0;
+      for (size_t from = 0; from < keys.size(); from += options.batch) {
+        std::vector<std::string> part(
+            keys.begin() + from,
+            keys.begin() + std::min(from + options.batch, keys.size()));
+        if (!cluster.mget(part, values, ok)) {
+          throw std::runtime_error("cluster: batch could not be read");
+        }
+        for (size_t i = 0; i < part.size(); i++) {
+          bool moved = cluster.node_for(part[i]) == options.added;
+          remapped += moved;
+          unexpected += ok[i] == moved; // Missing but not moved, or found
+        }
+      }
+      std::cout << "Adding " << options.added << " remapped " << remapped
+                << " keys (" << 100.0 * remapped / keys.size()
+                << "%, 1/N is " << 100.0 / cluster.nodes().size() << "%), "
+                << unexpected << " keys not where the ring routes them"
+                << std::endl;
+    }
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+#endif
@@ -0,0 +1,116 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The contended_mutex class is a std::mutex that measures its own
+ * contention: how often it is acquired, how often a locker has to wait, and
+ * for how long in total. An uncontended lock costs one extra try_lock and an
+ * increment made while the lock is held; only lockers that find it taken
+ * read the clock. Waits are also filed by their power of two in
+ * nanoseconds, so each lock keeps a coarse histogram of how long lockers
+ * waited for it.
+ */
+
+#ifndef CONTENDED_MUTEX_H
+#define CONTENDED_MUTEX_H
+
+#include <algorithm>
+#include <atomic>
+#include <bit>
+#include <chrono>
+#include <cstdint>
+#include <mutex>
+
+class contended_mutex {
+public:
+  static constexpr int WAIT_BUCKETS = 40; // Waits up to 2^40 ns, 18 minutes
+
+private:
+  std::mutex mutex;
+  std::atomic<uint64_t> acquired{0};  // Written only while holding mutex
+  std::atomic<uint64_t> contended{0}; // Acquisitions that had to wait
+  std::atomic<uint64_t> waited_ns{0}; // Total time those waited
+  std::atomic<uint64_t> waits[WAIT_BUCKETS] = {}; // By bit width of wait
+
+  void count_acquired() {
+    acquired.store(acquired.load(std::memory_order_relaxed) + 1,
+                   std::memory_order_relaxed);
+  }
+
+public:
+  struct stats {
+    uint64_t acquisitions = 0;
+    uint64_t contentions = 0;
+    uint64_t wait_ns = 0;
+    uint64_t waits[WAIT_BUCKETS] = {}; // Waits under 2^i ns, over 2^(i-1)
+
+    double contention_ratio() const {
+      return acquisitions ? double(contentions) / acquisitions : 0;
+    }
+
+    // An upper bound on the wait that fraction q of contended acquisitions
+    // did not exceed, within a factor of two
+    uint64_t wait_percentile(double q) const {
+      uint64_t rank = uint64_t(q * contentions);
+      uint64_t seen = 0;
+      for (int i = 0; i < WAIT_BUCKETS; i++) {
+        seen += waits[i];
+        if (seen > rank) {
+          return (uint64_t(1) << i) - 1;
+        }
+      }
+      return contentions ? (uint64_t(1) << (WAIT_BUCKETS - 1)) - 1 : 0;
+    }
+
+    stats &operator+=(const stats &other) {
+      acquisitions += other.acquisitions;
+      contentions += other.contentions;
+      wait_ns += other.wait_ns;
+      for (int i = 0; i < WAIT_BUCKETS; i++) {
+        waits[i] += other.waits[i];
+      }
+      return *this;
+    }
+  };
+
+  void lock() {
+    if (!mutex.try_lock()) {
+      std::chrono::steady_clock::time_point start =
+          std::chrono::steady_clock::now();
+      mutex.lock();
+      uint64_t waited = std::chrono::duration_cast<std::chrono::nanoseconds>(
+                            std::chrono::steady_clock::now() - start)
+                            .count();
+      contended.fetch_add(1, std::memory_order_relaxed);
+      waited_ns.fetch_add(waited, std::memory_order_relaxed);
+      int bucket = std::min(int(std::bit_width(waited)), WAIT_BUCKETS - 1);
+      waits[bucket].fetch_add(1, std::memory_order_relaxed);
+    }
+    count_acquired();
+  }
+
+  // A failed try_lock is not counted as contention; the caller chose not
+  // to wait
+  bool try_lock() {
+    if (!mutex.try_lock()) {
+      return false;
+    }
+    count_acquired();
+    return true;
+  }
+
+  void unlock() { mutex.unlock(); }
+
+  // Read the counters without taking the lock
+  stats usage() const {
+    stats s;
+    s.acquisitions = acquired.load(std::memory_order_relaxed);
+    s.contentions = contended.load(std::memory_order_relaxed);
+    s.wait_ns = waited_ns.load(std::memory_order_relaxed);
+    for (int i = 0; i < WAIT_BUCKETS; i++) {
+      s.waits[i] = waits[i].load(std::memory_order_relaxed);
+    }
+    return s;
+  }
+};
+
+#endif
@@ -0,0 +1,369 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The core_server class is a shared-nothing kvserver with one thread per
+ * core. Each core runs its own single-threaded io_context on a thread
+ * pinned to one CPU, accepts on the server's port with an acceptor of its
+ * own bound with SO_REUSEPORT, so the kernel spreads connections across
+ * the cores, and keeps the keys it owns in a private kvstore. A key is
+ * owned by the core chosen by the high bits of its hash, remixed first.
+ * The stores pick a shard and bucket from the hash's remainder and
+ * quotient by their shard count, which depend on every bit, so no bits are
+ * free for the core; the remix keeps a key's core independent of where its
+ * store puts it.
+ *
+ * A connection's requests for its own core's keys are applied directly. A
+ * GET, PUT, or DEL for another core's key travels to the owner over a
+ * lock-free single-producer, single-consumer queue, is applied there, and
+ * comes back on the reverse queue as the response, so each store's locks
+ * and buckets stay in the cache of the core that owns them. A core whose
+ * queues and sockets are idle sleeps in its io_context, and a sender wakes
+ * it with an empty handler. A batch is split by owner the same way: the
+ * session's core applies its own keys, each other owner applies its part
+ * of the batch to its own store and sends it back, and the session merges
+ * the parts into key order, so no core ever takes another's locks.
+ *
+ * STATS reports the server's request metrics but only the store of the
+ * core the connection landed on. Tracking, logging, and snapshots are not
+ * supported in this mode.
+ */
+
+#ifndef CORE_SERVER_H
+#define CORE_SERVER_H
+
+#include "kvserver.cc"
+#include "spsc_queue.hpp"
+
+#include <pthread.h>
+#include <sched.h>
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
+#include <thread>
+#include <vector>
+
+class core_server {
+private:
+  friend class Test;
+  static constexpr std::chrono::milliseconds EXPIRE_INTERVAL{10};
+  static constexpr size_t QUEUE_CAPACITY = 1024;
+
+  // A forwarded request, or with part set a forwarded part of a batch. It
+  // travels to the owning core, which writes the response to out or to the
+  // part, and back to the session's core as the reply.
+  struct core_message {
+    kvhandler *session = nullptr;
+    batch_part *part = nullptr;
+    message_view request;
+    protocol_type protocol = TEXT_PROTOCOL;
+    uint32_t request_id = 0;
+    std::string *out = nullptr;
+    bool answered = false;
+  };
+
+  struct core : public request_router {
+    core_server &server;
+    size_t index;
+    kvstore store;
+    boost::asio::io_context io{1};
+    boost::asio::executor_work_guard<boost::asio::io_context::executor_type>
+        work;
+    tcp::acceptor acceptor;
+    boost::asio::steady_timer expire_timer;
+    // inbox[i] carries messages from core i; a core sends itself nothing
+    std::vector<std::unique_ptr<spsc_queue<core_message>>> inbox;
+    // Messages by destination that found its queue full
+    std::vector<std::deque<core_message>> backlog;
+    size_t backlogged = 0;
+    std::atomic<bool> sleeping{false};
+    std::string scratch; // For restoring newlines in forwarded PUTs
+    std::thread thread;
+
+    core(core_server &server,
+         size_t index,
+         size_t num_cores,
+         unsigned short port)
+        : server(server),
+          index(index),
+          work(io.get_executor()),
+          acceptor(io),
+          expire_timer(io),
+          backlog(num_cores) {
+      for (size_t i = 0; i < num_cores; i++) {
+        inbox.push_back(
+            i == index ? nullptr
+                       : std::make_unique<spsc_queue<core_message>>(
+                             QUEUE_CAPACITY));
+      }
+      tcp::endpoint endpoint(tcp::v4(), port);
+      acceptor.open(endpoint.protocol());
+      acceptor.set_option(tcp::acceptor::reuse_address(true));
+      acceptor.set_option(
+          boost::asio::detail::socket_option::boolean<SOL_SOCKET,
+                                                      SO_REUSEPORT>(true));
+      acceptor.bind(endpoint);
+      acceptor.listen();
+      start_accept();
+      start_expire();
+    }
+
+    void start_accept() {
+      std::shared_ptr<kvsession> session = std::make_shared<kvsession>(
+          io, store, server.metrics, server.tracking);
+      session->route(this);
+      acceptor.async_accept(
+          session->socket(),
+          [this, session](const boost::system::error_code &error) {
+            if (!error) {
+              session->start();
+            }
+            start_accept();
+          });
+    }
+
+    // Reap a slice of expired pairs every EXPIRE_INTERVAL
+    void start_expire() {
+      expire_timer.expires_after(EXPIRE_INTERVAL);
+      expire_timer.async_wait([this](const boost::system::error_code &error) {
+        if (!error) {
+          store.expire();
+          start_expire();
+        }
+      });
+    }
+
+    size_t owner(std::string_view key) const override {
+      return server.core_of(key);
+    }
+
+    size_t local() const override { return index; }
+
+    size_t num_cores() const override { return server.cores.size(); }
+
+    void forward(kvhandler &session,
+                 const message_view &request,
+                 protocol_type protocol,
+                 uint32_t request_id,
+                 std::string &out) override {
+      core_message message;
+      message.session = &session;
+      message.request = request;
+      message.protocol = protocol;
+      message.request_id = request_id;
+      message.out = &out;
+      send(server.core_of(request.key), message);
+    }
+
+    void forward_batch(kvhandler &session,
+                       size_t to,
+                       batch_part &part) override {
+      core_message message;
+      message.session = &session;
+      message.part = &part;
+      send(to, message);
+    }
+
+    void send(size_t to, const core_message &message) {
+      core &destination = *server.cores[to];
+      if (backlog[to].empty() && destination.inbox[index]->push(message)) {
+        destination.wake();
+        return;
+      }
+      backlog[to].push_back(message);
+      backlogged++;
+    }
+
+    // Wake the core if it is sleeping. Called after a push to its inbox.
+    void wake() {
+      // Pairs with the fence in run: either this sees the core sleeping,
+      // or the core sees the push before it sleeps
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      if (sleeping.exchange(false)) {
+        boost::asio::post(io, []() {});
+      }
+    }
+
+    // Retry backlogged messages, then handle those waiting in the inbox:
+    // apply requests and send back their replies, and hand replies to their
+    // sessions. Returns the number of messages handled.
+    size_t drain() {
+      for (size_t to = 0; backlogged && to < backlog.size(); to++) {
+        core &destination = *server.cores[to];
+        bool pushed = false;
+        while (!backlog[to].empty() &&
+               destination.inbox[index]->push(backlog[to].front())) {
+          backlog[to].pop_front();
+          backlogged--;
+          pushed = true;
+        }
+        if (pushed) {
+          destination.wake();
+        }
+      }
+
+      size_t handled = 0;
+      core_message message;
+      for (size_t from = 0; from < inbox.size(); from++) {
+        for (size_t n = 0;
+             n < QUEUE_CAPACITY && inbox[from] && inbox[from]->pop(message);
+             n++) {
+          handled++;
+          if (message.answered) {
+            message.session->forward_done();
+            continue;
+          }
+          if (message.part) {
+            kvhandler::apply_batch(store, *message.part, message.part->out);
+          } else {
+            kvhandler::apply(store,
+                             message.request,
+                             message.protocol,
+                             message.request_id,
+                             scratch,
+                             *message.out);
+          }
+          message.answered = true;
+          send(from, message);
+        }
+      }
+      return handled;
+    }
+
+    // Alternate between the io_context and the inbox until stopped,
+    // sleeping in the io_context when both are idle
+    void run() {
+      while (!io.stopped()) {
+        if (io.poll() + drain() > 0) {
+          continue;
+        }
+        if (backlogged) {
+          std::this_thread::yield(); // A full queue is being drained
+          continue;
+        }
+        sleeping.store(true);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+        if (drain() == 0) {
+          io.run_one();
+        }
+        sleeping.store(false);
+      }
+    }
+  };
+
+  server_metrics metrics;
+  client_tracking tracking; // Tracking is refused, so this stays empty
+  std::vector<std::unique_ptr<core>> cores;
+
+  // The core that owns key, from the high bits of its hash after the
+  // MurmurHash3 finalizer, as hash_ring does
+  size_t core_of(std::string_view key) const {
+    uint64_t hash = std::hash<std::string_view>()(key);
+    hash ^= hash >> 33;
+    hash *= 0xff51afd7ed558ccdull;
+    hash ^= hash >> 33;
+    hash *= 0xc4ceb9fe1a85ec53ull;
+    hash ^= hash >> 33;
+    return size_t(((hash >> 32) * cores.size()) >> 32);
+  }
+
+  // The CPUs this process may run on, for pinning cores in turn
+  static std::vector<int> allowed_cpus() {
+    std::vector<int> cpus;
+    cpu_set_t set;
+    if (sched_getaffinity(0, sizeof(set), &set) == 0) {
+      for (int cpu = 0; cpu < CPU_SETSIZE; cpu++) {
+        if (CPU_ISSET(cpu, &set)) {
+          cpus.push_back(cpu);
+        }
+      }
+    }
+    return cpus;
+  }
+
+public:
+  // Serve on port with num_cores cores, pinned to the allowed CPUs in turn,
+  // so more cores than CPUs share them. Throws boost::system::system_error
+  // if the port cannot be bound.
+  core_server(unsigned short port, size_t num_cores) {
+    num_cores = std::max<size_t>(num_cores, 1);
+    for (size_t i = 0; i < num_cores; i++) {
+      cores.push_back(std::make_unique<core>(*this, i, num_cores, port));
+      port = cores[0]->acceptor.local_endpoint().port(); // When port is 0
+    }
+    std::vector<int> cpus = allowed_cpus();
+    for (size_t i = 0; i < num_cores; i++) {
+      core &c = *cores[i];
+      c.thread = std::thread([&c]() { c.run(); });
+      if (!cpus.empty()) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(cpus[i % cpus.size()], &set);
+        pthread_setaffinity_np(c.thread.native_handle(), sizeof(set), &set);
+      }
+    }
+  }
+
+  core_server(const core_server &) = delete;
+  core_server &operator=(const core_server &) = delete;
+
+  ~core_server() {
+    stop();
+    // Deliver the messages still between cores, so every waiting session
+    // is released before its io_context is destroyed
+    for (size_t handled = 1; handled;) {
+      handled = 0;
+      for (std::unique_ptr<core> &c : cores) {
+        handled += c->drain();
+      }
+    }
+  }
+
+  // Stop every core and wait for its thread to exit
+  void stop() {
+    for (std::unique_ptr<core> &c : cores) {
+      c->io.stop();
+    }
+    for (std::unique_ptr<core> &c : cores) {
+      if (c->thread.joinable()) {
+        c->thread.join();
+      }
+    }
+  }
+
+  unsigned short port() const {
+    return cores[0]->acceptor.local_endpoint().port();
+  }
+
+  size_t num_cores() const { return cores.size(); }
+
+  size_t size() {
+    size_t total = 0;
+    for (std::unique_ptr<core> &c : cores) {
+      total += c->store.size();
+    }
+    return total;
+  }
+
+  // Cap the bytes of stored entries, split evenly between the cores; 0 is
+  // unbounded
+  void set_memory_limit(size_t limit) {
+    for (std::unique_ptr<core> &c : cores) {
+      c->store.set_memory_limit(limit / cores.size());
+    }
+  }
+
+  // Sample accesses to find each core's hottest keys
+  void track_hot_keys(bool on) {
+    for (std::unique_ptr<core> &c : cores) {
+      c->store.track_hot_keys(on);
+    }
+  }
+
+  // The request metrics, with the first core's store figures
+  std::string stats() { return metrics.report(cores[0]->store); }
+};
+
+#endif
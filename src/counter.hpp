@@ -0,0 +1,56 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The striped_counter class counts events from many threads without making
+ * them share a cache line. Each thread adds to its own cache-aligned slot,
+ * and reading the counter sums the slots. Reads are approximate while
+ * threads are still counting.
+ */
+
+#ifndef COUNTER_H
+#define COUNTER_H
+
+#include "epoch.hpp"
+
+#include <atomic>
+#include <cstdint>
+
+class striped_counter {
+private:
+  static constexpr size_t NUM_SLOTS = 64;
+
+  struct alignas(CACHE_LINE_SIZE) slot {
+    std::atomic<uint64_t> value{0};
+  };
+
+  slot slots[NUM_SLOTS];
+
+public:
+  // Threads are numbered in the order they first count anything, so up to
+  // NUM_SLOTS threads each get a slot of their own
+  static size_t thread_slot() {
+    static std::atomic<size_t> next_thread{0};
+    static thread_local size_t index = next_thread++ % NUM_SLOTS;
+    return index;
+  }
+
+  void add(uint64_t count = 1) {
+    slots[thread_slot()].value.fetch_add(count, std::memory_order_relaxed);
+  }
+
+  uint64_t load() const {
+    uint64_t total = 0;
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+      total += slots[i].value.load(std::memory_order_relaxed);
+    }
+    return total;
+  }
+
+  void reset() {
+    for (size_t i = 0; i < NUM_SLOTS; i++) {
+      slots[i].value.store(0, std::memory_order_relaxed);
+    }
+  }
+};
+
+#endif
@@ -0,0 +1,255 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The delimiters namespace scans text protocol buffers with vector
+ * instructions. scan_line finds the newline that ends a request and the
+ * spaces between its first tokens in a single pass, where finding the line
+ * and then splitting it would read the line twice, and translate copies a
+ * value while swapping newlines and carriage returns without first searching
+ * it.
+ *
+ * Each function has an AVX2, an SSE2, and a scalar version, and the best one
+ * the CPU supports is chosen once at startup. SSE2 is part of x86-64, so the
+ * scalar version, built on memchr, only runs on other machines or when
+ * chosen with use() to compare the versions.
+ */
+
+#ifndef DELIMITERS_H
+#define DELIMITERS_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+#if defined(__x86_64__)
+#include <immintrin.h>
+#endif
+
+namespace delimiters {
+
+// The most spaces a request needs located: its first four tokens
+constexpr size_t MAX_SPACES = 4;
+
+// Where a line ends and where its first spaces are, counted from its start
+struct line_layout {
+  size_t length = 0; // Bytes before the newline
+  size_t spaces[MAX_SPACES];
+  size_t space_count = 0;
+};
+
+enum implementation { SCALAR, SSE2, AVX2 };
+
+inline const char *name(implementation kind) {
+  return kind == AVX2 ? "avx2" : kind == SSE2 ? "sse2" : "scalar";
+}
+
+namespace detail {
+
+// Lines are scanned in one vector pass for this many bytes. Past it memchr,
+// which libc tunes for long runs, finds the newline and then the spaces
+// faster than one loop comparing against both.
+constexpr size_t SHORT_LINE = 256;
+
+using scan_function = bool (*)(const char *, size_t, line_layout &);
+using translate_function = void (*)(char *, const char *, size_t, char, char);
+
+// Record the spaces set in a block's mask, up to the newline if it holds one
+inline bool scan_mask(size_t base,
+                      uint32_t newlines,
+                      uint32_t spaces,
+                      line_layout &layout) {
+  if (newlines) {
+    spaces &= (newlines & -newlines) - 1; // Only those before the newline
+  }
+  while (spaces && layout.space_count < MAX_SPACES) {
+    layout.spaces[layout.space_count++] = base + __builtin_ctz(spaces);
+    spaces &= spaces - 1;
+  }
+  if (newlines) {
+    layout.length = base + __builtin_ctz(newlines);
+    return true;
+  }
+  return false;
+}
+
+// Continue a scan from offset with memchr: first for the newline, then for
+// each space still wanted before it
+inline bool scan_rest(const char *data,
+                      size_t size,
+                      size_t offset,
+                      line_layout &layout) {
+  const char *newline = static_cast<const char *>(
+      std::memchr(data + offset, '\n', size - offset));
+  layout.length = newline ? size_t(newline - data) : size;
+  size_t at = offset;
+  while (layout.space_count < MAX_SPACES && at < layout.length) {
+    const char *space = static_cast<const char *>(
+        std::memchr(data + at, ' ', layout.length - at));
+    if (!space) {
+      break;
+    }
+    at = space - data;
+    layout.spaces[layout.space_count++] = at++;
+  }
+  return newline != nullptr;
+}
+
+inline bool scan_line_scalar(const char *data,
+                             size_t size,
+                             line_layout &layout) {
+  return scan_rest(data, size, 0, layout);
+}
+
+inline void translate_scalar(
+    char *dst, const char *src, size_t size, char from, char to) {
+  if (dst != src) {
+    std::memcpy(dst, src, size);
+  }
+  char *end = dst + size;
+  while (char *found =
+             static_cast<char *>(std::memchr(dst, from, end - dst))) {
+    *found = to;
+    dst = found + 1;
+  }
+}
+
+#if defined(__x86_64__)
+
+inline bool scan_line_sse2(const char *data, size_t size, line_layout &layout) {
+  const __m128i newline = _mm_set1_epi8('\n');
+  const __m128i space = _mm_set1_epi8(' ');
+  size_t head = std::min(size, SHORT_LINE);
+  size_t i = 0;
+  for (; i + 16 <= head; i += 16) {
+    __m128i block =
+        _mm_loadu_si128(reinterpret_cast<const __m128i *>(data + i));
+    uint32_t newlines = _mm_movemask_epi8(_mm_cmpeq_epi8(block, newline));
+    uint32_t spaces = _mm_movemask_epi8(_mm_cmpeq_epi8(block, space));
+    if ((newlines | spaces) && scan_mask(i, newlines, spaces, layout)) {
+      return true;
+    }
+  }
+  return scan_rest(data, size, i, layout);
+}
+
+// Flip the bits that turn from into to wherever a byte equals from
+inline void translate_sse2(
+    char *dst, const char *src, size_t size, char from, char to) {
+  const __m128i match = _mm_set1_epi8(from);
+  const __m128i flip = _mm_set1_epi8(char(from ^ to));
+  size_t i = 0;
+  for (; i + 16 <= size; i += 16) {
+    __m128i block = _mm_loadu_si128(reinterpret_cast<const __m128i *>(src + i));
+    block = _mm_xor_si128(
+        block, _mm_and_si128(_mm_cmpeq_epi8(block, match), flip));
+    _mm_storeu_si128(reinterpret_cast<__m128i *>(dst + i), block);
+  }
+  for (; i < size; i++) {
+    dst[i] = src[i] == from ? to : src[i];
+  }
+}
+
+__attribute__((target("avx2"))) inline bool
+scan_line_avx2(const char *data, size_t size, line_layout &layout) {
+  const __m256i newline = _mm256_set1_epi8('\n');
+  const __m256i space = _mm256_set1_epi8(' ');
+  size_t head = std::min(size, SHORT_LINE);
+  size_t i = 0;
+  for (; i + 32 <= head; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(data + i));
+    uint32_t newlines =
+        _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, newline));
+    uint32_t spaces = _mm256_movemask_epi8(_mm256_cmpeq_epi8(block, space));
+    if ((newlines | spaces) && scan_mask(i, newlines, spaces, layout)) {
+      return true;
+    }
+  }
+  return scan_rest(data, size, i, layout);
+}
+
+__attribute__((target("avx2"))) inline void
+translate_avx2(char *dst, const char *src, size_t size, char from, char to) {
+  const __m256i match = _mm256_set1_epi8(from);
+  const __m256i flip = _mm256_set1_epi8(char(from ^ to));
+  size_t i = 0;
+  for (; i + 32 <= size; i += 32) {
+    __m256i block =
+        _mm256_loadu_si256(reinterpret_cast<const __m256i *>(src + i));
+    block = _mm256_xor_si256(
+        block, _mm256_and_si256(_mm256_cmpeq_epi8(block, match), flip));
+    _mm256_storeu_si256(reinterpret_cast<__m256i *>(dst + i), block);
+  }
+  translate_sse2(dst + i, src + i, size - i, from, to);
+}
+
+#endif
+
+struct kernels {
+  implementation kind;
+  scan_function scan_line;
+  translate_function translate;
+};
+
+inline bool supported(implementation kind) {
+#if defined(__x86_64__)
+  __builtin_cpu_init(); // selected may be set before libgcc's constructor
+  return kind != AVX2 || __builtin_cpu_supports("avx2");
+#else
+  return kind == SCALAR;
+#endif
+}
+
+inline kernels kernels_for(implementation kind) {
+#if defined(__x86_64__)
+  if (kind == AVX2) {
+    return {AVX2, scan_line_avx2, translate_avx2};
+  }
+  if (kind == SSE2) {
+    return {SSE2, scan_line_sse2, translate_sse2};
+  }
+#endif
+  return {SCALAR, scan_line_scalar, translate_scalar};
+}
+
+inline kernels best() {
+  return kernels_for(supported(AVX2) ? AVX2 : supported(SSE2) ? SSE2 : SCALAR);
+}
+
+inline kernels selected = best();
+
+} // namespace detail
+
+// The version in use
+inline implementation active() { return detail::selected.kind; }
+
+// Switch to another version, for comparing them; false if the CPU lacks it.
+// Not safe while other threads are scanning.
+inline bool use(implementation kind) {
+  if (!detail::supported(kind)) {
+    return false;
+  }
+  detail::selected = detail::kernels_for(kind);
+  return true;
+}
+
+// Find the first newline in data and the first MAX_SPACES spaces before it.
+// Returns false if data holds no newline, with length set to data's size
+// and the spaces in all of data recorded.
+inline bool scan_line(std::string_view data, line_layout &layout) {
+  layout.space_count = 0;
+  return detail::selected.scan_line(data.data(), data.size(), layout);
+}
+
+// Copy size bytes from src to dst, replacing every from with to. dst may be
+// src, translating in place.
+inline void translate(
+    char *dst, const char *src, size_t size, char from, char to) {
+  detail::selected.translate(dst, src, size, from, to);
+}
+
+} // namespace delimiters
+
+#endif
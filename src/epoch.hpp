@@ -0,0 +1,177 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The epoch class implements epoch-based memory reclamation. Readers publish
+ * the epoch they entered in a per-thread slot and then traverse shared nodes
+ * without taking locks. Writers retire nodes they unlink and free them only
+ * once every reader that could still reach them has left.
+ */
+
+#ifndef EPOCH_H
+#define EPOCH_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <vector>
+
+// Cache line size used to keep independently written data on separate lines
+constexpr size_t CACHE_LINE_SIZE = 64;
+
+class epoch {
+private:
+  static constexpr int MAX_SLOTS = 1024;
+
+  // A reader slot holds the epoch its owner entered, or 0 when idle
+  struct alignas(CACHE_LINE_SIZE) slot {
+    std::atomic<uint64_t> entered{0};
+    std::atomic<bool> owned{false};
+  };
+
+  // Per-thread slot ownership, released when the thread exits
+  struct thread_slot {
+    int index = -1;
+    int depth = 0;
+
+    ~thread_slot() {
+      if (index >= 0) {
+        slots[index].entered.store(0, std::memory_order_release);
+        slots[index].owned.store(false, std::memory_order_release);
+      }
+    }
+  };
+
+  static std::atomic<uint64_t> global_epoch;
+  static std::atomic<int> high_water;
+  static slot slots[MAX_SLOTS];
+
+  static thread_slot &local() {
+    static thread_local thread_slot local_slot;
+    return local_slot;
+  }
+
+  // Claim a free slot for the calling thread, or return -1 if none is left
+  static int acquire_slot() {
+    for (int i = 0; i < MAX_SLOTS; i++) {
+      bool expected = false;
+      if (!slots[i].owned.load(std::memory_order_relaxed) &&
+          slots[i].owned.compare_exchange_strong(expected, true)) {
+        int mark = high_water.load();
+        while (mark < i + 1 && !high_water.compare_exchange_weak(mark, i + 1)) {
+        }
+        return i;
+      }
+    }
+    return -1;
+  }
+
+public:
+  // A guard marks a read-side critical section. Nodes observed inside it stay
+  // valid until it is destroyed. If every slot is taken the guard is inactive
+  // and the caller must fall back to locking.
+  class guard {
+  private:
+    thread_slot *owner;
+
+  public:
+    guard() : owner(&local()) {
+      if (owner->index < 0) {
+        owner->index = acquire_slot();
+        if (owner->index < 0) {
+          owner = nullptr;
+          return;
+        }
+      }
+      if (owner->depth++ == 0) {
+        slots[owner->index].entered.store(
+            global_epoch.load(std::memory_order_relaxed),
+            std::memory_order_relaxed);
+        std::atomic_thread_fence(std::memory_order_seq_cst);
+      }
+    }
+
+    ~guard() {
+      if (owner && --owner->depth == 0) {
+        slots[owner->index].entered.store(0, std::memory_order_release);
+      }
+    }
+
+    guard(const guard &) = delete;
+    guard &operator=(const guard &) = delete;
+
+    bool active() const { return owner != nullptr; }
+  };
+
+  // Nodes unlinked by one writer, freed once no reader can reach them. A
+  // retire_list is not thread safe; callers protect it with their own lock.
+  class retire_list {
+  private:
+    struct retired {
+      void *ptr;
+      void (*deleter)(void *);
+      uint64_t epoch;
+    };
+
+    static constexpr size_t RECLAIM_THRESHOLD = 64;
+    std::vector<retired> items;
+    size_t next_reclaim = RECLAIM_THRESHOLD;
+
+  public:
+    retire_list() = default;
+    retire_list(const retire_list &) = delete;
+    retire_list &operator=(const retire_list &) = delete;
+
+    ~retire_list() { drain(); }
+
+    // Retire a node that has already been unlinked from every shared path
+    void retire(void *ptr, void (*deleter)(void *)) {
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      items.push_back({ptr, deleter, global_epoch.load()});
+      if (items.size() >= next_reclaim) {
+        reclaim();
+      }
+    }
+
+    // Advance the epoch and free every node retired before the oldest reader
+    void reclaim() {
+      uint64_t oldest = global_epoch.fetch_add(1) + 1;
+      std::atomic_thread_fence(std::memory_order_seq_cst);
+      int mark = high_water.load(std::memory_order_acquire);
+      for (int i = 0; i < mark; i++) {
+        uint64_t entered = slots[i].entered.load(std::memory_order_acquire);
+        if (entered != 0 && entered < oldest) {
+          oldest = entered;
+        }
+      }
+
+      size_t kept = 0;
+      for (size_t i = 0; i < items.size(); i++) {
+        if (items[i].epoch < oldest) {
+          items[i].deleter(items[i].ptr);
+        } else {
+          items[kept++] = items[i];
+        }
+      }
+      items.resize(kept);
+
+      // Back off if long-running readers are holding nodes back
+      next_reclaim = std::max(RECLAIM_THRESHOLD, kept * 2);
+    }
+
+    // Free everything immediately; only valid once no readers remain
+    void drain() {
+      for (size_t i = 0; i < items.size(); i++) {
+        items[i].deleter(items[i].ptr);
+      }
+      items.clear();
+    }
+
+    size_t size() const { return items.size(); }
+  };
+};
+
+inline std::atomic<uint64_t> epoch::global_epoch{1};
+inline std::atomic<int> epoch::high_water{0};
+inline epoch::slot epoch::slots[epoch::MAX_SLOTS];
+
+#endif
@@ -0,0 +1,115 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The hash_ring class maps keys to nodes by consistent hashing. Each node
+ * is placed at many points, its virtual nodes, on a ring of 64-bit hashes,
+ * and a key belongs to the node at the first point at or after the key's
+ * hash. Adding a node therefore only takes over the keys just before its
+ * own points, about 1/N of them, and removing one hands its keys to the
+ * nodes that follow; every other key stays where it was.
+ *
+ * Points are derived from the node's name alone, so every client given the
+ * same names routes the same way, whatever order they were added in.
+ */
+
+#ifndef HASH_RING_H
+#define HASH_RING_H
+
+#include <algorithm>
+#include <cstdint>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class hash_ring {
+public:
+  // Enough points that each node's share is within a few percent of 1/N
+  static constexpr int DEFAULT_VIRTUAL_NODES = 160;
+
+private:
+  struct point {
+    uint64_t position;
+    uint32_t node; // Index into names
+  };
+
+  const int virtual_nodes;
+  std::vector<std::string> names;
+  std::vector<point> points; // By position, ties broken by name
+
+  void rebuild() {
+    points.clear();
+    points.reserve(names.size() * virtual_nodes);
+    for (uint32_t n = 0; n < names.size(); n++) {
+      for (int v = 0; v < virtual_nodes; v++) {
+        points.push_back({hash(names[n] + "#" + std::to_string(v)), n});
+      }
+    }
+    std::sort(points.begin(), points.end(), [&](const point &a,
+                                                const point &b) {
+      return a.position != b.position ? a.position < b.position
+                                      : names[a.node] < names[b.node];
+    });
+  }
+
+public:
+  explicit hash_ring(int virtual_nodes = DEFAULT_VIRTUAL_NODES)
+      : virtual_nodes(std::max(virtual_nodes, 1)) {}
+
+  // FNV-1a, then a 64-bit finalizer so nearby names and keys land far
+  // apart on the ring
+  static uint64_t hash(std::string_view bytes) {
+    uint64_t h = 14695981039346656037ull;
+    for (char c : bytes) {
+      h ^= static_cast<unsigned char>(c);
+      h *= 1099511628211ull;
+    }
+    h ^= h >> 33;
+    h *= 0xff51afd7ed558ccdull;
+    h ^= h >> 33;
+    h *= 0xc4ceb9fe1a85ec53ull;
+    h ^= h >> 33;
+    return h;
+  }
+
+  // Add a node, or do nothing if one of that name is already present
+  void add(const std::string &name) {
+    if (std::find(names.begin(), names.end(), name) == names.end()) {
+      names.push_back(name);
+      rebuild();
+    }
+  }
+
+  // Remove a node; those after it in nodes() move down one place
+  bool remove(const std::string &name) {
+    std::vector<std::string>::iterator found =
+        std::find(names.begin(), names.end(), name);
+    if (found == names.end()) {
+      return false;
+    }
+    names.erase(found);
+    rebuild();
+    return true;
+  }
+
+  // Node names in the order they were added
+  const std::vector<std::string> &nodes() const { return names; }
+
+  size_t size() const { return names.size(); }
+
+  bool empty() const { return names.empty(); }
+
+  // Index into nodes() of the node owning a key hash; the ring must not be
+  // empty
+  size_t owner(uint64_t key_hash) const {
+    std::vector<point>::const_iterator at = std::lower_bound(
+        points.begin(),
+        points.end(),
+        key_hash,
+        [](const point &p, uint64_t h) { return p.position < h; });
+    return (at == points.end() ? points.front() : *at).node;
+  }
+
+  size_t owner(std::string_view key) const { return owner(hash(key)); }
+};
+
+#endif
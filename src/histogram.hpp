@@ -0,0 +1,185 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The histogram class records latencies, or any non-negative integers, in
+ * the log-linear layout of an HDR histogram: values below 128 are counted
+ * exactly, and every larger power of two is split into 64 equal buckets, so
+ * any recorded value is reported to within 1.6% using a fixed 30 KiB of
+ * counts. Recording is a handful of instructions and never allocates, and
+ * histograms recorded on separate threads are merged afterwards.
+ *
+ * The striped_histogram class is for histograms that many threads record
+ * into while others read them, such as a server's request latencies. Each
+ * thread records into its own stripe of atomic counts, allocated the first
+ * time the thread records anything, and reading merges the stripes into a
+ * histogram. Counts read while threads are recording may be slightly stale.
+ */
+
+#ifndef HISTOGRAM_H
+#define HISTOGRAM_H
+
+#include "counter.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+class histogram {
+private:
+  friend class striped_histogram;
+
+  static constexpr int SUB_BITS = 7;
+  static constexpr uint64_t SUB_COUNT = 1 << SUB_BITS;
+  static constexpr uint64_t HALF_COUNT = SUB_COUNT / 2;
+  static constexpr size_t NUM_BUCKETS = (64 - SUB_BITS + 2) * HALF_COUNT;
+
+  std::vector<uint64_t> counts;
+  uint64_t total = 0;
+  uint64_t smallest = UINT64_MAX;
+  uint64_t largest = 0;
+  double sum = 0;
+
+  static size_t bucket_for(uint64_t value) {
+    if (value < SUB_COUNT) {
+      return value;
+    }
+    int shift = 63 - __builtin_clzll(value) - (SUB_BITS - 1);
+    return (size_t(shift) << (SUB_BITS - 1)) + (value >> shift);
+  }
+
+  // The largest value that lands in bucket
+  static uint64_t highest_in(size_t bucket) {
+    if (bucket < SUB_COUNT) {
+      return bucket;
+    }
+    int shift = int(bucket >> (SUB_BITS - 1)) - 1;
+    uint64_t sub = bucket - (uint64_t(shift) << (SUB_BITS - 1));
+    return ((sub + 1) << shift) - 1;
+  }
+
+public:
+  histogram() : counts(NUM_BUCKETS, 0) {}
+
+  void record(uint64_t value, uint64_t count = 1) {
+    counts[bucket_for(value)] += count;
+    total += count;
+    smallest = std::min(smallest, value);
+    largest = std::max(largest, value);
+    sum += double(value) * count;
+  }
+
+  void merge(const histogram &other) {
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+      counts[i] += other.counts[i];
+    }
+    total += other.total;
+    smallest = std::min(smallest, other.smallest);
+    largest = std::max(largest, other.largest);
+    sum += other.sum;
+  }
+
+  void reset() {
+    std::fill(counts.begin(), counts.end(), 0);
+    total = 0;
+    smallest = UINT64_MAX;
+    largest = 0;
+    sum = 0;
+  }
+
+  uint64_t count() const { return total; }
+  uint64_t min() const { return total ? smallest : 0; }
+  uint64_t max() const { return largest; }
+  double mean() const { return total ? sum / total : 0; }
+
+  // The smallest recorded value that at least fraction q of the values do
+  // not exceed, to within a bucket; q of 0.99 gives the p99
+  uint64_t percentile(double q) const {
+    if (total == 0) {
+      return 0;
+    }
+    uint64_t rank = std::max<uint64_t>(1, uint64_t(std::ceil(q * total)));
+    uint64_t seen = 0;
+    for (size_t i = 0; i < NUM_BUCKETS; i++) {
+      seen += counts[i];
+      if (seen >= rank) {
+        return std::min(highest_in(i), largest);
+      }
+    }
+    return largest;
+  }
+};
+
+class striped_histogram {
+private:
+  static constexpr size_t NUM_STRIPES = 16;
+
+  struct stripe {
+    std::atomic<uint64_t> counts[histogram::NUM_BUCKETS] = {};
+    std::atomic<uint64_t> largest{0};
+  };
+
+  std::atomic<stripe *> stripes[NUM_STRIPES] = {};
+
+  stripe &thread_stripe() {
+    std::atomic<stripe *> &slot =
+        stripes[striped_counter::thread_slot() % NUM_STRIPES];
+    stripe *s = slot.load(std::memory_order_acquire);
+    if (!s) {
+      stripe *fresh = new stripe();
+      if (slot.compare_exchange_strong(s, fresh, std::memory_order_acq_rel)) {
+        s = fresh;
+      } else {
+        delete fresh; // Another thread sharing the slot got there first
+      }
+    }
+    return *s;
+  }
+
+public:
+  striped_histogram() = default;
+  striped_histogram(const striped_histogram &) = delete;
+  striped_histogram &operator=(const striped_histogram &) = delete;
+
+  ~striped_histogram() {
+    for (size_t i = 0; i < NUM_STRIPES; i++) {
+      delete stripes[i].load(std::memory_order_relaxed);
+    }
+  }
+
+  void record(uint64_t value) {
+    stripe &s = thread_stripe();
+    s.counts[histogram::bucket_for(value)].fetch_add(
+        1, std::memory_order_relaxed);
+    uint64_t largest = s.largest.load(std::memory_order_relaxed);
+    while (value > largest &&
+           !s.largest.compare_exchange_weak(
+               largest, value, std::memory_order_relaxed)) {
+    }
+  }
+
+  // Merge the stripes. The minimum, mean, and percentiles are reported to
+  // within a bucket; the maximum is exact.
+  histogram load() const {
+    histogram merged;
+    for (size_t i = 0; i < NUM_STRIPES; i++) {
+      const stripe *s = stripes[i].load(std::memory_order_acquire);
+      if (!s) {
+        continue;
+      }
+      for (size_t b = 0; b < histogram::NUM_BUCKETS; b++) {
+        uint64_t count = s->counts[b].load(std::memory_order_relaxed);
+        if (count) {
+          uint64_t lowest = b ? histogram::highest_in(b - 1) + 1 : 0;
+          merged.record(lowest, count);
+        }
+      }
+      merged.largest = std::max(
+          merged.largest, s->largest.load(std::memory_order_relaxed));
+    }
+    return merged;
+  }
+};
+
+#endif
@@ -0,0 +1,138 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The hot_keys class finds the most frequently accessed keys in a stream
+ * without storing the stream. A count-min sketch estimates how often each
+ * key was seen: every key adds one to a counter in each of DEPTH rows, and
+ * its estimate is the smallest of those counters, which can only
+ * overestimate. Keys whose estimate beats the coldest of the top capacity
+ * keys replace it in a small table, so the table converges on the hottest
+ * keys.
+ *
+ * Each thread records only one access in SAMPLE, and reported counts are
+ * scaled back up, so tracking costs a thread-local decrement on most
+ * accesses. Sketch counters are relaxed atomics, and the table is updated
+ * under a try_lock that a recorder skips rather than wait for.
+ */
+
+#ifndef HOT_KEYS_H
+#define HOT_KEYS_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class hot_keys {
+public:
+  static constexpr size_t DEPTH = 4;
+  static constexpr size_t WIDTH = 1 << 14; // Counters per row
+  static constexpr uint32_t SAMPLE = 8;
+
+  struct entry {
+    std::string key;
+    uint64_t count; // Estimated accesses
+  };
+
+private:
+  std::vector<std::atomic<uint32_t>> counts; // DEPTH rows of WIDTH
+  size_t capacity;
+  mutable std::mutex table_lock;
+  std::vector<entry> table;         // Unordered; counts are sampled
+  std::atomic<uint64_t> floor{0};   // Coldest count in a full table
+
+  // Row d's counter for hash, using double hashing across rows
+  size_t slot(size_t hash, size_t d) const {
+    uint64_t step = (uint64_t(hash) >> 32 | uint64_t(hash) << 32) | 1;
+    return d * WIDTH + ((hash + d * step) & (WIDTH - 1));
+  }
+
+  void update_table(std::string_view key, uint64_t estimate) {
+    std::unique_lock<std::mutex> lock(table_lock, std::try_to_lock);
+    if (!lock.owns_lock()) {
+      return; // Another thread is updating; this sample is dropped
+    }
+    size_t coldest = 0;
+    for (size_t i = 0; i < table.size(); i++) {
+      if (table[i].key == key) {
+        table[i].count = std::max(table[i].count, estimate);
+        return;
+      }
+      if (table[i].count < table[coldest].count) {
+        coldest = i;
+      }
+    }
+    if (table.size() < capacity) {
+      table.push_back({std::string(key), estimate});
+    } else if (estimate > table[coldest].count) {
+      table[coldest] = {std::string(key), estimate};
+    } else {
+      return;
+    }
+    if (table.size() == capacity) {
+      uint64_t lowest = estimate;
+      for (const entry &e : table) {
+        lowest = std::min(lowest, e.count);
+      }
+      floor.store(lowest, std::memory_order_relaxed);
+    }
+  }
+
+public:
+  // Track the capacity hottest keys
+  explicit hot_keys(size_t capacity = 32)
+      : counts(DEPTH * WIDTH), capacity(std::max<size_t>(capacity, 1)) {
+    table.reserve(this->capacity);
+  }
+
+  // Note one access to key, whose hash is hash
+  void record(size_t hash, std::string_view key) {
+    static thread_local uint32_t countdown = 0;
+    if (countdown != 0) {
+      countdown--;
+      return;
+    }
+    countdown = SAMPLE - 1;
+
+    uint64_t estimate = UINT64_MAX;
+    for (size_t d = 0; d < DEPTH; d++) {
+      uint64_t count =
+          counts[slot(hash, d)].fetch_add(1, std::memory_order_relaxed) + 1;
+      estimate = std::min(estimate, count);
+    }
+    if (estimate > floor.load(std::memory_order_relaxed)) {
+      update_table(key, estimate);
+    }
+  }
+
+  // The tracked keys, hottest first, with counts scaled to every access
+  std::vector<entry> top() const {
+    std::vector<entry> result;
+    {
+      std::lock_guard<std::mutex> lock(table_lock);
+      result = table;
+    }
+    std::sort(result.begin(), result.end(), [](const entry &a, const entry &b) {
+      return a.count > b.count;
+    });
+    for (entry &e : result) {
+      e.count *= SAMPLE;
+    }
+    return result;
+  }
+
+  // Forget everything seen so far. Accesses recorded meanwhile may survive.
+  void reset() {
+    std::lock_guard<std::mutex> lock(table_lock);
+    for (std::atomic<uint32_t> &count : counts) {
+      count.store(0, std::memory_order_relaxed);
+    }
+    table.clear();
+    floor.store(0, std::memory_order_relaxed);
+  }
+};
+
+#endif
@@ -0,0 +1,288 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The io_ring class is a minimal Linux io_uring instance built on the raw
+ * system calls, so the server needs no liburing. It maps the submission and
+ * completion queues, hands out zeroed submission entries, and submits every
+ * prepared entry and waits for completions in a single io_uring_enter. A
+ * ring must be driven by the thread that created it: it asks the kernel to
+ * defer completion work until that thread next enters, so completions
+ * arrive in batches instead of interrupting it.
+ *
+ * The buffer_ring class is a group of equally sized buffers provided to the
+ * kernel through a mapped ring. A recv that selects a buffer from the group
+ * takes one only when data arrives, so idle connections hold no buffer, and
+ * the buffer is handed back with recycle once its data has been consumed.
+ */
+
+#ifndef IO_RING_H
+#define IO_RING_H
+
+#include <linux/io_uring.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdint>
+#include <cstring>
+#include <system_error>
+
+class io_ring {
+private:
+  int fd = -1;
+  io_uring_params params;
+  void *sq_map = MAP_FAILED;
+  size_t sq_map_size = 0;
+  void *cq_map = MAP_FAILED; // The same mapping when the kernel allows
+  size_t cq_map_size = 0;
+  io_uring_sqe *sqes = static_cast<io_uring_sqe *>(MAP_FAILED);
+  unsigned *sq_head;
+  unsigned *sq_tail;
+  unsigned *sq_array;
+  unsigned sq_mask;
+  unsigned *cq_head;
+  unsigned *cq_tail;
+  unsigned cq_mask;
+  io_uring_cqe *cqes;
+  unsigned prepared = 0; // Entries prepared but not yet submitted
+
+  template <typename T>
+  T *at(void *map, unsigned offset) {
+    return reinterpret_cast<T *>(static_cast<char *>(map) + offset);
+  }
+
+  void close_ring() {
+    if (sqes != MAP_FAILED) {
+      munmap(sqes, params.sq_entries * sizeof(io_uring_sqe));
+    }
+    if (cq_map != MAP_FAILED && cq_map != sq_map) {
+      munmap(cq_map, cq_map_size);
+    }
+    if (sq_map != MAP_FAILED) {
+      munmap(sq_map, sq_map_size);
+    }
+    if (fd >= 0) {
+      ::close(fd);
+    }
+  }
+
+  void *map(size_t size, off_t offset) {
+    void *mapped = mmap(nullptr,
+                        size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_SHARED | MAP_POPULATE,
+                        fd,
+                        offset);
+    if (mapped == MAP_FAILED) {
+      int error = errno;
+      close_ring();
+      throw std::system_error(
+          error, std::system_category(), "io_uring mmap");
+    }
+    return mapped;
+  }
+
+public:
+  // A ring of at least entries submission entries. Throws std::system_error
+  // if the kernel has no io_uring or refuses one.
+  explicit io_ring(unsigned entries) {
+    // Deferred completion work needs Linux 6.1; older kernels run without
+    unsigned flags[] = {
+        IORING_SETUP_SINGLE_ISSUER | IORING_SETUP_DEFER_TASKRUN, 0};
+    for (unsigned setup_flags : flags) {
+      std::memset(&params, 0, sizeof(params));
+      params.flags = setup_flags;
+      fd = int(syscall(__NR_io_uring_setup, entries, &params));
+      if (fd >= 0 || errno != EINVAL) {
+        break;
+      }
+    }
+    if (fd < 0) {
+      throw std::system_error(
+          errno, std::system_category(), "io_uring_setup");
+    }
+
+    sq_map_size = params.sq_off.array + params.sq_entries * sizeof(unsigned);
+    cq_map_size =
+        params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe);
+    if (params.features & IORING_FEAT_SINGLE_MMAP) {
+      sq_map_size = cq_map_size = std::max(sq_map_size, cq_map_size);
+    }
+    sq_map = map(sq_map_size, IORING_OFF_SQ_RING);
+    cq_map = params.features & IORING_FEAT_SINGLE_MMAP
+                 ? sq_map
+                 : map(cq_map_size, IORING_OFF_CQ_RING);
+    sqes = static_cast<io_uring_sqe *>(
+        map(params.sq_entries * sizeof(io_uring_sqe), IORING_OFF_SQES));
+
+    sq_head = at<unsigned>(sq_map, params.sq_off.head);
+    sq_tail = at<unsigned>(sq_map, params.sq_off.tail);
+    sq_array = at<unsigned>(sq_map, params.sq_off.array);
+    sq_mask = *at<unsigned>(sq_map, params.sq_off.ring_mask);
+    cq_head = at<unsigned>(cq_map, params.cq_off.head);
+    cq_tail = at<unsigned>(cq_map, params.cq_off.tail);
+    cq_mask = *at<unsigned>(cq_map, params.cq_off.ring_mask);
+    cqes = at<io_uring_cqe>(cq_map, params.cq_off.cqes);
+  }
+
+  io_ring(const io_ring &) = delete;
+  io_ring &operator=(const io_ring &) = delete;
+
+  ~io_ring() { close_ring(); }
+
+  int native_handle() const { return fd; }
+
+  // A zeroed submission entry, or nullptr if the queue is full until the
+  // prepared entries are submitted
+  io_uring_sqe *get_sqe() {
+    unsigned tail = *sq_tail;
+    unsigned head = std::atomic_ref<unsigned>(*sq_head).load(
+        std::memory_order_acquire);
+    if (tail - head >= params.sq_entries) {
+      return nullptr;
+    }
+    unsigned index = tail & sq_mask;
+    sq_array[index] = index;
+    io_uring_sqe *sqe = &sqes[index];
+    std::memset(sqe, 0, sizeof(*sqe));
+    // The kernel reads the entry only when entered, after it is filled in
+    std::atomic_ref<unsigned>(*sq_tail).store(tail + 1,
+                                              std::memory_order_release);
+    prepared++;
+    return sqe;
+  }
+
+  // Submit every prepared entry and wait until at least wait completions
+  // are ready. Returns 0, or a negative errno; EINTR is not an error.
+  int enter(unsigned wait) {
+    int submitted = int(syscall(__NR_io_uring_enter,
+                                fd,
+                                prepared,
+                                wait,
+                                IORING_ENTER_GETEVENTS,
+                                nullptr,
+                                0));
+    if (submitted < 0) {
+      return errno == EINTR || errno == EAGAIN || errno == EBUSY ? 0
+                                                                 : -errno;
+    }
+    prepared -= std::min(prepared, unsigned(submitted));
+    return 0;
+  }
+
+  // Call handle(cqe) for every ready completion, in order, then release
+  // them to the kernel. Returns the number handled.
+  template <typename Handler>
+  unsigned for_each_completion(Handler &&handle) {
+    unsigned head = *cq_head;
+    unsigned tail = std::atomic_ref<unsigned>(*cq_tail).load(
+        std::memory_order_acquire);
+    for (unsigned i = head; i != tail; i++) {
+      handle(cqes[i & cq_mask]);
+    }
+    std::atomic_ref<unsigned>(*cq_head).store(tail,
+                                              std::memory_order_release);
+    return tail - head;
+  }
+};
+
+class buffer_ring {
+private:
+  io_ring &ring;
+  uint16_t group;
+  unsigned count;
+  unsigned size;
+  // The ring's entries. The kernel header's io_uring_buf_ring cannot be
+  // used from C++, whose empty structs shift its flexible array, so the
+  // ring is addressed as entries and its tail as the first entry's resv.
+  io_uring_buf *entries;
+  size_t entries_size;
+  char *data;
+  uint16_t tail = 0;
+
+public:
+  // count buffers of size bytes as buffer group group of ring. count must
+  // be a power of two no larger than 32768.
+  buffer_ring(io_ring &ring, uint16_t group, unsigned count, unsigned size)
+      : ring(ring),
+        group(group),
+        count(count),
+        size(size),
+        entries_size(count * sizeof(io_uring_buf)) {
+    void *mapped = mmap(nullptr,
+                        entries_size + size_t(count) * size,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+    if (mapped == MAP_FAILED) {
+      throw std::system_error(
+          errno, std::system_category(), "buffer ring mmap");
+    }
+    entries = static_cast<io_uring_buf *>(mapped);
+    data = static_cast<char *>(mapped) + entries_size;
+
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.ring_addr = reinterpret_cast<uint64_t>(entries);
+    reg.ring_entries = count;
+    reg.bgid = group;
+    if (syscall(__NR_io_uring_register,
+                ring.native_handle(),
+                IORING_REGISTER_PBUF_RING,
+                &reg,
+                1) < 0) {
+      int error = errno;
+      munmap(mapped, entries_size + size_t(count) * size);
+      throw std::system_error(
+          error, std::system_category(), "IORING_REGISTER_PBUF_RING");
+    }
+    for (unsigned id = 0; id < count; id++) {
+      recycle(uint16_t(id));
+    }
+  }
+
+  buffer_ring(const buffer_ring &) = delete;
+  buffer_ring &operator=(const buffer_ring &) = delete;
+
+  // The ring must still be open, so the group can be unregistered
+  ~buffer_ring() {
+    io_uring_buf_reg reg;
+    std::memset(&reg, 0, sizeof(reg));
+    reg.bgid = group;
+    syscall(__NR_io_uring_register,
+            ring.native_handle(),
+            IORING_UNREGISTER_PBUF_RING,
+            &reg,
+            1);
+    munmap(entries, entries_size + size_t(count) * size);
+  }
+
+  uint16_t id() const { return group; }
+
+  // The buffer the kernel filled for a completion flagged
+  // IORING_CQE_F_BUFFER
+  const char *buffer(const io_uring_cqe &cqe) const {
+    return data + size_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT) * size;
+  }
+
+  // Give the buffer of a completion back to the kernel
+  void recycle(const io_uring_cqe &cqe) {
+    recycle(uint16_t(cqe.flags >> IORING_CQE_BUFFER_SHIFT));
+  }
+
+  void recycle(uint16_t id) {
+    io_uring_buf &entry = entries[tail & (count - 1)];
+    entry.addr = reinterpret_cast<uint64_t>(data + size_t(id) * size);
+    entry.len = size;
+    entry.bid = id;
+    tail++;
+    std::atomic_ref<uint16_t>(entries[0].resv).store(
+        tail, std::memory_order_release);
+  }
+};
+
+#endif
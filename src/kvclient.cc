@@ -3,7 +3,25 @@
  *
  * The kvclient class sends requests to the server and handles responses. It
  * uses the message class to encode and decode messages of type GET, PUT, and
- * DEL.
+ * DEL. A client may ask for the binary protocol, which it negotiates with the
+ * server when connecting and falls back to text if the server refuses.
+ *
+ * Requests may be pipelined: async_get, async_put and async_del queue a
+ * request with a completion callback and return immediately. Queued requests
+ * are sent together in one write by flush(), and wait() reads responses in
+ * order, invoking each callback, until nothing is left in flight. The
+ * blocking get, put and del are built on the same queue, as are the batch
+ * operations mget, mput and mdel, which carry many keys in one request.
+ * scan lists keys by prefix a page at a time, and stats fetches the
+ * server's counters.
+ *
+ * With enable_cache, get keeps the values it reads in a bounded LRU near
+ * cache and answers repeated reads from it without a round trip. The server
+ * tracks the keys the connection reads and pushes an invalidation when one
+ * changes; every get first takes in any invalidations that have arrived,
+ * without blocking. An invalidation that arrives while a read of the same
+ * key is in flight keeps that read's value out of the cache, since it may
+ * predate the change.
  */
 
 #ifndef KVCLIENT_H
@@ -12,6 +30,14 @@
 #include "message.hpp"
 
 #include <boost/asio.hpp>
+#include <algorithm>
+#include <deque>
+#include <functional>
+#include <list>
+#include <map>
+#include <unordered_map>
+#include <string_view>
+#include <vector>
 
 using boost::asio::ip::tcp;
 
@@ -19,7 +45,8 @@ class kvclient {
 public:
   kvclient(boost::asio::io_service &io_service,
            const std::string &host,
-           const std::string &port)
+           const std::string &port,
+           protocol_type protocol = TEXT_PROTOCOL)
       : io_service_(io_service), socket_(io_service) {
     tcp::resolver resolver(io_service);
     tcp::resolver::query query(host, port);
@@ -33,88 +60,606 @@ public:
     if (error) {
       throw boost::system::system_error(error);
     }
+
+    if (protocol == BINARY_PROTOCOL) {
+      message msg(PROTO, "BINARY");
+      send_request(msg);
+      if (read_response_msg().get_type() == OK) {
+        protocol_ = BINARY_PROTOCOL;
+      }
+    }
   }
 
+  protocol_type get_protocol() { return protocol_; }
+
+  tcp::socket &socket() { return socket_; }
+
   void send_request(const std::string &request) {
     boost::asio::write(socket_, boost::asio::buffer(request));
   }
 
   void send_request(message &msg) {
     std::string request;
-    msg.encode(request);
+    if (protocol_ == BINARY_PROTOCOL) {
+      msg.encode_binary(request, ++request_id_);
+    } else {
+      msg.encode(request);
+    }
     boost::asio::write(socket_, boost::asio::buffer(request));
   }
 
+  // Read one text line, searching only the bytes each read adds
   std::string read_response() {
-    boost::asio::streambuf response;
-    boost::asio::read_until(socket_, response, "\n");
-    std::istream response_stream(&response);
-    std::string line;
-    std::getline(response_stream, line);
+    size_t newline;
+    size_t searched = 0;
+    while ((newline = incoming_.find('\n', searched)) == std::string::npos) {
+      searched = incoming_.size();
+      fill(incoming_.size() + 1);
+    }
+    std::string line = incoming_.substr(0, newline);
+    incoming_.erase(0, newline + 1);
     return line;
   }
 
   message read_response_msg() {
-    boost::asio::streambuf response;
-    boost::asio::read_until(socket_, response, "\n");
-    std::istream response_stream(&response);
-    std::string line;
-    std::getline(response_stream, line);
+    if (protocol_ == BINARY_PROTOCOL) {
+      return read_binary_response();
+    }
+
+    std::string line = read_response();
     message msg;
     msg.decode(line);
 
     return msg;
   }
 
-  bool get(const std::string &key, std::string &value) {
+  using get_callback = std::function<void(bool found, const std::string &)>;
+  using status_callback = std::function<void(bool ok)>;
+
+  // Queue a GET; callback receives whether the key was found and its value.
+  // With the near cache on, a cached key completes at once.
+  bool async_get(const std::string &key, get_callback callback) {
+    if (cache_capacity_) {
+      poll();
+      std::unordered_map<std::string, cache_entry>::iterator hit =
+          cache_.find(key);
+      if (hit != cache_.end()) {
+        lru_.splice(lru_.begin(), lru_, hit->second.position);
+        cache_usage_.hits++;
+        callback(true, hit->second.value);
+        return true;
+      }
+      cache_usage_.misses++;
+      fetching_[key].in_flight++;
+    }
     message msg(GET, key);
-    if (msg.get_type() == UNSET || msg.get_type() == ERROR) {
+    bool queued = enqueue(msg, [this, key, callback](message &response) {
+      bool found = response.get_type() == OK;
+      fetched(key, found, response.get_value());
+      callback(found, response.get_value());
+    });
+    if (!queued) {
+      fetched(key, false, "");
+    }
+    return queued;
+  }
+
+  // Queue a PUT; callback receives whether the server stored the value.
+  // A nonzero ttl_ms makes the pair expire that many milliseconds later.
+  bool async_put(const std::string &key,
+                 const std::string &value,
+                 status_callback callback,
+                 uint32_t ttl_ms = 0) {
+    message msg(PUT, key, value);
+    msg.set_ttl(ttl_ms);
+    forget(key);
+    return enqueue(msg, [callback](message &response) {
+      callback(response.get_type() == OK);
+    });
+  }
+
+  // Queue a DEL; callback receives whether the key existed
+  bool async_del(const std::string &key, status_callback callback) {
+    message msg(DEL, key);
+    forget(key);
+    return enqueue(msg, [callback](message &response) {
+      callback(response.get_type() == OK);
+    });
+  }
+
+  using batch_callback = std::function<void(
+      const std::vector<bool> &ok, const std::vector<std::string> &values)>;
+
+  // Queue an MGET; callback receives per-key found flags and values, or
+  // empty vectors if the server rejected the batch
+  bool async_mget(const std::vector<std::string> &keys,
+                  batch_callback callback) {
+    return enqueue_batch(MGET, keys, std::move(callback));
+  }
+
+  // Queue an MPUT of keys[i] = values[i]; callback receives per-key results
+  bool async_mput(const std::vector<std::string> &keys,
+                  const std::vector<std::string> &values,
+                  batch_callback callback) {
+    if (keys.size() != values.size()) {
       return false;
     }
+    std::vector<std::string> args;
+    args.reserve(keys.size() * 2);
+    for (size_t i = 0; i < keys.size(); i++) {
+      forget(keys[i]);
+      args.push_back(keys[i]);
+      args.push_back(values[i]);
+    }
+    return enqueue_batch(MPUT, args, std::move(callback));
+  }
 
-    send_request(msg);
-    message response = read_response_msg();
+  // Queue an MDEL; callback receives whether each key existed
+  bool async_mdel(const std::vector<std::string> &keys,
+                  batch_callback callback) {
+    for (const std::string &key : keys) {
+      forget(key);
+    }
+    return enqueue_batch(MDEL, keys, std::move(callback));
+  }
 
-    if (response.get_type() == OK) {
-      value = response.get_value();
-      return true;
+  using scan_callback =
+      std::function<void(bool ok,
+                         const std::vector<std::string> &keys,
+                         const std::string &cursor)>;
+
+  // Queue a SCAN for up to count keys that start with prefix and sort after
+  // cursor, or from the first if cursor is empty. callback receives the
+  // keys in order and the cursor to continue from, empty once no keys
+  // remain; ok is false if the server keeps no ordered index.
+  bool async_scan(const std::string &prefix,
+                  uint32_t count,
+                  const std::string &cursor,
+                  scan_callback callback) {
+    uint32_t request_id = request_id_ + 1;
+    if (!encode_scan(
+            outgoing_, protocol_, prefix, count, cursor, request_id)) {
+      return false;
     }
-    return false;
+    request_id_ = request_id;
+    in_flight_.push_back(
+        {request_id_,
+         nullptr,
+         [callback](const std::vector<bool> &ok,
+                    const std::vector<std::string> &values) {
+           if (ok.empty()) {
+             callback(false, {}, "");
+             return;
+           }
+           callback(true,
+                    std::vector<std::string>(values.begin() + 1, values.end()),
+                    ok[0] ? values[0] : "");
+         }});
+    limit_in_flight();
+    return true;
   }
 
-  bool put(const std::string &key, const std::string &value) {
-    message msg(PUT, key, value);
-    if (msg.get_type() == UNSET || msg.get_type() == ERROR) {
+  // Send every queued request in a single write
+  void flush() {
+    if (!outgoing_.empty()) {
+      boost::asio::write(socket_, boost::asio::buffer(outgoing_));
+      outgoing_.clear();
+    }
+  }
+
+  // Flush, then complete in-flight requests until at most limit remain
+  void wait(size_t limit = 0) {
+    flush();
+    while (in_flight_.size() > limit) {
+      message response = read_response_msg();
+      complete(response);
+    }
+  }
+
+  // Complete whatever responses and invalidations have already arrived,
+  // without waiting for more
+  void poll() {
+    boost::system::error_code error;
+    size_t available = socket_.available(error);
+    if (!error && available) {
+      boost::asio::read(socket_,
+                        boost::asio::dynamic_buffer(incoming_),
+                        boost::asio::transfer_exactly(available));
+    }
+    while (buffered()) {
+      message response = read_response_msg();
+      complete(response);
+    }
+  }
+
+  struct cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t invalidations = 0; // Pushed by the server
+    size_t size = 0;
+  };
+
+  // Serve get from a near cache of up to capacity values, invalidated by
+  // the server. Returns false if the server refuses to track this
+  // connection's reads.
+  bool enable_cache(size_t capacity) {
+    message msg(TRACK, "ON");
+    bool ok = false;
+    if (!enqueue(msg, [&](message &response) {
+          ok = response.get_type() == OK;
+        })) {
       return false;
     }
+    wait();
+    if (ok) {
+      cache_capacity_ = std::max<size_t>(capacity, 1);
+    }
+    return ok;
+  }
 
-    send_request(msg);
-    message response = read_response_msg();
+  // Stop tracking and drop every cached value
+  void disable_cache() {
+    cache_capacity_ = 0;
+    cache_.clear();
+    lru_.clear();
+    message msg(TRACK, "OFF");
+    if (enqueue(msg, [](message &) {})) {
+      wait();
+    }
+  }
 
-    if (response.get_type() == OK) {
-      return true;
+  cache_stats cache_usage() const {
+    cache_stats stats = cache_usage_;
+    stats.size = cache_.size();
+    return stats;
+  }
+
+  size_t in_flight() { return in_flight_.size(); }
+
+  bool get(const std::string &key, std::string &value) {
+    bool found = false;
+    if (!async_get(key, [&](bool ok, const std::string &response_value) {
+          found = ok;
+          if (ok) {
+            value = response_value;
+          }
+        })) {
+      return false;
     }
-    return false;
+    wait();
+    return found;
+  }
+
+  bool put(const std::string &key,
+           const std::string &value,
+           uint32_t ttl_ms = 0) {
+    bool stored = false;
+    if (!async_put(key, value, [&](bool ok) { stored = ok; }, ttl_ms)) {
+      return false;
+    }
+    wait();
+    return stored;
   }
 
   bool del(const std::string &key) {
-    message msg(DEL, key);
-    if (msg.get_type() == UNSET || msg.get_type() == ERROR) {
+    bool deleted = false;
+    if (!async_del(key, [&](bool ok) { deleted = ok; })) {
       return false;
     }
+    wait();
+    return deleted;
+  }
 
-    send_request(msg);
-    message response = read_response_msg();
+  // Fetch many keys in one round trip; found[i] tells whether keys[i] exists
+  bool mget(const std::vector<std::string> &keys,
+            std::vector<std::string> &values,
+            std::vector<bool> &found) {
+    return run_batch(async_mget(keys, collect(found, &values)), found, keys);
+  }
 
-    if (response.get_type() == OK) {
-      return true;
+  bool mput(const std::vector<std::string> &keys,
+            const std::vector<std::string> &values,
+            std::vector<bool> &stored) {
+    return run_batch(
+        async_mput(keys, values, collect(stored, nullptr)), stored, keys);
+  }
+
+  bool mdel(const std::vector<std::string> &keys, std::vector<bool> &deleted) {
+    return run_batch(async_mdel(keys, collect(deleted, nullptr)), deleted, keys);
+  }
+
+  // Fetch the next page of up to count keys with prefix into keys, and
+  // replace cursor with where the following page starts: empty once the
+  // scan is done. Start with an empty cursor.
+  bool scan(const std::string &prefix,
+            uint32_t count,
+            std::string &cursor,
+            std::vector<std::string> &keys) {
+    bool ok = false;
+    if (!async_scan(prefix,
+                    count,
+                    cursor,
+                    [&](bool answered,
+                        const std::vector<std::string> &found,
+                        const std::string &next) {
+                      ok = answered;
+                      keys = found;
+                      cursor = next;
+                    })) {
+      return false;
     }
-    return false;
+    wait();
+    return ok;
+  }
+
+  // Fetch the server's STATS report as a map from counter name to value.
+  // A section and action ask for another report, as in "hotkeys" "on"; the
+  // hot key report maps each key to its estimated access count.
+  bool stats(std::map<std::string, std::string> &report,
+             const std::string &section = "",
+             const std::string &action = "") {
+    message msg;
+    msg.reset(STATS, section, action);
+    bool ok = false;
+    if (!enqueue(msg, [&](message &response) {
+          ok = response.get_type() == OK;
+          std::string text = response.get_value();
+          size_t pos = 0;
+          while (ok && pos < text.size()) {
+            size_t end = text.find('\n', pos);
+            if (end == std::string::npos) {
+              end = text.size();
+            }
+            std::string line = text.substr(pos, end - pos);
+            size_t space = line.rfind(' '); // Keys may hold spaces
+            if (space != std::string::npos) {
+              report[line.substr(0, space)] = line.substr(space + 1);
+            }
+            pos = end + 1;
+          }
+        })) {
+      return false;
+    }
+    wait();
+    return ok;
   }
 
 private:
+  // Bound the requests and bytes queued before responses are drained, so the
+  // client and server never both block writing to each other
+  static constexpr size_t MAX_IN_FLIGHT = 1024;
+  static constexpr size_t MAX_OUTGOING = 64 * 1024;
+
+  struct in_flight_request {
+    uint32_t request_id;
+    std::function<void(message &)> handler;
+    batch_callback batch_handler; // Set instead of handler for batches
+  };
+
   boost::asio::io_service &io_service_;
   tcp::socket socket_;
+  protocol_type protocol_ = TEXT_PROTOCOL;
+  uint32_t request_id_ = 0;
+  std::string outgoing_; // Encoded requests not yet written
+  std::string incoming_; // Bytes read but not yet consumed
+  std::deque<in_flight_request> in_flight_;
+
+  struct cache_entry {
+    std::string value;
+    std::list<std::string>::iterator position; // In lru_
+  };
+
+  // GETs in flight for a key, and whether it was invalidated meanwhile
+  struct fetch_state {
+    size_t in_flight = 0;
+    bool invalidated = false;
+  };
+
+  size_t cache_capacity_ = 0; // 0 while the near cache is off
+  std::unordered_map<std::string, cache_entry> cache_;
+  std::list<std::string> lru_; // Cached keys, most recently used first
+  std::unordered_map<std::string, fetch_state> fetching_;
+  cache_stats cache_usage_;
+
+  // Drop key from the near cache, and keep any read of it in flight from
+  // being cached
+  void forget(const std::string &key) {
+    std::unordered_map<std::string, cache_entry>::iterator hit =
+        cache_.find(key);
+    if (hit != cache_.end()) {
+      lru_.erase(hit->second.position);
+      cache_.erase(hit);
+    }
+    std::unordered_map<std::string, fetch_state>::iterator fetch =
+        fetching_.find(key);
+    if (fetch != fetching_.end()) {
+      fetch->second.invalidated = true;
+    }
+  }
+
+  // Finish a GET of key, caching the value unless it may be stale
+  void fetched(const std::string &key, bool found, const std::string &value) {
+    std::unordered_map<std::string, fetch_state>::iterator fetch =
+        fetching_.find(key);
+    if (fetch == fetching_.end()) {
+      return; // Sent before the cache was on
+    }
+    bool fresh = !fetch->second.invalidated;
+    if (--fetch->second.in_flight == 0) {
+      fetching_.erase(fetch);
+    }
+    if (!found || !fresh || !cache_capacity_) {
+      return;
+    }
+    std::unordered_map<std::string, cache_entry>::iterator hit =
+        cache_.find(key);
+    if (hit != cache_.end()) {
+      hit->second.value = value;
+      lru_.splice(lru_.begin(), lru_, hit->second.position);
+      return;
+    }
+    if (cache_.size() >= cache_capacity_) {
+      cache_.erase(lru_.back());
+      lru_.pop_back();
+    }
+    lru_.push_front(key);
+    cache_[key] = {value, lru_.begin()};
+  }
+
+  // Apply an invalidation, or complete the oldest request with response
+  void complete(message &response) {
+    if (response.get_type() == INV) {
+      cache_usage_.invalidations++;
+      forget(response.get_key());
+      return;
+    }
+    if (in_flight_.empty()) {
+      throw std::runtime_error("kvclient: response with nothing in flight");
+    }
+    in_flight_request request = std::move(in_flight_.front());
+    in_flight_.pop_front();
+    if (request.batch_handler) {
+      std::vector<bool> ok;
+      std::vector<std::string> values;
+      read_batch(response, ok, values);
+      request.batch_handler(ok, values);
+    } else {
+      request.handler(response);
+    }
+  }
+
+  // Whether a whole message is already buffered in incoming_
+  bool buffered() {
+    if (protocol_ == TEXT_PROTOCOL) {
+      return incoming_.find('\n') != std::string::npos;
+    }
+    binary_header header;
+    return incoming_.size() >= BINARY_HEADER_SIZE &&
+           header.read(incoming_.data()) &&
+           incoming_.size() >= BINARY_HEADER_SIZE + header.body_length();
+  }
+
+  // Encode msg onto the outgoing batch and remember how to complete it
+  bool enqueue(message &msg, std::function<void(message &)> handler) {
+    if (msg.get_type() == UNSET || msg.get_type() == ERROR) {
+      return false;
+    }
+
+    std::string request;
+    bool encoded = protocol_ == BINARY_PROTOCOL
+                       ? msg.encode_binary(request, ++request_id_)
+                       : msg.encode(request);
+    if (!encoded) {
+      return false;
+    }
+    outgoing_ += request;
+    in_flight_.push_back({request_id_, std::move(handler), nullptr});
+    limit_in_flight();
+    return true;
+  }
+
+  bool enqueue_batch(message_type type,
+                     const std::vector<std::string> &args,
+                     batch_callback callback) {
+    if (args.empty()) {
+      callback({}, {}); // Nothing to send
+      return true;
+    }
+    uint32_t request_id = request_id_ + 1;
+    if (!encode_batch(outgoing_, protocol_, type, args, request_id)) {
+      return false;
+    }
+    request_id_ = request_id;
+    in_flight_.push_back({request_id_, nullptr, std::move(callback)});
+    limit_in_flight();
+    return true;
+  }
+
+  void limit_in_flight() {
+    if (in_flight_.size() >= MAX_IN_FLIGHT || outgoing_.size() >= MAX_OUTGOING) {
+      wait(MAX_IN_FLIGHT / 2);
+    }
+  }
+
+  // Read the per-key results that follow a batch response header
+  void read_batch(message &header,
+                  std::vector<bool> &ok,
+                  std::vector<std::string> &values) {
+    if (header.get_type() != OK) {
+      return;
+    }
+
+    if (protocol_ == BINARY_PROTOCOL) {
+      if (!decode_batch_results(header.get_value(), ok, values)) {
+        throw std::runtime_error("kvclient: malformed batch response");
+      }
+      return;
+    }
+
+    size_t count = std::stoul(header.get_value());
+    for (size_t i = 0; i < count; i++) {
+      message result = read_response_msg();
+      ok.push_back(result.get_type() == OK);
+      values.push_back(result.get_value());
+    }
+  }
+
+  // A batch callback that copies results into caller-owned vectors
+  static batch_callback collect(std::vector<bool> &ok,
+                                std::vector<std::string> *values) {
+    return [&ok, values](const std::vector<bool> &results,
+                         const std::vector<std::string> &result_values) {
+      ok = results;
+      if (values) {
+        *values = result_values;
+      }
+    };
+  }
+
+  // Wait for a queued batch and check it returned one result per key
+  bool run_batch(bool queued,
+                 std::vector<bool> &ok,
+                 const std::vector<std::string> &keys) {
+    ok.clear();
+    if (!queued) {
+      return false;
+    }
+    wait();
+    return ok.size() == keys.size();
+  }
+
+  // Make sure at least size bytes are buffered in incoming_
+  void fill(size_t size) {
+    if (incoming_.size() < size) {
+      boost::asio::read(socket_,
+                        boost::asio::dynamic_buffer(incoming_),
+                        boost::asio::transfer_at_least(size - incoming_.size()));
+    }
+  }
+
+  // Read exactly one binary frame and check it answers the oldest request
+  message read_binary_response() {
+    fill(BINARY_HEADER_SIZE);
+
+    binary_header header;
+    message msg;
+    if (!header.read(incoming_.data()) ||
+        header.magic != BINARY_RESPONSE_MAGIC) {
+      throw std::runtime_error("kvclient: malformed binary response");
+    }
+    uint32_t expected = in_flight_.empty() ? request_id_
+                                           : in_flight_.front().request_id;
+    if (header.opcode != INV && header.request_id != expected) {
+      throw std::runtime_error("kvclient: response for unexpected request");
+    }
+
+    size_t frame_size = BINARY_HEADER_SIZE + header.body_length();
+    fill(frame_size);
+    msg.decode_binary(header,
+                      incoming_.substr(BINARY_HEADER_SIZE, header.body_length()));
+    incoming_.erase(0, frame_size);
+    return msg;
+  }
 };
 
 #endif
@@ -0,0 +1,326 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The kvcluster class is a client for several servers that each hold part of
+ * the keys. A hash_ring with virtual nodes picks the server for every key,
+ * so adding a server moves only about 1/N of the keys, and each server is
+ * reached through a small pool of kvclient connections, the key's hash
+ * choosing one so requests for the same key stay in order.
+ *
+ * GET, PUT, and DEL go to the one connection that owns the key. A batch is
+ * split by connection and every part is queued before any is waited on, so
+ * the servers work on their parts in parallel and the whole batch takes
+ * about as long as its slowest part; results come back in the caller's key
+ * order. As with kvclient, the async_ operations only queue requests and
+ * wait() sends them all and completes their callbacks.
+ *
+ * Keys are not moved when servers are added or removed: a key that now maps
+ * to another server reads as missing until it is written again.
+ */
+
+#ifndef KVCLUSTER_H
+#define KVCLUSTER_H
+
+#include "hash_ring.hpp"
+#include "kvclient.cc"
+
+#include <memory>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+class kvcluster {
+public:
+  // Connect to each host:port in endpoints over connections connections
+  kvcluster(boost::asio::io_service &io_service,
+            const std::vector<std::string> &endpoints,
+            protocol_type protocol = TEXT_PROTOCOL,
+            size_t connections = 1,
+            int virtual_nodes = hash_ring::DEFAULT_VIRTUAL_NODES)
+      : io_service_(io_service),
+        protocol_(protocol),
+        connections_(std::max<size_t>(connections, 1)),
+        ring_(virtual_nodes) {
+    for (const std::string &endpoint : endpoints) {
+      add_node(endpoint);
+    }
+  }
+
+  kvcluster(const kvcluster &) = delete;
+  kvcluster &operator=(const kvcluster &) = delete;
+
+  // Connect to the server at endpoint, host:port, and route its share of
+  // keys to it. Throws if it cannot be reached.
+  void add_node(const std::string &endpoint) {
+    if (index_of(endpoint) < pools_.size()) {
+      return;
+    }
+    size_t colon = endpoint.rfind(':');
+    if (colon == std::string::npos) {
+      throw std::invalid_argument("kvcluster: expected host:port, got " +
+                                  endpoint);
+    }
+    std::unique_ptr<node_pool> pool(new node_pool);
+    for (size_t i = 0; i < connections_; i++) {
+      pool->push_back(std::make_unique<kvclient>(io_service_,
+                                                 endpoint.substr(0, colon),
+                                                 endpoint.substr(colon + 1),
+                                                 protocol_));
+    }
+    ring_.add(endpoint); // Appended, so pools_ stays in ring order
+    pools_.push_back(std::move(pool));
+  }
+
+  // Complete the server's in-flight requests, then stop routing to it
+  bool remove_node(const std::string &endpoint) {
+    size_t index = index_of(endpoint);
+    if (index == pools_.size()) {
+      return false;
+    }
+    for (std::unique_ptr<kvclient> &client : *pools_[index]) {
+      client->wait();
+    }
+    ring_.remove(endpoint);
+    pools_.erase(pools_.begin() + index);
+    return true;
+  }
+
+  // Endpoints in the order they were added
+  const std::vector<std::string> &nodes() const { return ring_.nodes(); }
+
+  // The endpoint key is routed to
+  const std::string &node_for(const std::string &key) const {
+    check_nodes();
+    return ring_.nodes()[ring_.owner(key)];
+  }
+
+  bool async_get(const std::string &key, kvclient::get_callback callback) {
+    return connection(route(key)).async_get(key, std::move(callback));
+  }
+
+  bool async_put(const std::string &key,
+                 const std::string &value,
+                 kvclient::status_callback callback,
+                 uint32_t ttl_ms = 0) {
+    return connection(route(key))
+        .async_put(key, value, std::move(callback), ttl_ms);
+  }
+
+  bool async_del(const std::string &key, kvclient::status_callback callback) {
+    return connection(route(key)).async_del(key, std::move(callback));
+  }
+
+  // Batches complete once every server has answered its part, with results
+  // in key order, or empty vectors if any server rejected its part
+  bool async_mget(const std::vector<std::string> &keys,
+                  kvclient::batch_callback callback) {
+    return fan_out(MGET, keys, nullptr, std::move(callback));
+  }
+
+  bool async_mput(const std::vector<std::string> &keys,
+                  const std::vector<std::string> &values,
+                  kvclient::batch_callback callback) {
+    if (keys.size() != values.size()) {
+      return false;
+    }
+    return fan_out(MPUT, keys, &values, std::move(callback));
+  }
+
+  bool async_mdel(const std::vector<std::string> &keys,
+                  kvclient::batch_callback callback) {
+    return fan_out(MDEL, keys, nullptr, std::move(callback));
+  }
+
+  // Send every connection's queued requests, so all servers start on them
+  void flush() {
+    for (std::unique_ptr<node_pool> &pool : pools_) {
+      for (std::unique_ptr<kvclient> &client : *pool) {
+        client->flush();
+      }
+    }
+  }
+
+  // Flush, then complete every request in flight on any connection
+  void wait() {
+    flush();
+    for (std::unique_ptr<node_pool> &pool : pools_) {
+      for (std::unique_ptr<kvclient> &client : *pool) {
+        client->wait();
+      }
+    }
+  }
+
+  bool get(const std::string &key, std::string &value) {
+    return connection(route(key)).get(key, value);
+  }
+
+  bool put(const std::string &key,
+           const std::string &value,
+           uint32_t ttl_ms = 0) {
+    return connection(route(key)).put(key, value, ttl_ms);
+  }
+
+  bool del(const std::string &key) { return connection(route(key)).del(key); }
+
+  bool mget(const std::vector<std::string> &keys,
+            std::vector<std::string> &values,
+            std::vector<bool> &found) {
+    return run_batch(async_mget(keys, collect(found, &values)), found, keys);
+  }
+
+  bool mput(const std::vector<std::string> &keys,
+            const std::vector<std::string> &values,
+            std::vector<bool> &stored) {
+    return run_batch(
+        async_mput(keys, values, collect(stored, nullptr)), stored, keys);
+  }
+
+  bool mdel(const std::vector<std::string> &keys, std::vector<bool> &deleted) {
+    return run_batch(
+        async_mdel(keys, collect(deleted, nullptr)), deleted, keys);
+  }
+
+private:
+  using node_pool = std::vector<std::unique_ptr<kvclient>>;
+
+  // A batch's results as its parts come back
+  struct gather {
+    size_t pending = 1;    // Parts outstanding, plus one while queuing
+    bool rejected = false; // A part came back without a result per key
+    bool refused = false;  // A part could not be queued
+    std::vector<bool> ok;
+    std::vector<std::string> values;
+    kvclient::batch_callback callback;
+
+    void release() {
+      if (--pending || refused) {
+        return;
+      }
+      if (rejected) {
+        callback({}, {});
+      } else {
+        callback(ok, values);
+      }
+    }
+  };
+
+  boost::asio::io_service &io_service_;
+  const protocol_type protocol_;
+  const size_t connections_; // Per node
+  hash_ring ring_;
+  std::vector<std::unique_ptr<node_pool>> pools_; // In ring_.nodes() order
+
+  size_t index_of(const std::string &endpoint) const {
+    const std::vector<std::string> &names = ring_.nodes();
+    return std::find(names.begin(), names.end(), endpoint) - names.begin();
+  }
+
+  void check_nodes() const {
+    if (ring_.empty()) {
+      throw std::runtime_error("kvcluster: no nodes");
+    }
+  }
+
+  // The connection key is sent on, numbered across all nodes' pools: the
+  // owning node's, picked by the hash's low bits, which say next to nothing
+  // about where on the ring the key falls
+  size_t route(std::string_view key) const {
+    check_nodes();
+    uint64_t hash = hash_ring::hash(key);
+    size_t node = ring_.owner(hash);
+    return node * connections_ + (hash & 0xffffffff) % connections_;
+  }
+
+  kvclient &connection(size_t route) {
+    return *(*pools_[route / connections_])[route % connections_];
+  }
+
+  // Split a batch by connection and queue every part before waiting on any.
+  // A part may complete while later ones are queued, if its connection has
+  // to drain, so the gather is held open until all are queued.
+  bool fan_out(message_type type,
+               const std::vector<std::string> &keys,
+               const std::vector<std::string> *values,
+               kvclient::batch_callback callback) {
+    if (keys.empty()) {
+      callback({}, {});
+      return true;
+    }
+    std::vector<std::vector<size_t>> parts(pools_.size() * connections_);
+    for (size_t i = 0; i < keys.size(); i++) {
+      parts[route(keys[i])].push_back(i);
+    }
+
+    std::shared_ptr<gather> results = std::make_shared<gather>();
+    results->ok.resize(keys.size());
+    results->values.resize(keys.size());
+    results->callback = std::move(callback);
+    for (size_t r = 0; r < parts.size(); r++) {
+      if (parts[r].empty()) {
+        continue;
+      }
+      std::shared_ptr<std::vector<size_t>> positions =
+          std::make_shared<std::vector<size_t>>(std::move(parts[r]));
+      std::vector<std::string> part_keys, part_values;
+      part_keys.reserve(positions->size());
+      for (size_t i : *positions) {
+        part_keys.push_back(keys[i]);
+        if (values) {
+          part_values.push_back((*values)[i]);
+        }
+      }
+      kvclient::batch_callback scatter =
+          [results, positions](const std::vector<bool> &ok,
+                               const std::vector<std::string> &found) {
+            if (ok.size() != positions->size()) {
+              results->rejected = true;
+            }
+            for (size_t j = 0; !results->rejected && j < ok.size(); j++) {
+              results->ok[(*positions)[j]] = ok[j];
+              if (j < found.size()) {
+                results->values[(*positions)[j]] = found[j];
+              }
+            }
+            results->release();
+          };
+
+      results->pending++;
+      kvclient &client = connection(r);
+      bool queued = type == MGET   ? client.async_mget(part_keys, scatter)
+                    : type == MPUT ? client.async_mput(
+                                         part_keys, part_values, scatter)
+                                   : client.async_mdel(part_keys, scatter);
+      if (!queued) {
+        results->refused = true;
+        results->release();
+      }
+    }
+    bool refused = results->refused;
+    results->release();
+    return !refused;
+  }
+
+  static kvclient::batch_callback collect(std::vector<bool> &ok,
+                                          std::vector<std::string> *values) {
+    return [&ok, values](const std::vector<bool> &results,
+                         const std::vector<std::string> &result_values) {
+      ok = results;
+      if (values) {
+        *values = result_values;
+      }
+    };
+  }
+
+  bool run_batch(bool queued,
+                 std::vector<bool> &ok,
+                 const std::vector<std::string> &keys) {
+    ok.clear();
+    if (!queued) {
+      return false;
+    }
+    wait();
+    return ok.size() == keys.size();
+  }
+};
+
+#endif
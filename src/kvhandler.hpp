@@ -0,0 +1,702 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The kvhandler class is the part of a kvserver connection that never
+ * touches a socket. It parses the requests a connection has received in
+ * place, applies them to the store, and encodes their responses into one
+ * batch, counting them in the server's metrics. A transport derives its
+ * session from kvhandler and moves bytes between the socket and the
+ * handler's buffers: kvsession does so on the Asio io_service, and
+ * uring_session on an io_uring ring.
+ *
+ * When the server shards its keys between cores, a request_router tells
+ * the handler which core owns a key. A GET, PUT, or DEL for a key this core
+ * does not own is forwarded to the owner, which encodes its response into a
+ * slot the handler splices into the batch when every forwarded request has
+ * been answered. A batch command is split by owner: this core applies its
+ * own part, each other owner applies its part to its own store, and the
+ * results are merged back into key order once every part is answered.
+ */
+
+#ifndef KVHANDLER_H
+#define KVHANDLER_H
+
+#include "kvstore.hpp"
+#include "message.hpp"
+#include "metrics.hpp"
+#include "tracking.hpp"
+#include "wal.hpp"
+
+#include <algorithm>
+#include <chrono>
+#include <cstring>
+#include <memory>
+#include <mutex>
+#include <unordered_map>
+#include <vector>
+
+class kvhandler;
+
+// The keys of an MGET, MPUT, or MDEL that one core owns, with their values
+// for MPUT, and the results the owner encodes for them
+struct batch_part {
+  message_type type = UNSET;
+  protocol_type protocol = TEXT_PROTOCOL;
+  std::vector<std::string_view> keys;
+  std::vector<std::string_view> values;
+  std::vector<bool> results; // Scratch for the store's answers
+  std::string out;           // One batch result per key, in key order
+  std::vector<size_t> ends;  // Where each key's result ends in out
+
+  void reset(message_type batch_type, protocol_type batch_protocol) {
+    type = batch_type;
+    protocol = batch_protocol;
+    keys.clear();
+    values.clear();
+    out.clear();
+    ends.clear();
+  }
+};
+
+// Shards a thread-per-core server's keys between its cores' stores
+class request_router {
+public:
+  virtual ~request_router() = default;
+
+  // The core that owns key, this core, and how many cores there are
+  virtual size_t owner(std::string_view key) const = 0;
+  virtual size_t local() const = 0;
+  virtual size_t num_cores() const = 0;
+
+  // Have the owning core apply a GET, PUT, or DEL and append its response
+  // to out, then call session.forward_done() on this core. request views
+  // the session's buffer, which stays untouched until then.
+  virtual void forward(kvhandler &session,
+                       const message_view &request,
+                       protocol_type protocol,
+                       uint32_t request_id,
+                       std::string &out) = 0;
+
+  // Have core to apply part to its store with kvhandler::apply_batch, then
+  // call session.forward_done() on this core. part, and the bytes its keys
+  // and values view, stay untouched until then.
+  virtual void forward_batch(kvhandler &session,
+                             size_t to,
+                             batch_part &part) = 0;
+};
+
+// The keys each tracking session has read, and the sessions by client
+// number. A session registers when its client sends TRACK ON.
+struct client_tracking {
+  tracking_table keys;
+  std::mutex lock; // Guards sessions and next_client
+  std::unordered_map<uint64_t, std::weak_ptr<kvhandler>> sessions;
+  uint64_t next_client = 1;
+
+  // Push an invalidation of key to client, if its session is still open
+  void notify(uint64_t client, std::string_view key);
+};
+
+// Requests are handled in batches: every complete request in the buffer is
+// applied and its response appended to one send buffer, so pipelined
+// requests cost one read and one write per batch. Sessions start in the
+// text protocol and switch to binary framing when the client sends PROTO
+// BINARY.
+//
+// When the store has a write-ahead log, a batch that changed anything must
+// be held back until the log reports its records durable. When the store
+// is a replica's, and so read-only, every write is refused with ERROR.
+//
+// Requests are counted locally and added to the server's metrics once per
+// batch. The first request and every LATENCY_SAMPLE-th after it are timed
+// from parse to response, excluding network and log waits.
+//
+// With a router, requests for keys other cores own are forwarded and the
+// batch waits for their responses before it is sent. A request that is
+// not for a single key waits until the forwarded ones are answered, so
+// responses stay in request order, and at most one batch command is split
+// between cores at a time.
+//
+// Requests are parsed in place in the receive buffer and responses are
+// encoded into a reused send buffer, so once both buffers have grown to fit
+// the traffic a GET makes no heap allocations.
+class kvhandler : public std::enable_shared_from_this<kvhandler> {
+protected:
+  static constexpr size_t INITIAL_BUFFER_SIZE = 4096;
+  static constexpr size_t MAX_LINE_LENGTH = 1 << 20;
+  static constexpr size_t MAX_BATCH_RESPONSE = 1 << 20; // Flush point
+  static constexpr size_t MAX_SCAN_KEYS = 10000; // Per SCAN response
+
+  kvstore &store;
+  server_metrics &metrics;
+  client_tracking &tracking;
+  uint64_t client = 0; // Tracking client number, or 0 when not tracking
+  bool pushing = false; // Tracking was ever on, so pushes may be queued
+  std::mutex push_lock; // Guards pushes and push_protocol
+  std::string pushes; // Encoded invalidations waiting for the socket
+  protocol_type push_protocol = TEXT_PROTOCOL;
+  uint64_t handled = 0; // Requests handled, for sampling latency
+  uint64_t counted[server_metrics::NUM_COMMANDS] = {}; // Not yet added
+  protocol_type protocol = TEXT_PROTOCOL;
+  std::vector<char> buffer;
+  size_t head = 0; // Start of unconsumed bytes in buffer
+  size_t tail = 0; // End of received bytes in buffer
+  std::string value; // Scratch space for decoding text PUT values
+  std::string response;
+  batch_part batch; // Reused for each batch command's arguments
+  std::string batch_text; // Text MPUT values with newlines restored
+  std::vector<size_t> value_offsets;
+  bool logged = false; // The current batch changed the store
+  request_router *router = nullptr; // Set when keys are sharded by core
+
+  // A forwarded request's response, written by the owning core
+  struct forward_slot {
+    size_t offset; // Where the response belongs in response
+    std::unique_ptr<std::string> out;
+  };
+  std::vector<forward_slot> slots; // Reused; the first forwards are in use
+  size_t forwards = 0;
+  size_t unanswered = 0; // Forwarded requests not yet answered
+  std::shared_ptr<kvhandler> waiting; // Kept alive while any is unanswered
+  std::string spliced;
+
+  // A batch command split between cores, merged into its slot once every
+  // part is answered
+  struct split_batch {
+    bool pending = false;
+    uint32_t request_id = 0;
+    std::string *out = nullptr; // The slot's response
+    std::vector<size_t> owners; // The core that owns each key
+    std::vector<batch_part> parts; // By core
+    std::vector<size_t> taken; // Results merged so far, by core
+  };
+  split_batch split;
+
+  // Make room after tail for at least size more bytes
+  void reserve(size_t size) {
+    if (head == tail) {
+      head = tail = 0;
+    }
+    if (buffer.size() - tail >= size) {
+      return;
+    }
+    std::memmove(buffer.data(), buffer.data() + head, tail - head);
+    tail -= head;
+    head = 0;
+    if (buffer.size() - tail < size) {
+      buffer.resize(std::max(buffer.size() * 2, tail + size));
+    }
+  }
+
+  // Replace response with the responses to every complete request in the
+  // buffer. Returns false if the stream is unusable and the connection
+  // should be dropped. If no request was complete, wanted is set to the
+  // bytes still missing.
+  bool process_buffered(size_t &wanted) {
+    response.clear();
+    return continue_buffered(wanted);
+  }
+
+  // Like process_buffered, but append to the responses already in the
+  // batch. With unanswered forwards, stops before any request that must
+  // wait for them.
+  bool continue_buffered(size_t &wanted) {
+    wanted = 1;
+    bool closed = false;
+    while (response.size() < MAX_BATCH_RESPONSE &&
+           process_one(wanted, closed)) {
+    }
+    metrics.add_requests(counted);
+    if (closed) {
+      metrics.protocol_error();
+      return false;
+    }
+    return true;
+  }
+
+  // The log whose tail must be durable before the batch's responses are
+  // sent, or nullptr if the batch changed nothing or nothing is logged
+  wal *durable_log() {
+    wal *log = logged ? store.attached_log() : nullptr;
+    logged = false;
+    return log;
+  }
+
+  // Move queued invalidations onto the end of out
+  void take_pushes(std::string &out) {
+    std::lock_guard<std::mutex> lock(push_lock);
+    out += pushes;
+    pushes.clear();
+  }
+
+  // Arrange for the queued invalidations to be written on the session's
+  // own thread. Called from any thread when the queue becomes non-empty.
+  virtual void schedule_pushes() = 0;
+
+  // Called once every forwarded request in the batch has been answered and
+  // its response spliced into place, to continue the batch
+  virtual void forwards_done() {}
+
+  void stop_tracking() {
+    if (client) {
+      std::lock_guard<std::mutex> lock(tracking.lock);
+      tracking.sessions.erase(client);
+      client = 0;
+    }
+  }
+
+private:
+  // Handle the next request in the buffer. Returns false when no complete
+  // request is buffered, setting wanted to the bytes still missing, or when
+  // the stream is unusable, setting closed.
+  bool process_one(size_t &wanted, bool &closed) {
+    std::string_view pending(buffer.data() + head, tail - head);
+
+    if (protocol == BINARY_PROTOCOL) {
+      binary_header header;
+      if (pending.size() < BINARY_HEADER_SIZE) {
+        wanted = BINARY_HEADER_SIZE - pending.size();
+        return false;
+      }
+      if (!header.read(pending.data()) ||
+          header.magic != BINARY_REQUEST_MAGIC) {
+        closed = true; // Framing is lost
+        return false;
+      }
+      size_t frame_size = BINARY_HEADER_SIZE + header.body_length();
+      if (pending.size() < frame_size) {
+        wanted = frame_size - pending.size();
+        return false;
+      }
+
+      message_view request;
+      request.decode_binary(
+          header, pending.substr(BINARY_HEADER_SIZE, header.body_length()));
+      if (must_wait(request)) {
+        return false;
+      }
+      handle_counted(request, header.request_id);
+      head += frame_size;
+      return true;
+    }
+
+    // Find the line's end and its tokens in one pass
+    delimiters::line_layout layout;
+    if (!delimiters::scan_line(pending, layout)) {
+      closed = pending.size() > MAX_LINE_LENGTH; // Refuse unbounded lines
+      return false;
+    }
+
+    message_view request;
+    request.decode(pending.substr(0, layout.length), layout);
+    if (must_wait(request)) {
+      return false;
+    }
+    handle_counted(request, 0);
+    head += layout.length + 1;
+    return true;
+  }
+
+  static bool single_key(message_type type) {
+    return type == GET || type == PUT || type == DEL;
+  }
+
+  // Whether request must wait for the forwarded requests to be answered
+  bool must_wait(const message_view &request) const {
+    return unanswered && !single_key(request.type);
+  }
+
+  // Save a place at the end of the response for a forwarded request,
+  // returning the string its response is written to
+  std::string &hold_place() {
+    if (forwards == slots.size()) {
+      slots.push_back({0, std::make_unique<std::string>()});
+    }
+    forward_slot &slot = slots[forwards++];
+    slot.offset = response.size();
+    slot.out->clear();
+    return *slot.out;
+  }
+
+  // Count a request sent to another core, keeping the session alive until
+  // every one is answered
+  void await_forward() {
+    if (unanswered++ == 0) {
+      waiting = shared_from_this();
+    }
+  }
+
+  // Hand a request to the core that owns its key, saving its place
+  void forward(const message_view &request, uint32_t request_id) {
+    std::string &out = hold_place();
+    await_forward();
+    router->forward(*this, request, protocol, request_id, out);
+  }
+
+  // Split the parsed batch by the core that owns each key, apply this
+  // core's part, and forward the rest, saving the batch's place. Returns
+  // false, doing nothing, if this core owns every key.
+  bool split_by_owner(uint32_t request_id) {
+    size_t local = router->local();
+    split.owners.clear();
+    bool remote = false;
+    for (std::string_view key : batch.keys) {
+      split.owners.push_back(router->owner(key));
+      remote |= split.owners.back() != local;
+    }
+    if (!remote) {
+      return false;
+    }
+
+    split.parts.resize(router->num_cores());
+    for (batch_part &part : split.parts) {
+      part.reset(batch.type, protocol);
+    }
+    for (size_t i = 0; i < batch.keys.size(); i++) {
+      batch_part &part = split.parts[split.owners[i]];
+      part.keys.push_back(batch.keys[i]);
+      if (batch.type == MPUT) {
+        part.values.push_back(batch.values[i]);
+      }
+    }
+    split.pending = true;
+    split.request_id = request_id;
+    split.out = &hold_place();
+    logged |= apply_batch(store, split.parts[local], split.parts[local].out);
+    for (size_t core = 0; core < split.parts.size(); core++) {
+      if (core != local && !split.parts[core].keys.empty()) {
+        await_forward();
+        router->forward_batch(*this, core, split.parts[core]);
+      }
+    }
+    return true;
+  }
+
+  // Merge the parts of the split batch into its slot in key order
+  void merge_split() {
+    std::string &out = *split.out;
+    size_t offset = message_view::begin_batch_response(
+        out, protocol, split.owners.size(), split.request_id);
+    split.taken.assign(split.parts.size(), 0);
+    for (size_t owner : split.owners) {
+      const batch_part &part = split.parts[owner];
+      size_t j = split.taken[owner]++;
+      size_t begin = j ? part.ends[j - 1] : 0;
+      out.append(part.out, begin, part.ends[j] - begin);
+    }
+    message_view::end_batch_response(out, protocol, offset);
+    split.pending = false;
+  }
+
+  void start_tracking() {
+    if (!client) {
+      std::lock_guard<std::mutex> lock(tracking.lock);
+      client = tracking.next_client++;
+      tracking.sessions[client] = weak_from_this();
+    }
+    pushing = true;
+    std::lock_guard<std::mutex> lock(push_lock);
+    push_protocol = protocol;
+  }
+
+  // Handle a request, counting it and timing it if it is sampled
+  void handle_counted(const message_view &request, uint32_t request_id) {
+    counted[server_metrics::command_index(request.type)]++;
+    if (handled++ % server_metrics::LATENCY_SAMPLE != 0) {
+      handle_request(request, request_id);
+      return;
+    }
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    handle_request(request, request_id);
+    metrics.sample(request.type, std::chrono::steady_clock::now() - start);
+  }
+
+  // Apply one parsed request and append its response
+  void handle_request(const message_view &request, uint32_t request_id) {
+    // The response to a protocol switch is sent in the old protocol
+    protocol_type reply_protocol = protocol;
+    message_type status = ERROR;
+
+    if (single_key(request.type) &&
+        (request.type == GET || !store.read_only())) {
+      if (client && request.type == GET) {
+        // Track before reading, so a change after the read is pushed
+        tracking.keys.track(
+            request.key, client, [this](uint64_t c, std::string_view key) {
+              tracking.notify(c, key);
+            });
+      }
+      if (router && router->owner(request.key) != router->local()) {
+        forward(request, request_id);
+        return;
+      }
+      logged |=
+          apply(store, request, protocol, request_id, value, response);
+      return;
+    } else if (is_batch(request.type)) {
+      if (handle_batch(request, request_id)) {
+        return;
+      }
+    } else if (request.type == SCAN) {
+      if (handle_scan(request, request_id)) {
+        return;
+      }
+    } else if (request.type == STATS) {
+      if (metrics.report(store, request.key, request.value, value)) {
+        message_view::encode_response(
+            response, reply_protocol, OK, value, request_id);
+        return;
+      }
+    } else if (request.type == PROTO) {
+      if (request.key == "BINARY") {
+        protocol = BINARY_PROTOCOL;
+        status = OK;
+      } else if (request.key == "TEXT") {
+        protocol = TEXT_PROTOCOL;
+        status = OK;
+      }
+      if (pushing) {
+        std::lock_guard<std::mutex> lock(push_lock);
+        push_protocol = protocol;
+      }
+    } else if (request.type == TRACK && !router) {
+      if (request.key == "ON") {
+        start_tracking();
+        status = OK;
+      } else if (request.key == "OFF") {
+        stop_tracking();
+        status = OK;
+      }
+    }
+    message_view::encode_response(
+        response, reply_protocol, status, std::string_view(), request_id);
+  }
+
+  // Apply an MGET, MPUT, or MDEL and append one result per key. Writes take
+  // each stripe lock once per batch. Returns false if the arguments are
+  // malformed, leaving the response untouched.
+  bool handle_batch(const message_view &request, uint32_t request_id) {
+    batch.reset(request.type, protocol);
+    std::vector<std::string_view> &batch_keys = batch.keys;
+    std::string_view args = request.value;
+    std::string_view arg;
+    while (message_view::next_argument(args, protocol, arg)) {
+      if (arg.empty()) {
+        return false;
+      }
+      batch_keys.push_back(arg);
+    }
+    if (!args.empty()) {
+      return false; // Truncated binary argument
+    }
+    if (request.type != MGET && store.read_only()) {
+      return false;
+    }
+
+    if (request.type == MPUT) {
+      if (batch_keys.size() % 2 != 0) {
+        return false;
+      }
+      // Split alternating arguments, restoring newlines in text values.
+      // They are kept apart from value, which single-key requests reuse
+      // while a split batch is still being answered.
+      batch_text.clear();
+      value_offsets.clear();
+      for (size_t i = 0; i < batch_keys.size(); i += 2) {
+        batch_keys[i / 2] = batch_keys[i];
+        if (protocol == TEXT_PROTOCOL) {
+          value_offsets.push_back(batch_text.size());
+          append_translated(batch_text, batch_keys[i + 1], '\r', '\n');
+        } else {
+          batch.values.push_back(batch_keys[i + 1]);
+        }
+      }
+      batch_keys.resize(batch_keys.size() / 2);
+      for (size_t i = 0; i < value_offsets.size(); i++) {
+        size_t end = i + 1 < value_offsets.size() ? value_offsets[i + 1]
+                                                  : batch_text.size();
+        batch.values.push_back(std::string_view(batch_text).substr(
+            value_offsets[i], end - value_offsets[i]));
+      }
+    }
+
+    if (router && split_by_owner(request_id)) {
+      return true;
+    }
+    size_t offset = message_view::begin_batch_response(
+        response, protocol, batch_keys.size(), request_id);
+    logged |= apply_batch(store, batch, response);
+    message_view::end_batch_response(response, protocol, offset);
+    return true;
+  }
+
+  // Apply a SCAN and append its keys, led by the cursor to continue from or
+  // by ERROR once none remain. Returns false if the store has no ordered
+  // index.
+  bool handle_scan(const message_view &request, uint32_t request_id) {
+    if (!store.ordered()) {
+      return false;
+    }
+    size_t limit = std::min<size_t>(request.limit, MAX_SCAN_KEYS);
+    value.clear();
+    value_offsets.clear();
+    // One key beyond the limit tells whether the scan is complete
+    store.scan(
+        request.key, request.value, limit + 1, [&](std::string_view key) {
+          value_offsets.push_back(value.size());
+          value += key;
+        });
+    bool more = value_offsets.size() > limit;
+    size_t found = std::min(value_offsets.size(), limit);
+    auto key_at = [&](size_t i) {
+      size_t end = i + 1 < value_offsets.size() ? value_offsets[i + 1]
+                                                : value.size();
+      return std::string_view(value).substr(value_offsets[i],
+                                            end - value_offsets[i]);
+    };
+
+    size_t offset = message_view::begin_batch_response(
+        response, protocol, found + 1, request_id);
+    message_view::append_batch_result(response,
+                                      protocol,
+                                      more ? OK : ERROR,
+                                      more ? key_at(found - 1)
+                                           : std::string_view());
+    for (size_t i = 0; i < found; i++) {
+      message_view::append_batch_result(response, protocol, OK, key_at(i));
+    }
+    message_view::end_batch_response(response, protocol, offset);
+    return true;
+  }
+
+public:
+  kvhandler(kvstore &store, server_metrics &metrics, client_tracking &tracking)
+      : store(store),
+        metrics(metrics),
+        tracking(tracking),
+        buffer(INITIAL_BUFFER_SIZE) {}
+
+  virtual ~kvhandler() { stop_tracking(); }
+
+  // Shard keys between cores with router. Tracking is refused once set.
+  void route(request_router *r) { router = r; }
+
+  // Apply a GET, PUT, or DEL to store and append its response to out,
+  // using scratch to restore newlines in a text PUT's value. Returns true
+  // if the store changed.
+  static bool apply(kvstore &store,
+                    const message_view &request,
+                    protocol_type protocol,
+                    uint32_t request_id,
+                    std::string &scratch,
+                    std::string &out) {
+    bool changed = false;
+    if (request.type == GET) {
+      if (store.visit(request.key, [&](std::string_view found) {
+            message_view::encode_response(
+                out, protocol, OK, found, request_id);
+          })) {
+        return false;
+      }
+    } else if (request.type == PUT) {
+      std::string_view stored = request.value;
+      if (protocol == TEXT_PROTOCOL) {
+        // Restore newlines carried as carriage returns
+        scratch.clear();
+        append_translated(scratch, request.value, '\r', '\n');
+        stored = scratch;
+      }
+      changed = store.put(
+          request.key, stored, std::chrono::milliseconds(request.ttl));
+    } else if (request.type == DEL) {
+      changed = store.del(request.key);
+    }
+    message_view::encode_response(
+        out, protocol, changed ? OK : ERROR, std::string_view(), request_id);
+    return changed;
+  }
+
+  // Apply part's MGET, MPUT, or MDEL to store and append one batch result
+  // per key to out, recording where each ends in part.ends. Writes take
+  // each stripe lock once per batch. Returns true if the store may have
+  // changed.
+  static bool apply_batch(kvstore &store, batch_part &part, std::string &out) {
+    part.ends.clear();
+    if (part.type == MGET) {
+      store.multi_visit(
+          part.keys, [&](size_t, bool found, std::string_view found_value) {
+            message_view::append_batch_result(
+                out, part.protocol, found ? OK : ERROR, found_value);
+            part.ends.push_back(out.size());
+          });
+      return false;
+    }
+    if (part.type == MPUT) {
+      store.multi_put(part.keys, part.values, part.results);
+    } else {
+      store.multi_del(part.keys, part.results);
+    }
+    for (size_t i = 0; i < part.keys.size(); i++) {
+      message_view::append_batch_result(out,
+                                        part.protocol,
+                                        part.results[i] ? OK : ERROR,
+                                        std::string_view());
+      part.ends.push_back(out.size());
+    }
+    return true;
+  }
+
+  // Called on this core when the owner has answered a forwarded request
+  void forward_done() {
+    if (--unanswered) {
+      return;
+    }
+    if (split.pending) {
+      merge_split();
+    }
+    spliced.clear();
+    size_t from = 0;
+    for (size_t i = 0; i < forwards; i++) {
+      spliced.append(response, from, slots[i].offset - from);
+      spliced += *slots[i].out;
+      from = slots[i].offset;
+    }
+    spliced.append(response, from);
+    response.swap(spliced);
+    forwards = 0;
+    std::shared_ptr<kvhandler> session = std::move(waiting);
+    forwards_done();
+  }
+
+  // Queue an invalidation of key for the client. Safe from any thread.
+  void push_invalidation(std::string_view key) {
+    bool idle;
+    {
+      std::lock_guard<std::mutex> lock(push_lock);
+      idle = pushes.empty(); // Otherwise a flush is already due
+      message_view::encode_invalidation(pushes, push_protocol, key);
+    }
+    metrics.invalidation_pushed();
+    if (idle) {
+      schedule_pushes();
+    }
+  }
+};
+
+inline void client_tracking::notify(uint64_t client, std::string_view key) {
+  std::shared_ptr<kvhandler> session;
+  {
+    std::lock_guard<std::mutex> guard(lock);
+    std::unordered_map<uint64_t, std::weak_ptr<kvhandler>>::iterator it =
+        sessions.find(client);
+    if (it != sessions.end()) {
+      session = it->second.lock();
+    }
+  }
+  if (session) {
+    session->push_invalidation(key);
+  }
+}
+
+#endif
@@ -0,0 +1,341 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The kvpool class is a client that any number of threads may share. It
+ * keeps a small, fixed pool of binary protocol connections and multiplexes
+ * every caller's requests over them, so an application with hundreds of
+ * request threads needs only a handful of sockets per server.
+ *
+ * A caller takes the next connection in turn, encodes its request with a
+ * fresh request id, and registers a promise under that id before sending.
+ * Sending is combined: the first caller to find nobody writing on the
+ * connection becomes its writer and sends everything queued, including
+ * requests other threads queue meanwhile, in as few writes as it can; the
+ * rest return at once. Each connection has a reader thread that decodes
+ * responses as they arrive and fulfils the promise registered under their
+ * request id. A caller therefore holds a connection's lock only to queue
+ * its request, never while it waits for the response.
+ *
+ * If a connection fails, every request waiting on it and every later one
+ * sent on it throws the error, as kvclient does.
+ */
+
+#ifndef KVPOOL_H
+#define KVPOOL_H
+
+#include "kvclient.cc"
+#include "message.hpp"
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+class kvpool {
+public:
+  static constexpr size_t DEFAULT_CONNECTIONS = 4;
+
+  struct usage_stats {
+    uint64_t requests = 0;
+    uint64_t writes = 0; // Socket writes, each sending one or more requests
+  };
+
+  kvpool(const std::string &host,
+         const std::string &port,
+         size_t connections = DEFAULT_CONNECTIONS) {
+    for (size_t i = 0; i < std::max<size_t>(connections, 1); i++) {
+      // A kvclient connects and negotiates the binary protocol, and the
+      // pool takes over its socket
+      kvclient client(io_service_, host, port, BINARY_PROTOCOL);
+      if (client.get_protocol() != BINARY_PROTOCOL) {
+        throw std::runtime_error("kvpool: server refused the binary protocol");
+      }
+      connections_.push_back(
+          std::make_unique<connection>(std::move(client.socket())));
+    }
+    for (std::unique_ptr<connection> &c : connections_) {
+      connection *conn = c.get();
+      conn->reader = std::thread([this, conn]() { read_responses(*conn); });
+    }
+  }
+
+  kvpool(const kvpool &) = delete;
+  kvpool &operator=(const kvpool &) = delete;
+
+  // Fail whatever is still in flight and stop the reader threads
+  ~kvpool() {
+    for (std::unique_ptr<connection> &c : connections_) {
+      boost::system::error_code ignored;
+      c->socket.shutdown(tcp::socket::shutdown_both, ignored);
+    }
+    for (std::unique_ptr<connection> &c : connections_) {
+      c->reader.join();
+    }
+  }
+
+  size_t size() const { return connections_.size(); }
+
+  usage_stats usage() {
+    usage_stats total;
+    for (std::unique_ptr<connection> &c : connections_) {
+      std::lock_guard<std::mutex> guard(c->lock);
+      total.requests += c->requests;
+      total.writes += c->writes;
+    }
+    return total;
+  }
+
+  bool get(const std::string &key, std::string &value) {
+    message response;
+    if (!call(response, [&](std::string &out, uint32_t request_id) {
+          return encode_request(out, BINARY_PROTOCOL, GET, key, "", request_id);
+        })) {
+      return false;
+    }
+    if (response.get_type() != OK) {
+      return false;
+    }
+    value = response.get_value();
+    return true;
+  }
+
+  bool put(const std::string &key,
+           const std::string &value,
+           uint32_t ttl_ms = 0) {
+    message request(PUT, key, value);
+    request.set_ttl(ttl_ms);
+    message response;
+    return call(response,
+                [&](std::string &out, uint32_t request_id) {
+                  std::string encoded; // encode_binary replaces its output
+                  if (!request.encode_binary(encoded, request_id)) {
+                    return false;
+                  }
+                  out += encoded;
+                  return true;
+                }) &&
+           response.get_type() == OK;
+  }
+
+  bool del(const std::string &key) {
+    message response;
+    return call(response,
+                [&](std::string &out, uint32_t request_id) {
+                  return encode_request(
+                      out, BINARY_PROTOCOL, DEL, key, "", request_id);
+                }) &&
+           response.get_type() == OK;
+  }
+
+  // Fetch many keys in one round trip; found[i] tells whether keys[i] exists
+  bool mget(const std::vector<std::string> &keys,
+            std::vector<std::string> &values,
+            std::vector<bool> &found) {
+    return batch(MGET, keys, found, &values);
+  }
+
+  bool mput(const std::vector<std::string> &keys,
+            const std::vector<std::string> &values,
+            std::vector<bool> &stored) {
+    if (keys.size() != values.size()) {
+      stored.clear();
+      return false;
+    }
+    std::vector<std::string> args;
+    args.reserve(keys.size() * 2);
+    for (size_t i = 0; i < keys.size(); i++) {
+      args.push_back(keys[i]);
+      args.push_back(values[i]);
+    }
+    return batch(MPUT, args, stored, nullptr) && stored.size() == keys.size();
+  }
+
+  bool mdel(const std::vector<std::string> &keys, std::vector<bool> &deleted) {
+    return batch(MDEL, keys, deleted, nullptr);
+  }
+
+private:
+  struct connection {
+    tcp::socket socket;
+    std::thread reader;
+    std::mutex lock;      // Guards the members below
+    std::string outgoing; // Encoded requests waiting for the writer
+    bool writing = false; // A caller is sending outgoing
+    boost::system::error_code error; // Set once the connection fails
+    uint32_t request_id = 0;
+    std::unordered_map<uint32_t, std::promise<message>> pending;
+    uint64_t requests = 0;
+    uint64_t writes = 0;
+
+    explicit connection(tcp::socket socket) : socket(std::move(socket)) {}
+  };
+
+  boost::asio::io_service io_service_;
+  std::vector<std::unique_ptr<connection>> connections_;
+  std::atomic<size_t> next_{0}; // Connection the next request is sent on
+
+  // Send a request encoded by encode on the next connection and wait for its
+  // response. Returns false if the request could not be encoded; throws if
+  // the connection fails.
+  template <typename Encoder>
+  bool call(message &response, Encoder encode) {
+    size_t turn = next_.fetch_add(1, std::memory_order_relaxed);
+    connection &c = *connections_[turn % connections_.size()];
+    std::future<message> answer;
+    {
+      std::unique_lock<std::mutex> guard(c.lock);
+      if (c.error) {
+        throw boost::system::system_error(c.error);
+      }
+      uint32_t request_id = ++c.request_id;
+      if (!encode(c.outgoing, request_id)) {
+        c.request_id--;
+        return false;
+      }
+      std::promise<message> &promise = c.pending[request_id];
+      answer = promise.get_future();
+      c.requests++;
+      if (!c.writing) {
+        send(c, guard);
+      }
+    }
+    response = answer.get();
+    return true;
+  }
+
+  // Send outgoing until it is empty, releasing the lock around each write so
+  // other callers can queue more. Called with the lock held.
+  void send(connection &c, std::unique_lock<std::mutex> &guard) {
+    c.writing = true;
+    std::string writing;
+    while (!c.outgoing.empty() && !c.error) {
+      writing.swap(c.outgoing);
+      c.outgoing.clear();
+      c.writes++;
+      guard.unlock();
+      boost::system::error_code error;
+      boost::asio::write(c.socket, boost::asio::buffer(writing), error);
+      guard.lock();
+      if (error) {
+        fail(c, guard, error);
+      }
+    }
+    c.writing = false;
+  }
+
+  // Fail every pending request with error and refuse later ones. Called
+  // with the lock held, and returns with it held.
+  void fail(connection &c,
+            std::unique_lock<std::mutex> &guard,
+            boost::system::error_code error) {
+    if (!c.error) {
+      c.error = error;
+    }
+    std::unordered_map<uint32_t, std::promise<message>> failed;
+    failed.swap(c.pending);
+    c.outgoing.clear();
+    guard.unlock();
+    for (auto &entry : failed) {
+      entry.second.set_exception(
+          std::make_exception_ptr(boost::system::system_error(error)));
+    }
+    guard.lock();
+  }
+
+  // Decode responses as they arrive and hand each to the caller waiting on
+  // its request id, until the connection closes
+  void read_responses(connection &c) {
+    std::string incoming;
+    std::vector<std::pair<uint32_t, message>> arrived;
+    boost::system::error_code error;
+    char buffer[64 * 1024];
+    while (!error) {
+      size_t length = c.socket.read_some(boost::asio::buffer(buffer), error);
+      incoming.append(buffer, length);
+
+      size_t consumed = 0;
+      binary_header header;
+      while (incoming.size() - consumed >= BINARY_HEADER_SIZE) {
+        if (!header.read(incoming.data() + consumed) ||
+            header.magic != BINARY_RESPONSE_MAGIC) {
+          error = boost::asio::error::invalid_argument;
+          break;
+        }
+        size_t frame_size = BINARY_HEADER_SIZE + header.body_length();
+        if (incoming.size() - consumed < frame_size) {
+          break;
+        }
+        message response;
+        response.decode_binary(
+            header,
+            incoming.substr(consumed + BINARY_HEADER_SIZE,
+                            header.body_length()));
+        consumed += frame_size;
+        if (header.opcode != INV) {
+          arrived.emplace_back(header.request_id, std::move(response));
+        }
+      }
+      incoming.erase(0, consumed);
+
+      // Take the promises under the lock, but fulfil them outside it
+      std::vector<std::pair<std::promise<message>, message>> ready;
+      {
+        std::unique_lock<std::mutex> guard(c.lock);
+        for (std::pair<uint32_t, message> &response : arrived) {
+          auto waiting = c.pending.find(response.first);
+          if (waiting != c.pending.end()) {
+            ready.emplace_back(std::move(waiting->second),
+                               std::move(response.second));
+            c.pending.erase(waiting);
+          }
+        }
+        if (error) {
+          fail(c, guard, error);
+        }
+      }
+      arrived.clear();
+      for (auto &response : ready) {
+        response.first.set_value(std::move(response.second));
+      }
+    }
+  }
+
+  bool batch(message_type type,
+             const std::vector<std::string> &args,
+             std::vector<bool> &ok,
+             std::vector<std::string> *values) {
+    ok.clear();
+    if (args.empty()) {
+      if (values) {
+        values->clear();
+      }
+      return true; // Nothing to send, as in kvclient
+    }
+    message response;
+    if (!call(response, [&](std::string &out, uint32_t request_id) {
+          return encode_batch(out, BINARY_PROTOCOL, type, args, request_id);
+        })) {
+      return false;
+    }
+    if (response.get_type() != OK) {
+      return false;
+    }
+    std::vector<std::string> results;
+    if (!decode_batch_results(response.get_value(), ok, results)) {
+      throw std::runtime_error("kvpool: malformed batch response");
+    }
+    if (values) {
+      *values = std::move(results);
+    }
+    return type == MPUT || ok.size() == args.size();
+  }
+};
+
+#endif
@@ -2,108 +2,407 @@
  * Nicole ElChaar, CSE 411, Fall 2022
  *
  * The kvserver class handles GET, PUT, and DELETE requests from any number of
- * clients, using a thread pool to handle multiple requests at once. It returns
- * OK and ERROR responses depending on the success of the operation. The
- * kvserver uses the kvstore class to store the key-value pairs.
+ * clients. Each connection is an asynchronous session driven by whichever
+ * thread of the io_service pool is free, so thousands of idle connections
+ * cost no threads. Each session speaks the text or binary protocol from
+ * message.hpp. It returns OK and ERROR responses depending on the success of
+ * the operation. The kvserver uses the kvstore class to store the
+ * key-value pairs, optionally logging every change to a write-ahead log.
+ * A timer on the io_service reaps expired pairs in small slices between
+ * requests. Every session counts its requests, latencies, and bytes in the
+ * server's metrics, which a STATS request reports and an optional HTTP
+ * endpoint serves in Prometheus format. Clients with a near cache turn on
+ * tracking for their connection, and the server pushes them an
+ * invalidation whenever a key they read changes. On Linux, connections may
+ * instead be served from io_uring rings by a uring_transport, which handles
+ * requests the same way with fewer system calls. With the store's ordered
+ * index enabled, SCAN lists keys by prefix a page at a time. A kvserver
+ * may stream its changes to replicas, and may itself be a read-only
+ * replica of another kvserver.
  */
 
 #ifndef KVSERVER_H
 #define KVSERVER_H
 
-#include "kvstore.hpp"
-#include "message.hpp"
-#include "test.cc"
+#include "kvhandler.hpp"
+#include "replication.hpp"
+#include "snapshot.hpp"
+#include "uring_transport.hpp"
+
+#include <sys/stat.h>
 
 #include <boost/asio.hpp>
 #include <boost/bind/bind.hpp>
 #include <boost/thread.hpp>
+#include <algorithm>
+#include <cerrno>
+#include <chrono>
+#include <cstring>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <stdexcept>
+#include <thread>
+#include <unordered_map>
+#include <vector>
 
 using boost::asio::ip::tcp;
 
+// A session drives a kvhandler from its socket: it reads, lets the handler
+// apply every complete request buffered, and sends all of their responses
+// in one write before reading again. It keeps itself alive by holding a
+// shared_ptr in each pending handler.
+//
+// A session's socket runs its handlers on a strand, so invalidations
+// pushed from other sessions' threads can be written between batches
+// without racing the session's own reads and writes. Pushes queued while a
+// batch is being handled go out at the end of its responses.
+class kvsession : public kvhandler {
+private:
+  tcp::socket socket_;
+  bool started = false;
+  bool writing = false; // A write is in flight
+  bool response_ready = false; // send is waiting for a push write
+  std::string push_out; // Invalidations being written
+
+  std::shared_ptr<kvsession> self() {
+    return std::static_pointer_cast<kvsession>(shared_from_this());
+  }
+
+  // Read at least size more bytes into the buffer, then process it
+  void start_read(size_t size = 1) {
+    reserve(std::max(size, INITIAL_BUFFER_SIZE / 2));
+    socket_.async_read_some(
+        boost::asio::buffer(buffer.data() + tail, buffer.size() - tail),
+        boost::bind(&kvsession::handle_read,
+                    self(),
+                    boost::asio::placeholders::error,
+                    boost::asio::placeholders::bytes_transferred));
+    if (pushing) {
+      flush_pushes(); // Idle until the client writes; push meanwhile
+    }
+  }
+
+  void handle_read(const boost::system::error_code &error,
+                   size_t bytes_transferred) {
+    if (error) {
+      // Client disconnected; the session is freed with its handler
+      metrics.connection_error(error);
+      return;
+    }
+    metrics.bytes_received(bytes_transferred);
+    tail += bytes_transferred;
+    process();
+  }
+
+  // Handle every complete request in the buffer, then write their responses
+  // together, or read more if none is complete
+  void process() {
+    size_t wanted;
+    if (!process_buffered(wanted)) {
+      return; // Drop the connection
+    }
+    respond(wanted);
+  }
+
+  void forwards_done() override {
+    size_t wanted;
+    if (!continue_buffered(wanted)) {
+      return;
+    }
+    respond(wanted);
+  }
+
+  // Send the batch once no forwarded request is unanswered; forwards_done
+  // continues it otherwise
+  void respond(size_t wanted) {
+    if (unanswered) {
+      return;
+    }
+
+    if (response.empty()) {
+      start_read(wanted);
+      return;
+    }
+
+    wal *log = durable_log();
+    if (log) {
+      // Acknowledge nothing until the batch's records are durable
+      std::shared_ptr<kvsession> session = self();
+      log->on_durable(log->tail(), [session](bool ok) {
+        boost::asio::post(session->socket_.get_executor(), [session, ok]() {
+          if (ok) {
+            session->send();
+          }
+        });
+      });
+      return;
+    }
+    send();
+  }
+
+  // Write the batched responses, then process the rest of the buffer
+  void send() {
+    if (pushing) {
+      if (writing) {
+        response_ready = true; // Sent when the push write completes
+        return;
+      }
+      take_pushes(response);
+    }
+    writing = true;
+    boost::asio::async_write(socket_,
+                             boost::asio::buffer(response),
+                             boost::bind(&kvsession::handle_write,
+                                         self(),
+                                         boost::asio::placeholders::error));
+  }
+
+  void handle_write(const boost::system::error_code &error) {
+    writing = false;
+    if (error) {
+      metrics.connection_error(error);
+      return;
+    }
+    metrics.bytes_sent(response.size());
+    process();
+  }
+
+  // Write queued invalidations unless a write is already in flight, whose
+  // completion calls this again or carries them with the next batch
+  void flush_pushes() {
+    if (writing) {
+      return;
+    }
+    push_out.clear();
+    take_pushes(push_out);
+    if (push_out.empty()) {
+      return;
+    }
+    writing = true;
+    boost::asio::async_write(socket_,
+                             boost::asio::buffer(push_out),
+                             boost::bind(&kvsession::handle_push_write,
+                                         self(),
+                                         boost::asio::placeholders::error));
+  }
+
+  void handle_push_write(const boost::system::error_code &error) {
+    writing = false;
+    if (error) {
+      return; // The read or the held response ends the session
+    }
+    metrics.bytes_sent(push_out.size());
+    if (response_ready) {
+      response_ready = false;
+      send();
+    } else {
+      flush_pushes();
+    }
+  }
+
+  void schedule_pushes() override {
+    boost::asio::post(socket_.get_executor(),
+                      boost::bind(&kvsession::flush_pushes, self()));
+  }
+
+public:
+  kvsession(boost::asio::io_service &io_service,
+            kvstore &store,
+            server_metrics &metrics,
+            client_tracking &tracking)
+      : kvhandler(store, metrics, tracking),
+        socket_(boost::asio::make_strand(io_service)) {}
+
+  ~kvsession() {
+    if (started) {
+      metrics.connection_closed();
+    }
+  }
+
+  tcp::socket &socket() { return socket_; }
+
+  void start() {
+    started = true;
+    metrics.connection_opened();
+    process();
+  }
+};
+
 class kvserver {
 private:
   friend class Test;
+  friend class Microbench;
+  static constexpr std::chrono::milliseconds EXPIRE_INTERVAL{10};
+
   boost::asio::io_service &io_service;
   tcp::acceptor acceptor;
   kvstore store;
-  std::vector<message> message_queue;
+  server_metrics metrics;
+  client_tracking tracking;
+  boost::asio::steady_timer expire_timer;
+  std::unique_ptr<metrics_endpoint> endpoint;
+  std::unique_ptr<replication_log> feed;
+  std::unique_ptr<replication_source> source;
+  std::unique_ptr<replica> follower;
+  std::unique_ptr<uring_transport> uring; // Stopped before anything else
 
   void start_accept() {
-    tcp::socket *socket = new tcp::socket(io_service);
-    acceptor.async_accept(*socket,
+    std::shared_ptr<kvsession> session =
+        std::make_shared<kvsession>(io_service, store, metrics, tracking);
+    acceptor.async_accept(session->socket(),
                           boost::bind(&kvserver::handle_accept,
                                       this,
-                                      socket,
+                                      session,
                                       boost::asio::placeholders::error));
   }
 
-  void handle_accept(tcp::socket *socket,
+  void handle_accept(std::shared_ptr<kvsession> session,
                      const boost::system::error_code &error) {
     if (!error) {
-      boost::thread t(boost::bind(&kvserver::handle_session, this, socket));
-    } else {
-      delete socket;
+      session->start();
     }
     start_accept();
   }
 
-  void handle_session(tcp::socket *socket) {
-    try {
-      for (;;) {
-        boost::asio::streambuf request;
-        boost::asio::read_until(*socket, request, "\n");
-
-        // Copy into string
-        std::istream request_stream(&request);
-        std::string request_string;
-        std::getline(request_stream, request_string);
-
-        // Parse message
-        message msg(request_string);
-
-        // Handle message
-        if (msg.get_type() == GET) {
-          std::string value;
-          if (store.get(msg.get_key(), value)) {
-            message resp(OK, value);
-            boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-          } else {
-            message resp(ERROR);
-            boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-          }
-        } else if (msg.get_type() == PUT) {
-          if (store.put(msg.get_key(), msg.get_value())) {
-            message resp(OK);
-            boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-          } else {
-            message resp(ERROR);
-            boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-          }
-        } else if (msg.get_type() == DEL) {
-          if (store.del(msg.get_key())) {
-            message resp(OK);
-            boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-          } else {
-            message resp(ERROR);
-            boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-          }
-        } else {
-          message resp(ERROR);
-          boost::asio::write(*socket, boost::asio::buffer(resp.to_string()));
-        }
+  // The STATS replication report: the replicas served, then the primary
+  // followed
+  std::string replication_report() {
+    return (source ? source->report() : std::string()) +
+           (follower ? follower->report() : std::string());
+  }
+
+  // Reap a slice of expired pairs every EXPIRE_INTERVAL
+  void start_expire() {
+    expire_timer.expires_after(EXPIRE_INTERVAL);
+    expire_timer.async_wait([this](const boost::system::error_code &error) {
+      if (!error) {
+        store.expire();
+        start_expire();
       }
-    } catch (std::exception &e) {
-      // std::cout << "Client disconnected" << std::endl;
-    }
-    delete socket;
+    });
   }
 
 public:
-  kvserver(boost::asio::io_service &io_service, short port)
+  // Serve on port. The store starts from the snapshot at snapshot_path if
+  // one exists, then replays the records of log the snapshot does not hold
+  // and logs every later change to it. A snapshot that exists but cannot be
+  // loaded throws std::runtime_error, as does a log truncated by a snapshot
+  // that cannot be loaded. With
+  // uring_threads, connections are served by that many io_uring threads
+  // instead of the io_service, which then only runs timers; a kernel
+  // without io_uring throws std::system_error.
+  kvserver(boost::asio::io_service &io_service,
+           short port,
+           wal *log = nullptr,
+           const std::string &snapshot_path = "",
+           size_t uring_threads = 0)
       : io_service(io_service),
-        acceptor(io_service, tcp::endpoint(tcp::v4(), port)) {
-    start_accept();
+        acceptor(io_service, tcp::endpoint(tcp::v4(), port)),
+        expire_timer(io_service) {
+    store.set_change_listener([this](std::string_view key) {
+      tracking.keys.invalidate(
+          key, [this](uint64_t client, std::string_view changed) {
+            tracking.notify(client, changed);
+          });
+    });
+    uint64_t log_position = 0;
+    struct stat st;
+    if (!snapshot_path.empty() &&
+        (::stat(snapshot_path.c_str(), &st) == 0 || errno != ENOENT) &&
+        snapshot::load(snapshot_path,
+                       store,
+                       std::thread::hardware_concurrency(),
+                       &log_position) < 0) {
+      // Serving a partial store would save it over the snapshot
+      throw std::runtime_error("kvserver: cannot load snapshot " +
+                               snapshot_path);
+    }
+    if (log) {
+      store.recover(*log, log_position);
+      store.attach_log(log);
+    }
+    if (uring_threads) {
+      uring = std::make_unique<uring_transport>(acceptor.native_handle(),
+                                                uring_threads,
+                                                store,
+                                                metrics,
+                                                tracking);
+    } else {
+      start_accept();
+    }
+    start_expire();
+  }
+
+  // The bound port, useful when constructed with port 0
+  unsigned short port() const { return acceptor.local_endpoint().port(); }
+
+  // Write a snapshot of the store without blocking requests, then drop the
+  // log records it holds, so the log only grows between snapshots. Returns
+  // the number of pairs saved, or -1 on failure.
+  long long save_snapshot(const std::string &path) {
+    uint64_t log_position;
+    long long saved = snapshot::save(store, path, &log_position);
+    wal *log = store.attached_log();
+    if (saved >= 0 && log && !log->truncate_through(log_position)) {
+      // Still correct, as replay skips the records the snapshot holds
+      std::cerr << "wal: cannot truncate the log after a snapshot"
+                << std::endl;
+    }
+    return saved;
+  }
+
+  // Load a file of "key value" lines on every core. Returns the number of
+  // lines loaded, or -1 if the file cannot be read.
+  long long load_file(const std::string &path) {
+    return store.bulk_load_file(path);
+  }
+
+  size_t size() { return store.size(); }
+
+  // Cap the bytes of stored entries, evicting as needed; 0 is unbounded
+  void set_memory_limit(size_t limit) { store.set_memory_limit(limit); }
+
+  kvstore::cache_stats cache_usage() { return store.cache_usage(); }
+
+  // The report a STATS request returns
+  std::string stats() { return metrics.report(store); }
+
+  // Sample accesses to find the hottest keys, as STATS hotkeys on does
+  void track_hot_keys(bool on) { store.track_hot_keys(on); }
+
+  // Index the keys in order, so SCAN can list them by prefix
+  void enable_ordered_index() { store.enable_ordered_index(); }
+
+  // Stream every change to replicas that connect on port, keeping backlog
+  // bytes of recent changes for replicas that reconnect. Call before
+  // serving requests. Returns the bound port, useful when port is 0.
+  unsigned short serve_replicas(
+      unsigned short port,
+      size_t backlog = replication_log::DEFAULT_CAPACITY) {
+    feed = std::make_unique<replication_log>(backlog);
+    store.attach_feed(feed.get());
+    source =
+        std::make_unique<replication_source>(io_service, port, store, *feed);
+    metrics.report_replication([this]() { return replication_report(); });
+    return source->port();
+  }
+
+  // Follow the primary serving replicas at host:port, refusing clients'
+  // writes from now on. Call before serving requests.
+  void replicate_from(const std::string &host, const std::string &port) {
+    store.set_read_only(true);
+    follower = std::make_unique<replica>(io_service, store, host, port);
+    metrics.report_replication([this]() { return replication_report(); });
+  }
+
+  // Serve the metrics in Prometheus format at http://host:port/metrics.
+  // Returns the bound port, useful when port is 0.
+  unsigned short serve_metrics(unsigned short port) {
+    endpoint = std::make_unique<metrics_endpoint>(
+        io_service, port, [this]() { return metrics.prometheus(store); });
+    return endpoint->port();
   }
 };
 
-#endif
\ No newline at end of file
+#endif
@@ -1,104 +1,1327 @@
 /*
  * Nicole ElChaar, CSE 411, Fall 2022
  *
- * The kvstore class implements a hash map with a fixed number of locks for
- * concurrent operation.
+ * The kvstore class implements a sharded hash map for concurrent operation.
+ * Each shard owns its own table, lock, and size counter, so operations on
+ * different shards never touch the same memory and a rehash in one shard
+ * cannot corrupt another.
+ *
+ * Reads never take a lock. Table chains hold immutable nodes: writers
+ * serialize on the shard lock and publish a new node rather than modifying
+ * one in place, and unlinked nodes are reclaimed through the epoch class. A
+ * rehash relinks nodes into a new bucket array under a sequence counter, so
+ * a reader that misses during a rehash knows to retry.
+ *
+ * Each node keeps its key and value inline after a small fixed header, in one
+ * allocation from its shard's slab, so an entry costs its data plus 24 bytes
+ * rounded up to a size class rather than a heap node and two strings.
+ *
+ * With a write-ahead log attached, every change is appended to the log while
+ * its shard lock is held, so the log orders changes to a key exactly as the
+ * table applied them. A replication feed is appended to the same way, but
+ * only once the change is visible to readers, so a stream that reads the
+ * feed's tail before a lock-free snapshot misses nothing in between. Pairs
+ * that expire are not fed, since replicas expire them on their own.
+ *
+ * With a memory limit set, each shard keeps its entries under its share of
+ * the limit by evicting with CLOCK: a get sets a node's reference bit if it
+ * is clear, new nodes start without it so keys read once go first, and a
+ * write that takes the shard over its share sweeps a hand
+ * across the buckets, clearing set bits and evicting nodes whose bit is
+ * already clear. A write whose entry alone is larger than its shard's share
+ * is refused, since evicting the rest of the shard would still leave it
+ * over. Hits and misses are counted in per-thread slots, so a get writes no
+ * shared cache line.
+ *
+ * Bulk loads hash and partition records by shard on every core, then fill
+ * each shard from one thread under a single acquisition of its lock, into a
+ * table sized for the load up front.
+ *
+ * A pair may carry an expiry time, stored after its value. A get treats an
+ * expired node as a miss, and each shard files its expiring nodes in a
+ * timing wheel that reclaims them a few at a time: every write to the shard
+ * reaps a handful that are due, and expire reaps a bounded slice from every
+ * shard, so nothing ever scans a whole table. Expired pairs count towards
+ * size until they are reaped.
+ *
+ * Shard locks count their acquisitions and the time lockers spend waiting,
+ * which shows whether the shard count is high enough for the core count.
+ * stripe_usage breaks this down by shard, and track_hot_keys turns on a
+ * sampled sketch of the most accessed keys, to tell a stripe that is hot
+ * because of a few keys from one that is merely unlucky.
+ *
+ * A change listener, if set, hears of every pair added, replaced, or
+ * removed, including by eviction and expiry; the server uses it to
+ * invalidate clients' near caches.
+ *
+ * With the ordered index enabled, each shard also keeps its keys in an
+ * ordered_index skiplist, updated under the shard lock whenever a key is
+ * added or removed, and scan merges the shards' skiplists to list keys by
+ * prefix in byte order without taking any lock.
  */
 
 #ifndef KVSTORE_H
 #define KVSTORE_H
 
-#include "test.cc"
+#include "contended_mutex.hpp"
+#include "counter.hpp"
+#include "epoch.hpp"
+#include "hot_keys.hpp"
+#include "ordered_index.hpp"
+#include "replication_log.hpp"
+#include "slab.hpp"
+#include "timing_wheel.hpp"
+#include "wal.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <functional>
 #include <iostream>
+#include <memory>
 #include <mutex>
-#include <unordered_map>
+#include <string>
+#include <string_view>
+#include <thread>
 #include <vector>
 
 class kvstore {
 private:
   friend class Test;
-  int num_locks;
-  std::vector<std::mutex> locks;
-  std::hash<std::string> hash_func;
-  std::unordered_map<std::string, std::string> store;
 
-public:
-  kvstore(int num_locks = 100) : num_locks(num_locks), locks(num_locks) {
-    hash_func = std::hash<std::string>{};
+  static constexpr size_t INITIAL_BUCKETS = 16;
+  static constexpr size_t BULK_BLOCK_SIZE = 64 << 20; // File bytes per pass
+  static constexpr size_t WRITE_EXPIRE_BUDGET = 4; // Reaped per shard write
+
+  // An immutable key-value pair; only the chain link and the CLOCK
+  // reference bit are ever rewritten. The key and value bytes follow the
+  // header in the same allocation, followed by an 8-byte expiry time if the
+  // pair has one.
+  struct node {
+    static constexpr uint32_t REFERENCED = 1u << 31;
+    static constexpr uint32_t EXPIRING = 1u << 30;
+    static constexpr uint32_t KEY_LENGTH = EXPIRING - 1;
+
+    std::atomic<node *> next;
+    const size_t hash;
+    std::atomic<uint32_t> key_bits; // Key length, plus the flag bits
+    const uint32_t value_length;
+
+    node(size_t hash, size_t key_length, size_t value_length, bool expiring)
+        : next(nullptr),
+          hash(hash),
+          key_bits(uint32_t(key_length) | (expiring ? EXPIRING : 0)),
+          value_length(uint32_t(value_length)) {}
+
+    const char *data() const {
+      return reinterpret_cast<const char *>(this + 1);
+    }
+
+    size_t key_length() const {
+      return key_bits.load(std::memory_order_relaxed) & KEY_LENGTH;
+    }
+
+    bool expiring() const {
+      return key_bits.load(std::memory_order_relaxed) & EXPIRING;
+    }
+
+    // Expiry time in milliseconds since the Unix epoch, or 0 for none
+    uint64_t expires() const {
+      if (!expiring()) {
+        return 0;
+      }
+      uint64_t expires;
+      std::memcpy(&expires, data() + key_length() + value_length, 8);
+      return expires;
+    }
+
+    bool expired(uint64_t now) const {
+      return expiring() && expires() <= now;
+    }
+
+    std::string_view key() const {
+      return std::string_view(data(), key_length());
+    }
+
+    std::string_view value() const {
+      return std::string_view(data() + key_length(), value_length);
+    }
+
+    static size_t bytes_for(size_t key_length,
+                            size_t value_length,
+                            bool expiring) {
+      return sizeof(node) + key_length + value_length + (expiring ? 8 : 0);
+    }
+
+    size_t bytes() const {
+      return bytes_for(key_length(), value_length, expiring());
+    }
+
+    // Mark the node recently used, writing only if the bit is clear so hot
+    // nodes stay clean in every reader's cache
+    void touch() {
+      if (!(key_bits.load(std::memory_order_relaxed) & REFERENCED)) {
+        key_bits.fetch_or(REFERENCED, std::memory_order_relaxed);
+      }
+    }
+
+    // Clear the reference bit, returning whether it was set. A touch racing
+    // with this may be lost, which only costs the node its second chance.
+    bool clear_referenced() {
+      uint32_t bits = key_bits.load(std::memory_order_relaxed);
+      if (!(bits & REFERENCED)) {
+        return false;
+      }
+      key_bits.store(bits & ~REFERENCED, std::memory_order_relaxed);
+      return true;
+    }
+
+    // Build a node in one allocation from allocator, expiring at expires
+    // unless it is 0
+    static node *create(slab &allocator,
+                        size_t hash,
+                        std::string_view key,
+                        std::string_view value,
+                        uint64_t expires = 0) {
+      size_t extra = expires ? 8 : 0;
+      void *memory =
+          allocator.allocate(sizeof(node) + key.size() + value.size() + extra);
+      node *n = new (memory) node(hash, key.size(), value.size(), expires != 0);
+      char *data = reinterpret_cast<char *>(n + 1);
+      std::memcpy(data, key.data(), key.size());
+      std::memcpy(data + key.size(), value.data(), value.size());
+      std::memcpy(data + key.size() + value.size(), &expires, extra);
+      return n;
+    }
+  };
+
+  // A timing wheel entry for an expiring node. The node may have been
+  // replaced or freed by the time the entry fires, so it is only compared
+  // against the nodes in its chain, never dereferenced.
+  struct expiry {
+    const node *n;
+    size_t hash;
+  };
+
+  // A power-of-two bucket array
+  struct table {
+    size_t mask;
+    std::unique_ptr<std::atomic<node *>[]> buckets;
+
+    table(size_t num_buckets)
+        : mask(num_buckets - 1),
+          buckets(new std::atomic<node *>[num_buckets]) {
+      for (size_t i = 0; i < num_buckets; i++) {
+        buckets[i].store(nullptr, std::memory_order_relaxed);
+      }
+    }
+  };
+
+  // A shard is a self-contained hash table guarded by its own lock. The
+  // fields readers touch live on a separate cache line from the lock.
+  struct alignas(CACHE_LINE_SIZE) shard {
+    std::atomic<table *> tab;
+    std::atomic<uint64_t> resize_seq{0}; // Odd while a rehash is relinking
+
+    alignas(CACHE_LINE_SIZE) contended_mutex lock;
+    std::atomic<size_t> size{0};
+    std::atomic<size_t> bytes{0};     // Bytes of live entries
+    std::atomic<uint64_t> evictions{0};
+    std::atomic<uint64_t> expirations{0};
+    size_t clock_hand = 0;            // Next bucket the CLOCK sweep visits
+    std::unique_ptr<timing_wheel<expiry>> wheel; // Made by the first TTL
+    slab nodes; // Declared before retired so it outlives retired nodes
+    epoch::retire_list retired;
+    std::unique_ptr<ordered_index> index; // Made by enable_ordered_index
+
+    shard() : tab(new table(INITIAL_BUCKETS)) {}
+    ~shard() {
+      retired.drain();
+      free_table(tab.load(std::memory_order_relaxed));
+    }
+  };
+
+  int num_shards;
+  std::unique_ptr<shard[]> shards;
+  std::hash<std::string_view> hash_func;
+  wal *log = nullptr;
+  replication_log *feed = nullptr;
+  std::atomic<bool> refusing_writes{false}; // Client writes, on a replica
+  std::atomic<size_t> shard_limit{0}; // Entry bytes per shard; 0 is unbounded
+  std::atomic<bool> expiring{false};  // Set once any pair has had a TTL
+  std::atomic<bool> indexed{false};   // Every shard has an ordered index
+  striped_counter hits;
+  striped_counter misses;
+  std::mutex sketch_lock; // Guards key_sketch itself, not its contents
+  std::unique_ptr<hot_keys> key_sketch; // Made by the first track_hot_keys
+  std::atomic<hot_keys *> key_tracker{nullptr}; // key_sketch while tracking
+  std::function<void(std::string_view)> change_listener;
+
+  // Tell the change listener, if any, that key's pair changed
+  void changed(std::string_view key) {
+    if (change_listener) {
+      change_listener(key);
+    }
+  }
+
+  // Count an access to key in the hot key sketch, if tracking
+  void track(size_t hash, std::string_view key) {
+    hot_keys *tracker = key_tracker.load(std::memory_order_acquire);
+    if (tracker) {
+      tracker->record(hash, key);
+    }
+  }
+
+  // Return a node to the slab that allocated it; runs under its shard lock
+  static void delete_node(void *ptr) {
+    node *n = static_cast<node *>(ptr);
+    size_t bytes = n->bytes();
+    n->~node();
+    slab::release(n, bytes);
+  }
+
+  static void delete_table(void *ptr) { delete static_cast<table *>(ptr); }
+
+  // Free a table together with every node still linked from it
+  static void free_table(void *ptr) {
+    table *t = static_cast<table *>(ptr);
+    for (size_t i = 0; i <= t->mask; i++) {
+      node *n = t->buckets[i].load(std::memory_order_relaxed);
+      while (n) {
+        node *next = n->next.load(std::memory_order_relaxed);
+        delete_node(n);
+        n = next;
+      }
+    }
+    delete t;
+  }
+
+  shard &shard_for(size_t hash) { return shards[hash % num_shards]; }
+
+  size_t bucket_for(size_t hash, const table *t) const {
+    return (hash / num_shards) & t->mask;
+  }
+
+  // Walk a chain looking for key; safe with or without the shard lock
+  node *find(const table *t, size_t hash, std::string_view key) const {
+    node *n = t->buckets[bucket_for(hash, t)].load(std::memory_order_acquire);
+    while (n) {
+      if (n->hash == hash && n->key() == key) {
+        return n;
+      }
+      n = n->next.load(std::memory_order_acquire);
+    }
+    return nullptr;
+  }
+
+  // Locate the link that points at key's node, or at the chain's end.
+  // Requires the shard lock.
+  std::atomic<node *> *find_link(table *t, size_t hash, std::string_view key) {
+    std::atomic<node *> *link = &t->buckets[bucket_for(hash, t)];
+    node *n = link->load(std::memory_order_relaxed);
+    while (n && !(n->hash == hash && n->key() == key)) {
+      link = &n->next;
+      n = link->load(std::memory_order_relaxed);
+    }
+    return link;
   }
 
-  bool get(const std::string &key, std::string &value) {
-    int hash = hash_func(key) % num_locks;
-    locks[hash].lock();
-    if (store.find(key) == store.end()) {
-      locks[hash].unlock();
+  // Double the bucket array, relinking existing nodes rather than copying
+  // them. Readers that race with this see an odd resize_seq and retry on a
+  // miss. Requires the shard lock.
+  void grow(shard &s) {
+    table *old_table = s.tab.load(std::memory_order_relaxed);
+    table *new_table = new table((old_table->mask + 1) * 2);
+
+    uint64_t seq = s.resize_seq.load(std::memory_order_relaxed);
+    s.resize_seq.store(seq + 1, std::memory_order_relaxed);
+    std::atomic_thread_fence(std::memory_order_release);
+
+    for (size_t i = 0; i <= old_table->mask; i++) {
+      node *n = old_table->buckets[i].load(std::memory_order_relaxed);
+      while (n) {
+        node *next = n->next.load(std::memory_order_relaxed);
+        std::atomic<node *> &head =
+            new_table->buckets[bucket_for(n->hash, new_table)];
+        n->next.store(head.load(std::memory_order_relaxed),
+                      std::memory_order_release);
+        head.store(n, std::memory_order_release);
+        n = next;
+      }
+    }
+
+    s.tab.store(new_table, std::memory_order_release);
+    s.resize_seq.store(seq + 2, std::memory_order_release);
+    s.retired.retire(old_table, delete_table);
+  }
+
+  // Spin until no rehash is in progress and return the sequence observed
+  static uint64_t read_begin(const shard &s) {
+    uint64_t seq = s.resize_seq.load(std::memory_order_acquire);
+    while (seq & 1) {
+      std::this_thread::yield();
+      seq = s.resize_seq.load(std::memory_order_acquire);
+    }
+    return seq;
+  }
+
+  // A miss is only trusted if no rehash started since read_begin
+  static bool read_validate(const shard &s, uint64_t seq) {
+    std::atomic_thread_fence(std::memory_order_acquire);
+    return s.resize_seq.load(std::memory_order_relaxed) == seq;
+  }
+
+  // Append a record of n's pair to to, a wal or replication_log
+  template <typename Log>
+  static void append_put(Log &to, const node *n) {
+    if (n->expires()) {
+      // The expiry follows the value, in host order as the node keeps it
+      to.append(wal::RECORD_PUT_TTL,
+                n->key(),
+                std::string_view(n->value().data(), n->value().size() + 8));
+    } else {
+      to.append(wal::RECORD_PUT, n->key(), n->value());
+    }
+  }
+
+  // Link fresh into its shard, replacing any node with the same key.
+  // Requires the shard lock.
+  void put_locked(shard &s, node *fresh) {
+    uint64_t expires = fresh->expires();
+    if (log) {
+      append_put(*log, fresh);
+    }
+    if (s.wheel) {
+      expire_locked(s, now_ms(), WRITE_EXPIRE_BUDGET);
+    }
+    table *t = s.tab.load(std::memory_order_relaxed);
+    std::atomic<node *> *link = find_link(t, fresh->hash, fresh->key());
+    node *old = link->load(std::memory_order_relaxed);
+    add_bytes(s, fresh->bytes());
+    if (old) {
+      // Replace the node in place in its chain
+      fresh->next.store(old->next.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+      link->store(fresh, std::memory_order_release);
+      add_bytes(s, -old->bytes());
+      s.retired.retire(old, delete_node);
+    } else {
+      std::atomic<node *> &head = t->buckets[bucket_for(fresh->hash, t)];
+      fresh->next.store(head.load(std::memory_order_relaxed),
+                        std::memory_order_relaxed);
+      head.store(fresh, std::memory_order_release);
+      if (s.index) {
+        s.index->insert(fresh->key());
+      }
+      size_t size = s.size.load(std::memory_order_relaxed) + 1;
+      s.size.store(size, std::memory_order_relaxed);
+      if (size > t->mask + 1) {
+        grow(s);
+      }
+    }
+    changed(fresh->key());
+    if (feed) {
+      append_put(*feed, fresh);
+    }
+
+    if (expires) {
+      if (!s.wheel) {
+        s.wheel = std::make_unique<timing_wheel<expiry>>(now_ms());
+        expiring.store(true, std::memory_order_relaxed);
+      }
+      s.wheel->schedule(expires, {fresh, fresh->hash});
+    }
+
+    size_t limit = shard_limit.load(std::memory_order_relaxed);
+    if (limit && s.bytes.load(std::memory_order_relaxed) > limit) {
+      evict_locked(s, fresh, limit);
+    }
+  }
+
+  // Whether a pair fits in a shard's share of the memory limit at all
+  bool fits(std::string_view key,
+            std::string_view value,
+            uint64_t expires) const {
+    size_t limit = shard_limit.load(std::memory_order_relaxed);
+    return !limit ||
+           node::bytes_for(key.size(), value.size(), expires != 0) <= limit;
+  }
+
+  // Reap up to budget of the shard's nodes whose expiry is due, returning
+  // how many were expired. Requires the shard lock.
+  size_t expire_locked(shard &s, uint64_t now, size_t budget) {
+    size_t reaped = 0;
+    s.wheel->expire(now, budget, [&](const expiry &e) {
+      table *t = s.tab.load(std::memory_order_relaxed);
+      std::atomic<node *> *link = &t->buckets[bucket_for(e.hash, t)];
+      node *n = link->load(std::memory_order_relaxed);
+      while (n && n != e.n) {
+        link = &n->next;
+        n = link->load(std::memory_order_relaxed);
+      }
+      // A node at the same address may be a newer pair; check its own expiry
+      if (n && n->expired(now)) {
+        unlink_locked(s, link, n, true);
+        reaped++;
+      }
+    });
+    s.expirations.store(s.expirations.load(std::memory_order_relaxed) + reaped,
+                        std::memory_order_relaxed);
+    return reaped;
+  }
+
+  // Adjust a shard's live byte count. Requires the shard lock.
+  static void add_bytes(shard &s, size_t delta) {
+    s.bytes.store(s.bytes.load(std::memory_order_relaxed) + delta,
+                  std::memory_order_relaxed);
+  }
+
+  // Unlink old, which link points at, and retire it, feeding its removal
+  // to replicas unless it expired. Requires the shard lock.
+  void unlink_locked(shard &s,
+                     std::atomic<node *> *link,
+                     node *old,
+                     bool expired = false) {
+    link->store(old->next.load(std::memory_order_relaxed),
+                std::memory_order_release);
+    s.size.store(s.size.load(std::memory_order_relaxed) - 1,
+                 std::memory_order_relaxed);
+    add_bytes(s, -old->bytes());
+    if (s.index) {
+      s.index->erase(old->key());
+    }
+    changed(old->key());
+    if (feed && !expired) {
+      feed->append(wal::RECORD_DEL, old->key());
+    }
+    s.retired.retire(old, delete_node);
+  }
+
+  // Sweep the CLOCK hand over whole buckets until the shard is within
+  // limit, giving referenced nodes a second chance and never evicting keep.
+  // Two full sweeps clear every bit, so the loop is bounded. Requires the
+  // shard lock.
+  void evict_locked(shard &s, const node *keep, size_t limit) {
+    table *t = s.tab.load(std::memory_order_relaxed);
+    uint64_t now = s.wheel ? now_ms() : 0; // Expired nodes go first
+    for (size_t swept = 0;
+         swept <= 2 * (t->mask + 1) &&
+         s.bytes.load(std::memory_order_relaxed) > limit;
+         swept++) {
+      std::atomic<node *> *link = &t->buckets[s.clock_hand++ & t->mask];
+      node *n = link->load(std::memory_order_relaxed);
+      while (n) {
+        node *next = n->next.load(std::memory_order_relaxed);
+        bool expired = n->expired(now);
+        if (n == keep || (!expired && n->clear_referenced())) {
+          link = &n->next;
+        } else if (expired) {
+          // Reaped early, as the timing wheel would have: never logged
+          unlink_locked(s, link, n, true);
+          s.expirations.store(
+              s.expirations.load(std::memory_order_relaxed) + 1,
+              std::memory_order_relaxed);
+        } else {
+          if (log) {
+            log->append(wal::RECORD_DEL, n->key());
+          }
+          unlink_locked(s, link, n);
+          s.evictions.store(s.evictions.load(std::memory_order_relaxed) + 1,
+                            std::memory_order_relaxed);
+        }
+        n = next;
+      }
+    }
+  }
+
+  // Swap in an empty table, retiring the old one with its nodes. Requires
+  // the shard lock.
+  void clear_locked(shard &s) {
+    table *old_table = s.tab.load(std::memory_order_relaxed);
+    s.tab.store(new table(INITIAL_BUCKETS), std::memory_order_release);
+    for (size_t b = 0; change_listener && b <= old_table->mask; b++) {
+      node *n = old_table->buckets[b].load(std::memory_order_relaxed);
+      for (; n; n = n->next.load(std::memory_order_relaxed)) {
+        changed(n->key());
+      }
+    }
+    s.size.store(0, std::memory_order_relaxed);
+    s.bytes.store(0, std::memory_order_relaxed);
+    s.wheel.reset();
+    if (s.index) {
+      s.index->clear();
+    }
+    s.retired.retire(old_table, free_table);
+  }
+
+  // Unlink key's node if present, returning whether it held a live pair.
+  // Requires the shard lock.
+  bool del_locked(shard &s, size_t hash, std::string_view key) {
+    std::atomic<node *> *link =
+        find_link(s.tab.load(std::memory_order_relaxed), hash, key);
+    node *old = link->load(std::memory_order_relaxed);
+    if (!old) {
       return false;
     }
-    value = store[key];
-    locks[hash].unlock();
-    return true;
+    if (log) {
+      log->append(wal::RECORD_DEL, key);
+    }
+    bool live = !(old->expiring() && old->expired(now_ms()));
+    unlink_locked(s, link, old);
+    return live;
   }
 
-  bool put(const std::string &key, const std::string &value) {
-    int hash = hash_func(key) % num_locks;
-    locks[hash].lock();
-    store[key] = value;
-    locks[hash].unlock();
-    return true;
+  // Whether key's pair in s has not expired by now. A pair that is not
+  // found was removed after it was indexed, and counts as live.
+  bool unexpired(shard &s, std::string_view key, uint64_t now) {
+    node *n = find(s.tab.load(std::memory_order_acquire), hash_func(key), key);
+    return !n || !n->expired(now);
+  }
+
+  // Visit batch indices grouped by shard, holding each shard's lock once
+  // while apply(shard, index) runs for all of that shard's keys
+  template <typename Apply>
+  void for_each_shard_group(const std::vector<size_t> &hashes, Apply &&apply) {
+    std::vector<std::pair<int, size_t>> order(hashes.size());
+    for (size_t i = 0; i < hashes.size(); i++) {
+      order[i] = {int(hashes[i] % num_shards), i};
+    }
+    std::sort(order.begin(), order.end());
+
+    for (size_t i = 0; i < order.size();) {
+      shard &s = shards[order[i].first];
+      std::lock_guard<contended_mutex> lock(s.lock);
+      for (int group = order[i].first;
+           i < order.size() && order[i].first == group;
+           i++) {
+        apply(s, order[i].second);
+      }
+    }
+  }
+
+  // A record waiting to be bulk loaded; the views point into caller memory
+  struct bulk_record {
+    size_t hash;
+    std::string_view key;
+    std::string_view value;
+  };
+
+  // Records produced by one bulk load thread, one list per shard
+  using bulk_partition = std::vector<std::vector<bulk_record>>;
+
+  // Run work(t) for t in [0, num_threads) on the caller and new threads
+  template <typename Work>
+  static void run_parallel(unsigned num_threads, Work &&work) {
+    std::vector<std::thread> threads;
+    for (unsigned t = 1; t < num_threads; t++) {
+      threads.emplace_back([&work, t]() { work(t); });
+    }
+    work(0);
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+  }
+
+  static unsigned default_threads() {
+    return std::max(1u, std::thread::hardware_concurrency());
+  }
+
+  // Insert partitioned records with threads claiming whole shards. Each
+  // shard's lock is taken once, and records are applied in producer order
+  // so a later duplicate key wins as it would with put. Records put would
+  // refuse as too large for the memory limit are skipped.
+  void insert_partitioned(std::vector<bulk_partition> &parts,
+                          unsigned num_threads) {
+    std::atomic<int> next(0);
+    run_parallel(num_threads, [&](unsigned) {
+      for (int i = next++; i < num_shards; i = next++) {
+        shard &s = shards[i];
+        std::lock_guard<contended_mutex> lock(s.lock);
+        for (size_t p = 0; p < parts.size(); p++) {
+          std::vector<bulk_record> &records = parts[p][i];
+          for (size_t r = 0; r < records.size(); r++) {
+            if (!fits(records[r].key, records[r].value, 0)) {
+              continue;
+            }
+            put_locked(s,
+                       node::create(s.nodes,
+                                    records[r].hash,
+                                    records[r].key,
+                                    records[r].value));
+          }
+          records.clear();
+        }
+      }
+    });
+  }
+
+  // Parse "key value" lines in text into part, skipping lines without a
+  // space. The value runs to the end of the line.
+  void parse_lines(std::string_view text, bulk_partition &part) {
+    while (!text.empty()) {
+      size_t end = text.find('\n');
+      std::string_view line = text.substr(0, end);
+      text.remove_prefix(end == std::string_view::npos ? text.size()
+                                                       : end + 1);
+      size_t space = line.find(' ');
+      if (space == std::string_view::npos || space == 0) {
+        continue;
+      }
+      std::string_view key = line.substr(0, space);
+      size_t hash = hash_func(key);
+      part[hash % num_shards].push_back(
+          {hash, key, line.substr(space + 1)});
+    }
   }
 
-  bool del(const std::string &key) {
-    int hash = hash_func(key) % num_locks;
-    locks[hash].lock();
-    if (store.find(key) == store.end()) {
-      locks[hash].unlock();
+public:
+  kvstore(int num_shards = 100)
+      : num_shards(num_shards > 0 ? num_shards : 1),
+        shards(new shard[this->num_shards]) {
+    hash_func = std::hash<std::string_view>{};
+  }
+
+  bool get(std::string_view key, std::string &value) {
+    return visit(key, [&](std::string_view found) { value.assign(found); });
+  }
+
+  // Look up key and pass a view of its value to visitor. The view is only
+  // valid inside the call, which lets callers encode a value straight from
+  // the store without an intermediate copy.
+  template <typename Visitor>
+  bool visit(std::string_view key, Visitor &&visitor) {
+    size_t hash = hash_func(key);
+    shard &s = shard_for(hash);
+    track(hash, key);
+
+    epoch::guard guard;
+    if (!guard.active()) {
+      // Out of reader slots; reclamation also holds the lock, so this is safe
+      std::lock_guard<contended_mutex> lock(s.lock);
+      node *n = find(s.tab.load(std::memory_order_relaxed), hash, key);
+      if (!n || (n->expiring() && n->expired(now_ms()))) {
+        misses.add();
+        return false;
+      }
+      n->touch();
+      hits.add();
+      visitor(n->value());
+      return true;
+    }
+
+    for (;;) {
+      uint64_t seq = read_begin(s);
+      node *n = find(s.tab.load(std::memory_order_acquire), hash, key);
+      if (n && n->expiring() && n->expired(now_ms())) {
+        misses.add(); // Left for the timing wheel to reap
+        return false;
+      }
+      if (n) {
+        n->touch();
+        hits.add();
+        visitor(n->value());
+        return true;
+      }
+      if (read_validate(s, seq)) {
+        misses.add();
+        return false;
+      }
+    }
+  }
+
+  bool put(std::string_view key, std::string_view value) {
+    return put_until(key, value, 0);
+  }
+
+  // Store a pair that expires ttl from now; a zero ttl never expires
+  bool put(std::string_view key,
+           std::string_view value,
+           std::chrono::milliseconds ttl) {
+    return put_until(
+        key, value, ttl.count() > 0 ? now_ms() + uint64_t(ttl.count()) : 0);
+  }
+
+  // Store a pair that expires at expires, in milliseconds since the Unix
+  // epoch, or never if it is 0. A time already past deletes key instead.
+  // Returns false, leaving key as it was, if the pair is larger than a
+  // shard's share of the memory limit.
+  bool put_until(std::string_view key,
+                 std::string_view value,
+                 uint64_t expires) {
+    if (expires && expires <= now_ms()) {
+      del(key);
+      return true;
+    }
+    if (!fits(key, value, expires)) {
       return false;
     }
-    store.erase(key);
-    locks[hash].unlock();
+    size_t hash = hash_func(key);
+    shard &s = shard_for(hash);
+    track(hash, key);
+
+    std::lock_guard<contended_mutex> lock(s.lock);
+    put_locked(s, node::create(s.nodes, hash, key, value, expires));
     return true;
   }
 
-  bool clear() {
-    for (int i = 0; i < num_locks; i++) {
-      locks[i].lock(); // Acquire all locks
+  bool del(std::string_view key) {
+    size_t hash = hash_func(key);
+    shard &s = shard_for(hash);
+    track(hash, key);
+
+    std::lock_guard<contended_mutex> lock(s.lock);
+    return del_locked(s, hash, key);
+  }
+
+  // Look up every key under a single epoch, calling
+  // visitor(index, found, value) for each key in order
+  template <typename Visitor>
+  void multi_visit(const std::vector<std::string_view> &keys,
+                   Visitor &&visitor) {
+    epoch::guard guard;
+    for (size_t i = 0; i < keys.size(); i++) {
+      bool found = visit(keys[i], [&](std::string_view value) {
+        visitor(i, true, value);
+      });
+      if (!found) {
+        visitor(i, false, std::string_view());
+      }
+    }
+  }
+
+  // Store every key-value pair, taking each shard lock once per batch.
+  // stored[i] is set to whether keys[i] was stored, which it is unless the
+  // pair is larger than a shard's share of the memory limit.
+  void multi_put(const std::vector<std::string_view> &keys,
+                 const std::vector<std::string_view> &values,
+                 std::vector<bool> &stored) {
+    std::vector<size_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      hashes[i] = hash_func(keys[i]);
+      track(hashes[i], keys[i]);
     }
-    store.clear();
-    if (store.size() != 0) {
-      for (int i = 0; i < num_locks; i++) {
-        locks[i].unlock(); // Release all locks
+    stored.assign(keys.size(), false);
+    for_each_shard_group(hashes, [&](shard &s, size_t i) {
+      if (fits(keys[i], values[i], 0)) {
+        put_locked(s, node::create(s.nodes, hashes[i], keys[i], values[i]));
+        stored[i] = true;
       }
-      return false;
+    });
+  }
+
+  // Delete every key, taking each shard lock once per batch. deleted[i] is
+  // set to whether keys[i] existed.
+  void multi_del(const std::vector<std::string_view> &keys,
+                 std::vector<bool> &deleted) {
+    std::vector<size_t> hashes(keys.size());
+    for (size_t i = 0; i < keys.size(); i++) {
+      hashes[i] = hash_func(keys[i]);
+      track(hashes[i], keys[i]);
     }
-    for (int i = 0; i < num_locks; i++) {
-      locks[i].unlock(); // Release all locks
+    deleted.assign(keys.size(), false);
+    for_each_shard_group(hashes, [&](shard &s, size_t i) {
+      deleted[i] = del_locked(s, hashes[i], keys[i]);
+    });
+  }
+
+  // Size every shard's table for count pairs spread evenly across shards,
+  // so filling the store to count triggers no rehash
+  void reserve(size_t count) {
+    size_t per_shard = count / num_shards + 1;
+    for (int i = 0; i < num_shards; i++) {
+      shard &s = shards[i];
+      std::lock_guard<contended_mutex> lock(s.lock);
+      while (s.tab.load(std::memory_order_relaxed)->mask + 1 < per_shard) {
+        grow(s);
+      }
+    }
+  }
+
+  // Load the pairs in [first, last), where each element has first and
+  // second members convertible to std::string_view, using num_threads
+  // threads. Returns the number of pairs loaded.
+  template <typename Iterator>
+  size_t bulk_load(Iterator first,
+                   Iterator last,
+                   unsigned num_threads = default_threads()) {
+    num_threads = std::max(num_threads, 1u);
+    std::vector<std::pair<std::string_view, std::string_view>> pairs;
+    for (; first != last; ++first) {
+      pairs.emplace_back(first->first, first->second);
+    }
+    reserve(size() + pairs.size());
+
+    // Each thread hashes a contiguous slice, keeping the input order
+    std::vector<bulk_partition> parts(num_threads, bulk_partition(num_shards));
+    run_parallel(num_threads, [&](unsigned t) {
+      size_t begin = pairs.size() * t / num_threads;
+      size_t end = pairs.size() * (t + 1) / num_threads;
+      for (size_t i = begin; i < end; i++) {
+        size_t hash = hash_func(pairs[i].first);
+        parts[t][hash % num_shards].push_back(
+            {hash, pairs[i].first, pairs[i].second});
+      }
+    });
+    insert_partitioned(parts, num_threads);
+    return pairs.size();
+  }
+
+  // Load a file of "key value" lines, as in users.txt, using num_threads
+  // threads. The file is mapped and handled in large blocks, each split at
+  // line boundaries across the threads, so memory stays bounded however big
+  // the file is. Later lines for a key replace earlier ones. Returns the
+  // number of lines loaded, or -1 if the file cannot be read.
+  long long bulk_load_file(const std::string &path,
+                           unsigned num_threads = default_threads()) {
+    num_threads = std::max(num_threads, 1u);
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      ::close(fd);
+      return -1;
+    }
+    size_t length = st.st_size;
+    if (length == 0) {
+      ::close(fd);
+      return 0;
+    }
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      return -1;
+    }
+    madvise(mapped, length, MADV_SEQUENTIAL);
+    std::string_view file(static_cast<const char *>(mapped), length);
+
+    // Estimate the line count from the first block to size the tables
+    std::string_view sample = file.substr(0, 1 << 20);
+    size_t sample_lines = std::count(sample.begin(), sample.end(), '\n') + 1;
+    reserve(size() + length / (sample.size() / sample_lines + 1));
+
+    std::vector<bulk_partition> parts(num_threads, bulk_partition(num_shards));
+    long long loaded = 0;
+    while (!file.empty()) {
+      // Cut the next block, and each thread's slice of it, after a newline
+      auto cut = [](std::string_view text, size_t at) {
+        if (at >= text.size()) {
+          return text.size();
+        }
+        size_t newline = text.find('\n', at);
+        return newline == std::string_view::npos ? text.size() : newline + 1;
+      };
+      std::string_view block = file.substr(0, cut(file, BULK_BLOCK_SIZE));
+      file.remove_prefix(block.size());
+
+      run_parallel(num_threads, [&](unsigned t) {
+        size_t begin = t == 0 ? 0 : cut(block, block.size() * t / num_threads);
+        size_t end = cut(block, block.size() * (t + 1) / num_threads);
+        if (begin < end) {
+          parse_lines(block.substr(begin, end - begin), parts[t]);
+        }
+      });
+      for (size_t t = 0; t < parts.size(); t++) {
+        for (int i = 0; i < num_shards; i++) {
+          loaded += parts[t][i].size();
+        }
+      }
+      insert_partitioned(parts, num_threads);
+    }
+    munmap(mapped, length);
+    return loaded;
+  }
+
+  // Clear each shard in turn; writers on other shards are never blocked
+  bool clear() {
+    if (log || feed) {
+      // Hold every shard so no change lands between the record and the clear
+      std::vector<std::unique_lock<contended_mutex>> locks;
+      for (int i = 0; i < num_shards; i++) {
+        locks.emplace_back(shards[i].lock);
+      }
+      if (log) {
+        log->append(wal::RECORD_CLEAR, std::string_view());
+      }
+      for (int i = 0; i < num_shards; i++) {
+        clear_locked(shards[i]);
+      }
+      if (feed) {
+        feed->append(wal::RECORD_CLEAR, std::string_view());
+      }
+      return true;
+    }
+
+    for (int i = 0; i < num_shards; i++) {
+      std::lock_guard<contended_mutex> lock(shards[i].lock);
+      clear_locked(shards[i]);
     }
     return true;
   }
 
-  void print() {
-    for (int i = 0; i < num_locks; i++) {
-      locks[i].lock(); // Acquire all locks
+  // Log every later change to log, or stop logging with nullptr. Attach
+  // after replaying the log and before serving writes.
+  void attach_log(wal *log) { this->log = log; }
+
+  wal *attached_log() const { return log; }
+
+  // Feed every later change to feed, for streaming to replicas, or stop
+  // with nullptr. Every shard is held while it is attached, so each change
+  // is either already visible or fed.
+  void attach_feed(replication_log *feed) {
+    std::vector<std::unique_lock<contended_mutex>> locks;
+    for (int i = 0; i < num_shards; i++) {
+      locks.emplace_back(shards[i].lock);
     }
-    for (auto it = store.begin(); it != store.end(); it++) {
-      std::cout << it->first << " => " << it->second << std::endl;
+    this->feed = feed;
+  }
+
+  // Apply a change recorded in a write-ahead log or a replication feed
+  void apply_record(wal::record_type type,
+                    std::string_view key,
+                    std::string_view value) {
+    if (type == wal::RECORD_PUT) {
+      put(key, value);
+    } else if (type == wal::RECORD_PUT_TTL && value.size() >= 8) {
+      // The expiry follows the value, in host order as the node keeps it
+      uint64_t expires;
+      std::memcpy(&expires, value.data() + value.size() - 8, 8);
+      put_until(key, value.substr(0, value.size() - 8), expires);
+    } else if (type == wal::RECORD_DEL) {
+      del(key);
+    } else if (type == wal::RECORD_CLEAR) {
+      clear();
     }
-    for (int i = 0; i < num_locks; i++) {
-      locks[i].unlock(); // Release all locks
+  }
+
+  // Replay the records of log after record after, the last one a snapshot
+  // already loaded holds, without logging the replayed changes
+  size_t recover(wal &log, uint64_t after = 0) {
+    wal *attached = this->log;
+    this->log = nullptr;
+    size_t applied = log.replay(
+        [&](wal::record_type type,
+            std::string_view key,
+            std::string_view value) { apply_record(type, key, value); },
+        after);
+    this->log = attached;
+    return applied;
+  }
+
+  // The newest record in the attached log whose change readers can already
+  // see, or 0 without a log. Records are appended under their shard's lock,
+  // so taking each lock once after reading the tail waits out any change
+  // still being made.
+  uint64_t log_position() {
+    if (!log) {
+      return 0;
+    }
+    uint64_t position = log->tail();
+    for (int i = 0; i < num_shards; i++) {
+      std::lock_guard<contended_mutex> lock(shards[i].lock);
     }
+    return position;
   }
 
-  size_t size() {
-    for (int i = 0; i < num_locks; i++) {
-      locks[i].lock(); // Acquire all locks
+  // Have servers refuse clients' writes, as a replica does; the store's
+  // own methods still apply them
+  void set_read_only(bool on) {
+    refusing_writes.store(on, std::memory_order_relaxed);
+  }
+
+  bool read_only() const {
+    return refusing_writes.load(std::memory_order_relaxed);
+  }
+
+  // Call visitor(key, value, expires) for every unexpired pair in shard i
+  // without blocking writers; expires is 0 for pairs that never expire.
+  // Returns false if a rehash moved nodes during the walk, in which case
+  // pairs may have been missed or repeated and the caller should discard
+  // what it saw and try again. Concurrent updates may or may not be seen.
+  template <typename Visitor>
+  bool visit_shard(int i, Visitor &&visitor) {
+    shard &s = shards[i];
+    epoch::guard guard;
+    std::unique_lock<contended_mutex> lock(s.lock, std::defer_lock);
+    if (!guard.active()) {
+      lock.lock();
+    }
+    uint64_t seq = read_begin(s);
+    uint64_t now = now_ms();
+    table *t = s.tab.load(std::memory_order_acquire);
+    for (size_t b = 0; b <= t->mask; b++) {
+      node *n = t->buckets[b].load(std::memory_order_acquire);
+      while (n) {
+        if (!n->expired(now)) {
+          visitor(n->key(), n->value(), n->expires());
+        }
+        n = n->next.load(std::memory_order_acquire);
+      }
+    }
+    return lock.owns_lock() || read_validate(s, seq);
+  }
+
+  // Keep each shard's keys in an ordered index as well, so scan can list
+  // them. Existing keys are indexed one shard at a time, blocking only that
+  // shard's writers; afterwards every write that adds or removes a key also
+  // updates its shard's index.
+  void enable_ordered_index() {
+    for (int i = 0; i < num_shards; i++) {
+      shard &s = shards[i];
+      std::lock_guard<contended_mutex> lock(s.lock);
+      if (s.index) {
+        continue;
+      }
+      s.index = std::make_unique<ordered_index>(
+          s.nodes, s.retired, (i + 1) * 0x9e3779b97f4a7c15ull);
+      table *t = s.tab.load(std::memory_order_relaxed);
+      for (size_t b = 0; b <= t->mask; b++) {
+        node *n = t->buckets[b].load(std::memory_order_relaxed);
+        for (; n; n = n->next.load(std::memory_order_relaxed)) {
+          s.index->insert(n->key());
+        }
+      }
+    }
+    indexed.store(true, std::memory_order_release);
+  }
+
+  bool ordered() const { return indexed.load(std::memory_order_acquire); }
+
+  // Call visitor(key) for up to count keys that start with prefix and sort
+  // after `after`, in byte order, and return how many were visited. An
+  // empty `after` starts at the first key with the prefix, and passing the
+  // last key visited continues from there. Each view is only valid inside
+  // the call. Writers are never blocked: keys changed during the scan may
+  // or may not be seen, and expired pairs not yet reaped are skipped.
+  // Visits nothing unless the ordered index is enabled.
+  template <typename Visitor>
+  size_t scan(std::string_view prefix,
+              std::string_view after,
+              size_t count,
+              Visitor &&visitor) {
+    if (!ordered() || count == 0) {
+      return 0;
+    }
+    epoch::guard guard;
+    std::vector<std::unique_lock<contended_mutex>> locks;
+    if (!guard.active()) {
+      // Out of reader slots; hold every shard still, as clear does
+      for (int i = 0; i < num_shards; i++) {
+        locks.emplace_back(shards[i].lock);
+      }
+    }
+
+    // Merge the shards' cursors, smallest key first
+    std::string_view from = std::max(prefix, after);
+    std::vector<ordered_index::cursor> cursors;
+    cursors.reserve(num_shards);
+    std::vector<int> heap;
+    for (int i = 0; i < num_shards; i++) {
+      cursors.push_back(shards[i].index->seek(from));
+      ordered_index::cursor &c = cursors.back();
+      if (c.valid() && after >= prefix && c.key() == after) {
+        c.next();
+      }
+      if (c.valid() && c.key().starts_with(prefix)) {
+        heap.push_back(i);
+      }
+    }
+    auto later = [&](int a, int b) {
+      return cursors[a].key() > cursors[b].key();
+    };
+    std::make_heap(heap.begin(), heap.end(), later);
+
+    uint64_t now = expiring.load(std::memory_order_relaxed) ? now_ms() : 0;
+    size_t visited = 0;
+    while (!heap.empty() && visited < count) {
+      std::pop_heap(heap.begin(), heap.end(), later);
+      int i = heap.back();
+      ordered_index::cursor &c = cursors[i];
+      if (!now || unexpired(shards[i], c.key(), now)) {
+        visitor(c.key());
+        visited++;
+      }
+      c.next();
+      if (c.valid() && c.key().starts_with(prefix)) {
+        std::push_heap(heap.begin(), heap.end(), later);
+      } else {
+        heap.pop_back();
+      }
+    }
+    return visited;
+  }
+
+  // Print every pair without blocking writers; concurrent updates may or may
+  // not be reflected
+  void print() {
+    epoch::guard guard;
+    for (int i = 0; i < num_shards; i++) {
+      std::unique_lock<contended_mutex> lock(shards[i].lock, std::defer_lock);
+      if (!guard.active()) {
+        lock.lock();
+      }
+      table *t = shards[i].tab.load(std::memory_order_acquire);
+      for (size_t b = 0; b <= t->mask; b++) {
+        node *n = t->buckets[b].load(std::memory_order_acquire);
+        while (n) {
+          std::cout << n->key() << " => " << n->value() << std::endl;
+          n = n->next.load(std::memory_order_acquire);
+        }
+      }
     }
-    size_t size = store.size();
-    for (int i = 0; i < num_locks; i++) {
-      locks[i].unlock(); // Release all locks
+  }
+
+  // Sum the per-shard counters without taking any locks
+  size_t size() {
+    size_t size = 0;
+    for (int i = 0; i < num_shards; i++) {
+      size += shards[i].size.load(std::memory_order_relaxed);
     }
     return size;
   }
+
+  int shard_count() const { return num_shards; }
+
+  // The clock expiry times are measured against: milliseconds since the Unix
+  // epoch, so they survive a restart through the log or a snapshot
+  static uint64_t now_ms() {
+    return std::chrono::duration_cast<std::chrono::milliseconds>(
+               std::chrono::system_clock::now().time_since_epoch())
+        .count();
+  }
+
+  // Reap up to budget due pairs from each shard, skipping shards whose lock
+  // is busy; their own writes reap them meanwhile. Meant to be called every
+  // few milliseconds. Returns the number of pairs expired.
+  size_t expire(size_t budget = 64) {
+    if (!expiring.load(std::memory_order_relaxed)) {
+      return 0;
+    }
+    uint64_t now = now_ms();
+    size_t reaped = 0;
+    for (int i = 0; i < num_shards; i++) {
+      shard &s = shards[i];
+      std::unique_lock<contended_mutex> lock(s.lock, std::try_to_lock);
+      if (lock.owns_lock() && s.wheel && s.wheel->pending(now)) {
+        reaped += expire_locked(s, now, budget);
+      }
+    }
+    return reaped;
+  }
+
+  // Bound the bytes of live entries, counting each entry's key, value, and
+  // node header, to about limit; 0 removes the bound. The limit is split
+  // evenly across shards and enforced on the next write to each shard.
+  void set_memory_limit(size_t limit) {
+    shard_limit.store(limit ? std::max<size_t>(limit / num_shards, 1) : 0,
+                      std::memory_order_relaxed);
+  }
+
+  size_t memory_limit() const {
+    return shard_limit.load(std::memory_order_relaxed) * num_shards;
+  }
+
+  // Cache effectiveness since the store was created
+  struct cache_stats {
+    uint64_t hits = 0;
+    uint64_t misses = 0;
+    uint64_t evictions = 0;
+    uint64_t expirations = 0;
+    size_t bytes = 0; // Bytes of live entries, as counted against the limit
+    size_t limit = 0; // 0 when unbounded
+
+    double hit_ratio() const {
+      return hits + misses ? double(hits) / (hits + misses) : 0;
+    }
+  };
+
+  // Read the counters without taking any locks
+  cache_stats cache_usage() {
+    cache_stats stats;
+    stats.hits = hits.load();
+    stats.misses = misses.load();
+    stats.limit = memory_limit();
+    for (int i = 0; i < num_shards; i++) {
+      stats.evictions += shards[i].evictions.load(std::memory_order_relaxed);
+      stats.expirations +=
+          shards[i].expirations.load(std::memory_order_relaxed);
+      stats.bytes += shards[i].bytes.load(std::memory_order_relaxed);
+    }
+    return stats;
+  }
+
+  // Acquisitions of and time spent waiting for the shard locks, summed
+  // over every shard
+  contended_mutex::stats lock_usage() {
+    contended_mutex::stats total;
+    for (int i = 0; i < num_shards; i++) {
+      total += shards[i].lock.usage();
+    }
+    return total;
+  }
+
+  // Call listener with the key of every pair added, replaced, or removed,
+  // including by eviction and expiry, once readers can see the change and
+  // while its shard lock is still held. Set it before the store is shared.
+  void set_change_listener(std::function<void(std::string_view)> listener) {
+    change_listener = std::move(listener);
+  }
+
+  // Lock usage of each shard, indexed by shard
+  std::vector<contended_mutex::stats> stripe_usage() {
+    std::vector<contended_mutex::stats> usage(num_shards);
+    for (int i = 0; i < num_shards; i++) {
+      usage[i] = shards[i].lock.usage();
+    }
+    return usage;
+  }
+
+  // Start or stop sampling accesses into a sketch of the hottest keys.
+  // Starting again resumes the same sketch; reset_hot_keys clears it.
+  void track_hot_keys(bool on) {
+    std::lock_guard<std::mutex> lock(sketch_lock);
+    if (on && !key_sketch) {
+      key_sketch = std::make_unique<hot_keys>();
+    }
+    key_tracker.store(on ? key_sketch.get() : nullptr,
+                      std::memory_order_release);
+  }
+
+  bool tracking_hot_keys() const {
+    return key_tracker.load(std::memory_order_relaxed) != nullptr;
+  }
+
+  // The hottest keys seen while tracking, hottest first, with estimated
+  // access counts
+  std::vector<hot_keys::entry> hottest_keys() {
+    std::lock_guard<std::mutex> lock(sketch_lock);
+    return key_sketch ? key_sketch->top() : std::vector<hot_keys::entry>();
+  }
+
+  void reset_hot_keys() {
+    std::lock_guard<std::mutex> lock(sketch_lock);
+    if (key_sketch) {
+      key_sketch->reset();
+    }
+  }
+
+  // Total node memory across shards. Nodes waiting for reclamation still
+  // count as used.
+  slab::stats memory() {
+    slab::stats total;
+    for (int i = 0; i < num_shards; i++) {
+      std::lock_guard<contended_mutex> lock(shards[i].lock);
+      total += shards[i].nodes.usage();
+    }
+    return total;
+  }
 };
 
 #endif
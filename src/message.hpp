@@ -3,21 +3,617 @@
  *
  * The message class encodes and decodes GET, PUT, and DEL messages, defining
  * the interface between the client and server.
+ *
+ * Two wire formats are supported. The text format is one space-delimited line
+ * per message. The binary format is negotiated per connection by sending the
+ * text line "PROTO BINARY"; after an OK reply every frame is a fixed header
+ * followed by raw extras, key, and value bytes, so keys and values may hold
+ * any bytes and are never scanned.
+ *
+ * The batch commands MGET, MPUT, and MDEL carry many arguments in one
+ * request: in text they follow the command on one line, and in binary the
+ * value holds each argument as a 4 byte length and its bytes. A batch
+ * response is "OK n" followed by n single responses in text, or one frame
+ * whose value holds a status byte, 4 byte length, and payload per result in
+ * binary.
+ *
+ * A PUT may give the pair a time to live in milliseconds, as a fourth token
+ * in text ("PUT key value ttl") or as 4 bytes of extras in binary. Without
+ * one the pair never expires. A text PUT whose fourth token is not a
+ * positive 32-bit number is refused with ERR; before TTLs, any tokens after
+ * the value were ignored.
+ *
+ * STATS is answered with OK and a report of the server's counters, one
+ * "name value" pair per line. It may name a section of the report and an
+ * action on it, as in "STATS hotkeys on"; in binary these are the key and
+ * value.
+ *
+ * "TRACK ON" asks the server to track the keys this connection reads, and
+ * "TRACK OFF" stops it. While tracking, the server may send "INV key"
+ * between responses when a key the connection read has changed; in binary
+ * it is a response frame with request id 0 holding the key.
+ *
+ * "SCAN prefix count cursor" lists up to count keys that start with prefix
+ * and sort after cursor, in byte order; the cursor is omitted to start from
+ * the first such key. In binary the prefix is the key, the cursor the
+ * value, and the count 4 bytes of extras. The response is a batch whose
+ * first result is the cursor to continue from, or ERR once no keys remain,
+ * followed by one OK result per key.
  */
 
 #ifndef MESSAGE_H
 #define MESSAGE_H
 
-#include <sstream>
+#include "delimiters.hpp"
+
+#include <cstdint>
+#include <cstring>
+#include <string>
+#include <string_view>
 #include <vector>
 
-enum message_type { GET = 3, PUT = 4, DEL = 5, OK = 0, ERROR = 1, UNSET = -1 };
+enum message_type {
+  GET = 3,
+  PUT = 4,
+  DEL = 5,
+  PROTO = 6,
+  MGET = 7,
+  MPUT = 8,
+  MDEL = 9,
+  STATS = 10,
+  TRACK = 11,
+  INV = 12,
+  SCAN = 13,
+  OK = 0,
+  ERROR = 1,
+  UNSET = -1
+};
+
+enum protocol_type { TEXT_PROTOCOL = 0, BINARY_PROTOCOL = 1 };
+
+inline bool is_batch(message_type type) {
+  return type == MGET || type == MPUT || type == MDEL;
+}
+
+// Binary frame header, all fields in network byte order:
+//   magic(1) opcode(1) extras_length(1) reserved(1)
+//   request_id(4) key_length(4) value_length(4)
+constexpr uint8_t BINARY_REQUEST_MAGIC = 0x80;
+constexpr uint8_t BINARY_RESPONSE_MAGIC = 0x81;
+constexpr size_t BINARY_HEADER_SIZE = 16;
+constexpr uint32_t BINARY_MAX_BODY = 64 << 20; // Largest accepted key + value
+constexpr uint8_t BINARY_TTL_EXTRAS = 4;       // Extras length of a PUT's TTL
+constexpr uint8_t BINARY_LIMIT_EXTRAS = 4;     // Extras length of SCAN's count
+
+struct binary_header {
+  uint8_t magic = 0;
+  uint8_t opcode = 0;
+  uint8_t extras_length = 0;
+  uint32_t request_id = 0;
+  uint32_t key_length = 0;
+  uint32_t value_length = 0;
+
+  static void write_u32(char *out, uint32_t value) {
+    out[0] = static_cast<char>(value >> 24);
+    out[1] = static_cast<char>(value >> 16);
+    out[2] = static_cast<char>(value >> 8);
+    out[3] = static_cast<char>(value);
+  }
+
+  static uint32_t read_u32(const char *in) {
+    const unsigned char *bytes = reinterpret_cast<const unsigned char *>(in);
+    return (uint32_t(bytes[0]) << 24) | (uint32_t(bytes[1]) << 16) |
+           (uint32_t(bytes[2]) << 8) | uint32_t(bytes[3]);
+  }
+
+  void write(char *out) const {
+    out[0] = static_cast<char>(magic);
+    out[1] = static_cast<char>(opcode);
+    out[2] = static_cast<char>(extras_length);
+    out[3] = 0;
+    write_u32(out + 4, request_id);
+    write_u32(out + 8, key_length);
+    write_u32(out + 12, value_length);
+  }
+
+  // Parse a header, rejecting unknown magic and oversized bodies
+  bool read(const char *in) {
+    magic = static_cast<uint8_t>(in[0]);
+    opcode = static_cast<uint8_t>(in[1]);
+    extras_length = static_cast<uint8_t>(in[2]);
+    request_id = read_u32(in + 4);
+    key_length = read_u32(in + 8);
+    value_length = read_u32(in + 12);
+    if (magic != BINARY_REQUEST_MAGIC && magic != BINARY_RESPONSE_MAGIC) {
+      return false;
+    }
+    return key_length <= BINARY_MAX_BODY &&
+           value_length <= BINARY_MAX_BODY - key_length;
+  }
+
+  size_t body_length() const {
+    return size_t(extras_length) + key_length + value_length;
+  }
+};
+
+// Append value to out, translating every occurrence of from into to. The
+// text protocol carries newlines in values as carriage returns. Most values
+// hold neither, so one memchr decides whether a plain copy will do, and
+// otherwise the rest is translated as it is copied.
+inline void append_translated(std::string &out,
+                              std::string_view value,
+                              char from,
+                              char to) {
+  const char *found =
+      static_cast<const char *>(std::memchr(value.data(), from, value.size()));
+  if (!found) {
+    out.append(value.data(), value.size());
+    return;
+  }
+  size_t clean = found - value.data();
+  size_t offset = out.size();
+  out.resize(offset + value.size());
+  std::memcpy(&out[offset], value.data(), clean);
+  delimiters::translate(
+      &out[offset + clean], found, value.size() - clean, from, to);
+}
+
+// A message_view parses a request in place. Its key and value reference the
+// caller's buffer and stay valid only while that buffer is unchanged. Text
+// values are left in wire form, with newlines still carried as carriage
+// returns. Parsing never allocates.
+class message_view {
+public:
+  message_type type = UNSET;
+  std::string_view key;
+  std::string_view value;
+  uint32_t ttl = 0; // Milliseconds a PUT's pair lives, or 0 for no expiry
+  uint32_t limit = 0; // Most keys a SCAN returns
+
+  // Parse a positive decimal that fits in 32 bits, as a TTL or a count
+  static bool parse_positive(std::string_view token, uint32_t &value) {
+    if (token.empty() || token.size() > 10) {
+      return false;
+    }
+    uint64_t parsed = 0;
+    for (size_t i = 0; i < token.size(); i++) {
+      if (token[i] < '0' || token[i] > '9') {
+        return false;
+      }
+      parsed = parsed * 10 + (token[i] - '0');
+    }
+    if (parsed == 0 || parsed > UINT32_MAX) {
+      return false;
+    }
+    value = uint32_t(parsed);
+    return true;
+  }
+
+  // Decode one text line without its trailing newline
+  bool decode(std::string_view line) {
+    delimiters::line_layout layout;
+    delimiters::scan_line(line, layout);
+    return decode(line, layout);
+  }
+
+  // Decode a line whose spaces delimiters::scan_line has already found
+  bool decode(std::string_view line, const delimiters::line_layout &layout) {
+    ttl = 0;
+    limit = 0;
+
+    // Batch commands keep every argument after the command in value
+    size_t command_end = layout.space_count ? layout.spaces[0] : line.size();
+    if (command_end + 1 < line.size()) {
+      std::string_view command = line.substr(0, command_end);
+      type = command == "MGET"   ? MGET
+             : command == "MPUT" ? MPUT
+             : command == "MDEL" ? MDEL
+                                 : UNSET;
+      if (type != UNSET) {
+        key = std::string_view();
+        value = line.substr(command_end + 1);
+        return true;
+      }
+    }
+
+    std::string_view tokens[4];
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < line.size() && count < 4) {
+      size_t space =
+          count < layout.space_count ? layout.spaces[count] : line.size();
+      tokens[count++] = line.substr(pos, space - pos);
+      pos = space + 1;
+    }
+
+    key = std::string_view();
+    value = std::string_view();
+    if (count == 0) {
+      type = UNSET;
+      return false;
+    }
+
+    if (tokens[0] == "ERR") {
+      type = ERROR;
+      return true;
+    }
+
+    if (tokens[0] == "OK") {
+      type = OK;
+      value = line.size() > 3 ? line.substr(3) : std::string_view();
+      return true;
+    }
+
+    if (tokens[0] == "STATS" && count < 4) {
+      type = STATS;
+      key = tokens[1];
+      value = tokens[2];
+      return true;
+    }
+
+    // Check that at least one additional token is present
+    if (count < 2) {
+      type = UNSET;
+      return false;
+    }
+
+    key = tokens[1];
+    if (tokens[0] == "GET") {
+      type = GET;
+    } else if (tokens[0] == "PUT" && count >= 3 &&
+               (count == 3 || parse_positive(tokens[3], ttl))) {
+      type = PUT;
+      value = tokens[2];
+    } else if (tokens[0] == "DEL") {
+      type = DEL;
+    } else if (tokens[0] == "PROTO") {
+      type = PROTO;
+    } else if (tokens[0] == "TRACK") {
+      type = TRACK;
+    } else if (tokens[0] == "INV") {
+      type = INV;
+    } else if (tokens[0] == "SCAN" && count >= 3 &&
+               parse_positive(tokens[2], limit)) {
+      type = SCAN;
+      value = count == 4 ? tokens[3] : std::string_view();
+    } else {
+      type = UNSET;
+      key = std::string_view();
+      return false;
+    }
+    return true;
+  }
+
+  // Decode a binary frame body described by header
+  bool decode_binary(const binary_header &header, std::string_view body) {
+    if (body.size() != header.body_length()) {
+      type = UNSET;
+      return false;
+    }
+    key = body.substr(header.extras_length, header.key_length);
+    value = body.substr(header.extras_length + header.key_length,
+                        header.value_length);
+    ttl = 0;
+    limit = 0;
+    if (header.opcode == PUT && header.extras_length == BINARY_TTL_EXTRAS) {
+      ttl = binary_header::read_u32(body.data());
+    }
+    if (header.opcode == SCAN &&
+        header.extras_length == BINARY_LIMIT_EXTRAS) {
+      limit = binary_header::read_u32(body.data());
+    }
+
+    bool valid = false;
+    switch (header.opcode) {
+    case GET:
+    case DEL:
+    case TRACK:
+    case INV:
+      valid = !key.empty();
+      break;
+    case PUT:
+      valid = !key.empty() && !value.empty();
+      break;
+    case MGET:
+    case MPUT:
+    case MDEL:
+      valid = !value.empty();
+      break;
+    case SCAN:
+      valid = limit > 0;
+      break;
+    case STATS:
+    case OK:
+    case ERROR:
+      valid = true;
+      break;
+    }
+    type = valid ? static_cast<message_type>(header.opcode) : UNSET;
+    return valid;
+  }
+
+  // Append a response in either protocol to out. Once out has grown to fit
+  // the largest response this never allocates.
+  static void encode_response(std::string &out,
+                              protocol_type protocol,
+                              message_type type,
+                              std::string_view payload = std::string_view(),
+                              uint32_t request_id = 0) {
+    if (protocol == BINARY_PROTOCOL) {
+      binary_header header;
+      header.magic = BINARY_RESPONSE_MAGIC;
+      header.opcode = static_cast<uint8_t>(type);
+      header.request_id = request_id;
+      header.value_length = payload.size();
+      size_t offset = out.size();
+      out.resize(offset + BINARY_HEADER_SIZE);
+      header.write(&out[offset]);
+      out.append(payload.data(), payload.size());
+      return;
+    }
+
+    if (type == OK) {
+      out += "OK";
+      if (!payload.empty()) {
+        out += ' ';
+        append_translated(out, payload, '\n', '\r');
+      }
+    } else {
+      out += "ERR";
+    }
+    out += '\n';
+  }
+
+  // Append an invalidation of key, pushed to a tracking client
+  static void encode_invalidation(std::string &out,
+                                  protocol_type protocol,
+                                  std::string_view key) {
+    if (protocol == BINARY_PROTOCOL) {
+      binary_header header;
+      header.magic = BINARY_RESPONSE_MAGIC;
+      header.opcode = static_cast<uint8_t>(INV);
+      header.key_length = key.size();
+      size_t offset = out.size();
+      out.resize(offset + BINARY_HEADER_SIZE);
+      header.write(&out[offset]);
+      out.append(key.data(), key.size());
+      return;
+    }
+    out += "INV ";
+    out.append(key.data(), key.size());
+    out += '\n';
+  }
+
+  // Split the next argument off the front of a batch request's value
+  static bool next_argument(std::string_view &args,
+                            protocol_type protocol,
+                            std::string_view &arg) {
+    if (args.empty()) {
+      return false;
+    }
+    if (protocol == BINARY_PROTOCOL) {
+      if (args.size() < 4) {
+        return false;
+      }
+      uint32_t length = binary_header::read_u32(args.data());
+      if (length > args.size() - 4) {
+        return false;
+      }
+      arg = args.substr(4, length);
+      args.remove_prefix(4 + length);
+      return true;
+    }
+    size_t space = args.find(' ');
+    arg = args.substr(0, space);
+    args.remove_prefix(space == std::string_view::npos ? args.size()
+                                                       : space + 1);
+    return true;
+  }
+
+  // Start a batch response of count results, returning where it begins
+  static size_t begin_batch_response(std::string &out,
+                                     protocol_type protocol,
+                                     size_t count,
+                                     uint32_t request_id) {
+    size_t offset = out.size();
+    if (protocol == BINARY_PROTOCOL) {
+      encode_response(out, protocol, OK, std::string_view(), request_id);
+    } else {
+      out += "OK ";
+      out += std::to_string(count);
+      out += '\n';
+    }
+    return offset;
+  }
+
+  // Append one result to a batch response
+  static void append_batch_result(std::string &out,
+                                  protocol_type protocol,
+                                  message_type status,
+                                  std::string_view payload) {
+    if (protocol == BINARY_PROTOCOL) {
+      char prefix[5];
+      prefix[0] = static_cast<char>(status);
+      binary_header::write_u32(prefix + 1, payload.size());
+      out.append(prefix, sizeof(prefix));
+      out.append(payload.data(), payload.size());
+      return;
+    }
+    encode_response(out, protocol, status, payload);
+  }
+
+  // Finish a batch response by recording its length in the binary header
+  static void end_batch_response(std::string &out,
+                                 protocol_type protocol,
+                                 size_t offset) {
+    if (protocol == BINARY_PROTOCOL) {
+      binary_header::write_u32(&out[offset + 12],
+                               out.size() - offset - BINARY_HEADER_SIZE);
+    }
+  }
+};
+
+// Encode a GET, PUT, or DEL request onto out as the message class would,
+// without building a message. Keys may not hold spaces or newlines in text.
+inline bool encode_request(std::string &out,
+                           protocol_type protocol,
+                           message_type type,
+                           std::string_view key,
+                           std::string_view value = std::string_view(),
+                           uint32_t request_id = 0) {
+  if ((type != GET && type != PUT && type != DEL) || key.empty() ||
+      (type == PUT && value.empty())) {
+    return false;
+  }
+  if (type != PUT) {
+    value = std::string_view();
+  }
+
+  if (protocol == BINARY_PROTOCOL) {
+    binary_header header;
+    header.magic = BINARY_REQUEST_MAGIC;
+    header.opcode = static_cast<uint8_t>(type);
+    header.request_id = request_id;
+    header.key_length = key.size();
+    header.value_length = value.size();
+    size_t offset = out.size();
+    out.resize(offset + BINARY_HEADER_SIZE);
+    header.write(&out[offset]);
+    out.append(key.data(), key.size());
+    out.append(value.data(), value.size());
+    return true;
+  }
+
+  if (key.find_first_of(" \n") != std::string_view::npos) {
+    return false;
+  }
+  out += type == GET ? "GET " : type == PUT ? "PUT " : "DEL ";
+  out.append(key.data(), key.size());
+  if (type == PUT) {
+    out += ' ';
+    append_translated(out, value, '\n', '\r');
+  }
+  out += '\n';
+  return true;
+}
+
+// Encode a batch request whose arguments are keys, or alternating keys and
+// values for MPUT
+inline bool encode_batch(std::string &out,
+                         protocol_type protocol,
+                         message_type type,
+                         const std::vector<std::string> &args,
+                         uint32_t request_id = 0) {
+  if (!is_batch(type) || args.empty()) {
+    return false;
+  }
+  for (size_t i = 0; i < args.size(); i++) {
+    bool is_value = type == MPUT && i % 2 == 1;
+    if (args[i].empty() ||
+        (protocol == TEXT_PROTOCOL && !is_value &&
+         args[i].find_first_of(" \n") != std::string::npos) ||
+        (protocol == TEXT_PROTOCOL && is_value &&
+         args[i].find(' ') != std::string::npos)) {
+      return false;
+    }
+  }
+
+  if (protocol == BINARY_PROTOCOL) {
+    binary_header header;
+    header.magic = BINARY_REQUEST_MAGIC;
+    header.opcode = static_cast<uint8_t>(type);
+    header.request_id = request_id;
+    size_t offset = out.size();
+    out.resize(offset + BINARY_HEADER_SIZE);
+    for (size_t i = 0; i < args.size(); i++) {
+      char length[4];
+      binary_header::write_u32(length, args[i].size());
+      out.append(length, sizeof(length));
+      out += args[i];
+    }
+    header.value_length = out.size() - offset - BINARY_HEADER_SIZE;
+    header.write(&out[offset]);
+    return true;
+  }
+
+  out += type == MGET ? "MGET" : type == MPUT ? "MPUT" : "MDEL";
+  for (size_t i = 0; i < args.size(); i++) {
+    out += ' ';
+    append_translated(out, args[i], '\n', '\r');
+  }
+  out += '\n';
+  return true;
+}
+
+// Encode a SCAN for up to limit keys starting with prefix and sorting after
+// cursor, or from the first such key if cursor is empty
+inline bool encode_scan(std::string &out,
+                        protocol_type protocol,
+                        std::string_view prefix,
+                        uint32_t limit,
+                        std::string_view cursor,
+                        uint32_t request_id = 0) {
+  if (limit == 0) {
+    return false;
+  }
+
+  if (protocol == BINARY_PROTOCOL) {
+    binary_header header;
+    header.magic = BINARY_REQUEST_MAGIC;
+    header.opcode = static_cast<uint8_t>(SCAN);
+    header.extras_length = BINARY_LIMIT_EXTRAS;
+    header.request_id = request_id;
+    header.key_length = prefix.size();
+    header.value_length = cursor.size();
+    size_t offset = out.size();
+    out.resize(offset + BINARY_HEADER_SIZE + BINARY_LIMIT_EXTRAS);
+    header.write(&out[offset]);
+    binary_header::write_u32(&out[offset + BINARY_HEADER_SIZE], limit);
+    out.append(prefix.data(), prefix.size());
+    out.append(cursor.data(), cursor.size());
+    return true;
+  }
+
+  if (prefix.find_first_of(" \n") != std::string_view::npos ||
+      cursor.find_first_of(" \n") != std::string_view::npos) {
+    return false;
+  }
+  out += "SCAN ";
+  out.append(prefix.data(), prefix.size());
+  out += ' ';
+  out += std::to_string(limit);
+  if (!cursor.empty()) {
+    out += ' ';
+    out.append(cursor.data(), cursor.size());
+  }
+  out += '\n';
+  return true;
+}
+
+// Decode the per-key results in the body of a binary batch response, each
+// a status byte and a 4-byte length before its value. Returns false if the
+// body is malformed.
+inline bool decode_batch_results(std::string_view body,
+                                 std::vector<bool> &ok,
+                                 std::vector<std::string> &values) {
+  while (body.size() >= 5) {
+    uint32_t length = binary_header::read_u32(body.data() + 1);
+    if (length > body.size() - 5) {
+      return false;
+    }
+    ok.push_back(static_cast<uint8_t>(body[0]) == OK);
+    values.emplace_back(body.substr(5, length));
+    body.remove_prefix(5 + length);
+  }
+  return body.empty();
+}
 
 class message {
 private:
   message_type type;
   std::string first;
   std::string second;
+  uint32_t ttl = 0;
 
 public:
   message(message_type type, std::string first, std::string second);
@@ -28,9 +624,13 @@ public:
   std::string to_string();
   bool encode(std::string &encoded_message);
   bool decode(std::string &encoded_message);
+  bool encode_binary(std::string &encoded_message, uint32_t request_id = 0);
+  bool decode_binary(const binary_header &header, const std::string &body);
   message_type get_type();
   std::string get_key();
   std::string get_value();
+  uint32_t get_ttl();
+  bool set_ttl(uint32_t ttl);
   bool reset(message_type type, std::string first, std::string second);
   bool reset(message_type type, std::string first);
   bool reset(message_type type);
@@ -74,73 +674,29 @@ std::string message::to_string() {
 }
 
 bool message::decode(std::string &encoded_message) {
-  std::stringstream ss(encoded_message);
-  std::string token;
-  std::vector<std::string> tokens;
-  while (std::getline(ss, token, ' ')) {
-    tokens.push_back(token);
-  }
-
-  if (tokens[0] == "ERR") {
-    this->type = ERROR;
-    return true;
-  }
-
-  if (tokens[0] == "OK") {
-    this->type = OK;
-    if (tokens.size() > 1) {
-      this->second = tokens[1];
-    }
-    return true;
-  }
-
-  // Check that at least one additional token is present
-  if (tokens.size() < 2) {
-    this->type = UNSET;
-    this->first = "";
-    this->second = "";
+  message_view view;
+  if (!view.decode(encoded_message)) {
+    reset();
     return false;
   }
 
-  if (tokens[0] == "GET") {
-    this->type = GET;
-    this->first = tokens[1];
-  } else if (tokens[0] == "PUT") {
-    if (tokens.size() < 3) {
-      this->type = UNSET;
-      this->first = "";
-      this->second = "";
-      return false;
-    }
-    this->type = PUT;
-    this->first = tokens[1];
-    this->second = tokens[2];
-  } else if (tokens[0] == "DEL") {
-    this->type = DEL;
-    this->first = tokens[1];
-  } else {
-    this->type = UNSET;
-    this->first = "";
-    this->second = "";
-    return false;
-  }
+  this->type = view.type;
+  this->first.assign(view.key);
+  this->ttl = view.ttl;
 
   // Replace carriage returns in values with newlines
-  while (this->second.find("\r") != std::string::npos) {
-    this->second.replace(this->second.find("\r"), 1, "\n");
-  }
+  this->second.clear();
+  append_translated(this->second, view.value, '\r', '\n');
 
   return true;
 }
 
 bool message::encode(std::string &encoded_message) {
-  // Forbid newlines in keys, replace newlines in values with carriage returns
-  if (this->first.find("\n") != std::string::npos) {
+  // Forbid newlines in keys; newlines in values are sent as carriage returns
+  if (this->first.find('\n') != std::string::npos &&
+      this->type != OK) {
     return false;
   }
-  while (this->second.find("\n") != std::string::npos) {
-    this->second.replace(this->second.find("\n"), 1, "\r");
-  }
 
   if (this->type == GET) {
     // Check that first is set
@@ -153,17 +709,42 @@ bool message::encode(std::string &encoded_message) {
     if (this->first == "" || this->second == "") {
       return false;
     }
-    encoded_message = "PUT " + this->first + " " + this->second;
+    encoded_message = "PUT " + this->first + " ";
+    append_translated(encoded_message, this->second, '\n', '\r');
+    if (this->ttl) {
+      encoded_message += " " + std::to_string(this->ttl);
+    }
   } else if (this->type == DEL) {
     // Check that first is set
     if (this->first == "") {
       return false;
     }
     encoded_message = "DEL " + this->first;
+  } else if (this->type == PROTO) {
+    // Check that first is set
+    if (this->first == "") {
+      return false;
+    }
+    encoded_message = "PROTO " + this->first;
+  } else if (this->type == TRACK || this->type == INV) {
+    // Check that first is set
+    if (this->first == "") {
+      return false;
+    }
+    encoded_message = (this->type == TRACK ? "TRACK " : "INV ") + this->first;
+  } else if (this->type == STATS) {
+    encoded_message = "STATS";
+    if (this->first != "") {
+      encoded_message += " " + this->first;
+    }
+    if (this->first != "" && this->second != "") {
+      encoded_message += " " + this->second;
+    }
   } else if (this->type == OK) {
     encoded_message = "OK";
     if (this->first != "") {
-      encoded_message += " " + this->first;
+      encoded_message += " ";
+      append_translated(encoded_message, this->first, '\n', '\r');
     }
   } else if (this->type == ERROR) {
     encoded_message = "ERR";
@@ -172,16 +753,103 @@ bool message::encode(std::string &encoded_message) {
   return true;
 }
 
+bool message::encode_binary(std::string &encoded_message,
+                            uint32_t request_id) {
+  binary_header header;
+  const std::string *key = &this->first;
+  const std::string *value = &this->second;
+
+  if (this->type == GET || this->type == DEL) {
+    if (this->first == "") {
+      return false;
+    }
+    header.magic = BINARY_REQUEST_MAGIC;
+    value = nullptr;
+  } else if (this->type == PUT) {
+    if (this->first == "" || this->second == "") {
+      return false;
+    }
+    header.magic = BINARY_REQUEST_MAGIC;
+    if (this->ttl) {
+      header.extras_length = BINARY_TTL_EXTRAS;
+    }
+  } else if (this->type == STATS) {
+    header.magic = BINARY_REQUEST_MAGIC;
+  } else if (this->type == TRACK || this->type == INV) {
+    if (this->first == "") {
+      return false;
+    }
+    header.magic =
+        this->type == TRACK ? BINARY_REQUEST_MAGIC : BINARY_RESPONSE_MAGIC;
+    value = nullptr;
+  } else if (this->type == OK) {
+    // As in the text format, a response payload is held in first
+    header.magic = BINARY_RESPONSE_MAGIC;
+    value = &this->first;
+    key = nullptr;
+  } else if (this->type == ERROR) {
+    header.magic = BINARY_RESPONSE_MAGIC;
+    key = nullptr;
+    value = nullptr;
+  } else {
+    return false;
+  }
+
+  header.opcode = static_cast<uint8_t>(this->type);
+  header.request_id = request_id;
+  header.key_length = key ? key->size() : 0;
+  header.value_length = value ? value->size() : 0;
+
+  encoded_message.resize(BINARY_HEADER_SIZE + header.extras_length);
+  header.write(&encoded_message[0]);
+  if (header.extras_length) {
+    binary_header::write_u32(&encoded_message[BINARY_HEADER_SIZE], this->ttl);
+  }
+  if (key) {
+    encoded_message += *key;
+  }
+  if (value) {
+    encoded_message += *value;
+  }
+  return true;
+}
+
+bool message::decode_binary(const binary_header &header,
+                            const std::string &body) {
+  message_view view;
+  if (!view.decode_binary(header, body)) {
+    reset();
+    return false;
+  }
+  this->type = view.type;
+  this->first.assign(view.key);
+  this->second.assign(view.value);
+  this->ttl = view.ttl;
+  return true;
+}
+
 message_type message::get_type() { return this->type; }
 
 std::string message::get_key() { return this->first; }
 
 std::string message::get_value() { return this->second; }
 
+uint32_t message::get_ttl() { return this->ttl; }
+
+// Give a PUT a time to live in milliseconds; 0 means it never expires
+bool message::set_ttl(uint32_t ttl) {
+  if (this->type != PUT) {
+    return false;
+  }
+  this->ttl = ttl;
+  return true;
+}
+
 bool message::reset(message_type type, std::string first, std::string second) {
   this->type = type;
   this->first = first;
   this->second = second;
+  this->ttl = 0;
   return true;
 }
 
@@ -189,6 +857,7 @@ bool message::reset(message_type type, std::string first) {
   this->type = type;
   this->first = first;
   this->second = "";
+  this->ttl = 0;
   return true;
 }
 
@@ -196,6 +865,7 @@ bool message::reset(message_type type) {
   this->type = type;
   this->first = "";
   this->second = "";
+  this->ttl = 0;
   return true;
 }
 
@@ -203,6 +873,7 @@ bool message::reset() {
   this->type = UNSET;
   this->first = "";
   this->second = "";
+  this->ttl = 0;
   return true;
 }
 
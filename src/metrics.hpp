@@ -0,0 +1,423 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The server_metrics class counts what a kvserver does: requests and their
+ * latencies by command, connections opened, lost, and dropped, and bytes
+ * received and sent. Requests and bytes are recorded into per-thread
+ * stripes and summed only when read, so io threads never share a cache line
+ * to count a request. Sessions add their request counts once per batch, and
+ * time only one request in LATENCY_SAMPLE: reading the clock twice would
+ * cost more than a cached GET spends in the store.
+ *
+ * report() and prometheus() combine these counters with the store's own:
+ * its size and memory, cache hit ratio, and shard lock contention. report()
+ * is the payload of a STATS response, one "name value" pair per line;
+ * prometheus() is the same numbers in the Prometheus text exposition format.
+ * STATS may also ask for lock contention per shard, for the hottest keys
+ * the store has sampled, or for the state of replication.
+ *
+ * The metrics_endpoint class answers HTTP GET /metrics with prometheus(), so
+ * a Prometheus server can scrape a kvserver directly.
+ */
+
+#ifndef METRICS_H
+#define METRICS_H
+
+#include "counter.hpp"
+#include "histogram.hpp"
+#include "kvstore.hpp"
+#include "message.hpp"
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <functional>
+#include <istream>
+#include <memory>
+#include <string>
+#include <string_view>
+#include <vector>
+
+class server_metrics {
+public:
+  // GET through TRACK, SCAN, then every request that failed to parse
+  static constexpr int NUM_COMMANDS = TRACK - GET + 3;
+  static constexpr uint64_t LATENCY_SAMPLE = 32;
+
+  static int command_index(message_type type) {
+    if (type == SCAN) {
+      return NUM_COMMANDS - 2;
+    }
+    return type >= GET && type <= TRACK ? type - GET : NUM_COMMANDS - 1;
+  }
+
+private:
+  static constexpr const char *COMMAND_NAMES[NUM_COMMANDS] = {
+      "get", "put", "del", "proto", "mget", "mput", "mdel", "stats",
+      "track", "scan", "invalid"};
+
+  // Quantiles reported for every command's latency
+  static constexpr double QUANTILES[] = {0.5, 0.9, 0.99, 0.999};
+  static constexpr const char *QUANTILE_NAMES[] = {"p50", "p90", "p99",
+                                                   "p999"};
+
+  struct metric {
+    const char *name;
+    const char *type; // Prometheus type, counter or gauge
+    const char *help;
+    double value;
+  };
+
+  std::chrono::steady_clock::time_point started =
+      std::chrono::steady_clock::now();
+  striped_counter requests[NUM_COMMANDS];
+  striped_histogram latency[NUM_COMMANDS]; // Nanoseconds, sampled
+  striped_counter received;
+  striped_counter sent;
+  striped_counter pushed;
+  striped_counter entered; // io_uring_enter calls
+  std::atomic<int64_t> active{0};
+  std::atomic<uint64_t> accepted{0};
+  std::atomic<uint64_t> failed{0};  // Connections lost to a socket error
+  std::atomic<uint64_t> dropped{0}; // Connections closed for bad framing
+  std::function<std::string()> replication; // Set when replicating
+
+  // Counts print exactly; anything fractional to six significant digits
+  static void append_number(std::string &out, double value) {
+    char text[32];
+    if (value == std::floor(value) && std::fabs(value) < 1e15) {
+      std::snprintf(text, sizeof(text), "%lld", (long long)value);
+    } else {
+      std::snprintf(text, sizeof(text), "%.6g", value);
+    }
+    out += text;
+  }
+
+  // Everything but the per-command latencies. Reading the store's memory
+  // takes each shard lock in turn.
+  std::vector<metric> collect(kvstore &store) const {
+    kvstore::cache_stats cache = store.cache_usage();
+    slab::stats memory = store.memory();
+    contended_mutex::stats locks = store.lock_usage();
+    double uptime = std::chrono::duration<double>(
+                        std::chrono::steady_clock::now() - started)
+                        .count();
+    return {
+        {"uptime_seconds", "gauge", "Seconds since the server started.",
+         uptime},
+        {"connections", "gauge", "Open client connections.",
+         double(active.load(std::memory_order_relaxed))},
+        {"connections_total", "counter", "Client connections accepted.",
+         double(accepted.load(std::memory_order_relaxed))},
+        {"connection_errors_total", "counter",
+         "Connections lost to a socket error.",
+         double(failed.load(std::memory_order_relaxed))},
+        {"protocol_errors_total", "counter",
+         "Connections closed for a malformed frame or overlong line.",
+         double(dropped.load(std::memory_order_relaxed))},
+        {"received_bytes_total", "counter", "Bytes read from clients.",
+         double(received.load())},
+        {"sent_bytes_total", "counter", "Bytes written to clients.",
+         double(sent.load())},
+        {"invalidations_total", "counter",
+         "Invalidations pushed to tracking clients.", double(pushed.load())},
+        {"ring_enters_total", "counter",
+         "io_uring_enter calls made by the io_uring transport.",
+         double(entered.load())},
+        {"keys", "gauge", "Pairs in the store.", double(store.size())},
+        {"memory_used_bytes", "gauge", "Bytes of live store nodes.",
+         double(memory.used_bytes)},
+        {"memory_reserved_bytes", "gauge", "Bytes of slabs the store holds.",
+         double(memory.reserved_bytes)},
+        {"memory_limit_bytes", "gauge", "Eviction limit, or 0 if unbounded.",
+         double(cache.limit)},
+        {"cache_hits_total", "counter", "Lookups that found their key.",
+         double(cache.hits)},
+        {"cache_misses_total", "counter", "Lookups that missed.",
+         double(cache.misses)},
+        {"cache_hit_ratio", "gauge", "Hits as a fraction of lookups.",
+         cache.hit_ratio()},
+        {"evictions_total", "counter", "Pairs evicted for memory.",
+         double(cache.evictions)},
+        {"expirations_total", "counter", "Pairs removed when they expired.",
+         double(cache.expirations)},
+        {"lock_acquisitions_total", "counter", "Shard lock acquisitions.",
+         double(locks.acquisitions)},
+        {"lock_contentions_total", "counter",
+         "Shard lock acquisitions that had to wait.",
+         double(locks.contentions)},
+        {"lock_contention_ratio", "gauge",
+         "Contentions as a fraction of acquisitions.",
+         locks.contention_ratio()},
+        {"lock_wait_seconds_total", "counter",
+         "Time spent waiting for shard locks.", locks.wait_ns / 1e9},
+    };
+  }
+
+public:
+  // Add counts[i] requests of each command i and zero counts
+  void add_requests(uint64_t (&counts)[NUM_COMMANDS]) {
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+      if (counts[i]) {
+        requests[i].add(counts[i]);
+        counts[i] = 0;
+      }
+    }
+  }
+
+  // Record a sampled request of type that took latency to handle
+  void sample(message_type type, std::chrono::nanoseconds latency) {
+    this->latency[command_index(type)].record(latency.count());
+  }
+
+  void bytes_received(size_t bytes) { received.add(bytes); }
+  void bytes_sent(size_t bytes) { sent.add(bytes); }
+  void invalidation_pushed() { pushed.add(); }
+  void ring_entered() { entered.add(); }
+
+  void connection_opened() {
+    accepted.fetch_add(1, std::memory_order_relaxed);
+    active.fetch_add(1, std::memory_order_relaxed);
+  }
+
+  void connection_closed() { active.fetch_sub(1, std::memory_order_relaxed); }
+
+  // Count a failed read or write; a client closing its end is no failure
+  void connection_error(const boost::system::error_code &error) {
+    if (error != boost::asio::error::eof &&
+        error != boost::asio::error::operation_aborted) {
+      failed.fetch_add(1, std::memory_order_relaxed);
+    }
+  }
+
+  void protocol_error() { dropped.fetch_add(1, std::memory_order_relaxed); }
+
+  // Answer STATS replication with report(). Set before serving requests.
+  void report_replication(std::function<std::string()> report) {
+    replication = std::move(report);
+  }
+
+  // "name value" lines for a STATS response. Each command reports its
+  // request count and sampled latency percentiles in microseconds.
+  std::string report(kvstore &store) const {
+    std::string out;
+    for (const metric &m : collect(store)) {
+      out += m.name;
+      out += ' ';
+      append_number(out, m.value);
+      out += '\n';
+    }
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+      histogram h = latency[i].load();
+      std::string name = COMMAND_NAMES[i];
+      out += name + "_requests_total ";
+      append_number(out, requests[i].load());
+      out += '\n';
+      for (size_t q = 0; q < std::size(QUANTILES); q++) {
+        out += name + "_latency_" + QUANTILE_NAMES[q] + "_us ";
+        append_number(out, h.percentile(QUANTILES[q]) / 1e3);
+        out += '\n';
+      }
+    }
+    return out;
+  }
+
+  // The report for "STATS section action" into out. An empty section is
+  // report(); "stripes" breaks lock contention down by shard; "hotkeys"
+  // lists the hottest keys as "key count" lines, and its actions on, off,
+  // and reset control tracking them; "replication" reports a primary's
+  // replicas or a replica's progress. Returns false for anything else.
+  bool report(kvstore &store,
+              std::string_view section,
+              std::string_view action,
+              std::string &out) const {
+    if (section.empty() && action.empty()) {
+      out = report(store);
+    } else if (section == "stripes" && action.empty()) {
+      out = stripe_report(store);
+    } else if (section == "replication" && action.empty() && replication) {
+      out = replication();
+    } else if (section == "hotkeys") {
+      if (action == "on" || action == "off") {
+        store.track_hot_keys(action == "on");
+      } else if (action == "reset") {
+        store.reset_hot_keys();
+      } else if (!action.empty()) {
+        return false;
+      }
+      out.clear();
+      for (const hot_keys::entry &e : store.hottest_keys()) {
+        out += e.key + ' ' + std::to_string(e.count) + '\n';
+      }
+    } else {
+      return false;
+    }
+    return true;
+  }
+
+  // Contention summed over shard locks, then the hottest shard by time
+  // waited and a group of lines for every shard that was ever contended.
+  // Wait percentiles are upper bounds, within a factor of two.
+  static std::string stripe_report(kvstore &store) {
+    std::vector<contended_mutex::stats> usage = store.stripe_usage();
+    contended_mutex::stats total;
+    size_t hottest = 0;
+    size_t contended = 0;
+    for (size_t i = 0; i < usage.size(); i++) {
+      total += usage[i];
+      if (usage[i].wait_ns > usage[hottest].wait_ns) {
+        hottest = i;
+      }
+      contended += usage[i].contentions > 0;
+    }
+
+    std::string out = "stripes " + std::to_string(usage.size()) +
+                      "\ncontended_stripes " + std::to_string(contended) +
+                      "\nhottest_stripe " + std::to_string(hottest) +
+                      "\nwait_p50_ns " +
+                      std::to_string(total.wait_percentile(0.5)) +
+                      "\nwait_p99_ns " +
+                      std::to_string(total.wait_percentile(0.99)) + '\n';
+    for (size_t i = 0; i < usage.size(); i++) {
+      const contended_mutex::stats &u = usage[i];
+      if (u.contentions == 0) {
+        continue;
+      }
+      std::string name = "stripe_" + std::to_string(i) + '_';
+      out += name + "acquisitions " + std::to_string(u.acquisitions) + '\n';
+      out += name + "contentions " + std::to_string(u.contentions) + '\n';
+      out += name + "wait_ns " + std::to_string(u.wait_ns) + '\n';
+      out += name + "wait_p99_ns " +
+             std::to_string(u.wait_percentile(0.99)) + '\n';
+    }
+    return out;
+  }
+
+  // The Prometheus text exposition format, every name prefixed kvserver_.
+  // Latencies are a summary per command, in seconds, whose count is every
+  // request and whose sum is estimated from the sampled mean.
+  std::string prometheus(kvstore &store) const {
+    std::string out;
+    for (const metric &m : collect(store)) {
+      std::string name = std::string("kvserver_") + m.name;
+      out += "# HELP " + name + ' ' + m.help + '\n';
+      out += "# TYPE " + name + ' ' + m.type + '\n';
+      out += name + ' ';
+      append_number(out, m.value);
+      out += '\n';
+    }
+
+    out += "# HELP kvserver_request_duration_seconds Time spent handling "
+           "requests, by command.\n"
+           "# TYPE kvserver_request_duration_seconds summary\n";
+    for (int i = 0; i < NUM_COMMANDS; i++) {
+      histogram h = latency[i].load();
+      uint64_t count = requests[i].load();
+      std::string labels = std::string("{command=\"") + COMMAND_NAMES[i];
+      for (size_t q = 0; q < std::size(QUANTILES); q++) {
+        out += "kvserver_request_duration_seconds" + labels +
+               "\",quantile=\"";
+        append_number(out, QUANTILES[q]);
+        out += "\"} ";
+        append_number(out, h.percentile(QUANTILES[q]) / 1e9);
+        out += '\n';
+      }
+      out += "kvserver_request_duration_seconds_sum" + labels + "\"} ";
+      append_number(out, h.mean() * count / 1e9);
+      out += "\nkvserver_request_duration_seconds_count" + labels + "\"} ";
+      append_number(out, count);
+      out += '\n';
+    }
+    return out;
+  }
+};
+
+class metrics_endpoint {
+private:
+  using tcp = boost::asio::ip::tcp;
+  static constexpr size_t MAX_REQUEST = 8192; // Bytes of request headers
+
+  struct exchange {
+    tcp::socket socket;
+    boost::asio::streambuf request{MAX_REQUEST};
+    std::string response;
+
+    explicit exchange(tcp::acceptor &acceptor)
+        : socket(acceptor.get_executor()) {}
+  };
+
+  tcp::acceptor acceptor;
+  std::function<std::string()> render;
+
+  void start_accept() {
+    std::shared_ptr<exchange> e = std::make_shared<exchange>(acceptor);
+    acceptor.async_accept(
+        e->socket, [this, e](const boost::system::error_code &error) {
+          if (error == boost::asio::error::operation_aborted) {
+            return; // The endpoint is closing
+          }
+          if (!error) {
+            start_read(e);
+          }
+          start_accept();
+        });
+  }
+
+  void start_read(std::shared_ptr<exchange> e) {
+    boost::asio::async_read_until(
+        e->socket,
+        e->request,
+        "\r\n\r\n",
+        [this, e](const boost::system::error_code &error, size_t) {
+          if (!error) {
+            respond(e);
+          }
+        });
+  }
+
+  // Answer GET /metrics and refuse everything else, then close
+  void respond(std::shared_ptr<exchange> e) {
+    std::istream request(&e->request);
+    std::string method;
+    std::string target;
+    request >> method >> target;
+
+    std::string status = "200 OK";
+    std::string body;
+    if (method != "GET") {
+      status = "405 Method Not Allowed";
+    } else if (target != "/metrics" && target.rfind("/metrics?", 0) != 0) {
+      status = "404 Not Found";
+    } else {
+      body = render();
+    }
+    e->response = "HTTP/1.1 " + status +
+                  "\r\nContent-Type: text/plain; version=0.0.4\r\n"
+                  "Content-Length: " +
+                  std::to_string(body.size()) +
+                  "\r\nConnection: close\r\n\r\n" + body;
+    boost::asio::async_write(
+        e->socket,
+        boost::asio::buffer(e->response),
+        [e](const boost::system::error_code &, size_t) {
+          boost::system::error_code ignored;
+          e->socket.shutdown(tcp::socket::shutdown_both, ignored);
+        });
+  }
+
+public:
+  // Serve render() on port; port 0 picks a free one
+  metrics_endpoint(boost::asio::io_service &io_service,
+                   unsigned short port,
+                   std::function<std::string()> render)
+      : acceptor(io_service, tcp::endpoint(tcp::v4(), port)),
+        render(std::move(render)) {
+    start_accept();
+  }
+
+  unsigned short port() const { return acceptor.local_endpoint().port(); }
+};
+
+#endif
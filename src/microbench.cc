@@ -0,0 +1,1153 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The microbench program measures individual pieces of the key-value store in
+ * isolation. Each benchmark is selected by name on the command line and
+ * prints one line per measurement. Every heap allocation in the process is
+ * counted so benchmarks can report allocations per operation.
+ */
+
+#ifndef MICROBENCH_H
+#define MICROBENCH_H
+
+#include "kvclient.cc"
+#include "kvpool.cc"
+#include "kvserver.cc"
+#include "message.hpp"
+#include "snapshot.hpp"
+#include "wal.hpp"
+#include "workload.hpp"
+
+#include <fcntl.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include <atomic>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <fstream>
+#include <functional>
+#include <iomanip>
+#include <iostream>
+#include <future>
+#include <map>
+#include <mutex>
+#include <sstream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+using boost::asio::ip::tcp;
+
+// Count every heap allocation made by the process. GCC cannot see that the
+// replaced operators pair malloc with free, so silence its mismatch warning.
+static std::atomic<size_t> allocation_count(0);
+
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wmismatched-new-delete"
+
+void *operator new(size_t size) {
+  allocation_count.fetch_add(1, std::memory_order_relaxed);
+  if (void *ptr = std::malloc(size ? size : 1)) {
+    return ptr;
+  }
+  throw std::bad_alloc();
+}
+
+void operator delete(void *ptr) noexcept { std::free(ptr); }
+
+void operator delete(void *ptr, size_t) noexcept { std::free(ptr); }
+#pragma GCC diagnostic pop
+
+class Microbench {
+private:
+  using clock = std::chrono::steady_clock;
+
+  int iterations;
+  int scale;       // Copies of users.txt loaded by the memory benchmark
+  int max_threads; // Most threads the scaling benchmark runs
+
+  // Print one result line: benchmark, variant, rate and allocations per op
+  static void report(const std::string &name,
+                     const std::string &variant,
+                     size_t ops,
+                     clock::duration elapsed,
+                     size_t allocations) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::left << std::setw(14) << name << std::setw(22) << variant
+              << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << (seconds > 0 ? ops / seconds : 0)
+              << " ops/s" << std::setw(10)
+              << (seconds * 1e9 / (ops ? ops : 1)) << " ns/op"
+              << std::setprecision(3) << std::setw(10)
+              << double(allocations) / (ops ? ops : 1) << " allocs/op"
+              << std::endl;
+  }
+
+  // Run op iterations times and report its rate and allocations
+  void measure(const std::string &name,
+               const std::string &variant,
+               const std::function<void()> &op) {
+    for (int i = 0; i < iterations / 10 + 1; i++) {
+      op(); // Warm up buffers and caches
+    }
+    size_t allocations = allocation_count.load();
+    clock::time_point start = clock::now();
+    for (int i = 0; i < iterations; i++) {
+      op();
+    }
+    clock::duration elapsed = clock::now() - start;
+    report(name,
+           variant,
+           iterations,
+           elapsed,
+           allocation_count.load() - allocations);
+  }
+
+  // The stringstream tokenizer message::decode used before message_view
+  static bool legacy_decode(const std::string &line,
+                            std::string &key,
+                            std::string &value) {
+    std::stringstream ss(line);
+    std::string token;
+    std::vector<std::string> tokens;
+    while (std::getline(ss, token, ' ')) {
+      tokens.push_back(token);
+    }
+    if (tokens.size() < 2) {
+      return false;
+    }
+    key = tokens[1];
+    value = tokens.size() > 2 ? tokens[2] : "";
+    while (value.find("\r") != std::string::npos) {
+      value.replace(value.find("\r"), 1, "\n");
+    }
+    return true;
+  }
+
+  // Compare request parsers on GET and PUT lines
+  void bench_parse() {
+    const std::string get_line = "GET zad418";
+    const std::string put_line = "PUT zad418 /L,-W6COHMT5/!$J*'\r";
+    std::string key, value;
+    message_view view;
+
+    measure("parse", "legacy GET", [&]() {
+      legacy_decode(get_line, key, value);
+    });
+    measure("parse", "message GET", [&]() {
+      message msg(get_line);
+    });
+    measure("parse", "message_view GET", [&]() { view.decode(get_line); });
+    measure("parse", "legacy PUT", [&]() {
+      legacy_decode(put_line, key, value);
+    });
+    measure("parse", "message_view PUT", [&]() { view.decode(put_line); });
+  }
+
+  // The text path before delimiters: memchr for the line's end, again for
+  // each token, and a memchr and copy per run between translated bytes
+  static size_t legacy_split(std::string_view pending,
+                             std::string_view tokens[4]) {
+    size_t newline = pending.find('\n');
+    std::string_view line = pending.substr(0, newline);
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < line.size() && count < 4) {
+      size_t space = line.find(' ', pos);
+      if (space == std::string_view::npos) {
+        space = line.size();
+      }
+      tokens[count++] = line.substr(pos, space - pos);
+      pos = space + 1;
+    }
+    return newline;
+  }
+
+  // legacy_split with the line's end and spaces found in one scan, as
+  // message_view::decode splits a line
+  static size_t split(std::string_view pending, std::string_view tokens[4]) {
+    delimiters::line_layout layout;
+    delimiters::scan_line(pending, layout);
+    std::string_view line = pending.substr(0, layout.length);
+    size_t count = 0;
+    size_t pos = 0;
+    while (pos < line.size() && count < 4) {
+      size_t space =
+          count < layout.space_count ? layout.spaces[count] : line.size();
+      tokens[count++] = line.substr(pos, space - pos);
+      pos = space + 1;
+    }
+    return layout.length;
+  }
+
+  static void legacy_translate(std::string &out,
+                               std::string_view value,
+                               char from,
+                               char to) {
+    const char *data = value.data();
+    size_t remaining = value.size();
+    while (remaining > 0) {
+      const char *found =
+          static_cast<const char *>(std::memchr(data, from, remaining));
+      size_t run = found ? size_t(found - data) : remaining;
+      out.append(data, run);
+      if (!found) {
+        break;
+      }
+      out += to;
+      data += run + 1;
+      remaining -= run + 1;
+    }
+  }
+
+  // Compare the text path's delimiter scanning before and after delimiters,
+  // with each of its versions, in GB/s of requests on one core. Each op
+  // finds a PUT's line and tokens, restores its value's newlines, and
+  // encodes the value back as a GET response would.
+  void bench_delimiters() {
+    delimiters::implementation original = delimiters::active();
+    for (size_t size : {16, 256, 4096, 16384}) {
+      for (bool newlines : {false, true}) {
+        std::string value(size, 'v');
+        if (newlines) {
+          for (size_t i = 0; i < size; i += 64) {
+            value[i] = '\r';
+          }
+        }
+        std::string pending = "PUT zad418 " + value + "\nGET zad418\n";
+        std::string variant_size = " " + std::to_string(size) +
+                                   (newlines ? "B, \\r" : "B");
+        std::string scratch, out;
+        auto run = [&](const std::string &variant,
+                       const std::function<void()> &op) {
+          int ops = std::max<int>(iterations * 16 / (size / 64 + 16), 1);
+          for (int i = 0; i < ops / 10 + 1; i++) {
+            op();
+          }
+          clock::time_point start = clock::now();
+          for (int i = 0; i < ops; i++) {
+            op();
+          }
+          double seconds =
+              std::chrono::duration<double>(clock::now() - start).count();
+          std::cout << std::left << std::setw(14) << "delimiters"
+                    << std::setw(22) << variant + variant_size << std::right
+                    << std::fixed << std::setprecision(2) << std::setw(12)
+                    << pending.size() * ops / seconds / 1e9 << " GB/s"
+                    << std::setprecision(1) << std::setw(10)
+                    << seconds * 1e9 / ops << " ns/op" << std::endl;
+        };
+
+        run("legacy", [&]() {
+          std::string_view tokens[4];
+          legacy_split(pending, tokens);
+          scratch.clear();
+          legacy_translate(scratch, tokens[2], '\r', '\n');
+          out.clear();
+          legacy_translate(out, scratch, '\n', '\r');
+        });
+        for (delimiters::implementation kind :
+             {delimiters::SCALAR, delimiters::SSE2, delimiters::AVX2}) {
+          if (!delimiters::use(kind)) {
+            continue;
+          }
+          run(delimiters::name(kind), [&]() {
+            std::string_view tokens[4];
+            split(pending, tokens);
+            scratch.clear();
+            append_translated(scratch, tokens[2], '\r', '\n');
+            out.clear();
+            append_translated(out, scratch, '\n', '\r');
+          });
+        }
+        delimiters::use(original);
+      }
+    }
+  }
+
+  // A kvserver on an ephemeral loopback port, served by one io thread
+  struct loopback {
+    boost::asio::io_service server_io_service;
+    boost::asio::io_service client_io_service;
+    kvserver server;
+    boost::thread server_thread;
+
+    loopback()
+        : server(server_io_service, 0),
+          server_thread(boost::bind(&boost::asio::io_service::run,
+                                    &server_io_service)) {}
+
+    ~loopback() {
+      server_io_service.stop();
+      server_thread.join();
+    }
+
+    std::string port() { return std::to_string(server.port()); }
+  };
+
+  // Serve GETs over loopback from an in-process server and count every
+  // allocation made by client and server together
+  void bench_get() {
+    loopback net;
+    net.server.store.put("zad418", "/L,-W6COHMT5/!$J*'");
+
+    for (int protocol = TEXT_PROTOCOL; protocol <= BINARY_PROTOCOL;
+         protocol++) {
+      kvclient client(net.client_io_service,
+                      "127.0.0.1",
+                      net.port(),
+                      static_cast<protocol_type>(protocol));
+
+      // Encode the request and size the response once, outside the loop
+      message msg(GET, "zad418");
+      std::string request, expected;
+      if (protocol == BINARY_PROTOCOL) {
+        msg.encode_binary(request, 0);
+        message(OK, "/L,-W6COHMT5/!$J*'").encode_binary(expected, 0);
+      } else {
+        msg.encode(request);
+        message(OK, "/L,-W6COHMT5/!$J*'").encode(expected);
+      }
+      std::vector<char> response(expected.size());
+
+      measure("get", protocol == BINARY_PROTOCOL ? "binary" : "text", [&]() {
+        client.send_request(request);
+        boost::asio::read(client.socket(),
+                          boost::asio::buffer(response.data(),
+                                              response.size()));
+      });
+    }
+  }
+
+  // Compare GET throughput on one connection as more requests are kept in
+  // flight; depth 1 is the blocking client
+  void bench_pipeline() {
+    loopback net;
+    net.server.store.put("zad418", "/L,-W6COHMT5/!$J*'");
+    kvclient client(net.client_io_service, "127.0.0.1", net.port());
+
+    const size_t depths[] = {1, 4, 16, 64, 256};
+    for (size_t depth : depths) {
+      size_t found = 0;
+      auto on_get = [&](bool ok, const std::string &) { found += ok; };
+      measure("pipeline", "depth " + std::to_string(depth), [&]() {
+        client.async_get("zad418", on_get);
+        if (client.in_flight() >= depth) {
+          client.wait();
+        }
+      });
+      client.wait();
+    }
+  }
+
+  // Compare fetching a page of keys one GET at a time, pipelined, and as a
+  // single MGET; each op fetches every key once
+  void bench_batch() {
+    loopback net;
+    const size_t page_size = 100;
+    std::vector<std::string> keys, values;
+    for (size_t i = 0; i < page_size; i++) {
+      keys.push_back("batch" + std::to_string(i));
+      values.push_back("/L,-W6COHMT5/!$J*'");
+      net.server.store.put(keys[i], values[i]);
+    }
+    kvclient client(net.client_io_service, "127.0.0.1", net.port());
+    std::vector<std::string> fetched;
+    std::vector<bool> found;
+    std::string value;
+    auto on_get = [](bool, const std::string &) {};
+
+    std::string variant = " x" + std::to_string(page_size);
+    measure("batch", "get" + variant, [&]() {
+      for (size_t i = 0; i < page_size; i++) {
+        client.get(keys[i], value);
+      }
+    });
+    measure("batch", "pipelined get" + variant, [&]() {
+      for (size_t i = 0; i < page_size; i++) {
+        client.async_get(keys[i], on_get);
+      }
+      client.wait();
+    });
+    measure("batch", "mget" + variant, [&]() {
+      client.mget(keys, fetched, found);
+    });
+    measure("batch", "put" + variant, [&]() {
+      for (size_t i = 0; i < page_size; i++) {
+        client.put(keys[i], values[i]);
+      }
+    });
+    measure("batch", "mput" + variant, [&]() {
+      client.mput(keys, values, found);
+    });
+  }
+
+  // Run op(thread, i) for ops iterations split across num_threads threads
+  // and report the combined rate
+  void measure_threads(const std::string &name,
+                       const std::string &variant,
+                       int num_threads,
+                       size_t ops,
+                       const std::function<void(int, size_t)> &op) {
+    size_t allocations = allocation_count.load();
+    clock::time_point start = clock::now();
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t]() {
+        for (size_t i = t; i < ops; i += num_threads) {
+          op(t, i);
+        }
+      });
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+    report(name,
+           variant,
+           ops,
+           clock::now() - start,
+           allocation_count.load() - allocations);
+  }
+
+  // Compare GET throughput from many threads when each opens its own
+  // connection against sharing a kvpool of a few, and report how many
+  // requests the pool sends per write
+  void bench_pool() {
+    loopback net;
+    net.server.store.put("zad418", "/L,-W6COHMT5/!$J*'");
+    const int num_threads = 64;
+
+    {
+      std::vector<std::unique_ptr<kvclient>> clients;
+      for (int t = 0; t < num_threads; t++) {
+        clients.push_back(std::make_unique<kvclient>(
+            net.client_io_service, "127.0.0.1", net.port(), BINARY_PROTOCOL));
+      }
+      measure_threads("pool",
+                      "own, " + std::to_string(num_threads) + " sockets",
+                      num_threads,
+                      iterations,
+                      [&](int t, size_t) {
+                        std::string value;
+                        clients[t]->get("zad418", value);
+                      });
+    }
+
+    for (size_t sockets : {1, 2, 4, 8}) {
+      kvpool pool("127.0.0.1", net.port(), sockets);
+      measure_threads("pool",
+                      "kvpool, " + std::to_string(sockets) +
+                          (sockets == 1 ? " socket" : " sockets"),
+                      num_threads,
+                      iterations,
+                      [&](int, size_t) {
+                        std::string value;
+                        pool.get("zad418", value);
+                      });
+      kvpool::usage_stats usage = pool.usage();
+      std::cout << std::left << std::setw(14) << "pool" << std::setw(22)
+                << "  requests per write" << std::right << std::setw(12)
+                << std::fixed << std::setprecision(1)
+                << double(usage.requests) / std::max<uint64_t>(usage.writes, 1)
+                << std::endl;
+    }
+  }
+
+  // Compare durable PUT throughput when every writer syncs its own record
+  // against the write-ahead log's group commit, and the relaxed policies.
+  // The log lives in the current directory so it is synced to real storage.
+  void bench_wal() {
+    const std::string path = "microbench.wal";
+    const size_t ops = std::min<size_t>(iterations, 20000);
+    const int thread_counts[] = {1, 16};
+    std::string value = "/L,-W6COHMT5/!$J*'";
+
+    for (int num_threads : thread_counts) {
+      std::string threads = ", " + std::to_string(num_threads) + " threads";
+
+      // Without group commit: each put writes and syncs its own record
+      {
+        std::remove(path.c_str());
+        kvstore store;
+        std::mutex file_lock;
+        int fd = ::open(path.c_str(), O_WRONLY | O_CREAT | O_APPEND, 0644);
+        auto put_and_sync = [&](int, size_t i) {
+          std::string key = "wal" + std::to_string(i);
+          std::string record = key + ' ' + value + '\n';
+          std::lock_guard<std::mutex> guard(file_lock);
+          store.put(key, value);
+          if (::write(fd, record.data(), record.size()) < 0 ||
+              fdatasync(fd) != 0) {
+            std::cerr << "wal: write failed" << std::endl;
+          }
+        };
+        measure_threads(
+            "wal", "fsync each" + threads, num_threads, ops, put_and_sync);
+        ::close(fd);
+      }
+
+      const std::pair<wal::sync_policy, std::string> policies[] = {
+          {wal::SYNC_ALWAYS, "group commit"},
+          {wal::SYNC_INTERVAL, "interval 1ms"},
+          {wal::SYNC_NEVER, "never sync"},
+      };
+      for (const auto &policy : policies) {
+        std::remove(path.c_str());
+        wal log(path, policy.first, std::chrono::milliseconds(1));
+        kvstore store;
+        store.recover(log);
+        store.attach_log(&log);
+        auto put_and_wait = [&](int, size_t i) {
+          // Wait for the put to be durable, as a deferred ack would
+          store.put("wal" + std::to_string(i), value);
+          std::promise<bool> durable;
+          log.on_durable(log.tail(), [&](bool ok) { durable.set_value(ok); });
+          durable.get_future().wait();
+        };
+        measure_threads(
+            "wal", policy.second + threads, num_threads, ops, put_and_wait);
+        if (policy.first == wal::SYNC_ALWAYS) {
+          std::cout << std::left << std::setw(14) << "wal" << std::setw(22)
+                    << "  records per sync" << std::right << std::setw(12)
+                    << std::fixed << std::setprecision(1)
+                    << double(ops) / std::max<uint64_t>(log.sync_count(), 1)
+                    << std::endl;
+        }
+      }
+    }
+    std::remove(path.c_str());
+  }
+
+  // Resident set size of this process in bytes
+  static size_t resident_bytes() {
+    std::ifstream statm("/proc/self/statm");
+    size_t pages = 0, resident = 0;
+    statm >> pages >> resident;
+    return resident * sysconf(_SC_PAGESIZE);
+  }
+
+  // Run load in a child process so each layout starts from the same heap,
+  // and print the resident memory it added per entry
+  static void measure_memory(const std::string &variant,
+                             size_t entries,
+                             const std::function<std::string()> &load) {
+    std::cout.flush();
+    pid_t pid = fork();
+    if (pid == 0) {
+      size_t before = resident_bytes();
+      std::string detail = load();
+      size_t after = resident_bytes();
+      std::cout << std::left << std::setw(14) << "memory" << std::setw(22)
+                << variant << std::right << std::setw(12) << entries
+                << " entries" << std::fixed << std::setprecision(1)
+                << std::setw(10) << double(after - before) / entries
+                << " B/entry RSS" << detail << std::endl;
+      _exit(0);
+    }
+    int status;
+    waitpid(pid, &status, 0);
+  }
+
+  // Compare the resident memory of the original unordered_map layout with
+  // the slab-backed kvstore after loading users.txt scale times, with each
+  // copy's keys made unique by a suffix
+  void bench_memory() {
+    std::vector<std::pair<std::string, std::string>> users;
+    std::ifstream users_file("src/users.txt");
+    std::string line;
+    while (getline(users_file, line)) {
+      size_t space = line.find(' ');
+      if (space != std::string::npos) {
+        users.emplace_back(line.substr(0, space), line.substr(space + 1));
+      }
+    }
+    if (users.empty()) {
+      std::cerr << "memory: unable to read src/users.txt" << std::endl;
+      return;
+    }
+    size_t entries = users.size() * scale;
+    std::string variant = " x" + std::to_string(scale);
+
+    measure_memory("unordered_map" + variant, entries, [&]() {
+      static std::unordered_map<std::string, std::string> store;
+      std::string key;
+      for (int copy = 0; copy < scale; copy++) {
+        for (size_t i = 0; i < users.size(); i++) {
+          key = users[i].first + '#' + std::to_string(copy);
+          store[key] = users[i].second;
+        }
+      }
+      return std::string();
+    });
+
+    measure_memory("kvstore" + variant, entries, [&]() {
+      static kvstore store;
+      std::string key;
+      for (int copy = 0; copy < scale; copy++) {
+        for (size_t i = 0; i < users.size(); i++) {
+          key = users[i].first + '#' + std::to_string(copy);
+          store.put(key, users[i].second);
+        }
+      }
+      slab::stats usage = store.memory();
+      std::ostringstream detail;
+      detail << std::fixed << std::setprecision(1) << "  used "
+             << usage.used_bytes / 1048576.0 << " MiB reserved "
+             << usage.reserved_bytes / 1048576.0 << " MiB fragmentation "
+             << usage.fragmentation() * 100 << "%";
+      return detail.str();
+    });
+  }
+
+  // Print how long one step of a startup took for entries pairs
+  static void report_seconds(const std::string &name,
+                             const std::string &variant,
+                             size_t entries,
+                             clock::duration elapsed) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    std::cout << std::left << std::setw(14) << name << std::setw(22)
+              << variant << std::right << std::setw(12) << entries
+              << " entries" << std::fixed << std::setprecision(3)
+              << std::setw(10) << seconds << " s" << std::setprecision(1)
+              << std::setw(12) << (seconds > 0 ? entries / seconds : 0)
+              << " pairs/s" << std::endl;
+  }
+
+  // Compare starting a store by parsing users.txt-format text line by line,
+  // as Test::SetUp once did, with bulk loading the text and loading a binary
+  // snapshot, each on one and on all threads. The data is users.txt
+  // repeated scale times with unique keys.
+  void bench_startup() {
+    const std::string text_path = "microbench.txt";
+    const std::string snapshot_path = "microbench.snap";
+    std::ifstream users_file("src/users.txt");
+    std::ofstream text(text_path);
+    std::vector<std::string> lines;
+    std::string line;
+    while (getline(users_file, line)) {
+      lines.push_back(line);
+    }
+    size_t entries = 0;
+    for (int copy = 0; copy < scale; copy++) {
+      for (size_t i = 0; i < lines.size(); i++) {
+        size_t space = lines[i].find(' ');
+        if (space != std::string::npos) {
+          text << lines[i].substr(0, space) << '#' << copy
+               << lines[i].substr(space) << '\n';
+          entries++;
+        }
+      }
+    }
+    text.close();
+    lines.clear();
+
+    {
+      kvstore store;
+      clock::time_point start = clock::now();
+      std::ifstream input(text_path);
+      while (getline(input, line)) {
+        std::string key = line.substr(0, line.find(" "));
+        std::string value = line.substr(line.find(" ") + 1);
+        store.put(key, value);
+      }
+      report_seconds(
+          "startup", "text getline", store.size(), clock::now() - start);
+
+      start = clock::now();
+      snapshot::save(store, snapshot_path);
+      report_seconds(
+          "startup", "snapshot save", store.size(), clock::now() - start);
+    }
+
+    unsigned cores = std::max(1u, std::thread::hardware_concurrency());
+    for (unsigned num_threads = 1;; num_threads = cores) {
+      std::string threads = " x" + std::to_string(num_threads);
+      {
+        kvstore store;
+        clock::time_point start = clock::now();
+        store.bulk_load_file(text_path, num_threads);
+        report_seconds("startup",
+                       "bulk text" + threads,
+                       store.size(),
+                       clock::now() - start);
+      }
+      {
+        kvstore store;
+        clock::time_point start = clock::now();
+        snapshot::load(snapshot_path, store, num_threads);
+        report_seconds("startup",
+                       "snapshot load" + threads,
+                       store.size(),
+                       clock::now() - start);
+      }
+      if (num_threads == cores) {
+        break;
+      }
+    }
+    std::remove(text_path.c_str());
+    std::remove(snapshot_path.c_str());
+  }
+
+  // Compare GET latency on an unbounded store with a store capped at half
+  // of the data, with and without writes forcing inline evictions. Keys are
+  // users.txt repeated scale times, read in a fixed pseudo-random order.
+  void bench_eviction() {
+    std::vector<std::string> users, keys;
+    std::ifstream users_file("src/users.txt");
+    std::string line;
+    while (getline(users_file, line)) {
+      users.push_back(line.substr(0, line.find(' ')));
+    }
+    for (int copy = 0; copy < scale; copy++) {
+      for (size_t i = 0; i < users.size(); i++) {
+        keys.push_back(users[i] + '#' + std::to_string(copy));
+      }
+    }
+    if (keys.empty()) {
+      std::cerr << "eviction: unable to read src/users.txt" << std::endl;
+      return;
+    }
+    const std::string value = "/L,-W6COHMT5/!$J*'";
+
+    for (int bounded = 0; bounded <= 1; bounded++) {
+      kvstore store;
+      std::string variant = bounded ? "limit 50%" : "unbounded";
+      for (size_t i = 0; i < keys.size(); i++) {
+        store.put(keys[i], value);
+      }
+      if (bounded) {
+        store.set_memory_limit(store.cache_usage().bytes / 2);
+        store.put(keys[0], value); // Evict down to the limit in each shard
+        for (size_t i = 0; i < keys.size(); i++) {
+          store.put(keys[i], value);
+        }
+      }
+
+      uint64_t random = 88172645463325252ull;
+      std::string found;
+      measure("eviction", variant + " get", [&]() {
+        random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+        store.get(keys[random % keys.size()], found);
+      });
+      size_t op = 0;
+      measure("eviction", variant + " get+10% put", [&]() {
+        random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+        if (++op % 10 == 0) {
+          store.put(keys[random % keys.size()], value);
+        } else {
+          store.get(keys[random % keys.size()], found);
+        }
+      });
+
+      kvstore::cache_stats stats = store.cache_usage();
+      std::cout << std::left << std::setw(14) << "eviction" << std::setw(22)
+                << ("  " + variant) << std::right << std::fixed
+                << std::setprecision(3) << std::setw(12) << stats.hit_ratio()
+                << " hit ratio" << std::setw(12) << stats.evictions
+                << " evictions" << std::endl;
+    }
+  }
+
+  // Compare writes on a store with and without the ordered index, which
+  // costs a skiplist update for every key added or removed but nothing for
+  // a value replaced, then time prefix scans. Keys are users.txt repeated
+  // scale times.
+  void bench_index() {
+    std::vector<std::string> keys;
+    std::ifstream users_file("src/users.txt");
+    std::string line;
+    while (getline(users_file, line)) {
+      keys.push_back(line.substr(0, line.find(' ')));
+    }
+    size_t users = keys.size();
+    for (int copy = 1; copy < scale; copy++) {
+      for (size_t i = 0; i < users; i++) {
+        keys.push_back(keys[i] + '#' + std::to_string(copy));
+      }
+    }
+    if (keys.empty()) {
+      std::cerr << "index: unable to read src/users.txt" << std::endl;
+      return;
+    }
+    const std::string value = "/L,-W6COHMT5/!$J*'";
+
+    for (int indexed = 0; indexed <= 1; indexed++) {
+      kvstore store;
+      std::string variant = indexed ? "ordered" : "hash only";
+      if (indexed) {
+        store.enable_ordered_index();
+      }
+      clock::time_point start = clock::now();
+      for (size_t i = 0; i < keys.size(); i++) {
+        store.put(keys[i], value);
+      }
+      report("index", variant + " load", keys.size(), clock::now() - start, 0);
+
+      uint64_t random = 88172645463325252ull;
+      measure("index", variant + " put replace", [&]() {
+        random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+        store.put(keys[random % keys.size()], value);
+      });
+      measure("index", variant + " del+put", [&]() {
+        random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+        const std::string &key = keys[random % keys.size()];
+        store.del(key);
+        store.put(key, value);
+      });
+      std::cout << std::left << std::setw(14) << "index" << std::setw(22)
+                << ("  " + variant) << std::right << std::fixed
+                << std::setprecision(1) << std::setw(12)
+                << double(store.memory().used_bytes) / keys.size()
+                << " bytes/key" << std::endl;
+
+      if (indexed) {
+        const char *prefixes[] = {"zad", "tui", "a"};
+        size_t op = 0;
+        std::string cursor;
+        measure("index", "scan 100", [&]() {
+          std::string_view prefix = prefixes[op++ % 3];
+          store.scan(prefix, "", 100, [&](std::string_view key) {
+            cursor = key;
+          });
+        });
+      }
+    }
+  }
+
+  // Value at fraction p of sorted samples, in microseconds
+  static double percentile(const std::vector<uint32_t> &sorted, double p) {
+    return sorted.empty() ? 0 : sorted[size_t(p * (sorted.size() - 1))] / 1e3;
+  }
+
+  // Compare GET latency while keys expire with a store whose keys outlive
+  // the run. A reaper thread calls expire every 10 ms, as the server's timer
+  // does. Keys are users.txt repeated scale times and expire uniformly at
+  // 10M per minute, so -s 100 expires 10M keys over a minute.
+  void bench_expiry() {
+    std::vector<std::string> users, keys;
+    std::ifstream users_file("src/users.txt");
+    std::string line;
+    while (getline(users_file, line)) {
+      users.push_back(line.substr(0, line.find(' ')));
+    }
+    for (int copy = 0; copy < scale; copy++) {
+      for (size_t i = 0; i < users.size(); i++) {
+        keys.push_back(users[i] + '#' + std::to_string(copy));
+      }
+    }
+    if (keys.empty()) {
+      std::cerr << "expiry: unable to read src/users.txt" << std::endl;
+      return;
+    }
+    const std::string value = "/L,-W6COHMT5/!$J*'";
+    const uint64_t window_ms = keys.size() * 60000 / 10000000 + 1;
+
+    for (int expiring = 0; expiring <= 1; expiring++) {
+      kvstore store;
+      store.reserve(keys.size());
+      uint64_t random = 88172645463325252ull;
+      for (size_t i = 0; i < keys.size(); i++) {
+        random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+        uint64_t ttl = expiring ? random % window_ms + 1 : 3600 * 1000;
+        store.put(keys[i], value, std::chrono::milliseconds(ttl));
+      }
+
+      std::atomic<bool> done(false);
+      clock::duration reaping_time(0); // Spent inside expire
+      std::thread reaper([&]() {
+        while (!done) {
+          clock::time_point begin = clock::now();
+          store.expire();
+          reaping_time += clock::now() - begin;
+          std::this_thread::sleep_for(std::chrono::milliseconds(10));
+        }
+      });
+
+      // Read for as long as keys take to expire, timing every eighth get
+      std::vector<uint32_t> samples;
+      std::string found;
+      size_t gets = 0;
+      clock::time_point start = clock::now();
+      clock::time_point end = start + std::chrono::milliseconds(window_ms);
+      for (clock::time_point now = start; now < end; gets++) {
+        random ^= random << 13, random ^= random >> 7, random ^= random << 17;
+        const std::string &key = keys[random % keys.size()];
+        if (gets % 8 == 0) {
+          now = clock::now();
+          store.get(key, found);
+          clock::duration latency = clock::now() - now;
+          samples.push_back(
+              std::chrono::duration_cast<std::chrono::nanoseconds>(latency)
+                  .count());
+        } else {
+          store.get(key, found);
+        }
+      }
+      while (expiring && store.size() > 0 &&
+             clock::now() < end + std::chrono::seconds(10)) {
+        std::this_thread::sleep_for(std::chrono::milliseconds(10));
+      }
+      clock::duration elapsed = clock::now() - start;
+      done = true;
+      reaper.join();
+
+      std::sort(samples.begin(), samples.end());
+      uint64_t expired = store.cache_usage().expirations;
+      std::string variant = expiring ? "expiring" : "no expiry";
+      std::cout << std::left << std::setw(14) << "expiry" << std::setw(22)
+                << (variant + " get") << std::right << std::fixed
+                << std::setprecision(2) << std::setw(10)
+                << percentile(samples, 0.5) << " p50 us" << std::setw(10)
+                << percentile(samples, 0.99) << " p99 us" << std::setw(10)
+                << percentile(samples, 0.999) << " p99.9 us" << std::endl;
+      if (expiring) {
+        // The reaper keeps pace with the keys' deadlines; its capacity is
+        // what it could reap if it ran flat out
+        double seconds = std::chrono::duration<double>(elapsed).count();
+        double busy = std::chrono::duration<double>(reaping_time).count();
+        std::cout << std::left << std::setw(14) << "expiry" << std::setw(22)
+                  << (std::to_string(keys.size()) + " keys") << std::right
+                  << std::setprecision(1) << std::setw(12)
+                  << expired / seconds << " expired/s" << std::setw(12)
+                  << (busy > 0 ? expired / busy : 0) << " capacity/s"
+                  << std::setw(10) << std::setprecision(2) << seconds
+                  << " s" << std::endl;
+      }
+    }
+  }
+
+  // Run iterations operations on each of num_threads threads against store:
+  // a get for each read, and a put, or a del one time in ten, for each
+  // write. Every thousandth operation also reads size. Keys and operation
+  // types are drawn before the clock starts. Returns the wall time.
+  clock::duration run_store_mix(kvstore &store,
+                                const std::vector<std::string> &keys,
+                                const key_chooser &chooser,
+                                unsigned num_threads,
+                                int read_percent) {
+    struct op {
+      uint32_t key;
+      uint8_t roll; // Below read_percent reads; 0-9 past it deletes
+    };
+    std::vector<std::vector<op>> plans(num_threads);
+    for (unsigned t = 0; t < num_threads; t++) {
+      std::mt19937_64 random(t + 1);
+      std::uniform_int_distribution<int> percent(0, 99);
+      for (int i = 0; i < iterations; i++) {
+        plans[t].push_back({uint32_t(chooser.next(random)),
+                            uint8_t(percent(random))});
+      }
+    }
+
+    std::atomic<unsigned> ready(0);
+    std::atomic<bool> go(false);
+    std::vector<std::thread> threads;
+    for (unsigned t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t]() {
+        std::string value;
+        ready++;
+        while (!go) {
+          std::this_thread::yield();
+        }
+        const std::vector<op> &plan = plans[t];
+        for (size_t i = 0; i < plan.size(); i++) {
+          const std::string &key = keys[plan[i].key];
+          if (plan[i].roll < read_percent) {
+            store.get(key, value);
+          } else if (plan[i].roll - read_percent < 10) {
+            store.del(key);
+          } else {
+            store.put(key, key);
+          }
+          if (i % 1000 == 0) {
+            store.size();
+          }
+        }
+      });
+    }
+    while (ready < num_threads) {
+      std::this_thread::yield();
+    }
+    clock::time_point start = clock::now();
+    go = true;
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+    return clock::now() - start;
+  }
+
+  // Print one scaling result: throughput, speedup over base ops/s, and the
+  // share of thread time spent waiting for shard locks
+  static void report_scaling(const std::string &variant,
+                             size_t ops,
+                             unsigned num_threads,
+                             clock::duration elapsed,
+                             double base,
+                             const contended_mutex::stats &locks) {
+    double seconds = std::chrono::duration<double>(elapsed).count();
+    double rate = seconds > 0 ? ops / seconds : 0;
+    std::cout << std::left << std::setw(14) << "scaling" << std::setw(30)
+              << variant << std::right << std::fixed << std::setprecision(1)
+              << std::setw(12) << rate << " ops/s" << std::setprecision(2)
+              << std::setw(7) << (base > 0 ? rate / base : 1) << "x"
+              << std::setprecision(1) << std::setw(7)
+              << 100 * locks.wait_ns / (seconds * 1e9 * num_threads + 1)
+              << "% wait" << std::setprecision(3) << std::setw(8)
+              << 100 * locks.contention_ratio() << "% contended" << std::endl;
+  }
+
+  // Drive kvstore directly, without networking, to find how it scales with
+  // threads for several shard counts, then vary the read share, key skew,
+  // and key count at the default shard count, and time clear. Keys number
+  // 10000 times scale; threads double up to -t.
+  void bench_scaling() {
+    size_t num_keys = size_t(10000) * scale;
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < num_keys * 10; i++) {
+      keys.push_back(key_chooser::key(i));
+    }
+    std::vector<unsigned> thread_counts;
+    for (int t = 1; t < max_threads; t *= 2) {
+      thread_counts.push_back(t);
+    }
+    thread_counts.push_back(max_threads);
+
+    // Run one configuration on a store preloaded with its keys
+    auto run = [&](int num_shards,
+                   size_t key_count,
+                   unsigned num_threads,
+                   int read_percent,
+                   double zipf,
+                   double base) {
+      kvstore store(num_shards);
+      for (size_t i = 0; i < key_count; i++) {
+        store.put(keys[i], keys[i]);
+      }
+      key_chooser chooser(key_count, zipf);
+      contended_mutex::stats before = store.lock_usage();
+      clock::duration elapsed =
+          run_store_mix(store, keys, chooser, num_threads, read_percent);
+      contended_mutex::stats locks = store.lock_usage();
+      locks.acquisitions -= before.acquisitions;
+      locks.contentions -= before.contentions;
+      locks.wait_ns -= before.wait_ns;
+
+      std::ostringstream variant;
+      variant << "s" << num_shards << " t" << num_threads << " k"
+              << key_count << " r" << read_percent
+              << (zipf > 0 ? " zipf" : " uniform");
+      size_t ops = size_t(iterations) * num_threads;
+      report_scaling(variant.str(), ops, num_threads, elapsed, base, locks);
+      return ops / std::chrono::duration<double>(elapsed).count();
+    };
+
+    const int shard_counts[] = {1, 16, 100, 1024};
+    for (int num_shards : shard_counts) {
+      double base = 0;
+      for (unsigned num_threads : thread_counts) {
+        double rate = run(num_shards, num_keys, num_threads, 90, 0, base);
+        base = base ? base : rate;
+      }
+    }
+
+    const int read_percents[] = {100, 90, 50, 0};
+    for (double zipf : {0.0, 0.99}) {
+      for (int read_percent : read_percents) {
+        run(100, num_keys, max_threads, read_percent, zipf, 0);
+      }
+    }
+
+    for (size_t key_count : {size_t(1000), num_keys * 10}) {
+      run(100, key_count, max_threads, 90, 0, 0);
+    }
+
+    for (int num_shards : shard_counts) {
+      kvstore store(num_shards);
+      for (size_t i = 0; i < num_keys; i++) {
+        store.put(keys[i], keys[i]);
+      }
+      std::string shards = " s" + std::to_string(num_shards);
+      measure("scaling", "size" + shards, [&]() { store.size(); });
+      clock::time_point start = clock::now();
+      store.clear(); // Nodes are freed later, by epoch reclamation
+      std::cout << std::left << std::setw(14) << "scaling" << std::setw(30)
+                << "clear" + shards << std::right << std::fixed
+                << std::setprecision(1) << std::setw(12)
+                << std::chrono::duration<double, std::micro>(clock::now() -
+                                                             start)
+                       .count()
+                << " us" << std::endl;
+    }
+  }
+
+public:
+  Microbench(int iterations, int scale, int max_threads)
+      : iterations(iterations), scale(scale), max_threads(max_threads) {}
+
+  int run(const std::vector<std::string> &names) {
+    std::map<std::string, std::function<void()>> benchmarks = {
+        {"parse", [this]() { bench_parse(); }},
+        {"delimiters", [this]() { bench_delimiters(); }},
+        {"get", [this]() { bench_get(); }},
+        {"pipeline", [this]() { bench_pipeline(); }},
+        {"batch", [this]() { bench_batch(); }},
+        {"memory", [this]() { bench_memory(); }},
+        {"pool", [this]() { bench_pool(); }},
+        {"wal", [this]() { bench_wal(); }},
+        {"startup", [this]() { bench_startup(); }},
+        {"eviction", [this]() { bench_eviction(); }},
+        {"expiry", [this]() { bench_expiry(); }},
+        {"index", [this]() { bench_index(); }},
+        {"scaling", [this]() { bench_scaling(); }},
+    };
+
+    std::vector<std::string> selected = names;
+    if (selected.empty()) {
+      for (auto it = benchmarks.begin(); it != benchmarks.end(); it++) {
+        selected.push_back(it->first);
+      }
+    }
+
+    for (size_t i = 0; i < selected.size(); i++) {
+      auto it = benchmarks.find(selected[i]);
+      if (it == benchmarks.end()) {
+        std::cerr << "Unknown benchmark: " << selected[i] << std::endl;
+        return 1;
+      }
+      it->second();
+    }
+    return 0;
+  }
+};
+
+int main(int argc, char *argv[]) {
+  int iterations = 100000;
+  int scale = 10;
+  int max_threads =
+      std::max(4, 2 * int(std::thread::hardware_concurrency()));
+  std::vector<std::string> names;
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg == "-n" && i + 1 < argc) {
+      iterations = atoi(argv[++i]);
+    } else if (arg == "-t" && i + 1 < argc) {
+      max_threads = std::max(1, atoi(argv[++i]));
+    } else if (arg == "-s" && i + 1 < argc) {
+      scale = std::max(1, atoi(argv[++i]));
+    } else if (arg == "-h" || arg == "--help") {
+      std::cerr << "Usage: microbench [-n iterations] [-s scale] [-t threads]\n"
+                   "                  [benchmark...]"
+                << std::endl;
+      return 0;
+    } else {
+      names.push_back(arg);
+    }
+  }
+
+  Microbench bench(iterations, scale, max_threads);
+  return bench.run(names);
+}
+
+#endif
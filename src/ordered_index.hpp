@@ -0,0 +1,226 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The ordered_index class is a skiplist of keys in byte order, so keys can
+ * be listed by prefix or from a position without visiting the rest. It
+ * allows one writer at a time, which the caller serializes with its own
+ * lock, and any number of readers that take no lock at all.
+ *
+ * A writer builds an entry completely before linking it, bottom level
+ * first, and unlinks an entry from the top level down before retiring it.
+ * A reader inside an epoch guard therefore only ever sees whole entries,
+ * and one standing on an unlinked entry still follows its links back into
+ * the list. Entries are allocated from the caller's slab and retired to its
+ * retire_list, so they are freed under the same lock as every other change.
+ */
+
+#ifndef ORDERED_INDEX_H
+#define ORDERED_INDEX_H
+
+#include "epoch.hpp"
+#include "slab.hpp"
+
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <string_view>
+
+class ordered_index {
+private:
+  // Levels are promoted with probability 1/4, enough for 4^16 keys
+  static constexpr int MAX_HEIGHT = 16;
+
+  // An entry's links to the next entry on each of its levels follow the
+  // header in the same allocation, then the key bytes
+  struct entry {
+    uint32_t key_length;
+    uint32_t height;
+
+    std::atomic<entry *> *links() {
+      return reinterpret_cast<std::atomic<entry *> *>(this + 1);
+    }
+
+    const std::atomic<entry *> *links() const {
+      return reinterpret_cast<const std::atomic<entry *> *>(this + 1);
+    }
+
+    std::string_view key() const {
+      return std::string_view(reinterpret_cast<const char *>(links() + height),
+                              key_length);
+    }
+
+    size_t bytes() const {
+      return sizeof(entry) + height * sizeof(std::atomic<entry *>) +
+             key_length;
+    }
+
+    static entry *create(slab &allocator, std::string_view key, int height) {
+      void *memory = allocator.allocate(
+          sizeof(entry) + height * sizeof(std::atomic<entry *>) + key.size());
+      entry *e = new (memory) entry{uint32_t(key.size()), uint32_t(height)};
+      for (int level = 0; level < height; level++) {
+        new (&e->links()[level]) std::atomic<entry *>(nullptr);
+      }
+      char *bytes = reinterpret_cast<char *>(e->links() + height);
+      std::memcpy(bytes, key.data(), key.size());
+      return e;
+    }
+  };
+
+  slab &allocator;
+  epoch::retire_list &retired;
+  std::atomic<entry *> head[MAX_HEIGHT];
+  uint64_t random_state;
+  size_t count = 0;
+
+  // Return an entry to its slab; runs under the writer's lock
+  static void delete_entry(void *ptr) {
+    entry *e = static_cast<entry *>(ptr);
+    slab::release(e, e->bytes());
+  }
+
+  std::atomic<entry *> *link(entry *e, int level) {
+    return e ? &e->links()[level] : &head[level];
+  }
+
+  const std::atomic<entry *> *link(const entry *e, int level) const {
+    return e ? &e->links()[level] : &head[level];
+  }
+
+  int random_height() {
+    // xorshift64; the writer's lock guards the state
+    random_state ^= random_state << 13;
+    random_state ^= random_state >> 7;
+    random_state ^= random_state << 17;
+    int height = 1;
+    for (uint64_t bits = random_state;
+         height < MAX_HEIGHT && (bits & 3) == 0;
+         bits >>= 2) {
+      height++;
+    }
+    return height;
+  }
+
+  // Fill preds with the last entry before key on every level, nullptr
+  // standing for the head. Writer only.
+  void predecessors(std::string_view key, entry **preds) {
+    entry *e = nullptr;
+    for (int level = MAX_HEIGHT - 1; level >= 0; level--) {
+      entry *next = link(e, level)->load(std::memory_order_relaxed);
+      while (next && next->key() < key) {
+        e = next;
+        next = link(e, level)->load(std::memory_order_relaxed);
+      }
+      preds[level] = e;
+    }
+  }
+
+public:
+  // A reader's position in the index, valid only inside an epoch guard or
+  // while the writer's lock is held
+  class cursor {
+  private:
+    const entry *at;
+
+  public:
+    explicit cursor(const entry *at) : at(at) {}
+
+    bool valid() const { return at != nullptr; }
+
+    std::string_view key() const { return at->key(); }
+
+    void next() { at = at->links()[0].load(std::memory_order_acquire); }
+  };
+
+  // seed varies the tower heights between indexes
+  ordered_index(slab &allocator, epoch::retire_list &retired, uint64_t seed)
+      : allocator(allocator), retired(retired), random_state(seed | 1) {
+    for (int level = 0; level < MAX_HEIGHT; level++) {
+      head[level].store(nullptr, std::memory_order_relaxed);
+    }
+  }
+
+  ordered_index(const ordered_index &) = delete;
+  ordered_index &operator=(const ordered_index &) = delete;
+
+  // Only valid once no readers remain
+  ~ordered_index() {
+    entry *e = head[0].load(std::memory_order_relaxed);
+    while (e) {
+      entry *next = e->links()[0].load(std::memory_order_relaxed);
+      delete_entry(e);
+      e = next;
+    }
+  }
+
+  // Add key if it is not already present. Writer only.
+  void insert(std::string_view key) {
+    entry *preds[MAX_HEIGHT];
+    predecessors(key, preds);
+    entry *found = link(preds[0], 0)->load(std::memory_order_relaxed);
+    if (found && found->key() == key) {
+      return;
+    }
+    int height = random_height();
+    entry *fresh = entry::create(allocator, key, height);
+    for (int level = 0; level < height; level++) {
+      fresh->links()[level].store(
+          link(preds[level], level)->load(std::memory_order_relaxed),
+          std::memory_order_relaxed);
+    }
+    for (int level = 0; level < height; level++) {
+      link(preds[level], level)->store(fresh, std::memory_order_release);
+    }
+    count++;
+  }
+
+  // Remove key if present, retiring its entry. Writer only.
+  void erase(std::string_view key) {
+    entry *preds[MAX_HEIGHT];
+    predecessors(key, preds);
+    entry *found = link(preds[0], 0)->load(std::memory_order_relaxed);
+    if (!found || found->key() != key) {
+      return;
+    }
+    for (int level = int(found->height) - 1; level >= 0; level--) {
+      link(preds[level], level)->store(
+          found->links()[level].load(std::memory_order_relaxed),
+          std::memory_order_release);
+    }
+    retired.retire(found, delete_entry);
+    count--;
+  }
+
+  // Remove every key, retiring their entries. Writer only.
+  void clear() {
+    entry *e = head[0].load(std::memory_order_relaxed);
+    for (int level = 0; level < MAX_HEIGHT; level++) {
+      head[level].store(nullptr, std::memory_order_release);
+    }
+    while (e) {
+      entry *next = e->links()[0].load(std::memory_order_relaxed);
+      retired.retire(e, delete_entry);
+      e = next;
+    }
+    count = 0;
+  }
+
+  // The first key not less than key
+  cursor seek(std::string_view key) const {
+    const entry *e = nullptr;
+    const entry *next = nullptr;
+    for (int level = MAX_HEIGHT - 1; level >= 0; level--) {
+      next = link(e, level)->load(std::memory_order_acquire);
+      while (next && next->key() < key) {
+        e = next;
+        next = link(e, level)->load(std::memory_order_acquire);
+      }
+    }
+    return cursor(next);
+  }
+
+  // Keys in the index. Writer only.
+  size_t size() const { return count; }
+};
+
+#endif
@@ -0,0 +1,699 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * Primary-replica replication between kvservers. A primary's
+ * replication_source accepts replicas on a port of its own and runs a
+ * replication_stream for each. On a replica server, a replica connects to
+ * it and applies what it is sent to the server's store, which serves reads
+ * and refuses clients' writes.
+ *
+ * A replica that connects for the first time, or whose place in the
+ * primary's replication_log has been dropped, is sent a full sync: the
+ * stream reads the feed's tail, then walks the store one shard at a time
+ * without blocking writers, and then sends every record after that tail.
+ * The feed only records a change once it is visible, so the walk sees
+ * every change up to the tail, and replaying later changes over it, some
+ * of which the walk may also have seen, leaves the replica exactly as the
+ * primary was. The stream pins its place in the backlog from the tail
+ * until it has caught up, so a walk slower than the backlog lasts still
+ * finishes. A replica that reconnects to the same primary run resumes
+ * from the last record it applied, if the backlog still holds it; a
+ * stream that falls behind the backlog otherwise is closed, counted, and
+ * logged, and its replica resyncs.
+ *
+ * After the snapshot, each frame carries every record appended while the
+ * previous frame was being written, and frames are sent without waiting
+ * for the replica, so the stream is batched and pipelined. The replica
+ * acknowledges the newest record it has applied after each read, and the
+ * primary measures each replica's lag as records not yet acknowledged and
+ * as the time from sending a frame to its acknowledgement.
+ *
+ * The replica opens with a hello, and then each side sends the other only
+ * one kind of message:
+ *
+ *   hello:   magic (8) | run id (8) | sequence (8)
+ *   frame:   kind (1) | sequence (8) | head (8) | length (4) | payload
+ *   ack:     sequence (8)
+ *
+ * with big-endian integers. The hello names the primary run and the record
+ * the replica has applied up to, or zeros. A FULL_SYNC frame's payload is
+ * the run id, and the replica clears its store; SNAPSHOT and RECORDS
+ * frames carry records in the write-ahead log's format. A RECORDS frame's
+ * sequence is its newest record's, and every frame's head is the newest
+ * record the primary had when it was sent.
+ */
+
+#ifndef REPLICATION_H
+#define REPLICATION_H
+
+#include "kvstore.hpp"
+#include "message.hpp"
+#include "replication_log.hpp"
+#include "wal.hpp"
+
+#include <boost/asio.hpp>
+#include <atomic>
+#include <chrono>
+#include <cstring>
+#include <deque>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+namespace replication {
+
+using tcp = boost::asio::ip::tcp;
+using clock = std::chrono::steady_clock;
+
+constexpr char MAGIC[8] = {'K', 'V', 'R', 'E', 'P', 'L', '0', '1'};
+constexpr size_t HELLO_SIZE = 24;
+constexpr size_t FRAME_HEADER_SIZE = 21;
+constexpr size_t ACK_SIZE = 8;
+constexpr size_t MAX_FRAME = 256 << 10; // Payload bytes a frame aims for
+
+enum frame_kind : uint8_t {
+  FRAME_FULL_SYNC = 1,
+  FRAME_SNAPSHOT = 2,
+  FRAME_RECORDS = 3,
+};
+
+inline void write_u64(char *out, uint64_t value) {
+  binary_header::write_u32(out, uint32_t(value >> 32));
+  binary_header::write_u32(out + 4, uint32_t(value));
+}
+
+inline uint64_t read_u64(const char *in) {
+  return uint64_t(binary_header::read_u32(in)) << 32 |
+         binary_header::read_u32(in + 4);
+}
+
+} // namespace replication
+
+class replication_source;
+
+// Sends one replica a full sync or the records after its place, then every
+// later record as it is appended. Handlers run on the socket's strand.
+class replication_stream
+    : public std::enable_shared_from_this<replication_stream> {
+private:
+  using tcp = replication::tcp;
+  using clock = replication::clock;
+  static constexpr size_t MAX_UNACKED = 1024; // Frames timed for lag
+
+  tcp::socket socket_;
+  replication_source &source;
+  kvstore &store;
+  replication_log &feed;
+  char hello[replication::HELLO_SIZE];
+  char ack[replication::ACK_SIZE];
+  std::string out;      // The frame being built or written
+  std::string scratch;  // A snapshot value with its expiry
+  uint64_t sent = 0;    // Newest record sent, or the snapshot's tail
+  int next_shard = -1;  // Shard the snapshot walks next, or -1 if done
+  bool announce = false; // Send a RECORDS frame even if it is empty
+  bool pinned = false;   // sent is pinned in the feed until caught up
+  std::atomic<bool> closed{false};
+  // Sequence and send time of RECORDS frames not yet acknowledged
+  std::deque<std::pair<uint64_t, clock::time_point>> unacked;
+
+  void start_frame() { out.assign(replication::FRAME_HEADER_SIZE, '\0'); }
+
+  void finish_frame(replication::frame_kind kind, uint64_t sequence) {
+    out[0] = char(kind);
+    replication::write_u64(&out[1], sequence);
+    replication::write_u64(&out[9], feed.tail());
+    binary_header::write_u32(&out[17],
+                             out.size() - replication::FRAME_HEADER_SIZE);
+  }
+
+  void read_hello();
+  void full_sync();
+  void send_snapshot();
+  void stream();
+  void write_frame(bool timed);
+  void read_ack();
+  void close();
+
+public:
+  std::atomic<uint64_t> acked{0}; // Newest record the replica applied
+  std::atomic<uint64_t> lag_us{0}; // Send to acknowledgement, last frame
+  std::atomic<bool> syncing{false};
+  std::string address; // The replica's, for reports
+
+  replication_stream(boost::asio::io_service &io_service,
+                     replication_source &source,
+                     kvstore &store,
+                     replication_log &feed)
+      : socket_(boost::asio::make_strand(io_service)),
+        source(source),
+        store(store),
+        feed(feed) {}
+
+  tcp::socket &socket() { return socket_; }
+
+  void start() {
+    boost::system::error_code ignored;
+    socket_.set_option(tcp::no_delay(true), ignored);
+    tcp::endpoint peer = socket_.remote_endpoint(ignored);
+    address = peer.address().to_string() + ':' + std::to_string(peer.port());
+    read_hello();
+  }
+
+  bool open() const { return !closed.load(); }
+};
+
+// Accepts replicas on a port of its own and streams the store's changes to
+// each. The store must have feed attached before it serves writes.
+class replication_source {
+private:
+  friend class Test;
+  friend class replication_stream;
+  using tcp = replication::tcp;
+
+  boost::asio::io_service &io_service;
+  tcp::acceptor acceptor;
+  kvstore &store;
+  replication_log &feed;
+  std::mutex lock; // Guards streams
+  std::vector<std::weak_ptr<replication_stream>> streams;
+  std::atomic<uint64_t> full_syncs{0};
+  std::atomic<uint64_t> resumes{0};
+  std::atomic<uint64_t> overruns{0}; // Streams that fell behind the backlog
+
+  void start_accept() {
+    std::shared_ptr<replication_stream> stream =
+        std::make_shared<replication_stream>(io_service, *this, store, feed);
+    acceptor.async_accept(
+        stream->socket(),
+        [this, stream](const boost::system::error_code &error) {
+          if (error == boost::asio::error::operation_aborted) {
+            return; // The source is closing
+          }
+          if (!error) {
+            stream->start();
+            std::lock_guard<std::mutex> guard(lock);
+            std::erase_if(streams,
+                          [](const std::weak_ptr<replication_stream> &s) {
+                            return s.expired();
+                          });
+            streams.push_back(stream);
+          }
+          start_accept();
+        });
+  }
+
+public:
+  // Serve replicas on port; port 0 picks a free one
+  replication_source(boost::asio::io_service &io_service,
+                     unsigned short port,
+                     kvstore &store,
+                     replication_log &feed)
+      : io_service(io_service),
+        acceptor(io_service, tcp::endpoint(tcp::v4(), port)),
+        store(store),
+        feed(feed) {
+    start_accept();
+  }
+
+  unsigned short port() const { return acceptor.local_endpoint().port(); }
+
+  // "name value" lines: the newest record, then each connected replica's
+  // acknowledged record, lag in records and microseconds, and whether it
+  // is still receiving a snapshot
+  std::string report() {
+    uint64_t tail = feed.tail();
+    std::vector<std::shared_ptr<replication_stream>> live;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      for (std::weak_ptr<replication_stream> &s : streams) {
+        std::shared_ptr<replication_stream> stream = s.lock();
+        if (stream && stream->open()) {
+          live.push_back(std::move(stream));
+        }
+      }
+    }
+    std::string out = "replication_sequence " + std::to_string(tail) +
+                      "\nreplicas " + std::to_string(live.size()) +
+                      "\nfull_syncs_total " +
+                      std::to_string(full_syncs.load()) +
+                      "\nresumes_total " + std::to_string(resumes.load()) +
+                      "\nbacklog_overruns_total " +
+                      std::to_string(overruns.load()) + '\n';
+    for (size_t i = 0; i < live.size(); i++) {
+      replication_stream &s = *live[i];
+      uint64_t acked = s.acked.load();
+      std::string name = "replica_" + std::to_string(i) + '_';
+      out += name + "address " + s.address + '\n';
+      out += name + "syncing " + std::to_string(s.syncing.load()) + '\n';
+      out += name + "acked_sequence " + std::to_string(acked) + '\n';
+      out += name + "lag_records " +
+             std::to_string(tail > acked ? tail - acked : 0) + '\n';
+      out += name + "lag_us " + std::to_string(s.lag_us.load()) + '\n';
+    }
+    return out;
+  }
+};
+
+inline void replication_stream::read_hello() {
+  std::shared_ptr<replication_stream> self = shared_from_this();
+  boost::asio::async_read(
+      socket_,
+      boost::asio::buffer(hello),
+      [self](const boost::system::error_code &error, size_t) {
+        if (error ||
+            std::memcmp(self->hello,
+                        replication::MAGIC,
+                        sizeof(replication::MAGIC)) != 0) {
+          self->close();
+          return;
+        }
+        uint64_t run_id = replication::read_u64(self->hello + 8);
+        uint64_t sequence = replication::read_u64(self->hello + 16);
+        self->read_ack();
+        if (run_id == self->feed.run_id() && self->feed.retains(sequence)) {
+          self->source.resumes++;
+          self->sent = sequence;
+          self->acked = sequence;
+          self->stream();
+        } else {
+          self->full_sync();
+        }
+      });
+}
+
+// Announce a full sync, then walk the store from the feed's current tail
+inline void replication_stream::full_sync() {
+  source.full_syncs++;
+  syncing = true;
+  sent = feed.pin();
+  pinned = true;
+  next_shard = 0;
+  start_frame();
+  char id[8];
+  replication::write_u64(id, feed.run_id());
+  out.append(id, sizeof(id));
+  finish_frame(replication::FRAME_FULL_SYNC, sent);
+  write_frame(false);
+}
+
+// Send shards' pairs until a frame is full or the walk is done
+inline void replication_stream::send_snapshot() {
+  start_frame();
+  int shards = store.shard_count();
+  while (next_shard < shards &&
+         out.size() < replication::FRAME_HEADER_SIZE + replication::MAX_FRAME) {
+    // A walk that raced a rehash is redone from the shard's start
+    size_t mark = out.size();
+    do {
+      out.resize(mark);
+    } while (!store.visit_shard(
+        next_shard,
+        [&](std::string_view key, std::string_view value, uint64_t expires) {
+          if (!expires) {
+            wal::encode(out, wal::RECORD_PUT, key, value);
+            return;
+          }
+          // The expiry follows the value, in host order as the node keeps it
+          scratch.assign(value);
+          scratch.append(reinterpret_cast<const char *>(&expires), 8);
+          wal::encode(out, wal::RECORD_PUT_TTL, key, scratch);
+        }));
+    next_shard++;
+  }
+  if (next_shard == shards) {
+    next_shard = -1;
+    announce = true; // The replica is in sync once it has this tail
+  }
+  finish_frame(replication::FRAME_SNAPSHOT, sent);
+  write_frame(false);
+}
+
+// Send every record after sent, or wait for the next one to be appended
+inline void replication_stream::stream() {
+  if (closed) {
+    return;
+  }
+  start_frame();
+  uint64_t from = sent;
+  if (!feed.read(sent, out, replication::MAX_FRAME)) {
+    source.overruns++;
+    std::cerr << "replication: " << address
+              << " fell behind the backlog and will resync" << std::endl;
+    close();
+    return;
+  }
+  if (pinned) {
+    // Hold the place until the records after the snapshot are all sent
+    if (sent == from) {
+      feed.unpin(sent);
+      pinned = false;
+    } else {
+      feed.move_pin(from, sent);
+    }
+  }
+  if (sent == from && !announce) {
+    std::shared_ptr<replication_stream> self = shared_from_this();
+    feed.wait(sent, [self]() {
+      boost::asio::post(self->socket_.get_executor(),
+                        [self]() { self->stream(); });
+    });
+    return;
+  }
+  announce = false;
+  syncing = false;
+  finish_frame(replication::FRAME_RECORDS, sent);
+  write_frame(true);
+}
+
+// Write the frame in out, then continue the snapshot or the stream. A
+// timed frame is remembered until acknowledged, for measuring lag.
+inline void replication_stream::write_frame(bool timed) {
+  if (timed) {
+    unacked.emplace_back(sent, clock::now());
+    if (unacked.size() > MAX_UNACKED) {
+      unacked.pop_front();
+    }
+  }
+  std::shared_ptr<replication_stream> self = shared_from_this();
+  boost::asio::async_write(
+      socket_,
+      boost::asio::buffer(out),
+      [self](const boost::system::error_code &error, size_t) {
+        if (error) {
+          self->close();
+        } else if (self->next_shard >= 0) {
+          self->send_snapshot();
+        } else {
+          self->stream();
+        }
+      });
+}
+
+inline void replication_stream::read_ack() {
+  std::shared_ptr<replication_stream> self = shared_from_this();
+  boost::asio::async_read(
+      socket_,
+      boost::asio::buffer(ack),
+      [self](const boost::system::error_code &error, size_t) {
+        if (error) {
+          self->close();
+          return;
+        }
+        uint64_t sequence = replication::read_u64(self->ack);
+        self->acked = sequence;
+        clock::time_point sent_at;
+        bool timed = false;
+        while (!self->unacked.empty() &&
+               self->unacked.front().first <= sequence) {
+          sent_at = self->unacked.front().second;
+          timed = true;
+          self->unacked.pop_front();
+        }
+        if (timed) {
+          self->lag_us = std::chrono::duration_cast<std::chrono::microseconds>(
+                             clock::now() - sent_at)
+                             .count();
+        }
+        self->read_ack();
+      });
+}
+
+inline void replication_stream::close() {
+  closed = true;
+  if (pinned) {
+    feed.unpin(sent);
+    pinned = false;
+  }
+  boost::system::error_code ignored;
+  socket_.close(ignored);
+}
+
+// Follows a primary: connects to its replication port, applies the
+// snapshot and records it is sent to the store, and acknowledges them.
+// Reconnects after RETRY_INTERVAL whenever the connection fails, resuming
+// where it left off if the primary still can. The store should refuse
+// clients' writes, which would otherwise diverge from the primary.
+class replica {
+private:
+  friend class Test;
+  using tcp = replication::tcp;
+  using strand = boost::asio::strand<boost::asio::io_service::executor_type>;
+  static constexpr std::chrono::milliseconds RETRY_INTERVAL{200};
+  static constexpr size_t READ_SIZE = 64 << 10;
+
+  kvstore &store;
+  std::string host;
+  std::string port;
+  strand executor;
+  tcp::resolver resolver;
+  tcp::socket socket;
+  boost::asio::steady_timer retry;
+  uint64_t generation = 0; // Connection attempts; stale handlers bail out
+  char hello[replication::HELLO_SIZE];
+  char ack_out[replication::ACK_SIZE];
+  bool acking = false;      // An ack write is in flight
+  bool ack_due = false;     // applied moved on since it was sent
+  std::string incoming;     // Frame bytes not yet applied
+  uint64_t run_id = 0;      // Primary run the store is in sync with
+  uint64_t syncing_id = 0;  // Primary run of a full sync in progress
+  uint64_t applied = 0;     // Newest record applied from run_id
+
+  std::atomic<bool> connected{false};
+  std::atomic<uint64_t> applied_sequence{0};
+  std::atomic<uint64_t> head_sequence{0};
+  std::atomic<uint64_t> records_applied{0};
+  std::atomic<uint64_t> full_syncs{0};
+  std::atomic<uint64_t> connects{0};
+
+  void connect() {
+    uint64_t g = ++generation;
+    resolver.async_resolve(
+        host,
+        port,
+        [this, g](const boost::system::error_code &error,
+                  tcp::resolver::results_type endpoints) {
+          if (error == boost::asio::error::operation_aborted) {
+            return;
+          }
+          if (error) {
+            reconnect(g);
+            return;
+          }
+          boost::asio::async_connect(
+              socket,
+              endpoints,
+              [this, g](const boost::system::error_code &error,
+                        const tcp::endpoint &) {
+                if (error == boost::asio::error::operation_aborted) {
+                  return;
+                }
+                if (error) {
+                  reconnect(g);
+                  return;
+                }
+                start(g);
+              });
+        });
+  }
+
+  // Say where the store is, then apply whatever the primary sends
+  void start(uint64_t g) {
+    boost::system::error_code ignored;
+    socket.set_option(tcp::no_delay(true), ignored);
+    connected = true;
+    connects++;
+    incoming.clear();
+    acking = ack_due = false;
+    std::memcpy(hello, replication::MAGIC, sizeof(replication::MAGIC));
+    replication::write_u64(hello + 8, run_id);
+    replication::write_u64(hello + 16, run_id ? applied : 0);
+    boost::asio::async_write(
+        socket,
+        boost::asio::buffer(hello),
+        [this, g](const boost::system::error_code &error, size_t) {
+          if (error && error != boost::asio::error::operation_aborted) {
+            reconnect(g);
+          }
+        });
+    read(g);
+  }
+
+  void read(uint64_t g) {
+    size_t offset = incoming.size();
+    incoming.resize(offset + READ_SIZE);
+    socket.async_read_some(
+        boost::asio::buffer(&incoming[offset], READ_SIZE),
+        [this, g, offset](const boost::system::error_code &error, size_t n) {
+          if (error == boost::asio::error::operation_aborted ||
+              g != generation) {
+            return;
+          }
+          incoming.resize(offset + n);
+          if (error || !apply_frames()) {
+            reconnect(g);
+            return;
+          }
+          send_ack(g);
+          read(g);
+        });
+  }
+
+  // Apply every complete frame buffered. Returns false if the stream is
+  // malformed.
+  bool apply_frames() {
+    size_t offset = 0;
+    while (incoming.size() - offset >= replication::FRAME_HEADER_SIZE) {
+      const char *header = incoming.data() + offset;
+      uint64_t sequence = replication::read_u64(header + 1);
+      uint64_t head = replication::read_u64(header + 9);
+      size_t length = binary_header::read_u32(header + 17);
+      if (incoming.size() - offset <
+          replication::FRAME_HEADER_SIZE + length) {
+        break;
+      }
+      std::string_view payload(header + replication::FRAME_HEADER_SIZE,
+                               length);
+      switch (header[0]) {
+      case replication::FRAME_FULL_SYNC:
+        if (length != 8) {
+          return false;
+        }
+        store.clear();
+        run_id = 0; // Nothing to resume from until the snapshot is done
+        syncing_id = replication::read_u64(payload.data());
+        full_syncs++;
+        break;
+      case replication::FRAME_SNAPSHOT:
+        if (!apply_records(payload)) {
+          return false;
+        }
+        break;
+      case replication::FRAME_RECORDS:
+        if (!apply_records(payload)) {
+          return false;
+        }
+        if (syncing_id) {
+          run_id = syncing_id;
+          syncing_id = 0;
+        }
+        applied = sequence;
+        applied_sequence = sequence;
+        ack_due = true;
+        break;
+      default:
+        return false;
+      }
+      head_sequence = head;
+      offset += replication::FRAME_HEADER_SIZE + length;
+    }
+    incoming.erase(0, offset);
+    return true;
+  }
+
+  bool apply_records(std::string_view records) {
+    wal::record r;
+    bool intact = false;
+    size_t count = 0;
+    while (!records.empty()) {
+      size_t size = wal::parse(records, r, intact);
+      if (!size || !intact) {
+        return false;
+      }
+      store.apply_record(r.type, r.key, r.value);
+      records.remove_prefix(size);
+      count++;
+    }
+    records_applied += count;
+    return true;
+  }
+
+  // Acknowledge the newest record applied, unless an ack is in flight, in
+  // which case its completion sends this one
+  void send_ack(uint64_t g) {
+    if (acking || !ack_due) {
+      return;
+    }
+    acking = true;
+    ack_due = false;
+    replication::write_u64(ack_out, applied);
+    boost::asio::async_write(
+        socket,
+        boost::asio::buffer(ack_out),
+        [this, g](const boost::system::error_code &error, size_t) {
+          if (error == boost::asio::error::operation_aborted ||
+              g != generation) {
+            return;
+          }
+          acking = false;
+          if (error) {
+            reconnect(g);
+            return;
+          }
+          send_ack(g);
+        });
+  }
+
+  // Drop connection attempt g and try again after RETRY_INTERVAL
+  void reconnect(uint64_t g) {
+    if (g != generation) {
+      return; // Another handler of the same attempt got here first
+    }
+    generation++;
+    connected = false;
+    boost::system::error_code ignored;
+    socket.close(ignored);
+    retry.expires_after(RETRY_INTERVAL);
+    retry.async_wait([this](const boost::system::error_code &error) {
+      if (!error) {
+        connect();
+      }
+    });
+  }
+
+public:
+  // Follow the primary serving replicas at host:port
+  replica(boost::asio::io_service &io_service,
+          kvstore &store,
+          const std::string &host,
+          const std::string &port)
+      : store(store),
+        host(host),
+        port(port),
+        executor(boost::asio::make_strand(io_service)),
+        resolver(executor),
+        socket(executor),
+        retry(executor) {
+    boost::asio::post(executor, [this]() { connect(); });
+  }
+
+  replica(const replica &) = delete;
+  replica &operator=(const replica &) = delete;
+
+  // Newest record applied, numbered as on the primary
+  uint64_t applied_record() const { return applied_sequence.load(); }
+
+  bool is_connected() const { return connected.load(); }
+
+  // "name value" lines: whether the replica is connected and in sync, the
+  // newest record it has applied and how far that was behind the primary
+  // when the last frame was sent, and its totals
+  std::string report() const {
+    uint64_t applied = applied_sequence.load();
+    uint64_t head = head_sequence.load();
+    return "primary_connected " + std::to_string(connected.load()) +
+           "\nreplica_applied_sequence " + std::to_string(applied) +
+           "\nreplica_lag_records " +
+           std::to_string(head > applied ? head - applied : 0) +
+           "\nreplica_records_applied_total " +
+           std::to_string(records_applied.load()) +
+           "\nreplica_full_syncs_total " + std::to_string(full_syncs.load()) +
+           "\nreplica_connects_total " + std::to_string(connects.load()) +
+           '\n';
+  }
+};
+
+#endif
@@ -0,0 +1,202 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The replication_log class is the in-memory backlog of changes a primary
+ * streams to its replicas. The store appends a PUT, DEL, or CLEAR record,
+ * in the write-ahead log's format, once the change is applied and while its
+ * shard lock is still held, so records are numbered in the order the
+ * changes became visible. A stream reads every record after the last one
+ * it sent in one copy, so changes made while a frame is on the wire go out
+ * together in the next.
+ *
+ * Records are kept in chunks of about CHUNK_SIZE bytes, and whole chunks
+ * are dropped from the front once the backlog exceeds its capacity, so
+ * appending never moves older records. A replica that falls further behind
+ * than the backlog reaches must resynchronize from a snapshot. A full sync
+ * pins its place while it walks the store, so chunks it still needs are
+ * kept past the capacity until it catches up; otherwise a store that takes
+ * longer to walk than the backlog lasts would resync forever.
+ *
+ * Each log has a random run id, so a replica reconnecting after the
+ * primary restarted never resumes from a sequence number that meant
+ * something else.
+ */
+
+#ifndef REPLICATION_LOG_H
+#define REPLICATION_LOG_H
+
+#include "wal.hpp"
+
+#include <algorithm>
+#include <cstdint>
+#include <deque>
+#include <functional>
+#include <mutex>
+#include <random>
+#include <set>
+#include <string>
+#include <string_view>
+#include <utility>
+#include <vector>
+
+class replication_log {
+public:
+  static constexpr size_t DEFAULT_CAPACITY = 64 << 20;
+
+private:
+  static constexpr size_t CHUNK_SIZE = 1 << 20;
+
+  // Consecutive records starting with sequence number first
+  struct chunk {
+    uint64_t first;
+    std::string data;
+    std::vector<uint32_t> offsets; // Where each record starts in data
+  };
+
+  const uint64_t id;
+  const size_t capacity;
+  std::mutex lock;
+  std::deque<chunk> chunks;
+  size_t bytes = 0;       // Record bytes across chunks
+  uint64_t appended = 0;  // Sequence number of the newest record
+  uint64_t oldest = 1;    // Sequence number of the oldest record kept
+  std::multiset<uint64_t> pins; // Records after each are kept
+  std::vector<std::function<void()>> waiters;
+
+  static uint64_t random_id() {
+    std::random_device device;
+    return (uint64_t(device()) << 32 | device()) | 1;
+  }
+
+public:
+  explicit replication_log(size_t capacity = DEFAULT_CAPACITY)
+      : id(random_id()), capacity(std::max(capacity, CHUNK_SIZE)) {}
+
+  replication_log(const replication_log &) = delete;
+  replication_log &operator=(const replication_log &) = delete;
+
+  uint64_t run_id() const { return id; }
+
+  // Record a change and return its sequence number, waking any stream
+  // waiting for one
+  uint64_t append(wal::record_type type,
+                  std::string_view key,
+                  std::string_view value = std::string_view()) {
+    std::vector<std::function<void()>> ready;
+    uint64_t sequence;
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (chunks.empty() || chunks.back().data.size() >= CHUNK_SIZE) {
+        chunks.push_back({appended + 1, std::string(), {}});
+        chunks.back().data.reserve(CHUNK_SIZE + wal::RECORD_HEADER_SIZE);
+      }
+      chunk &last = chunks.back();
+      size_t before = last.data.size();
+      last.offsets.push_back(uint32_t(before));
+      wal::encode(last.data, type, key, value);
+      bytes += last.data.size() - before;
+      sequence = ++appended;
+      while (bytes > capacity && chunks.size() > 1 &&
+             (pins.empty() || chunks[1].first <= *pins.begin() + 1)) {
+        bytes -= chunks.front().data.size();
+        chunks.pop_front();
+        oldest = chunks.front().first;
+      }
+      ready.swap(waiters);
+    }
+    for (std::function<void()> &wake : ready) {
+      wake();
+    }
+    return sequence;
+  }
+
+  // Sequence number of the newest record appended so far
+  uint64_t tail() {
+    std::lock_guard<std::mutex> guard(lock);
+    return appended;
+  }
+
+  // Keep every record after the newest one until it is unpinned, whatever
+  // the capacity, and return its sequence number
+  uint64_t pin() {
+    std::lock_guard<std::mutex> guard(lock);
+    pins.insert(appended);
+    return appended;
+  }
+
+  // Move a pin from sequence forward to later, dropping the records
+  // between once the capacity allows
+  void move_pin(uint64_t sequence, uint64_t later) {
+    std::lock_guard<std::mutex> guard(lock);
+    pins.erase(pins.find(sequence));
+    pins.insert(later);
+  }
+
+  // Release a pin, letting the backlog shrink back to its capacity
+  void unpin(uint64_t sequence) {
+    std::lock_guard<std::mutex> guard(lock);
+    pins.erase(pins.find(sequence));
+  }
+
+  // Whether every record after sequence is still kept, so a stream can
+  // resume from there
+  bool retains(uint64_t sequence) {
+    std::lock_guard<std::mutex> guard(lock);
+    return sequence + 1 >= oldest && sequence <= appended;
+  }
+
+  // Append the records after sequence to out, stopping once at least
+  // max_bytes are copied, and advance sequence past them. Returns false if
+  // some of them were already dropped.
+  bool read(uint64_t &sequence, std::string &out, size_t max_bytes) {
+    std::lock_guard<std::mutex> guard(lock);
+    if (sequence + 1 < oldest) {
+      return false;
+    }
+    // The chunk holding the record after sequence; chunks are in order
+    std::deque<chunk>::iterator c = std::upper_bound(
+        chunks.begin(),
+        chunks.end(),
+        sequence + 1,
+        [](uint64_t s, const chunk &k) { return s < k.first; });
+    if (c == chunks.begin()) {
+      return true; // Nothing appended yet
+    }
+    size_t copied = 0;
+    for (--c; c != chunks.end() && sequence < appended && copied < max_bytes;
+         ++c) {
+      size_t index = sequence + 1 - c->first;
+      if (index >= c->offsets.size()) {
+        continue;
+      }
+      size_t from = c->offsets[index];
+      out.append(c->data, from);
+      copied += c->data.size() - from;
+      sequence = c->first + c->offsets.size() - 1;
+    }
+    return true;
+  }
+
+  // Call ready once a record after sequence exists: at once, outside any
+  // lock, if one already does, or else from the next append, which calls
+  // it with its shard lock held, so ready should only hand off.
+  void wait(uint64_t sequence, std::function<void()> ready) {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      if (sequence >= appended) {
+        waiters.push_back(std::move(ready));
+        return;
+      }
+    }
+    ready();
+  }
+
+  // Drop every waiting callback, for shutting down
+  void cancel_waits() {
+    std::vector<std::function<void()>> dropped;
+    std::lock_guard<std::mutex> guard(lock);
+    dropped.swap(waiters);
+  }
+};
+
+#endif
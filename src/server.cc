@@ -0,0 +1,318 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The server program runs a standalone kvserver on a pool of io threads until
+ * it receives SIGINT or SIGTERM. With --wal it recovers the store from the
+ * write-ahead log at startup and logs every change, acknowledging writes
+ * according to the sync policy. With --snapshot it starts from that
+ * snapshot if the file exists, refusing to start if it cannot be loaded,
+ * saves a new one every --snapshot-every seconds in the background,
+ * and saves one more on shutdown; with --wal as well, it replays only the
+ * records after the snapshot, and each snapshot drops the records it holds
+ * from the log. With --load it then bulk loads a file of
+ * "key value" lines, as in users.txt. With --max-memory it runs as a cache,
+ * evicting entries to stay under the given number of bytes (K, M, and G
+ * suffixes are accepted), and reports its hit ratio on shutdown. With
+ * --metrics-port it serves its metrics in Prometheus format over HTTP at
+ * /metrics on that port. With --hot-keys on it samples accesses from the
+ * start to find the hottest keys, which STATS hotkeys reports. With
+ * --ordered-index on it also keeps its keys in order, so SCAN can list them
+ * by prefix, at some cost to every write that adds or removes a key. With
+ * --transport uring it serves connections from io_uring rings, one per
+ * thread, and runs only timers and the metrics endpoint on the io_service.
+ * With --replication-port it streams every change to replicas that connect
+ * on that port, keeping --replication-backlog bytes of recent changes for
+ * replicas that reconnect. With --replica-of host:port it is a read-only
+ * replica of the primary whose replication port that is. With --per-core
+ * on it runs a core_server instead: one pinned thread per --threads, each
+ * with its own acceptor and its own share of the keys, which supports
+ * neither the log, snapshots, bulk loads, metrics, the ordered index, nor
+ * replication.
+ */
+
+#ifndef SERVER_H
+#define SERVER_H
+
+#include "core_server.cc"
+#include "kvserver.cc"
+#include "wal.hpp"
+
+#include <boost/asio.hpp>
+#include <boost/thread.hpp>
+#include <chrono>
+#include <condition_variable>
+#include <cstdlib>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+// Parse a byte count with an optional K, M, or G suffix
+static size_t parse_bytes(const std::string &value) {
+  size_t bytes = strtoull(value.c_str(), nullptr, 10);
+  switch (value.empty() ? '\0' : value.back()) {
+  case 'G':
+  case 'g':
+    bytes <<= 10;
+    [[fallthrough]];
+  case 'M':
+  case 'm':
+    bytes <<= 10;
+    [[fallthrough]];
+  case 'K':
+  case 'k':
+    bytes <<= 10;
+  }
+  return bytes;
+}
+
+static void usage() {
+  std::cerr << "Usage: server <port> [--threads n] [--wal path]\n"
+               "              [--sync always|interval|never] [--sync-ms ms]\n"
+               "              [--snapshot path] [--snapshot-every seconds]\n"
+               "              [--load path] [--max-memory bytes]\n"
+               "              [--metrics-port port] [--hot-keys on|off]\n"
+               "              [--transport asio|uring] [--per-core on|off]\n"
+               "              [--ordered-index on|off]\n"
+               "              [--replication-port port]\n"
+               "              [--replication-backlog bytes]\n"
+               "              [--replica-of host:port]"
+            << std::endl;
+}
+
+// Serve from num_cores pinned threads that share nothing until SIGINT or
+// SIGTERM
+static int run_per_core(int port,
+                        size_t num_cores,
+                        size_t max_memory,
+                        bool hot_key_tracking) {
+  try {
+    core_server server(port, num_cores);
+    server.set_memory_limit(max_memory);
+    server.track_hot_keys(hot_key_tracking);
+
+    boost::asio::io_service io_service;
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(
+        [&](const boost::system::error_code &, int) { io_service.stop(); });
+    std::cout << "Listening on port " << server.port() << " with "
+              << server.num_cores() << " cores" << std::endl;
+    io_service.run();
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]) {
+  if (argc < 2) {
+    usage();
+    return 1;
+  }
+
+  int port = atoi(argv[1]);
+  size_t num_threads = boost::thread::hardware_concurrency();
+  std::string wal_path;
+  wal::sync_policy policy = wal::SYNC_ALWAYS;
+  int sync_ms = 10;
+  std::string snapshot_path;
+  int snapshot_seconds = 0;
+  std::string load_path;
+  size_t max_memory = 0;
+  int metrics_port = 0;
+  bool hot_key_tracking = false;
+  bool use_uring = false;
+  bool per_core = false;
+  bool ordered_index = false;
+  int replication_port = 0;
+  size_t replication_backlog = replication_log::DEFAULT_CAPACITY;
+  std::string primary_host;
+  std::string primary_port;
+
+  for (int i = 2; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) {
+      usage();
+      return 1;
+    }
+    std::string value = argv[++i];
+    if (arg == "--threads") {
+      num_threads = std::max(1, atoi(value.c_str()));
+    } else if (arg == "--wal") {
+      wal_path = value;
+    } else if (arg == "--max-memory") {
+      max_memory = parse_bytes(value);
+    } else if (arg == "--metrics-port") {
+      metrics_port = atoi(value.c_str());
+    } else if (arg == "--hot-keys" && (value == "on" || value == "off")) {
+      hot_key_tracking = value == "on";
+    } else if (arg == "--transport" && (value == "asio" || value == "uring")) {
+      use_uring = value == "uring";
+    } else if (arg == "--ordered-index" &&
+               (value == "on" || value == "off")) {
+      ordered_index = value == "on";
+    } else if (arg == "--per-core" && (value == "on" || value == "off")) {
+      per_core = value == "on";
+    } else if (arg == "--replication-port") {
+      replication_port = atoi(value.c_str());
+    } else if (arg == "--replication-backlog") {
+      replication_backlog = parse_bytes(value);
+    } else if (arg == "--replica-of" && value.find(':') != std::string::npos) {
+      primary_host = value.substr(0, value.rfind(':'));
+      primary_port = value.substr(value.rfind(':') + 1);
+    } else if (arg == "--load") {
+      load_path = value;
+    } else if (arg == "--snapshot") {
+      snapshot_path = value;
+    } else if (arg == "--snapshot-every") {
+      snapshot_seconds = atoi(value.c_str());
+    } else if (arg == "--sync-ms") {
+      sync_ms = atoi(value.c_str());
+    } else if (arg == "--sync" && value == "always") {
+      policy = wal::SYNC_ALWAYS;
+    } else if (arg == "--sync" && value == "interval") {
+      policy = wal::SYNC_INTERVAL;
+    } else if (arg == "--sync" && value == "never") {
+      policy = wal::SYNC_NEVER;
+    } else {
+      usage();
+      return 1;
+    }
+  }
+
+  if (per_core) {
+    if (!wal_path.empty() || !snapshot_path.empty() || !load_path.empty() ||
+        metrics_port || use_uring || ordered_index || replication_port ||
+        !primary_host.empty()) {
+      std::cerr << "--per-core on supports none of --wal, --snapshot, "
+                   "--load, --metrics-port, --transport uring, "
+                   "--ordered-index, and replication"
+                << std::endl;
+      return 1;
+    }
+    return run_per_core(port, num_threads, max_memory, hot_key_tracking);
+  }
+
+  if (!primary_host.empty() && !load_path.empty()) {
+    std::cerr << "A replica takes its pairs from the primary, not --load"
+              << std::endl;
+    return 1;
+  }
+
+  try {
+    std::unique_ptr<wal> log;
+    if (!wal_path.empty()) {
+      log = std::make_unique<wal>(
+          wal_path, policy, std::chrono::milliseconds(sync_ms));
+    }
+
+    boost::asio::io_service io_service;
+    std::chrono::steady_clock::time_point start =
+        std::chrono::steady_clock::now();
+    kvserver server(io_service,
+                    port,
+                    log.get(),
+                    snapshot_path,
+                    use_uring ? num_threads : 0);
+    server.set_memory_limit(max_memory);
+    server.track_hot_keys(hot_key_tracking);
+    if (ordered_index) {
+      server.enable_ordered_index();
+    }
+    if (!load_path.empty() && server.load_file(load_path) < 0) {
+      std::cerr << "Unable to load " << load_path << std::endl;
+      return 1;
+    }
+    std::cout << "Loaded " << server.size() << " pairs in "
+              << std::chrono::duration<double>(
+                     std::chrono::steady_clock::now() - start)
+                     .count()
+              << " s" << std::endl;
+
+    // Save snapshots in the background; requests are never blocked
+    std::mutex snapshot_lock;
+    std::condition_variable snapshot_stop;
+    bool stopping = false;
+    std::thread snapshotter;
+    if (!snapshot_path.empty() && snapshot_seconds > 0) {
+      snapshotter = std::thread([&]() {
+        std::unique_lock<std::mutex> guard(snapshot_lock);
+        while (!snapshot_stop.wait_for(guard,
+                                       std::chrono::seconds(snapshot_seconds),
+                                       [&]() { return stopping; })) {
+          guard.unlock();
+          if (server.save_snapshot(snapshot_path) < 0) {
+            std::cerr << "Snapshot to " << snapshot_path << " failed"
+                      << std::endl;
+          }
+          guard.lock();
+        }
+      });
+    }
+
+    // Stop serving on SIGINT or SIGTERM; the log is synced as it closes
+    boost::asio::signal_set signals(io_service, SIGINT, SIGTERM);
+    signals.async_wait(
+        [&](const boost::system::error_code &, int) { io_service.stop(); });
+
+    std::cout << "Listening on port " << server.port() << " with "
+              << num_threads << (use_uring ? " io_uring" : "") << " threads"
+              << std::endl;
+    if (metrics_port) {
+      std::cout << "Serving metrics on port "
+                << server.serve_metrics(metrics_port) << std::endl;
+    }
+    if (replication_port) {
+      std::cout << "Serving replicas on port "
+                << server.serve_replicas(replication_port,
+                                         replication_backlog)
+                << std::endl;
+    }
+    if (!primary_host.empty()) {
+      server.replicate_from(primary_host, primary_port);
+      std::cout << "Replicating from " << primary_host << ':' << primary_port
+                << std::endl;
+    }
+
+    // The rings serve connections on threads of their own
+    std::vector<boost::shared_ptr<boost::thread>> threads;
+    for (size_t i = 0; i < (use_uring ? 1 : num_threads); i++) {
+      threads.push_back(boost::shared_ptr<boost::thread>(new boost::thread(
+          boost::bind(&boost::asio::io_service::run, &io_service))));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i]->join();
+    }
+    if (log) {
+      log->flush(); // Release held acknowledgements while io_service lives
+    }
+
+    if (snapshotter.joinable()) {
+      {
+        std::lock_guard<std::mutex> guard(snapshot_lock);
+        stopping = true;
+      }
+      snapshot_stop.notify_one();
+      snapshotter.join();
+    }
+    if (max_memory) {
+      kvstore::cache_stats stats = server.cache_usage();
+      std::cout << "Hit ratio " << stats.hit_ratio() << " with "
+                << stats.evictions << " evictions" << std::endl;
+    }
+
+    if (!snapshot_path.empty() && server.save_snapshot(snapshot_path) < 0) {
+      std::cerr << "Snapshot to " << snapshot_path << " failed" << std::endl;
+      return 1;
+    }
+  } catch (std::exception &e) {
+    std::cerr << e.what() << std::endl;
+    return 1;
+  }
+  return 0;
+}
+
+#endif
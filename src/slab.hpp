@@ -0,0 +1,201 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The slab class allocates small objects from size-classed pages. Each size
+ * class carves 16 KiB slabs into equal chunks and keeps freed chunks on a free
+ * list, so an object costs its size rounded up to the class and no malloc
+ * header. Slabs are cut from large anonymous mappings and carved lazily, so
+ * address space that has not been handed out yet costs no resident memory.
+ * Objects larger than the biggest class fall back to the heap.
+ *
+ * A slab is not thread safe; callers protect it with their own lock.
+ */
+
+#ifndef SLAB_H
+#define SLAB_H
+
+#include <sys/mman.h>
+
+#include <cstddef>
+#include <cstdint>
+#include <new>
+#include <vector>
+
+class slab {
+public:
+  static constexpr size_t SLAB_SIZE = 16 << 10;
+  static constexpr size_t MAX_CHUNK_SIZE = 1024;
+
+  // Memory accounting for one or more slabs
+  struct stats {
+    size_t used_bytes = 0;     // Bytes requested by live allocations
+    size_t reserved_bytes = 0; // Bytes of slabs and large allocations held
+    size_t allocations = 0;    // Live allocations
+
+    // Fraction of reserved memory not holding requested bytes
+    double fragmentation() const {
+      return reserved_bytes ? 1.0 - double(used_bytes) / reserved_bytes : 0;
+    }
+
+    stats &operator+=(const stats &other) {
+      used_bytes += other.used_bytes;
+      reserved_bytes += other.reserved_bytes;
+      allocations += other.allocations;
+      return *this;
+    }
+  };
+
+private:
+  static constexpr size_t REGION_SLABS = 64; // Slabs mapped at a time
+  static constexpr int NUM_CLASSES = 27;
+  static constexpr int LARGE_CLASS = NUM_CLASSES;
+
+  // Every slab, and every large allocation, starts with its owner so a
+  // chunk can be freed knowing only its address and size
+  struct header {
+    slab *owner;
+    uint32_t size_class;
+  };
+  static constexpr size_t HEADER_SIZE = 16;
+  static_assert(sizeof(header) <= HEADER_SIZE, "slab header too large");
+
+  struct free_chunk {
+    free_chunk *next;
+  };
+
+  struct size_class {
+    free_chunk *free = nullptr;
+    char *cursor = nullptr; // Next uncarved chunk in the newest slab
+    char *end = nullptr;
+  };
+
+  struct region {
+    void *base;
+    size_t length;
+  };
+
+  size_class classes[NUM_CLASSES];
+  std::vector<region> regions;
+  char *next_slab = nullptr; // Unused slabs left in the newest region
+  char *regions_end = nullptr;
+  stats totals;
+
+  // Class sizes step by 8 bytes up to 128, then by a quarter of each power
+  // of two, so rounding wastes at most 20% of an object
+  static size_t class_size(int i) {
+    if (i < 15) {
+      return 16 + 8 * i;
+    }
+    size_t base = size_t(128) << ((i - 15) / 4);
+    return base + base / 4 * ((i - 15) % 4 + 1);
+  }
+
+  static int class_for(size_t size) {
+    if (size <= 128) {
+      return size <= 16 ? 0 : int((size - 16 + 7) / 8);
+    }
+    int i = 15;
+    while (class_size(i) < size) {
+      i++;
+    }
+    return i;
+  }
+
+  // Hand out a fresh slab, mapping a new region when the last one is used up
+  char *new_slab() {
+    if (next_slab == regions_end) {
+      // Over-map by one slab so the region can be aligned to SLAB_SIZE
+      size_t length = (REGION_SLABS + 1) * SLAB_SIZE;
+      void *base = mmap(nullptr,
+                        length,
+                        PROT_READ | PROT_WRITE,
+                        MAP_PRIVATE | MAP_ANONYMOUS,
+                        -1,
+                        0);
+      if (base == MAP_FAILED) {
+        throw std::bad_alloc();
+      }
+      regions.push_back({base, length});
+      uintptr_t start = reinterpret_cast<uintptr_t>(base);
+      start = (start + SLAB_SIZE - 1) & ~(SLAB_SIZE - 1);
+      next_slab = reinterpret_cast<char *>(start);
+      regions_end = next_slab + REGION_SLABS * SLAB_SIZE;
+    }
+    char *s = next_slab;
+    next_slab += SLAB_SIZE;
+    totals.reserved_bytes += SLAB_SIZE;
+    return s;
+  }
+
+  void *allocate_chunk(int i) {
+    size_class &c = classes[i];
+    if (c.free) {
+      free_chunk *chunk = c.free;
+      c.free = chunk->next;
+      return chunk;
+    }
+    size_t chunk_size = class_size(i);
+    if (c.cursor == nullptr || size_t(c.end - c.cursor) < chunk_size) {
+      char *s = new_slab();
+      new (s) header{this, uint32_t(i)};
+      c.cursor = s + HEADER_SIZE;
+      c.end = s + SLAB_SIZE;
+    }
+    void *chunk = c.cursor;
+    c.cursor += chunk_size;
+    return chunk;
+  }
+
+public:
+  slab() = default;
+  slab(const slab &) = delete;
+  slab &operator=(const slab &) = delete;
+
+  // Unmap every region; live large allocations must already be released
+  ~slab() {
+    for (size_t i = 0; i < regions.size(); i++) {
+      munmap(regions[i].base, regions[i].length);
+    }
+  }
+
+  // Allocate size bytes aligned to 8
+  void *allocate(size_t size) {
+    totals.used_bytes += size;
+    totals.allocations++;
+    if (size > MAX_CHUNK_SIZE) {
+      char *block = static_cast<char *>(::operator new(HEADER_SIZE + size));
+      new (block) header{this, LARGE_CLASS};
+      totals.reserved_bytes += HEADER_SIZE + size;
+      return block + HEADER_SIZE;
+    }
+    return allocate_chunk(class_for(size));
+  }
+
+  // Free an allocation of size bytes made by whichever slab owns it. The
+  // owner's lock must be held.
+  static void release(void *ptr, size_t size) {
+    char *chunk = static_cast<char *>(ptr);
+    if (size > MAX_CHUNK_SIZE) {
+      header *h = reinterpret_cast<header *>(chunk - HEADER_SIZE);
+      slab *owner = h->owner;
+      owner->totals.used_bytes -= size;
+      owner->totals.allocations--;
+      owner->totals.reserved_bytes -= HEADER_SIZE + size;
+      ::operator delete(chunk - HEADER_SIZE);
+      return;
+    }
+
+    uintptr_t start = reinterpret_cast<uintptr_t>(chunk) & ~(SLAB_SIZE - 1);
+    header *h = reinterpret_cast<header *>(start);
+    slab *owner = h->owner;
+    owner->totals.used_bytes -= size;
+    owner->totals.allocations--;
+    free_chunk *freed = reinterpret_cast<free_chunk *>(chunk);
+    freed->next = owner->classes[h->size_class].free;
+    owner->classes[h->size_class].free = freed;
+  }
+
+  const stats &usage() const { return totals; }
+};
+
+#endif
@@ -0,0 +1,322 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The snapshot class saves a kvstore to a compact binary file and loads it
+ * back. A snapshot is written from the lock-free read path, one shard at a
+ * time, so writers are never blocked; pairs changed while it runs may or may
+ * not be included. Loading maps the file and inserts its partitions from
+ * several threads at once.
+ *
+ * The file holds a header, the packed records of each partition, and an
+ * index of partitions:
+ *
+ *   header:  magic (8) | record count (8) | index offset (8) | partitions (4)
+ *            | reserved (4) | log position (8)
+ *   record:  key length (4) | value length (4) | [expiry (8)] | key | value
+ *   index:   offset (8) | record count (8) | length (8), per partition
+ *
+ * Integers are big-endian. The top bit of a record's key length is set if
+ * the pair expires, in which case its expiry time in milliseconds since the
+ * Unix epoch follows the lengths; pairs already expired are never saved, and
+ * pairs that expire before they are loaded are skipped.
+ *
+ * Each partition holds the pairs of one shard of the saved store, so loading
+ * into a store with the same shard count touches each shard from exactly one
+ * thread.
+ *
+ * The log position is the last write-ahead log record the snapshot holds,
+ * or 0 if the store had no log. It is read before the first shard is
+ * walked, so every change up to it is in the snapshot and later ones may
+ * be; replaying the log's records after it on top of the snapshot restores
+ * the store, and the records up to it can be dropped from the log.
+ */
+
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "kvstore.hpp"
+#include "message.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <algorithm>
+#include <atomic>
+#include <cerrno>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <vector>
+
+class snapshot {
+private:
+  static constexpr char MAGIC[8] = {'K', 'V', 'S', 'N', 'A', 'P', '0', '2'};
+  static constexpr size_t HEADER_SIZE = 40;
+  static constexpr size_t INDEX_ENTRY_SIZE = 24;
+  static constexpr size_t RECORD_HEADER_SIZE = 8;
+  static constexpr uint32_t RECORD_EXPIRES = 1u << 31; // Set in key length
+  static constexpr size_t WRITE_BUFFER_SIZE = 1 << 20;
+
+  struct partition {
+    uint64_t offset;
+    uint64_t count;
+    uint64_t length;
+  };
+
+  static void write_u64(char *out, uint64_t value) {
+    binary_header::write_u32(out, uint32_t(value >> 32));
+    binary_header::write_u32(out + 4, uint32_t(value));
+  }
+
+  static uint64_t read_u64(const char *in) {
+    return uint64_t(binary_header::read_u32(in)) << 32 |
+           binary_header::read_u32(in + 4);
+  }
+
+  static bool write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  // Sync the directory holding path, so a file renamed into it stays there
+  // after a crash
+  static bool sync_directory(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "."
+                            : slash == 0              ? "/"
+                                                      : path.substr(0, slash);
+    int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir < 0) {
+      return false;
+    }
+    bool ok = fsync(dir) == 0;
+    ::close(dir);
+    return ok;
+  }
+
+  static void append_record(std::string &out,
+                            std::string_view key,
+                            std::string_view value,
+                            uint64_t expires) {
+    char header[RECORD_HEADER_SIZE + 8];
+    binary_header::write_u32(header,
+                             key.size() | (expires ? RECORD_EXPIRES : 0));
+    binary_header::write_u32(header + 4, value.size());
+    write_u64(header + RECORD_HEADER_SIZE, expires);
+    out.append(header, RECORD_HEADER_SIZE + (expires ? 8 : 0));
+    out.append(key.data(), key.size());
+    out.append(value.data(), value.size());
+  }
+
+  // Insert one partition's records, returning false if any overrun it
+  static bool load_partition(const char *data,
+                             const partition &p,
+                             kvstore &store) {
+    const char *record = data + p.offset;
+    const char *end = record + p.length;
+    for (uint64_t i = 0; i < p.count; i++) {
+      if (size_t(end - record) < RECORD_HEADER_SIZE) {
+        return false;
+      }
+      uint64_t key_length = binary_header::read_u32(record);
+      uint64_t value_length = binary_header::read_u32(record + 4);
+      record += RECORD_HEADER_SIZE;
+      uint64_t expires = 0;
+      if (key_length & RECORD_EXPIRES) {
+        if (size_t(end - record) < 8) {
+          return false;
+        }
+        key_length &= ~uint64_t(RECORD_EXPIRES);
+        expires = read_u64(record);
+        record += 8;
+      }
+      if (uint64_t(end - record) < key_length + value_length) {
+        return false;
+      }
+      store.put_until(std::string_view(record, key_length),
+                      std::string_view(record + key_length, value_length),
+                      expires);
+      record += key_length + value_length;
+    }
+    return record == end;
+  }
+
+public:
+  // Write every pair in store to path, replacing it atomically once the new
+  // file is synced, then sync the directory so the rename is durable.
+  // Returns the number of pairs written, or -1 on failure, and sets
+  // log_position, if given, to the log position saved.
+  static long long save(kvstore &store,
+                        const std::string &path,
+                        uint64_t *log_position = nullptr) {
+    std::string temp_path = path + ".tmp";
+    int fd = ::open(temp_path.c_str(), O_WRONLY | O_CREAT | O_TRUNC, 0644);
+    if (fd < 0) {
+      return -1;
+    }
+    uint64_t position = store.log_position();
+
+    int num_partitions = store.shard_count();
+    std::vector<partition> index(num_partitions);
+    std::string buffer(HEADER_SIZE, '\0'); // Patched once the index is known
+    std::string records;
+    uint64_t offset = HEADER_SIZE;
+    uint64_t total = 0;
+    bool ok = true;
+
+    for (int i = 0; i < num_partitions && ok; i++) {
+      // Collect the shard first so a walk that raced a rehash can be redone
+      uint64_t count;
+      do {
+        records.clear();
+        count = 0;
+      } while (!store.visit_shard(
+          i,
+          [&](std::string_view key, std::string_view value, uint64_t expires) {
+            append_record(records, key, value, expires);
+            count++;
+          }));
+
+      index[i] = {offset, count, records.size()};
+      offset += records.size();
+      total += count;
+      buffer += records;
+      if (buffer.size() >= WRITE_BUFFER_SIZE) {
+        ok = write_all(fd, buffer);
+        buffer.clear();
+      }
+    }
+
+    for (int i = 0; i < num_partitions; i++) {
+      char entry[INDEX_ENTRY_SIZE];
+      write_u64(entry, index[i].offset);
+      write_u64(entry + 8, index[i].count);
+      write_u64(entry + 16, index[i].length);
+      buffer.append(entry, sizeof(entry));
+    }
+
+    char header[HEADER_SIZE] = {};
+    std::memcpy(header, MAGIC, sizeof(MAGIC));
+    write_u64(header + 8, total);
+    write_u64(header + 16, offset);
+    binary_header::write_u32(header + 24, num_partitions);
+    write_u64(header + 32, position);
+
+    ok = ok && write_all(fd, buffer) &&
+         pwrite(fd, header, sizeof(header), 0) == ssize_t(sizeof(header)) &&
+         fdatasync(fd) == 0;
+    ok = ::close(fd) == 0 && ok;
+    if (!ok || std::rename(temp_path.c_str(), path.c_str()) != 0) {
+      std::remove(temp_path.c_str());
+      return -1;
+    }
+    // A log truncated through position must never outlive the rename
+    if (!sync_directory(path)) {
+      return -1;
+    }
+    if (log_position) {
+      *log_position = position;
+    }
+    return total;
+  }
+
+  // Map the snapshot at path and insert its pairs into store using up to
+  // num_threads threads. Returns the number of pairs loaded, or -1 if the
+  // file is missing or malformed, and sets log_position, if given, to the
+  // log position saved. If a partition turns out damaged once loading has
+  // begun, the store is cleared, as the others may already be in it.
+  static long long load(
+      const std::string &path,
+      kvstore &store,
+      unsigned num_threads = std::thread::hardware_concurrency(),
+      uint64_t *log_position = nullptr) {
+    int fd = ::open(path.c_str(), O_RDONLY);
+    if (fd < 0) {
+      return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) != 0 || size_t(st.st_size) < HEADER_SIZE) {
+      ::close(fd);
+      return -1;
+    }
+    size_t length = st.st_size;
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    ::close(fd);
+    if (mapped == MAP_FAILED) {
+      return -1;
+    }
+    madvise(mapped, length, MADV_WILLNEED);
+    const char *data = static_cast<const char *>(mapped);
+
+    // Validate the header and index before touching any record
+    uint64_t total = read_u64(data + 8);
+    uint64_t index_offset = read_u64(data + 16);
+    uint64_t num_partitions = binary_header::read_u32(data + 24);
+    uint64_t position = read_u64(data + 32);
+    bool valid = std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0 &&
+                 index_offset >= HEADER_SIZE && index_offset <= length &&
+                 (length - index_offset) == num_partitions * INDEX_ENTRY_SIZE;
+    std::vector<partition> index(valid ? num_partitions : 0);
+    uint64_t counted = 0;
+    for (size_t i = 0; i < index.size() && valid; i++) {
+      const char *entry = data + index_offset + i * INDEX_ENTRY_SIZE;
+      index[i] = {read_u64(entry), read_u64(entry + 8), read_u64(entry + 16)};
+      valid = index[i].offset >= HEADER_SIZE &&
+              index[i].offset <= index_offset &&
+              index[i].length <= index_offset - index[i].offset;
+      counted += index[i].count;
+    }
+    valid = valid && counted == total;
+
+    // Threads claim partitions in turn until none are left
+    std::atomic<size_t> next(0);
+    std::atomic<bool> intact(true);
+    auto worker = [&]() {
+      for (size_t i = next++; i < index.size(); i = next++) {
+        if (!load_partition(data, index[i], store)) {
+          intact = false;
+        }
+      }
+    };
+    std::vector<std::thread> threads;
+    size_t spawned = valid ? std::min<size_t>(std::max(num_threads, 1u),
+                                              index.size())
+                           : 0;
+    for (size_t t = 1; t < spawned; t++) {
+      threads.emplace_back(worker);
+    }
+    if (valid) {
+      worker();
+    }
+    for (size_t t = 0; t < threads.size(); t++) {
+      threads[t].join();
+    }
+    munmap(mapped, length);
+    if (valid && !intact) {
+      store.clear();
+    }
+    if (!valid || !intact) {
+      return -1;
+    }
+    if (log_position) {
+      *log_position = position;
+    }
+    return total;
+  }
+};
+
+#endif
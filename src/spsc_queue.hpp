@@ -0,0 +1,74 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The spsc_queue class is a bounded lock-free queue between exactly one
+ * producer thread and one consumer thread. Each side owns one index on a
+ * cache line of its own and only reads the other's, so a push or pop is a
+ * copy and a release store. Each side also caches the last index it read
+ * from the other, so it touches the other side's cache line only when the
+ * queue looks full or empty.
+ */
+
+#ifndef SPSC_QUEUE_H
+#define SPSC_QUEUE_H
+
+#include "epoch.hpp"
+
+#include <atomic>
+#include <bit>
+#include <cstdint>
+#include <memory>
+
+template <typename T>
+class spsc_queue {
+private:
+  // Written by the consumer
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> head{0};
+  size_t cached_tail = 0;
+
+  // Written by the producer
+  alignas(CACHE_LINE_SIZE) std::atomic<size_t> tail{0};
+  size_t cached_head = 0;
+
+  alignas(CACHE_LINE_SIZE) std::unique_ptr<T[]> slots;
+  size_t mask;
+
+public:
+  // A queue of at least capacity items
+  explicit spsc_queue(size_t capacity)
+      : slots(new T[std::bit_ceil(std::max<size_t>(capacity, 2))]),
+        mask(std::bit_ceil(std::max<size_t>(capacity, 2)) - 1) {}
+
+  spsc_queue(const spsc_queue &) = delete;
+  spsc_queue &operator=(const spsc_queue &) = delete;
+
+  // Producer only. Returns false if the queue is full.
+  bool push(const T &item) {
+    size_t t = tail.load(std::memory_order_relaxed);
+    if (t - cached_head > mask) {
+      cached_head = head.load(std::memory_order_acquire);
+      if (t - cached_head > mask) {
+        return false;
+      }
+    }
+    slots[t & mask] = item;
+    tail.store(t + 1, std::memory_order_release);
+    return true;
+  }
+
+  // Consumer only. Returns false if the queue is empty.
+  bool pop(T &item) {
+    size_t h = head.load(std::memory_order_relaxed);
+    if (h == cached_tail) {
+      cached_tail = tail.load(std::memory_order_acquire);
+      if (h == cached_tail) {
+        return false;
+      }
+    }
+    item = slots[h & mask];
+    head.store(h + 1, std::memory_order_release);
+    return true;
+  }
+};
+
+#endif
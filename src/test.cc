@@ -9,14 +9,23 @@
 #ifndef TEST_H
 #define TEST_H
 
+#include "histogram.hpp"
+#include "core_server.cc"
 #include "kvclient.cc"
+#include "kvcluster.cc"
+#include "kvpool.cc"
 #include "kvserver.cc"
 #include "message.hpp"
 
+#include <unistd.h>
+
+#include <algorithm>
 #include <cassert>
+#include <cstdio>
 #include <cstdlib>
 #include <fstream>
 #include <iostream>
+#include <map>
 #include <random>
 #include <vector>
 
@@ -42,6 +51,9 @@ using boost::asio::ip::tcp;
 class Test {
 private:
   kvserver server;
+  boost::asio::io_service &client_io_service;
+  const std::string host;
+  const std::string client_port;
   std::vector<kvclient> clients;
   std::vector<boost::shared_ptr<boost::thread>> server_threads;
   std::unordered_map<std::string, std::string> store; // Avoid duplicates
@@ -63,11 +75,14 @@ private:
       std::string value = line.substr(line.find(" ") + 1);
       value[value.length() - 1] = '\0'; // Null terminate the value
 
-      // Insert the key and value into the server's kvstore and local store
-      server.store.store[key] = value;
+      // Insert the key and value into the local store
       store[key] = value;
     }
 
+    // Load the server's kvstore from the local store on every core
+    NASSERT(server.store.bulk_load(store.begin(), store.end()) == store.size(),
+            "SETUP: Bulk load size mismatch");
+
     // Verify that the server's kvstore and local store have the same size
     NASSERT(server.store.size() == store.size(),
             "SETUP: Unexpected server size");
@@ -131,6 +146,80 @@ private:
     NASSERT(m.get_type() == UNSET);
     NASSERT(m.get_key() == "");
     NASSERT(m.get_value() == "");
+
+    msg = "";
+    m = message(msg);
+    NASSERT(m.get_type() == UNSET);
+
+    // Test that values round trip newlines through the text encoding
+    m = message(PUT, "key", "multi\nline");
+    NASSERT(m.encode(msg) && msg == "PUT key multi\rline\n");
+    m = message(msg.substr(0, msg.size() - 1));
+    NASSERT(m.get_value() == "multi\nline");
+
+    // Test that message_view parses in place without copying
+    message_view view;
+    std::string line = "PUT key value";
+    NASSERT(view.decode(line) && view.type == PUT);
+    NASSERT(view.key == "key" && view.value == "value");
+    NASSERT(view.key.data() == line.data() + 4);
+    NASSERT(!view.decode("GET") && view.type == UNSET);
+    return true;
+  }
+
+  // Verify every delimiter scanner the CPU supports agrees with a byte by
+  // byte scan, on lines long and short with delimiters at every offset
+  bool test_delimiters(int num_iterations = NUM_ITERS) {
+    std::mt19937 random(7);
+    const char alphabet[] = {'a', 'b', ' ', '\n', '\r'};
+    delimiters::implementation original = delimiters::active();
+    for (delimiters::implementation kind :
+         {delimiters::SCALAR, delimiters::SSE2, delimiters::AVX2}) {
+      if (!delimiters::use(kind)) {
+        continue;
+      }
+      for (int i = 0; i < num_iterations; i++) {
+        // Mostly letters, so delimiters land in every block of long lines
+        std::string data(random() % 700, 'a');
+        int sparsity = 1 + random() % 200;
+        for (char &c : data) {
+          if (random() % sparsity == 0) {
+            c = alphabet[random() % sizeof(alphabet)];
+          }
+        }
+
+        size_t length = data.find('\n');
+        bool ended = length != std::string::npos;
+        length = ended ? length : data.size();
+        std::vector<size_t> spaces;
+        for (size_t at = 0; at < length && spaces.size() < 4; at++) {
+          if (data[at] == ' ') {
+            spaces.push_back(at);
+          }
+        }
+        delimiters::line_layout layout;
+        NASSERT(delimiters::scan_line(data, layout) == ended &&
+                    layout.length == length &&
+                    std::vector<size_t>(layout.spaces,
+                                        layout.spaces + layout.space_count) ==
+                        spaces,
+                std::string("TEST DELIMITERS: ") + delimiters::name(kind) +
+                    " scanned a line wrongly");
+
+        std::string expected = data;
+        std::replace(expected.begin(), expected.end(), '\r', '\n');
+        std::string translated = "prefix";
+        append_translated(translated, data, '\r', '\n');
+        NASSERT(translated == "prefix" + expected,
+                std::string("TEST DELIMITERS: ") + delimiters::name(kind) +
+                    " translated a value wrongly");
+        delimiters::translate(&data[0], data.data(), data.size(), '\r', '\n');
+        NASSERT(data == expected,
+                std::string("TEST DELIMITERS: ") + delimiters::name(kind) +
+                    " translated in place wrongly");
+      }
+    }
+    delimiters::use(original);
     return true;
   }
 
@@ -182,12 +271,8 @@ private:
 
         // Get the value from the server
         std::string server_value;
-        // Verify with iterator
-        it = server.store.store.find(key);
-        NASSERT(it != server.store.store.end(),
+        NASSERT(server.store.get(key, server_value),
                 "TEST PUT: Key not found in server store");
-        server_value = it->second;
-        // server.store.get(key, server_value);
         NASSERT(strcmp(server_value.c_str(), value.c_str()) == 0,
                 "TEST PUT: Server value does not match value in database");
 
@@ -203,10 +288,8 @@ private:
                   "TEST PUT: Client put failed");
 
           // Verify the value was changed on the server
-          it = server.store.store.find(key);
-          NASSERT(it != server.store.store.end(),
+          NASSERT(server.store.get(key, server_value),
                   "TEST PUT: Key not found in server store");
-          server_value = it->second;
           NASSERT(strcmp(server_value.c_str(), new_value.c_str()) == 0,
                   "TEST PUT: Server value does not match updated value");
           NASSERT(server.store.size() == store.size(),
@@ -231,10 +314,9 @@ private:
         const std::string value = it->second;
 
         // Verify that the key is in the server's kvstore
-        it = server.store.store.find(key);
-        NASSERT(it != server.store.store.end(),
+        std::string server_value;
+        NASSERT(server.store.get(key, server_value),
                 "TEST DEL: Key does not exist on server");
-        std::string server_value = it->second;
         NASSERT(strcmp(server_value.c_str(), value.c_str()) == 0,
                 "TEST DEL: Server value does not match value in database");
 
@@ -245,7 +327,7 @@ private:
         clients[client_index].del(key);
 
         // Ensure that the key is no longer in the server's kvstore
-        NASSERT(server.store.store.find(key) == server.store.store.end(),
+        NASSERT(!server.store.get(key, server_value),
                 "TEST DEL: Server value still exists after delete");
 
         // Remove the key from the local database
@@ -330,10 +412,10 @@ private:
           // Verify OK and new value
           NASSERT(client.put(key, client_value),
                   "TEST STRESS PUT: Client put existing key failed");
-          it = server.store.store.find(key);
-          NASSERT(it != server.store.store.end(),
+          std::string server_value;
+          NASSERT(server.store.get(key, server_value),
                   "TEST STRESS PUT: Server value does not exist");
-          NASSERT(strcmp(client_value.c_str(), it->second.c_str()) == 0,
+          NASSERT(strcmp(client_value.c_str(), server_value.c_str()) == 0,
                   "TEST STRESS PUT: Inserted value does not match value in "
                   "database");
         } else {
@@ -354,8 +436,8 @@ private:
           // Verify OK and new value
           NASSERT(client.put(key, value),
                   "TEST STRESS PUT: Client received error on put");
-          auto it = server.store.store.find(key);
-          NASSERT(it != server.store.store.end(),
+          std::string server_value;
+          NASSERT(server.store.get(key, server_value),
                   "TEST STRESS PUT: Server failed to put new key");
         }
       }
@@ -438,6 +520,2011 @@ private:
     return true;
   }
 
+  // Stress test the kvstore directly with concurrent inserts and deletes of
+  // fresh keys, forcing every shard to rehash while other shards are written
+  bool test_stress_shards(int num_iterations = NUM_ITERS) {
+    const int num_threads = 8;
+    size_t starting_size = server.store.size();
+
+    auto insert_keys = [&](int thread_id) {
+      for (int i = 0; i < num_iterations * 10; i++) {
+        std::string key = "shard" + std::to_string(thread_id) + "_" +
+                          std::to_string(i);
+        NASSERT(server.store.put(key, key),
+                "TEST STRESS SHARDS: Put of new key failed");
+      }
+      for (int i = 0; i < num_iterations * 10; i += 2) {
+        std::string key = "shard" + std::to_string(thread_id) + "_" +
+                          std::to_string(i);
+        NASSERT(server.store.del(key),
+                "TEST STRESS SHARDS: Delete of inserted key failed");
+      }
+    };
+
+    std::vector<std::thread> threads;
+    for (int i = 0; i < num_threads; i++) {
+      threads.push_back(std::thread(insert_keys, i));
+    }
+    for (size_t i = 0; i < threads.size(); i++) {
+      threads[i].join();
+    }
+
+    // Every odd key must still be present with its own value
+    for (int t = 0; t < num_threads; t++) {
+      for (int i = 1; i < num_iterations * 10; i += 2) {
+        std::string key = "shard" + std::to_string(t) + "_" + std::to_string(i);
+        std::string value;
+        NASSERT(server.store.get(key, value) && value == key,
+                "TEST STRESS SHARDS: Inserted key lost or corrupted");
+      }
+    }
+    NASSERT(server.store.size() ==
+                starting_size + num_threads * num_iterations * 10 / 2,
+            "TEST STRESS SHARDS: Unexpected server size");
+
+    return true;
+  }
+
+  // Stress test lock-free reads: readers must always find keys that are never
+  // deleted while writers overwrite them and rehash every shard underneath
+  bool test_stress_readers(int num_iterations = NUM_ITERS) {
+    const int num_readers = 4;
+    const int num_writers = 2;
+    std::atomic<bool> done(false);
+
+    // Pick a fixed set of existing keys that readers will hammer
+    std::vector<std::string> hot_keys;
+    for (auto it = store.begin(); it != store.end() && hot_keys.size() < 64;
+         it++) {
+      hot_keys.push_back(it->first);
+    }
+
+    auto read_keys = [&]() {
+      std::string value;
+      while (!done.load()) {
+        for (size_t i = 0; i < hot_keys.size(); i++) {
+          NASSERT(server.store.get(hot_keys[i], value),
+                  "TEST STRESS READERS: Reader missed an existing key");
+          NASSERT(value == store.at(hot_keys[i]) || value == hot_keys[i],
+                  "TEST STRESS READERS: Reader saw a corrupted value");
+        }
+      }
+    };
+
+    auto write_keys = [&](int thread_id) {
+      for (int i = 0; i < num_iterations * 20; i++) {
+        std::string key = "reader" + std::to_string(thread_id) + "_" +
+                          std::to_string(i);
+        server.store.put(key, key);
+        const std::string &hot = hot_keys[i % hot_keys.size()];
+        server.store.put(hot, i % 2 ? hot : store.at(hot));
+      }
+    };
+
+    std::vector<std::thread> readers;
+    for (int i = 0; i < num_readers; i++) {
+      readers.push_back(std::thread(read_keys));
+    }
+    std::vector<std::thread> writers;
+    for (int i = 0; i < num_writers; i++) {
+      writers.push_back(std::thread(write_keys, i));
+    }
+    for (size_t i = 0; i < writers.size(); i++) {
+      writers[i].join();
+    }
+    done.store(true);
+    for (size_t i = 0; i < readers.size(); i++) {
+      readers[i].join();
+    }
+
+    return true;
+  }
+
+  // Test binary framing round trips arbitrary bytes in keys and values, and
+  // that binary and text clients share one server
+  bool test_binary(int num_iterations = NUM_ITERS) {
+    // Every byte value, including newlines, carriage returns and NULs
+    std::string blob;
+    for (int i = 0; i < 256; i++) {
+      blob += static_cast<char>(i);
+    }
+
+    // Round trip a message through the binary encoding
+    message m(PUT, "binary key\n", blob);
+    std::string encoded;
+    NASSERT(m.encode_binary(encoded, 42));
+    binary_header header;
+    NASSERT(header.read(encoded.data()));
+    NASSERT(header.request_id == 42 && header.opcode == PUT);
+    message decoded;
+    NASSERT(decoded.decode_binary(header,
+                                  encoded.substr(BINARY_HEADER_SIZE)));
+    NASSERT(decoded.get_type() == PUT);
+    NASSERT(decoded.get_key() == "binary key\n");
+    NASSERT(decoded.get_value() == blob);
+
+    try {
+      kvclient client(client_io_service, host, client_port, BINARY_PROTOCOL);
+      NASSERT(client.get_protocol() == BINARY_PROTOCOL,
+              "TEST BINARY: Server refused the binary protocol");
+
+      for (int i = 0; i < num_iterations; i++) {
+        // Existing keys read the same through binary and text clients
+        auto it = next(begin(store), rand() % store.size());
+        std::string binary_value, text_value;
+        NASSERT(client.get(it->first, binary_value),
+                "TEST BINARY: Binary get existing key failed");
+        NASSERT(clients[i % clients.size()].get(it->first, text_value));
+        NASSERT(binary_value == it->second && text_value == it->second,
+                "TEST BINARY: Binary and text values differ");
+
+        // Keys with spaces and values with every byte survive unchanged
+        std::string key = "binary key " + std::to_string(i) + "\r\n";
+        std::string value = blob + std::to_string(i);
+        std::string stored;
+        NASSERT(client.put(key, value), "TEST BINARY: Binary put failed");
+        NASSERT(server.store.get(key, stored) && stored == value,
+                "TEST BINARY: Server value does not match binary value");
+        NASSERT(client.get(key, stored) && stored == value,
+                "TEST BINARY: Binary get does not match binary value");
+        NASSERT(client.del(key), "TEST BINARY: Binary del failed");
+        NASSERT(!client.get(key, stored),
+                "TEST BINARY: Binary get found deleted key");
+      }
+    } catch (std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Test pipelined requests complete in order with the right results, in both
+  // protocols and across the client's in-flight limit
+  bool test_pipeline(int num_iterations = NUM_ITERS) {
+    try {
+      for (int protocol = TEXT_PROTOCOL; protocol <= BINARY_PROTOCOL;
+           protocol++) {
+        kvclient client(client_io_service,
+                        host,
+                        client_port,
+                        static_cast<protocol_type>(protocol));
+        std::vector<int> completed;
+        int num_requests = num_iterations * 3;
+
+        for (int i = 0; i < num_iterations; i++) {
+          // Queue a put, a get of the same key, and a get of a stored key
+          std::string key = "pipeline" + std::to_string(i);
+          auto it = next(begin(store), rand() % store.size());
+          std::string expected = it->second;
+
+          NASSERT(client.async_put(key, key, [&, i](bool ok) {
+            NASSERT(ok, "TEST PIPELINE: Pipelined put failed");
+            completed.push_back(i * 3);
+          }));
+          NASSERT(client.async_get(
+              key, [&, i, key](bool found, const std::string &value) {
+                NASSERT(found && value == key,
+                        "TEST PIPELINE: Pipelined get missed its own put");
+                completed.push_back(i * 3 + 1);
+              }));
+          NASSERT(client.async_get(
+              it->first,
+              [&, i, expected](bool found, const std::string &value) {
+                NASSERT(found && value == expected,
+                        "TEST PIPELINE: Pipelined get returned wrong value");
+                completed.push_back(i * 3 + 2);
+              }));
+        }
+        client.wait();
+        NASSERT(client.in_flight() == 0);
+
+        // Every callback ran exactly once, in the order it was queued
+        NASSERT(int(completed.size()) == num_requests,
+                "TEST PIPELINE: Not every pipelined request completed");
+        for (int i = 0; i < num_requests; i++) {
+          NASSERT(completed[i] == i,
+                  "TEST PIPELINE: Responses completed out of order");
+        }
+
+        // Blocking calls still work after pipelining on the same connection
+        for (int i = 0; i < num_iterations; i++) {
+          NASSERT(client.del("pipeline" + std::to_string(i)),
+                  "TEST PIPELINE: Delete of pipelined key failed");
+        }
+      }
+    } catch (std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Test MPUT, MGET, and MDEL return one correct result per key, in order,
+  // in both protocols
+  bool test_batch(int num_iterations = NUM_ITERS) {
+    try {
+      for (int protocol = TEXT_PROTOCOL; protocol <= BINARY_PROTOCOL;
+           protocol++) {
+        kvclient client(client_io_service,
+                        host,
+                        client_port,
+                        static_cast<protocol_type>(protocol));
+
+        // Store new keys, including a value spanning lines
+        std::vector<std::string> keys, values;
+        std::vector<bool> results;
+        for (int i = 0; i < num_iterations; i++) {
+          keys.push_back("batch" + std::to_string(i));
+          values.push_back(i % 2 ? "line\nbreak" + std::to_string(i)
+                                 : std::to_string(i));
+        }
+        NASSERT(client.mput(keys, values, results),
+                "TEST BATCH: Client mput failed");
+        for (int i = 0; i < num_iterations; i++) {
+          std::string stored;
+          NASSERT(results[i], "TEST BATCH: Mput reported a failed key");
+          NASSERT(server.store.get(keys[i], stored) && stored == values[i],
+                  "TEST BATCH: Mput value does not match server");
+        }
+
+        // Fetch a mix of stored, new, and missing keys
+        std::vector<std::string> mixed, fetched;
+        for (int i = 0; i < num_iterations; i++) {
+          mixed.push_back(next(begin(store), rand() % store.size())->first);
+          mixed.push_back(keys[i]);
+          mixed.push_back("missing" + std::to_string(i));
+        }
+        NASSERT(client.mget(mixed, fetched, results),
+                "TEST BATCH: Client mget failed");
+        NASSERT(fetched.size() == mixed.size());
+        for (size_t i = 0; i < mixed.size(); i++) {
+          std::string stored;
+          bool found = server.store.get(mixed[i], stored);
+          NASSERT(results[i] == found,
+                  "TEST BATCH: Mget found flag does not match server");
+          NASSERT(!found || fetched[i] == stored,
+                  "TEST BATCH: Mget value does not match server");
+        }
+
+        // Delete the new keys and one missing key
+        keys.push_back("missing");
+        NASSERT(client.mdel(keys, results), "TEST BATCH: Client mdel failed");
+        for (int i = 0; i < num_iterations; i++) {
+          std::string stored;
+          NASSERT(results[i], "TEST BATCH: Mdel missed an existing key");
+          NASSERT(!server.store.get(keys[i], stored),
+                  "TEST BATCH: Mdel left a key on the server");
+        }
+        NASSERT(!results.back(), "TEST BATCH: Mdel deleted a missing key");
+
+        // An empty batch succeeds without a request
+        NASSERT(client.mget({}, fetched, results) && fetched.empty());
+      }
+    } catch (std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Test slab accounting tracks entries of every size class, including
+  // values too large for a slab
+  bool test_memory(int num_iterations = NUM_ITERS) {
+    slab::stats loaded = server.store.memory();
+    NASSERT(loaded.allocations >= server.store.size(),
+            "TEST MEMORY: Fewer allocations than entries");
+    NASSERT(loaded.used_bytes <= loaded.reserved_bytes,
+            "TEST MEMORY: Used bytes exceed reserved bytes");
+    NASSERT(loaded.fragmentation() >= 0 && loaded.fragmentation() < 1,
+            "TEST MEMORY: Unexpected fragmentation");
+
+    for (int i = 0; i < num_iterations; i++) {
+      // Sizes from a few bytes to several times the largest slab chunk
+      std::string key = "memory" + std::to_string(i);
+      std::string value(i * 5 + 1, char('a' + i % 26));
+      std::string stored;
+      NASSERT(server.store.put(key, value), "TEST MEMORY: Put failed");
+      NASSERT(server.store.get(key, stored) && stored == value,
+              "TEST MEMORY: Value does not match after put");
+    }
+    slab::stats grown = server.store.memory();
+    NASSERT(grown.used_bytes > loaded.used_bytes,
+            "TEST MEMORY: Used bytes did not grow");
+
+    for (int i = 0; i < num_iterations; i++) {
+      NASSERT(server.store.del("memory" + std::to_string(i)),
+              "TEST MEMORY: Delete failed");
+    }
+    NASSERT(server.store.memory().used_bytes <= grown.used_bytes);
+    return true;
+  }
+
+  // Replay a log into a fresh store and check it matches expected
+  static bool replay_matches(
+      const std::string &path,
+      const std::unordered_map<std::string, std::string> &expected) {
+    wal log(path);
+    kvstore recovered;
+    recovered.recover(log);
+    NASSERT(recovered.size() == expected.size(),
+            "TEST WAL: Replayed store has the wrong size");
+    for (auto it = expected.begin(); it != expected.end(); it++) {
+      std::string value;
+      NASSERT(recovered.get(it->first, value) && value == it->second,
+              "TEST WAL: Replayed value does not match");
+    }
+    return true;
+  }
+
+  // Test every sync policy logs puts, deletes, and clears that replay to the
+  // same store, that a torn tail is dropped, and that the server only
+  // acknowledges writes once they are durable
+  bool test_wal(int num_iterations = NUM_ITERS) {
+    const std::string path =
+        "/tmp/kvstore_test_" + std::to_string(getpid()) + ".wal";
+    const wal::sync_policy policies[] = {
+        wal::SYNC_ALWAYS, wal::SYNC_INTERVAL, wal::SYNC_NEVER};
+
+    std::unordered_map<std::string, std::string> expected;
+    for (wal::sync_policy policy : policies) {
+      std::remove(path.c_str());
+      expected.clear();
+      {
+        wal log(path, policy, std::chrono::milliseconds(2));
+        kvstore logged;
+        logged.recover(log);
+        logged.attach_log(&log);
+
+        logged.put("cleared", "value");
+        logged.clear();
+        for (int i = 0; i < num_iterations; i++) {
+          auto it = next(begin(store), rand() % store.size());
+          logged.put(it->first, it->second);
+          expected[it->first] = it->second;
+          if (i % 3 == 0) {
+            logged.del(it->first);
+            expected.erase(it->first);
+          }
+        }
+        NASSERT(log.flush(), "TEST WAL: Flush failed");
+      }
+      if (!replay_matches(path, expected)) {
+        return false;
+      }
+    }
+
+    // A torn record at the end is dropped and cut from the file
+    struct stat intact;
+    NASSERT(stat(path.c_str(), &intact) == 0);
+    {
+      std::ofstream torn(path, std::ios::app | std::ios::binary);
+      torn << std::string("\x01\x02\x03\x04\x01\x00\x00", 7);
+    }
+    if (!replay_matches(path, expected)) {
+      return false;
+    }
+    struct stat truncated;
+    NASSERT(stat(path.c_str(), &truncated) == 0 &&
+                truncated.st_size == intact.st_size,
+            "TEST WAL: Torn tail was not truncated");
+    std::remove(path.c_str());
+
+    // Acknowledged writes through a logging server survive a restart
+    expected.clear();
+    {
+      wal log(path, wal::SYNC_ALWAYS);
+      boost::asio::io_service io_service;
+      kvserver logged_server(io_service, 0, &log);
+      boost::thread thread(
+          boost::bind(&boost::asio::io_service::run, &io_service));
+      {
+        kvclient client(
+            client_io_service, host, std::to_string(logged_server.port()));
+        for (int i = 0; i < num_iterations; i++) {
+          std::string key = "wal" + std::to_string(i);
+          NASSERT(client.put(key, key), "TEST WAL: Logged put failed");
+          NASSERT(log.sync_count() > 0,
+                  "TEST WAL: Put acknowledged before any sync");
+          expected[key] = key;
+        }
+      }
+      io_service.stop();
+      thread.join();
+    }
+    bool matched = replay_matches(path, expected);
+    std::remove(path.c_str());
+    return matched;
+  }
+
+  // Test a snapshot taken while writers run holds every pair that was not
+  // changed during it, and that a damaged snapshot is rejected
+  bool test_snapshot(int num_iterations = NUM_ITERS) {
+    const std::string path =
+        "/tmp/kvstore_test_" + std::to_string(getpid()) + ".snap";
+
+    // Churn keys outside the users.txt data while the snapshot is written
+    std::atomic<bool> done(false);
+    boost::thread writer([&]() {
+      for (int i = 0; !done; i = (i + 1) % num_iterations) {
+        std::string key = "snapshot" + std::to_string(i);
+        server.store.put(key, key);
+        server.store.del(key);
+      }
+    });
+    long long saved = snapshot::save(server.store, path);
+    done = true;
+    writer.join();
+    NASSERT(saved >= (long long)store.size(), "TEST SNAPSHOT: Save failed");
+
+    for (unsigned num_threads = 1; num_threads <= 4; num_threads *= 4) {
+      kvstore loaded;
+      NASSERT(snapshot::load(path, loaded, num_threads) == saved,
+              "TEST SNAPSHOT: Load returned the wrong count");
+      for (auto it = store.begin(); it != store.end(); it++) {
+        std::string value;
+        NASSERT(loaded.get(it->first, value) && value == it->second,
+                "TEST SNAPSHOT: Loaded value does not match");
+      }
+    }
+
+    // A truncated snapshot fails to load rather than loading partially
+    struct stat st;
+    NASSERT(stat(path.c_str(), &st) == 0 &&
+            truncate(path.c_str(), st.st_size / 2) == 0);
+    kvstore damaged;
+    NASSERT(snapshot::load(path, damaged) == -1,
+            "TEST SNAPSHOT: Loaded a truncated snapshot");
+
+    // A damaged partition found partway through leaves the store empty
+    kvstore small;
+    for (int i = 0; i < num_iterations; i++) {
+      small.put("damaged" + std::to_string(i), "value");
+    }
+    NASSERT(snapshot::save(small, path) == num_iterations);
+    std::string file;
+    {
+      std::ifstream in(path, std::ios::binary);
+      file.assign(std::istreambuf_iterator<char>(in),
+                  std::istreambuf_iterator<char>());
+    }
+    auto read_u64 = [&](size_t at) {
+      uint64_t value = 0;
+      for (size_t i = 0; i < 8; i++) {
+        value = value << 8 | uint8_t(file[at + i]);
+      }
+      return value;
+    };
+    // Shorten the last nonempty partition by a byte in the index
+    size_t entry = 0;
+    for (size_t at = read_u64(16); at < file.size(); at += 24) {
+      if (read_u64(at + 16) > 0) {
+        entry = at;
+      }
+    }
+    NASSERT(entry > 0);
+    uint64_t shortened = read_u64(entry + 16) - 1;
+    for (size_t i = 0; i < 8; i++) {
+      file[entry + 23 - i] = char(shortened >> (8 * i));
+    }
+    {
+      std::ofstream out(path, std::ios::binary | std::ios::trunc);
+      out << file;
+    }
+    NASSERT(snapshot::load(path, damaged) == -1 && damaged.size() == 0,
+            "TEST SNAPSHOT: Kept pairs from a damaged snapshot");
+
+    // A server refuses to start from a damaged snapshot, but starts empty
+    // when there is none
+    boost::asio::io_service io_service;
+    bool refused = false;
+    try {
+      kvserver restarted(io_service, 0, nullptr, path);
+    } catch (std::runtime_error &) {
+      refused = true;
+    }
+    NASSERT(refused, "TEST SNAPSHOT: Server started from a damaged snapshot");
+    std::remove(path.c_str());
+    NASSERT(snapshot::load(path, damaged) == -1,
+            "TEST SNAPSHOT: Loaded a missing snapshot");
+    {
+      kvserver fresh(io_service, 0, nullptr, path);
+      NASSERT(fresh.size() == 0,
+              "TEST SNAPSHOT: Server without a snapshot is not empty");
+    }
+    return true;
+  }
+
+  // Test a server with both a log and a snapshot replays only the records
+  // after the snapshot at startup, that saving a snapshot drops the records
+  // it holds from the log, even with writers running, and that the truncated
+  // log is refused without its snapshot
+  bool test_snapshot_log(int num_iterations = NUM_ITERS) {
+    const std::string path =
+        "/tmp/kvstore_test_" + std::to_string(getpid()) + ".snaplog";
+    const std::string log_path = path + ".wal";
+    std::remove(path.c_str());
+    std::remove(log_path.c_str());
+    boost::asio::io_service io_service;
+    {
+      wal log(log_path);
+      kvserver logged(io_service, 0, &log, path);
+      for (int i = 0; i < num_iterations; i++) {
+        logged.store.put("before" + std::to_string(i), "old");
+      }
+      NASSERT(logged.save_snapshot(path) == num_iterations,
+              "TEST SNAPSHOT LOG: Save failed");
+      struct stat st;
+      NASSERT(stat(log_path.c_str(), &st) == 0 && st.st_size == 16,
+              "TEST SNAPSHOT LOG: Log kept records the snapshot holds");
+
+      for (int i = 0; i < num_iterations; i++) {
+        logged.store.put("before" + std::to_string(i), "new");
+        logged.store.put("after" + std::to_string(i), "new");
+      }
+      NASSERT(log.flush());
+    }
+
+    // Only the records after the snapshot are replayed on top of it
+    {
+      uint64_t position = 0;
+      kvstore restored;
+      NASSERT(snapshot::load(path, restored, 1, &position) == num_iterations &&
+                  position == uint64_t(num_iterations),
+              "TEST SNAPSHOT LOG: Snapshot has the wrong log position");
+      wal log(log_path);
+      NASSERT(restored.recover(log, position) == size_t(2 * num_iterations),
+              "TEST SNAPSHOT LOG: Replayed records the snapshot holds");
+    }
+    {
+      wal log(log_path);
+      kvstore bare;
+      bool refused = false;
+      try {
+        bare.recover(log);
+      } catch (std::runtime_error &) {
+        refused = true;
+      }
+      NASSERT(refused, "TEST SNAPSHOT LOG: Replayed a truncated log alone");
+    }
+
+    // Restart with both, saving again while a writer runs
+    {
+      wal log(log_path);
+      kvserver restarted(io_service, 0, &log, path);
+      NASSERT(restarted.size() == size_t(2 * num_iterations),
+              "TEST SNAPSHOT LOG: Restart has the wrong size");
+      boost::thread writer([&]() {
+        for (int i = 0; i < num_iterations; i++) {
+          restarted.store.put("during" + std::to_string(i), "new");
+        }
+      });
+      NASSERT(restarted.save_snapshot(path) >= 2 * num_iterations,
+              "TEST SNAPSHOT LOG: Save during writes failed");
+      writer.join();
+      NASSERT(log.flush());
+    }
+    {
+      wal log(log_path);
+      kvserver restarted(io_service, 0, &log, path);
+      NASSERT(restarted.size() == size_t(3 * num_iterations),
+              "TEST SNAPSHOT LOG: Writes during the snapshot were lost");
+      for (int i = 0; i < num_iterations; i++) {
+        for (const char *prefix : {"before", "after", "during"}) {
+          std::string value;
+          NASSERT(restarted.store.get(prefix + std::to_string(i), value) &&
+                      value == "new",
+                  "TEST SNAPSHOT LOG: Restored value does not match");
+        }
+      }
+    }
+    std::remove(path.c_str());
+    std::remove(log_path.c_str());
+    return true;
+  }
+
+  // Test loading users.txt straight from the file on several threads keeps
+  // the last value of each duplicated key, as sequential puts would
+  bool test_bulk_load(int num_iterations = NUM_ITERS) {
+    std::unordered_map<std::string, std::string> expected;
+    std::ifstream users_file("src/users.txt");
+    std::string line;
+    while (getline(users_file, line)) {
+      expected[line.substr(0, line.find(" "))] =
+          line.substr(line.find(" ") + 1);
+    }
+
+    for (unsigned num_threads = 1; num_threads <= 8; num_threads *= 2) {
+      kvstore loaded;
+      NASSERT(loaded.bulk_load_file("src/users.txt", num_threads) > 0,
+              "TEST BULK LOAD: Unable to load users.txt");
+      NASSERT(loaded.size() == expected.size(),
+              "TEST BULK LOAD: Unexpected size after loading users.txt");
+      for (int i = 0; i < num_iterations; i++) {
+        auto it = next(begin(expected), rand() % expected.size());
+        std::string value;
+        NASSERT(loaded.get(it->first, value) && value == it->second,
+                "TEST BULK LOAD: Loaded value does not match users.txt");
+      }
+    }
+
+    kvstore missing;
+    NASSERT(missing.bulk_load_file("src/missing.txt") == -1,
+            "TEST BULK LOAD: Loaded a missing file");
+    return true;
+  }
+
+  // Test a memory-bounded store stays within its limit by evicting, keeps
+  // a key that is read between writes, and counts hits and misses
+  bool test_eviction(int num_iterations = NUM_ITERS) {
+    const size_t limit = 64 << 10;
+    kvstore bounded(8);
+    bounded.set_memory_limit(limit);
+    NASSERT(bounded.memory_limit() == limit);
+
+    std::string value;
+    NASSERT(bounded.put("hot", "value"));
+    for (int i = 0; i < num_iterations * 10; i++) {
+      std::string key = "evict" + std::to_string(i);
+      NASSERT(bounded.put(key, std::string(100, 'v')));
+      NASSERT(bounded.get("hot", value) && value == "value",
+              "TEST EVICTION: Evicted a key read after every write");
+      NASSERT(bounded.cache_usage().bytes <= limit,
+              "TEST EVICTION: Store grew past its memory limit");
+    }
+
+    kvstore::cache_stats stats = bounded.cache_usage();
+    NASSERT(stats.evictions > 0, "TEST EVICTION: Nothing was evicted");
+    NASSERT(bounded.size() + stats.evictions ==
+                size_t(num_iterations) * 10 + 1,
+            "TEST EVICTION: Evictions do not account for missing keys");
+    NASSERT(stats.hits == size_t(num_iterations) * 10,
+            "TEST EVICTION: Unexpected hit count");
+
+    int found = 0;
+    for (int i = 0; i < num_iterations * 10; i++) {
+      found += bounded.get("evict" + std::to_string(i), value);
+    }
+    stats = bounded.cache_usage();
+    NASSERT(stats.misses == size_t(num_iterations) * 10 - found,
+            "TEST EVICTION: Unexpected miss count");
+    NASSERT(stats.hit_ratio() > 0 && stats.hit_ratio() < 1);
+
+    // A pair larger than a shard's share is refused rather than flushing
+    // the shard, alone or in a batch
+    size_t before = bounded.size();
+    std::string oversized(limit / 8, 'v');
+    NASSERT(!bounded.put("hot", oversized) &&
+                !bounded.put("oversized", oversized),
+            "TEST EVICTION: Stored a pair larger than a shard's share");
+    std::vector<bool> stored;
+    bounded.multi_put({"oversized", "hot"}, {oversized, "value"}, stored);
+    NASSERT(stored.size() == 2 && !stored[0] && stored[1],
+            "TEST EVICTION: Batch stored a pair larger than a shard's share");
+    NASSERT(bounded.get("hot", value) && value == "value" &&
+                !bounded.get("oversized", value) &&
+                bounded.size() == before &&
+                bounded.cache_usage().evictions == stats.evictions,
+            "TEST EVICTION: Refused pair evicted the shard");
+
+    // Expired pairs the sweep reaches count as expirations, not evictions
+    kvstore expiring(1);
+    expiring.set_memory_limit(16 << 10);
+    for (int i = 0; i < 50; i++) {
+      NASSERT(expiring.put("ttl" + std::to_string(i),
+                           std::string(100, 'v'),
+                           std::chrono::milliseconds(1)));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    for (int i = 0; i < num_iterations; i++) {
+      NASSERT(expiring.put("live" + std::to_string(i), std::string(100, 'v')));
+    }
+    kvstore::cache_stats swept = expiring.cache_usage();
+    NASSERT(swept.expirations == 50,
+            "TEST EVICTION: Expired pairs not counted as expirations");
+    NASSERT(expiring.size() + swept.evictions == size_t(num_iterations),
+            "TEST EVICTION: Expired pairs counted as evictions");
+
+    // Removing the limit stops eviction
+    stats = bounded.cache_usage();
+    bounded.set_memory_limit(0);
+    for (int i = 0; i < num_iterations; i++) {
+      bounded.put("unbounded" + std::to_string(i), std::string(100, 'v'));
+    }
+    NASSERT(bounded.cache_usage().evictions == stats.evictions,
+            "TEST EVICTION: Evicted without a limit");
+    return true;
+  }
+
+  // Test TTLs parse in both protocols, that the timing wheel fires every
+  // value once and on time, and that expired pairs miss, are reaped without
+  // touching live ones, and survive neither a replay nor a snapshot
+  bool test_ttl(int num_iterations = NUM_ITERS) {
+    message_view view;
+    NASSERT(view.decode("PUT key value 250") && view.type == PUT &&
+                view.value == "value" && view.ttl == 250,
+            "TEST TTL: Text TTL not parsed");
+    // A fourth token that is not a TTL used to be ignored; it is now refused
+    NASSERT(!view.decode("PUT key value soon") &&
+                !view.decode("PUT key value 0"),
+            "TEST TTL: Accepted an invalid TTL");
+    {
+      tcp::socket socket(client_io_service);
+      socket.connect(tcp::endpoint(boost::asio::ip::address_v4::loopback(),
+                                   server.port()));
+      boost::asio::write(
+          socket,
+          boost::asio::buffer(std::string("PUT ttlbad value soon\n"
+                                          "GET ttlbad\n")));
+      std::string replies;
+      while (std::count(replies.begin(), replies.end(), '\n') < 2) {
+        char buffer[64];
+        replies.append(buffer,
+                       socket.read_some(boost::asio::buffer(buffer)));
+      }
+      NASSERT(replies == "ERR\nERR\n",
+              "TEST TTL: Server stored a PUT with an invalid TTL");
+    }
+    message m(PUT, "key", "value");
+    NASSERT(m.set_ttl(250));
+    std::string encoded;
+    NASSERT(m.encode_binary(encoded) && encoded.size() > BINARY_HEADER_SIZE);
+    binary_header header;
+    NASSERT(header.read(encoded.data()));
+    message decoded;
+    NASSERT(decoded.decode_binary(header,
+                                  encoded.substr(BINARY_HEADER_SIZE)) &&
+                decoded.get_ttl() == 250 && decoded.get_value() == "value",
+            "TEST TTL: Binary TTL did not round trip");
+
+    // Deadlines across every level fire exactly once, never early, and
+    // within a step of when they are due. With 1 ms ticks the longest
+    // deadlines overflow the top level and are parked.
+    const uint64_t step = 4000;
+    timing_wheel<int> wheel(0, 1);
+    std::vector<uint64_t> deadlines(num_iterations * 10);
+    for (size_t i = 0; i < deadlines.size(); i++) {
+      deadlines[i] = uint64_t(rand()) % (1ull << (6 + rand() % 21)) + 1;
+      wheel.schedule(deadlines[i], int(i));
+    }
+    std::vector<int> fired(deadlines.size(), 0);
+    bool on_time = true;
+    for (uint64_t now = step; wheel.size() > 0; now += step) {
+      wheel.expire(now, deadlines.size(), [&](int i) {
+        on_time = on_time && deadlines[i] <= now && deadlines[i] + step > now;
+        fired[i]++;
+      });
+    }
+    NASSERT(on_time, "TEST TTL: Wheel fired a value at the wrong time");
+    NASSERT(std::count(fired.begin(), fired.end(), 1) == int(fired.size()),
+            "TEST TTL: Wheel did not fire every value once");
+
+    const std::string path =
+        "/tmp/kvstore_test_" + std::to_string(getpid()) + ".ttl";
+    std::remove(path.c_str());
+    {
+      wal log(path, wal::SYNC_NEVER);
+      kvstore expiring;
+      expiring.recover(log);
+      expiring.attach_log(&log);
+      for (int i = 0; i < num_iterations; i++) {
+        std::string key = "ttl" + std::to_string(i);
+        expiring.put(key, key, std::chrono::milliseconds(200));
+        expiring.put("live" + key, key, std::chrono::hours(1));
+      }
+      // Overwriting without a TTL keeps the pair past its old deadline
+      expiring.put("ttl0", "kept");
+
+      std::string value;
+      NASSERT(expiring.get("ttl1", value) && value == "ttl1",
+              "TEST TTL: Pair missing before it expired");
+      NASSERT(snapshot::save(expiring, path + ".snap") == 2 * num_iterations,
+              "TEST TTL: Snapshot saved the wrong pairs");
+      std::this_thread::sleep_for(std::chrono::milliseconds(250));
+      NASSERT(!expiring.get("ttl1", value),
+              "TEST TTL: Expired pair was returned");
+      NASSERT(!expiring.del("ttl2"), "TEST TTL: Deleted an expired pair");
+
+      // Reaping happens in slices; keep going until the wheel is drained
+      size_t reaped = 0;
+      for (int i = 0; i < num_iterations && reaped < size_t(num_iterations);
+           i++) {
+        reaped += expiring.expire(4);
+      }
+      NASSERT(reaped == size_t(num_iterations) - 2,
+              "TEST TTL: Reaped the wrong number of pairs");
+      NASSERT(expiring.size() == size_t(num_iterations) + 1 &&
+                  expiring.cache_usage().expirations == reaped,
+              "TEST TTL: Size does not reflect reaped pairs");
+      NASSERT(expiring.get("ttl0", value) && value == "kept",
+              "TEST TTL: Reaped a pair that was overwritten without a TTL");
+      NASSERT(expiring.get("livettl1", value),
+              "TEST TTL: Reaped a pair that has not expired");
+      NASSERT(log.flush());
+    }
+
+    // Replay and snapshot loads skip pairs that expired in the meantime
+    wal log(path);
+    kvstore replayed;
+    replayed.recover(log);
+    kvstore loaded;
+    NASSERT(snapshot::load(path + ".snap", loaded) == 2 * num_iterations);
+    for (kvstore *restored : {&replayed, &loaded}) {
+      std::string value;
+      NASSERT(!restored->get("ttl1", value) &&
+                  restored->get("livettl1", value) && value == "ttl1",
+              "TEST TTL: Restored store has the wrong pairs");
+    }
+    NASSERT(replayed.size() == size_t(num_iterations) + 1,
+            "TEST TTL: Replay restored expired pairs");
+    std::remove(path.c_str());
+    std::remove((path + ".snap").c_str());
+
+    // Through the server, the pair lives until its TTL and is then reaped
+    // by the server's own timer
+    kvclient client(client_io_service, host, client_port);
+    NASSERT(client.put("ttl_client", "value", 50),
+            "TEST TTL: Client put with a TTL failed");
+    std::string value;
+    NASSERT(client.get("ttl_client", value) && value == "value");
+    std::this_thread::sleep_for(std::chrono::milliseconds(100));
+    NASSERT(!client.get("ttl_client", value),
+            "TEST TTL: Server returned an expired pair");
+    return true;
+  }
+
+  // Test the latency histogram reports exact small values, percentiles of
+  // large ones to within its bucket precision, and merges losslessly
+  bool test_histogram(int num_iterations = NUM_ITERS) {
+    histogram small;
+    for (int i = 0; i < 100; i++) {
+      small.record(i);
+    }
+    NASSERT(small.percentile(0.5) == 49 && small.percentile(1) == 99 &&
+                small.min() == 0,
+            "TEST HISTOGRAM: Small values are not exact");
+
+    histogram low, high, all;
+    const uint64_t scale = 1000003;
+    for (int i = 1; i <= num_iterations * 100; i++) {
+      (i % 2 ? low : high).record(uint64_t(i) * scale);
+      all.record(uint64_t(i) * scale);
+    }
+    low.merge(high);
+    const double quantiles[] = {0.5, 0.9, 0.99, 0.999, 1};
+    for (double q : quantiles) {
+      double exact = q * num_iterations * 100 * scale;
+      NASSERT(std::abs(all.percentile(q) - exact) <= exact / 64,
+              "TEST HISTOGRAM: Percentile outside the bucket precision");
+      NASSERT(low.percentile(q) == all.percentile(q),
+              "TEST HISTOGRAM: Merged histogram differs");
+    }
+    NASSERT(all.count() == size_t(num_iterations) * 100 &&
+                all.max() == uint64_t(num_iterations) * 100 * scale,
+            "TEST HISTOGRAM: Wrong count or maximum");
+    all.reset();
+    NASSERT(all.count() == 0 && all.percentile(0.99) == 0);
+    return true;
+  }
+
+  // Test shard locks count every acquisition, and count a writer that
+  // waits behind a held lock along with how long it waited
+  bool test_lock_usage(int num_iterations = NUM_ITERS) {
+    kvstore single(1);
+    for (int i = 0; i < num_iterations; i++) {
+      single.put("lock" + std::to_string(i), "value");
+    }
+    contended_mutex::stats before = single.lock_usage();
+    NASSERT(before.acquisitions == size_t(num_iterations) &&
+                before.contentions == 0,
+            "TEST LOCK USAGE: Uncontended puts miscounted");
+
+    single.shards[0].lock.lock();
+    std::thread writer([&]() { single.put("blocked", "value"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    single.shards[0].lock.unlock();
+    writer.join();
+
+    contended_mutex::stats after = single.lock_usage();
+    NASSERT(after.acquisitions == before.acquisitions + 2 &&
+                after.contentions == 1 && after.wait_ns >= 10000000,
+            "TEST LOCK USAGE: Blocked writer was not counted");
+    return true;
+  }
+
+  // Verify STATS counts requests in both protocols and reports the store,
+  // and that the HTTP endpoint serves the same metrics to Prometheus
+  bool test_stats(int num_iterations = NUM_ITERS) {
+    striped_histogram latencies;
+    std::vector<std::thread> recorders;
+    for (int t = 0; t < 4; t++) {
+      recorders.emplace_back([&, t]() {
+        for (int i = 1; i <= num_iterations; i++) {
+          latencies.record(i * (t + 1));
+        }
+      });
+    }
+    for (std::thread &recorder : recorders) {
+      recorder.join();
+    }
+    histogram merged = latencies.load();
+    NASSERT(merged.count() == uint64_t(num_iterations) * 4 &&
+                merged.max() == uint64_t(num_iterations) * 4,
+            "TEST STATS: Striped histogram lost values");
+
+    for (protocol_type protocol : {TEXT_PROTOCOL, BINARY_PROTOCOL}) {
+      kvclient client(client_io_service, host, client_port, protocol);
+      std::map<std::string, std::string> before;
+      NASSERT(client.stats(before), "TEST STATS: STATS failed");
+      for (int i = 0; i < num_iterations; i++) {
+        client.async_get(store.begin()->first,
+                         [](bool, const std::string &) {});
+        client.async_put("stats" + std::to_string(i), "value", [](bool) {});
+      }
+      client.wait();
+
+      std::map<std::string, std::string> after;
+      NASSERT(client.stats(after), "TEST STATS: STATS failed");
+      NASSERT(std::stoull(after["get_requests_total"]) -
+                      std::stoull(before["get_requests_total"]) ==
+                  uint64_t(num_iterations) &&
+              std::stoull(after["put_requests_total"]) -
+                      std::stoull(before["put_requests_total"]) ==
+                  uint64_t(num_iterations),
+              "TEST STATS: Requests miscounted");
+      NASSERT(std::stoull(after["cache_hits_total"]) -
+                      std::stoull(before["cache_hits_total"]) >=
+                  uint64_t(num_iterations) &&
+                  std::stoull(after["connections"]) >= 1 &&
+                  std::stoull(after["keys"]) == server.size() &&
+                  std::stoull(after["received_bytes_total"]) >
+                      std::stoull(before["received_bytes_total"]) &&
+                  after.count("lock_contention_ratio") &&
+                  std::stod(after["get_latency_p99_us"]) > 0,
+              "TEST STATS: Report is incomplete");
+      for (int i = 0; i < num_iterations; i++) {
+        client.del("stats" + std::to_string(i));
+      }
+    }
+
+    unsigned short metrics_port = server.serve_metrics(0);
+    tcp::socket socket(client_io_service);
+    socket.connect(tcp::endpoint(
+        boost::asio::ip::address_v4::loopback(), metrics_port));
+    boost::asio::write(socket,
+                       boost::asio::buffer(std::string(
+                           "GET /metrics HTTP/1.1\r\nHost: test\r\n\r\n")));
+    std::string page;
+    boost::system::error_code error;
+    boost::asio::read(socket, boost::asio::dynamic_buffer(page), error);
+    NASSERT(page.rfind("HTTP/1.1 200 OK\r\n", 0) == 0 &&
+                page.find("# TYPE kvserver_connections gauge") !=
+                    std::string::npos &&
+                page.find("kvserver_request_duration_seconds_count{"
+                          "command=\"get\"}") != std::string::npos,
+            "TEST STATS: Prometheus endpoint did not serve metrics");
+    return true;
+  }
+
+  // Verify the hot key sketch finds the hottest keys among many cold ones,
+  // that shard lock waits are filed per stripe, and that both reports are
+  // served through STATS
+  bool test_hot_keys(int num_iterations = NUM_ITERS) {
+    const int num_hot = 5;
+    hot_keys sketch(num_hot * 2);
+    std::vector<std::string> accesses;
+    for (int i = 0; i < num_iterations * 20; i++) {
+      accesses.push_back("cold" + std::to_string(i));
+    }
+    for (int h = 0; h < num_hot; h++) {
+      for (int i = 0; i < num_iterations * (h + 1); i++) {
+        accesses.push_back("hot" + std::to_string(h));
+      }
+    }
+    std::shuffle(accesses.begin(), accesses.end(), std::mt19937(411));
+    std::hash<std::string_view> hash;
+    for (const std::string &key : accesses) {
+      sketch.record(hash(key), key);
+    }
+    std::vector<hot_keys::entry> top = sketch.top();
+    NASSERT(top.size() >= size_t(num_hot), "TEST HOT KEYS: Table too small");
+    for (int h = 0; h < num_hot; h++) {
+      uint64_t actual = num_iterations * (num_hot - h);
+      NASSERT(top[h].key == "hot" + std::to_string(num_hot - 1 - h) &&
+                  top[h].count > actual / 2 && top[h].count < actual * 2,
+              "TEST HOT KEYS: Hottest keys missed or miscounted");
+    }
+    sketch.reset();
+    NASSERT(sketch.top().empty(), "TEST HOT KEYS: Reset kept keys");
+
+    kvstore striped(4);
+    std::string key = "stripe";
+    size_t shard = std::hash<std::string_view>{}(key) % 4;
+    striped.shards[shard].lock.lock();
+    std::thread writer([&]() { striped.put(key, "value"); });
+    std::this_thread::sleep_for(std::chrono::milliseconds(20));
+    striped.shards[shard].lock.unlock();
+    writer.join();
+    std::vector<contended_mutex::stats> stripes = striped.stripe_usage();
+    NASSERT(stripes.size() == 4 && stripes[shard].contentions == 1 &&
+                stripes[shard].wait_percentile(0.99) >= 10000000 &&
+                stripes[(shard + 1) % 4].contentions == 0,
+            "TEST HOT KEYS: Stripe wait not filed under its shard");
+
+    kvclient client(client_io_service, host, client_port);
+    std::map<std::string, std::string> report;
+    NASSERT(client.stats(report, "hotkeys", "reset") &&
+                client.stats(report, "hotkeys", "on"),
+            "TEST HOT KEYS: Unable to start tracking");
+    const std::string &hot = store.begin()->first;
+    for (int i = 0; i < num_iterations; i++) {
+      client.async_get(hot, [](bool, const std::string &) {});
+    }
+    client.wait();
+    report.clear();
+    NASSERT(client.stats(report, "hotkeys") && report.count(hot) &&
+                std::stoull(report[hot]) >= uint64_t(num_iterations) / 2,
+            "TEST HOT KEYS: Server did not report the hot key");
+    report.clear();
+    NASSERT(client.stats(report, "stripes") &&
+                std::stoull(report["stripes"]) ==
+                    size_t(server.store.shard_count()),
+            "TEST HOT KEYS: Server did not report stripes");
+    NASSERT(client.stats(report, "hotkeys", "off") &&
+                !server.store.tracking_hot_keys() &&
+                !client.stats(report, "bogus"),
+            "TEST HOT KEYS: STATS sections mishandled");
+    return true;
+  }
+
+  // Read client's cached value of key until it is expected or a second
+  // passes, without ever sending the read while it stays cached
+  static bool eventually_reads(kvclient &client,
+                               const std::string &key,
+                               const std::string &expected) {
+    for (int i = 0; i < 1000; i++) {
+      std::string value;
+      bool found = client.get(key, value);
+      if (found ? value == expected : expected.empty()) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+
+  // Verify near caches serve repeated reads locally, are invalidated by
+  // other connections' writes, deletes, and expiry, and never go back to an
+  // older value while a writer races them
+  bool test_near_cache(int num_iterations = NUM_ITERS) {
+    tracking_table table(tracking_table::NUM_STRIPES);
+    std::vector<uint64_t> notified;
+    auto note = [&](uint64_t client, std::string_view) {
+      notified.push_back(client);
+    };
+    table.track("near", 1, note);
+    table.track("near", 2, note);
+    table.track("near", 2, note);
+    table.invalidate("near", note);
+    table.invalidate("near", note);
+    NASSERT(notified == std::vector<uint64_t>({1, 2}) && table.size() == 0,
+            "TEST NEAR CACHE: Tracking table notified wrongly");
+
+    for (protocol_type protocol : {TEXT_PROTOCOL, BINARY_PROTOCOL}) {
+      kvclient reader(client_io_service, host, client_port, protocol);
+      kvclient writer(client_io_service, host, client_port);
+      NASSERT(writer.put("near", "1") && reader.enable_cache(2),
+              "TEST NEAR CACHE: Unable to enable the cache");
+
+      std::string value;
+      for (int i = 0; i < num_iterations; i++) {
+        NASSERT(reader.get("near", value) && value == "1",
+                "TEST NEAR CACHE: Wrong cached value");
+      }
+      kvclient::cache_stats stats = reader.cache_usage();
+      NASSERT(stats.misses == 1 && stats.hits == uint64_t(num_iterations - 1),
+              "TEST NEAR CACHE: Repeated reads left the process");
+
+      NASSERT(writer.put("near", "2") && eventually_reads(reader, "near", "2"),
+              "TEST NEAR CACHE: Write was not invalidated");
+      NASSERT(writer.del("near") && eventually_reads(reader, "near", ""),
+              "TEST NEAR CACHE: Delete was not invalidated");
+      NASSERT(writer.put("near", "3", 50) &&
+                  eventually_reads(reader, "near", "3") &&
+                  eventually_reads(reader, "near", ""),
+              "TEST NEAR CACHE: Expiry was not invalidated");
+      NASSERT(reader.cache_usage().invalidations >= 3,
+              "TEST NEAR CACHE: Invalidations were not pushed");
+
+      for (int i = 0; i < 3; i++) {
+        writer.put("near" + std::to_string(i), "value");
+        reader.get("near" + std::to_string(i), value);
+      }
+      NASSERT(reader.cache_usage().size == 2,
+              "TEST NEAR CACHE: Cache outgrew its capacity");
+
+      // Values only move forward while a writer races the cache, and the
+      // last write is seen
+      std::thread racer([&]() {
+        kvclient racing(client_io_service, host, client_port);
+        for (int i = 1; i <= num_iterations; i++) {
+          racing.put("race", std::to_string(i));
+        }
+      });
+      std::chrono::steady_clock::time_point deadline =
+          std::chrono::steady_clock::now() + std::chrono::seconds(10);
+      int last = 0;
+      bool forward = true;
+      while (last < num_iterations && forward &&
+             std::chrono::steady_clock::now() < deadline) {
+        if (reader.get("race", value)) {
+          forward = std::stoi(value) >= last;
+          last = std::stoi(value);
+        }
+      }
+      racer.join();
+      NASSERT(forward, "TEST NEAR CACHE: Cache went back to an older value");
+      NASSERT(last == num_iterations,
+              "TEST NEAR CACHE: Last write was never seen");
+      reader.disable_cache();
+      writer.del("race");
+    }
+    return true;
+  }
+
+  // Count the threads in this process from /proc/self/status
+  static int count_threads() {
+    std::ifstream status("/proc/self/status");
+    std::string line;
+    while (getline(status, line)) {
+      if (line.compare(0, 8, "Threads:") == 0) {
+        return atoi(line.c_str() + 8);
+      }
+    }
+    return -1;
+  }
+
+  // Open many mostly idle connections at once and verify the server answers
+  // on all of them without spawning a thread per connection
+  bool test_many_connections(int num_iterations = NUM_ITERS) {
+    const int num_connections = num_iterations * 2;
+    int threads_before = count_threads();
+
+    try {
+      std::vector<std::unique_ptr<kvclient>> connections;
+      for (int i = 0; i < num_connections; i++) {
+        connections.push_back(
+            std::make_unique<kvclient>(client_io_service, host, client_port));
+      }
+
+      // Issue a request on every connection while all of them stay open
+      for (int i = 0; i < num_connections; i++) {
+        auto it = next(begin(store), rand() % store.size());
+        std::string value;
+        NASSERT(connections[i]->get(it->first, value),
+                "TEST MANY CONNECTIONS: Client get existing key failed");
+        NASSERT(value == it->second,
+                "TEST MANY CONNECTIONS: Client value does not match database");
+      }
+
+      NASSERT(count_threads() == threads_before,
+              "TEST MANY CONNECTIONS: Server spawned threads per connection");
+    } catch (std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      return false;
+    }
+    return true;
+  }
+
+  // Test the io_uring transport serves what the Asio one does: pipelined
+  // text and binary requests, batches, values larger than its receive
+  // buffers, pushed invalidations, and logged writes acknowledged only once
+  // durable. Skipped where the kernel has no io_uring.
+  bool test_uring(int num_iterations = NUM_ITERS) {
+    const std::string path =
+        "/tmp/kvstore_test_" + std::to_string(getpid()) + ".uring.wal";
+    try {
+      wal log(path, wal::SYNC_ALWAYS);
+      boost::asio::io_service io_service;
+      std::unique_ptr<kvserver> ring_server;
+      try {
+        ring_server = std::make_unique<kvserver>(io_service, 0, &log, "", 2);
+      } catch (std::system_error &e) {
+        std::cout << "TEST URING: Skipped, " << e.what() << std::endl;
+        std::remove(path.c_str());
+        return true;
+      }
+      std::string port = std::to_string(ring_server->port());
+      boost::thread timers(
+          boost::bind(&boost::asio::io_service::run, &io_service));
+
+      std::string large(1 << 18, 'x'); // Spans many provided buffers
+      for (protocol_type protocol : {TEXT_PROTOCOL, BINARY_PROTOCOL}) {
+        kvclient client(client_io_service, host, port, protocol);
+        uint64_t syncs = log.sync_count();
+        int completed = 0;
+        for (int i = 0; i < num_iterations; i++) {
+          std::string key = "uring" + std::to_string(i);
+          NASSERT(client.async_put(key, key, [&](bool ok) {
+            NASSERT(ok, "TEST URING: Pipelined put failed");
+            completed++;
+          }));
+          NASSERT(client.async_get(
+              key, [&, key](bool found, const std::string &value) {
+                NASSERT(found && value == key,
+                        "TEST URING: Pipelined get missed its own put");
+                completed++;
+              }));
+        }
+        client.wait();
+        NASSERT(completed == num_iterations * 2,
+                "TEST URING: Not every pipelined request completed");
+        NASSERT(log.sync_count() > syncs,
+                "TEST URING: Puts acknowledged without a sync");
+
+        std::vector<std::string> values;
+        std::vector<bool> found;
+        NASSERT(client.mget({"uring0", "uring1", "uring_missing"},
+                            values,
+                            found) &&
+                    values[1] == "uring1" &&
+                    found == std::vector<bool>({true, true, false}),
+                "TEST URING: Batch get returned wrong results");
+
+        std::string value;
+        NASSERT(client.put("uring_large", large) &&
+                    client.get("uring_large", value) && value == large,
+                "TEST URING: Large value did not round trip");
+        for (int i = 0; i < num_iterations; i++) {
+          NASSERT(client.del("uring" + std::to_string(i)),
+                  "TEST URING: Delete failed");
+        }
+      }
+
+      // A write on one connection invalidates another's near cache
+      kvclient reader(client_io_service, host, port);
+      kvclient writer(client_io_service, host, port, BINARY_PROTOCOL);
+      std::string value;
+      NASSERT(writer.put("uring_near", "1") && reader.enable_cache(4) &&
+                  reader.get("uring_near", value) && value == "1",
+              "TEST URING: Unable to cache a value");
+      NASSERT(writer.put("uring_near", "2") &&
+                  eventually_reads(reader, "uring_near", "2"),
+              "TEST URING: Write was not invalidated");
+
+      // Many open connections are spread over the rings
+      std::vector<std::unique_ptr<kvclient>> connections;
+      for (int i = 0; i < num_iterations / 4; i++) {
+        connections.push_back(
+            std::make_unique<kvclient>(client_io_service, host, port));
+        NASSERT(connections.back()->get("uring_near", value) && value == "2",
+                "TEST URING: Connection read the wrong value");
+      }
+      std::map<std::string, std::string> report;
+      NASSERT(reader.stats(report) &&
+                  std::stoull(report["connections"]) >= connections.size() &&
+                  std::stoull(report["ring_enters_total"]) > 0,
+              "TEST URING: Stats do not count the rings");
+
+      io_service.stop();
+      timers.join();
+    } catch (std::exception &e) {
+      std::cerr << e.what() << std::endl;
+      std::remove(path.c_str());
+      return false;
+    }
+    std::remove(path.c_str());
+    return true;
+  }
+
+  bool test_per_core(int num_iterations = NUM_ITERS) {
+    // The queue hands every item across threads, in order
+    const int num_items = 100 * num_iterations;
+    spsc_queue<int> queue(64);
+    bool ordered = true;
+    std::thread consumer([&]() {
+      int item;
+      for (int expected = 0; expected < num_items;) {
+        if (queue.pop(item)) {
+          ordered = ordered && item == expected;
+          expected++;
+        } else {
+          std::this_thread::yield();
+        }
+      }
+    });
+    for (int i = 0; i < num_items; i++) {
+      while (!queue.push(i)) {
+        std::this_thread::yield();
+      }
+    }
+    consumer.join();
+    NASSERT(ordered, "TEST PER CORE: Queue reordered or lost items");
+
+    // More cores than this host may have CPUs; they share them
+    core_server cores(0, 4);
+    std::string port = std::to_string(cores.port());
+    for (protocol_type protocol : {TEXT_PROTOCOL, BINARY_PROTOCOL}) {
+      kvclient client(client_io_service, host, port, protocol);
+      // Pipelined requests for keys on every core answer in order
+      int next = 0;
+      for (int i = 0; i < num_iterations; i++) {
+        std::string key = "core" + std::to_string(i);
+        int put_index = 3 * i;
+        NASSERT(client.async_put(key, key + "_value", [&, put_index](bool ok) {
+          NASSERT(ok && next++ == put_index,
+                  "TEST PER CORE: Pipelined put failed or out of order");
+        }));
+        NASSERT(client.async_get(
+            key, [&, key, put_index](bool found, const std::string &value) {
+              NASSERT(found && value == key + "_value" &&
+                          next++ == put_index + 1,
+                      "TEST PER CORE: Pipelined get missed its own put");
+            }));
+        NASSERT(client.async_get(
+            "core_missing" + std::to_string(i),
+            [&, put_index](bool found, const std::string &) {
+              NASSERT(!found && next++ == put_index + 2,
+                      "TEST PER CORE: Missing key found or out of order");
+            }));
+      }
+      client.wait();
+      NASSERT(next == 3 * num_iterations,
+              "TEST PER CORE: Not every pipelined request completed");
+      NASSERT(cores.size() == size_t(num_iterations),
+              "TEST PER CORE: Keys were not stored once each");
+      for (size_t i = 0; i < cores.num_cores(); i++) {
+        NASSERT(cores.cores[i]->store.size() > 0,
+                "TEST PER CORE: A core owns no keys");
+      }
+
+      // Batches span cores
+      std::vector<std::string> values;
+      std::vector<bool> results;
+      NASSERT(client.mput({"core_a", "core_b", "core_c"},
+                          {"1", "2", "3"},
+                          results) &&
+                  results == std::vector<bool>({true, true, true}),
+              "TEST PER CORE: Batch put failed");
+      NASSERT(client.mget({"core0", "core_b", "core_missing"},
+                          values,
+                          results) &&
+                  values[0] == "core0_value" && values[1] == "2" &&
+                  results == std::vector<bool>({true, true, false}),
+              "TEST PER CORE: Batch get returned wrong results");
+      NASSERT(client.mdel({"core_a", "core_b", "core_c"}, results) &&
+                  results == std::vector<bool>({true, true, true}),
+              "TEST PER CORE: Batch delete failed");
+
+      // Pipelined between single-key requests, split batches answer in
+      // order with each key's result in its place
+      std::vector<std::string> keys, batch_values;
+      for (int i = 0; i < 32; i++) {
+        keys.push_back("core_batch" + std::to_string(i));
+        batch_values.push_back("line\nbreak" + std::to_string(i));
+      }
+      std::vector<std::string> probe = keys;
+      probe.insert(probe.begin() + 16, "core_batch_missing");
+      next = 0;
+      NASSERT(client.async_put("core_single", "a", [&](bool ok) {
+        NASSERT(ok && next++ == 0, "TEST PER CORE: Put before batch failed");
+      }));
+      NASSERT(client.async_mput(
+          keys,
+          batch_values,
+          [&](const std::vector<bool> &ok, const std::vector<std::string> &) {
+            NASSERT(ok == std::vector<bool>(keys.size(), true) &&
+                        next++ == 1,
+                    "TEST PER CORE: Split batch put failed");
+          }));
+      NASSERT(client.async_put("core_single", "b", [&](bool ok) {
+        NASSERT(ok && next++ == 2, "TEST PER CORE: Put after batch failed");
+      }));
+      NASSERT(client.async_mget(
+          probe,
+          [&](const std::vector<bool> &ok,
+              const std::vector<std::string> &found) {
+            bool placed = ok.size() == probe.size() && !ok[16];
+            for (size_t i = 0; placed && i < keys.size(); i++) {
+              size_t at = i < 16 ? i : i + 1;
+              placed = ok[at] && found[at] == batch_values[i];
+            }
+            NASSERT(placed && next++ == 3,
+                    "TEST PER CORE: Split batch get misplaced results");
+          }));
+      NASSERT(client.async_get(
+          "core_single", [&](bool found, const std::string &single) {
+            NASSERT(found && single == "b" && next++ == 4,
+                    "TEST PER CORE: Get after batch read the wrong value");
+          }));
+      NASSERT(client.async_mdel(
+          probe,
+          [&](const std::vector<bool> &ok, const std::vector<std::string> &) {
+            std::vector<bool> expected(probe.size(), true);
+            expected[16] = false;
+            NASSERT(ok == expected && next++ == 5,
+                    "TEST PER CORE: Split batch delete failed");
+          }));
+      NASSERT(client.async_del("core_single", [&](bool ok) {
+        NASSERT(ok && next++ == 6, "TEST PER CORE: Delete after batch failed");
+      }));
+      client.wait();
+      NASSERT(next == 7, "TEST PER CORE: Not every batch request completed");
+      NASSERT(!client.enable_cache(4),
+              "TEST PER CORE: Tracking accepted without shared tracking");
+
+      for (int i = 0; i < num_iterations; i++) {
+        NASSERT(client.del("core" + std::to_string(i)),
+                "TEST PER CORE: Delete failed");
+      }
+      NASSERT(cores.size() == 0, "TEST PER CORE: Deleted keys remain");
+    }
+
+    // Connections spread over the cores all see every core's keys
+    kvclient writer(client_io_service, host, port);
+    NASSERT(writer.put("core_shared", "1"),
+            "TEST PER CORE: Unable to put a shared key");
+    std::vector<std::unique_ptr<kvclient>> connections;
+    std::string value;
+    for (int i = 0; i < num_iterations / 4; i++) {
+      connections.push_back(
+          std::make_unique<kvclient>(client_io_service, host, port));
+      NASSERT(connections.back()->get("core_shared", value) && value == "1",
+              "TEST PER CORE: Connection read the wrong value");
+    }
+    std::map<std::string, std::string> report;
+    NASSERT(writer.stats(report) &&
+                std::stoull(report["connections"]) >= connections.size(),
+            "TEST PER CORE: Stats do not count every core's connections");
+    return true;
+  }
+
+  // Test that the ordered index lists keys by prefix in order, pages with a
+  // cursor without repeats, follows deletes, expiry, and clear, stays
+  // sorted while writers change it, and that SCAN works in both protocols
+  bool test_scan(int num_iterations = NUM_ITERS) {
+    message_view view;
+    NASSERT(view.decode("SCAN zad 10 zad4") && view.type == SCAN &&
+                view.key == "zad" && view.limit == 10 && view.value == "zad4",
+            "TEST SCAN: Text SCAN not parsed");
+    NASSERT(view.decode("SCAN  5") && view.key.empty() && view.limit == 5,
+            "TEST SCAN: Empty prefix not parsed");
+    NASSERT(!view.decode("SCAN zad 0") && !view.decode("SCAN zad"),
+            "TEST SCAN: Accepted an invalid count");
+
+    // Keys stored before the index is enabled are indexed too
+    kvstore store;
+    NASSERT(store.scan("", "", 10, [](std::string_view) {}) == 0,
+            "TEST SCAN: Scanned without an index");
+    std::vector<std::string> zad;
+    for (int i = 0; i < num_iterations; i++) {
+      if (i == num_iterations / 2) {
+        store.enable_ordered_index();
+      }
+      std::string key = (i % 2 ? "zad" : "tui") + std::to_string(i);
+      store.put(key, "value");
+      if (i % 2) {
+        zad.push_back(key);
+      }
+    }
+    std::sort(zad.begin(), zad.end());
+    std::vector<std::string> seen;
+    std::string cursor;
+    while (store.scan("zad", cursor, 7, [&](std::string_view key) {
+      seen.emplace_back(key);
+    })) {
+      cursor = seen.back();
+    }
+    NASSERT(seen == zad, "TEST SCAN: Pages did not list every key in order");
+
+    store.del(zad[0]);
+    store.put(zad[1], "replaced");
+    store.put("zad_expiring", "value", std::chrono::milliseconds(1));
+    std::this_thread::sleep_for(std::chrono::milliseconds(5));
+    seen.clear();
+    store.scan("zad", "", zad.size() + 10, [&](std::string_view key) {
+      seen.emplace_back(key);
+    });
+    NASSERT(seen == std::vector<std::string>(zad.begin() + 1, zad.end()),
+            "TEST SCAN: Deleted or expired keys listed");
+    store.clear();
+    NASSERT(store.scan("", "", 10, [](std::string_view) {}) == 0,
+            "TEST SCAN: Cleared keys listed");
+
+    // Scans run alongside writers and always see sorted, prefixed keys
+    std::atomic<bool> writing(true);
+    std::atomic<bool> sorted(true);
+    std::thread scanner([&]() {
+      while (writing) {
+        std::string last;
+        store.scan("zad", "", 50, [&](std::string_view key) {
+          if (key <= last || !key.starts_with("zad")) {
+            sorted = false;
+          }
+          last = key;
+        });
+      }
+    });
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 2; t++) {
+      writers.emplace_back([&, t]() {
+        for (int i = 0; i < num_iterations * 10; i++) {
+          std::string key = (i % 3 ? "zad" : "tui") +
+                            std::to_string((i * 7919 + t) % num_iterations);
+          if (i % 2) {
+            store.put(key, "value");
+          } else {
+            store.del(key);
+          }
+        }
+      });
+    }
+    for (std::thread &writer : writers) {
+      writer.join();
+    }
+    writing = false;
+    scanner.join();
+    NASSERT(sorted, "TEST SCAN: Scan saw keys out of order");
+
+    boost::asio::io_service io_service;
+    kvserver indexed(io_service, 0);
+    indexed.enable_ordered_index();
+    boost::thread serving(
+        boost::bind(&boost::asio::io_service::run, &io_service));
+    std::string port = std::to_string(indexed.port());
+    std::vector<std::string> keys;
+    for (int i = 0; i < num_iterations / 10; i++) {
+      keys.push_back("scan" + std::to_string(i));
+    }
+    std::sort(keys.begin(), keys.end());
+    for (protocol_type protocol : {TEXT_PROTOCOL, BINARY_PROTOCOL}) {
+      kvclient client(client_io_service, host, port, protocol);
+      for (const std::string &key : keys) {
+        NASSERT(client.put(key, "value"), "TEST SCAN: Put failed");
+      }
+      NASSERT(client.put("other", "value"), "TEST SCAN: Put failed");
+      std::vector<std::string> listed, page;
+      cursor.clear();
+      do {
+        NASSERT(client.scan("scan", 7, cursor, page),
+                "TEST SCAN: SCAN refused");
+        listed.insert(listed.end(), page.begin(), page.end());
+      } while (!cursor.empty());
+      NASSERT(listed == keys, "TEST SCAN: SCAN pages were wrong");
+      NASSERT(client.scan("", 1000, cursor, page) &&
+                  page.size() == keys.size() + 1 && cursor.empty(),
+              "TEST SCAN: Empty prefix did not list every key");
+      for (const std::string &key : keys) {
+        NASSERT(client.del(key), "TEST SCAN: Delete failed");
+      }
+      NASSERT(client.del("other"), "TEST SCAN: Delete failed");
+    }
+    io_service.stop();
+    serving.join();
+
+    kvclient plain(client_io_service, host, client_port);
+    std::vector<std::string> page;
+    NASSERT(!plain.scan("zad", 10, cursor, page),
+            "TEST SCAN: SCAN answered without an index");
+    return true;
+  }
+
+  // Every unexpired pair in store, walked without locks
+  static std::map<std::string, std::string> pairs(kvstore &store) {
+    std::map<std::string, std::string> all;
+    for (int i = 0; i < store.shard_count(); i++) {
+      std::map<std::string, std::string> shard;
+      while (!store.visit_shard(
+          i, [&](std::string_view key, std::string_view value, uint64_t) {
+            shard.emplace(key, value);
+          })) {
+        shard.clear();
+      }
+      all.merge(shard);
+    }
+    return all;
+  }
+
+  // Wait up to ten seconds for the replica to apply every record the
+  // primary has fed it
+  static bool caught_up(kvserver &primary, kvserver &replica) {
+    for (int i = 0; i < 10000; i++) {
+      if (replica.follower->applied_record() == primary.feed->tail()) {
+        return true;
+      }
+      std::this_thread::sleep_for(std::chrono::milliseconds(1));
+    }
+    return false;
+  }
+
+  // Break a replica's connection as a network failure would
+  static void disconnect(kvserver &server) {
+    replica *follower = server.follower.get();
+    boost::asio::post(follower->executor, [follower]() {
+      boost::system::error_code ignored;
+      follower->socket.shutdown(tcp::socket::shutdown_both, ignored);
+    });
+  }
+
+  // Verify a replica bootstraps from a snapshot taken while the primary is
+  // written, follows puts, deletes, batches, expiry, and clears, refuses
+  // clients' writes, resumes after a dropped connection, and resyncs once
+  // it has fallen behind the backlog
+  bool test_replication(int num_iterations = NUM_ITERS) {
+    boost::asio::io_service primary_io, replica_io;
+    kvserver primary(primary_io, 0);
+    for (int i = 0; i < num_iterations; i++) {
+      primary.store.put("before" + std::to_string(i), "value");
+    }
+    unsigned short replication_port = primary.serve_replicas(0, 4 << 20);
+    boost::thread primary_thread(
+        boost::bind(&boost::asio::io_service::run, &primary_io));
+
+    // Writers race the snapshot and the records that follow it
+    std::atomic<bool> writing(true);
+    std::vector<std::thread> writers;
+    for (int t = 0; t < 2; t++) {
+      writers.emplace_back([&, t]() {
+        for (int i = 0; writing || i < num_iterations; i++) {
+          std::string key = "racing" + std::to_string((i * 31 + t) % 500);
+          if (i % 3) {
+            primary.store.put(key, std::to_string(i));
+          } else {
+            primary.store.del(key);
+          }
+          primary.store.del("before" + std::to_string(i % num_iterations));
+        }
+      });
+    }
+    kvserver replica(replica_io, 0);
+    replica.replicate_from("127.0.0.1", std::to_string(replication_port));
+    boost::thread_group replica_threads;
+    for (int t = 0; t < 2; t++) {
+      replica_threads.create_thread(
+          boost::bind(&boost::asio::io_service::run, &replica_io));
+    }
+    std::this_thread::sleep_for(std::chrono::milliseconds(50));
+    writing = false;
+    for (std::thread &writer : writers) {
+      writer.join();
+    }
+    NASSERT(caught_up(primary, replica),
+            "TEST REPLICATION: Replica never caught up");
+    NASSERT(pairs(replica.store) == pairs(primary.store),
+            "TEST REPLICATION: Replica differs after the snapshot");
+    // The snapshot's place was pinned, but writers may have outrun the
+    // replica once it caught up
+    uint64_t full_syncs = primary.source->full_syncs.load();
+    uint64_t resumes = primary.source->resumes.load();
+
+    primary.store.put("expiring", "value", std::chrono::milliseconds(200));
+    std::string value;
+    NASSERT(caught_up(primary, replica) &&
+                replica.store.get("expiring", value),
+            "TEST REPLICATION: Expiring pair was not replicated");
+
+    // Clients' writes to the primary reach the replica, which refuses its
+    // own
+    std::string port = std::to_string(primary.port());
+    std::string replica_port = std::to_string(replica.port());
+    kvclient writer(client_io_service, host, port, BINARY_PROTOCOL);
+    kvclient reader(client_io_service, host, replica_port);
+    std::vector<std::string> keys, values;
+    for (int i = 0; i < num_iterations / 10; i++) {
+      std::string suffix = std::to_string(i);
+      NASSERT(writer.put("client" + suffix, "value" + suffix),
+              "TEST REPLICATION: Put failed");
+      keys.push_back("batch" + std::to_string(i));
+      values.push_back(std::to_string(i));
+    }
+    std::vector<bool> stored;
+    NASSERT(writer.mput(keys, values, stored) && writer.del("client0"),
+            "TEST REPLICATION: Batch or delete failed");
+    NASSERT(caught_up(primary, replica),
+            "TEST REPLICATION: Replica fell behind clients");
+    NASSERT(reader.get("client1", value) && value == "value1" &&
+                !reader.get("client0", value) &&
+                reader.get("batch2", value) && value == "2",
+            "TEST REPLICATION: Replica served stale reads");
+    NASSERT(!reader.put("client1", "changed") && !reader.del("client1") &&
+                !reader.mput(keys, values, stored),
+            "TEST REPLICATION: Replica accepted a write");
+    NASSERT(pairs(replica.store) == pairs(primary.store),
+            "TEST REPLICATION: Replica differs after client writes");
+
+    std::this_thread::sleep_for(std::chrono::milliseconds(250));
+    NASSERT(!reader.get("expiring", value),
+            "TEST REPLICATION: Replica served an expired pair");
+
+    std::map<std::string, std::string> report;
+    NASSERT(writer.stats(report, "replication") && report["replicas"] == "1" &&
+                report["replica_0_lag_records"] == "0" &&
+                report["full_syncs_total"] == std::to_string(full_syncs) &&
+                report["backlog_overruns_total"] ==
+                    std::to_string(primary.source->overruns.load()),
+            "TEST REPLICATION: Primary report was wrong");
+    NASSERT(reader.stats(report, "replication") &&
+                report["primary_connected"] == "1" &&
+                report["replica_applied_sequence"] ==
+                    std::to_string(primary.feed->tail()),
+            "TEST REPLICATION: Replica report was wrong");
+
+    // A dropped connection resumes from the backlog
+    disconnect(replica);
+    for (int i = 0; i < num_iterations; i++) {
+      primary.store.put("resumed" + std::to_string(i), "value");
+    }
+    primary.store.clear();
+    primary.store.put("after_clear", "value");
+    NASSERT(caught_up(primary, replica) &&
+                primary.source->resumes.load() == resumes + 1 &&
+                primary.source->full_syncs.load() == full_syncs,
+            "TEST REPLICATION: Replica did not resume");
+    NASSERT(pairs(replica.store) == pairs(primary.store),
+            "TEST REPLICATION: Replica differs after resuming");
+
+    // A full sync's pinned place outlasts the capacity until released
+    replication_log backlog(1); // Clamped to one chunk
+    std::string record(1024, 'x');
+    backlog.append(wal::RECORD_PUT, "unpinned", record);
+    uint64_t place = backlog.pin();
+    for (int i = 0; i < 4096; i++) {
+      backlog.append(wal::RECORD_PUT, "pinned", record);
+    }
+    uint64_t read_through = place;
+    std::string copied;
+    NASSERT(backlog.retains(place) &&
+                backlog.read(read_through, copied, 64 << 20) &&
+                read_through == backlog.tail(),
+            "TEST REPLICATION: Backlog dropped a pinned place");
+    backlog.unpin(place);
+    backlog.append(wal::RECORD_PUT, "released", record);
+    NASSERT(!backlog.retains(place),
+            "TEST REPLICATION: Backlog kept a released place");
+
+    // A replica further behind than the backlog resyncs from a snapshot
+    disconnect(replica);
+    std::string large(1024, 'x');
+    for (int i = 0; i < 8000; i++) {
+      primary.store.put("overflow" + std::to_string(i % 100), large);
+    }
+    NASSERT(caught_up(primary, replica) &&
+                primary.source->full_syncs.load() == full_syncs + 1,
+            "TEST REPLICATION: Replica did not resync");
+    NASSERT(pairs(replica.store) == pairs(primary.store),
+            "TEST REPLICATION: Replica differs after resyncing");
+
+    primary_io.stop();
+    replica_io.stop();
+    primary_thread.join();
+    replica_threads.join_all();
+    return true;
+  }
+
+  // Verify the ring spreads keys evenly and a new node takes about 1/N of
+  // them from the others, and that a cluster client routes single keys and
+  // fans batches out across several servers
+  bool test_cluster(int num_iterations = NUM_ITERS) {
+    const int num_keys = num_iterations * 20;
+    hash_ring ring;
+    for (int n = 0; n < 4; n++) {
+      ring.add("node" + std::to_string(n));
+    }
+    std::vector<size_t> owners, shares(4);
+    for (int i = 0; i < num_keys; i++) {
+      owners.push_back(ring.owner("key" + std::to_string(i)));
+      shares[owners.back()]++;
+    }
+    for (size_t share : shares) {
+      NASSERT(share > num_keys / 4 * 0.7 && share < num_keys / 4 * 1.3,
+              "TEST CLUSTER: Keys are unevenly spread");
+    }
+    ring.add("node4");
+    int moved = 0;
+    for (int i = 0; i < num_keys; i++) {
+      size_t owner = ring.owner("key" + std::to_string(i));
+      if (owner != owners[i]) {
+        NASSERT(owner == 4, "TEST CLUSTER: Key moved between old nodes");
+        moved++;
+      }
+    }
+    NASSERT(moved > num_keys / 5 * 0.7 && moved < num_keys / 5 * 1.3,
+            "TEST CLUSTER: New node did not take about 1/N of the keys");
+    hash_ring reordered;
+    for (int n = 4; n >= 0; n--) {
+      reordered.add("node" + std::to_string(n));
+    }
+    for (int i = 0; i < num_keys; i++) {
+      std::string key = "key" + std::to_string(i);
+      NASSERT(ring.nodes()[ring.owner(key)] ==
+                  reordered.nodes()[reordered.owner(key)],
+              "TEST CLUSTER: Routing depends on the order nodes were added");
+    }
+    ring.remove("node4");
+    for (int i = 0; i < num_keys; i++) {
+      NASSERT(ring.owner("key" + std::to_string(i)) == owners[i],
+              "TEST CLUSTER: Removing a node did not restore routing");
+    }
+
+    boost::asio::io_service nodes_io;
+    std::vector<std::unique_ptr<kvserver>> servers;
+    std::vector<std::string> endpoints;
+    for (int n = 0; n < 4; n++) {
+      servers.push_back(std::make_unique<kvserver>(nodes_io, 0));
+      endpoints.push_back(host + ":" + std::to_string(servers[n]->port()));
+    }
+    boost::thread nodes_thread(
+        boost::bind(&boost::asio::io_service::run, &nodes_io));
+
+    kvcluster cluster(client_io_service,
+                      std::vector<std::string>(endpoints.begin(),
+                                               endpoints.begin() + 3),
+                      BINARY_PROTOCOL,
+                      2);
+    std::vector<std::string> keys, values, found_values;
+    std::vector<bool> ok;
+    for (int i = 0; i < num_iterations; i++) {
+      keys.push_back("cluster" + std::to_string(i));
+      values.push_back("value" + std::to_string(i));
+    }
+    NASSERT(cluster.mput(keys, values, ok) &&
+                std::count(ok.begin(), ok.end(), true) == num_iterations,
+            "TEST CLUSTER: Batch put failed");
+    // Every key is on the server it routes to and no other
+    for (int i = 0; i < num_iterations; i++) {
+      std::string value;
+      for (int n = 0; n < 3; n++) {
+        bool owns = cluster.node_for(keys[i]) == endpoints[n];
+        NASSERT(servers[n]->store.get(keys[i], value) == owns,
+                "TEST CLUSTER: Key stored on the wrong server");
+      }
+    }
+    for (int n = 0; n < 3; n++) {
+      NASSERT(servers[n]->store.size() > size_t(num_iterations) / 6,
+              "TEST CLUSTER: A server was left without its share");
+    }
+
+    // Batch results come back in key order, misses included
+    std::vector<std::string> mixed;
+    for (int i = 0; i < num_iterations; i++) {
+      mixed.push_back(i % 2 ? keys[i] : "missing" + std::to_string(i));
+    }
+    NASSERT(cluster.mget(mixed, found_values, ok) && ok.size() == mixed.size(),
+            "TEST CLUSTER: Batch get failed");
+    for (int i = 0; i < num_iterations; i++) {
+      NASSERT(ok[i] == (i % 2 == 1) && (!ok[i] || found_values[i] == values[i]),
+              "TEST CLUSTER: Batch get returned the wrong result");
+    }
+
+    // Single keys, pipelined and blocking
+    int completed = 0;
+    kvclient::status_callback count_put = [&](bool stored) {
+      completed += stored;
+    };
+    kvclient::get_callback count_get = [&](bool found,
+                                           const std::string &value) {
+      completed += found && value == "updated";
+    };
+    for (int i = 0; i < num_iterations; i++) {
+      NASSERT(cluster.async_put(keys[i], "updated", count_put) &&
+                  cluster.async_get(keys[i], count_get),
+              "TEST CLUSTER: Pipelined request was not queued");
+    }
+    cluster.wait();
+    NASSERT(completed == 2 * num_iterations,
+            "TEST CLUSTER: Pipelined requests completed out of order");
+    std::string value;
+    NASSERT(cluster.put("single", "value") && cluster.get("single", value) &&
+                value == "value" && cluster.del("single") &&
+                !cluster.get("single", value),
+            "TEST CLUSTER: Single key operations failed");
+
+    // A fourth server takes about a quarter of the keys, which now read as
+    // missing, and removing it routes them back
+    cluster.add_node(endpoints[3]);
+    NASSERT(cluster.mget(keys, found_values, ok),
+            "TEST CLUSTER: Batch get failed after adding a node");
+    int remapped = 0;
+    for (int i = 0; i < num_iterations; i++) {
+      bool moved_to_new = cluster.node_for(keys[i]) == endpoints[3];
+      NASSERT(ok[i] != moved_to_new,
+              "TEST CLUSTER: Adding a node remapped the wrong keys");
+      remapped += moved_to_new;
+    }
+    NASSERT(remapped > num_iterations / 4 * 0.5 &&
+                remapped < num_iterations / 4 * 1.5,
+            "TEST CLUSTER: New node did not take about 1/N of the keys");
+    NASSERT(cluster.remove_node(endpoints[3]) &&
+                !cluster.remove_node(endpoints[3]),
+            "TEST CLUSTER: Node removal failed");
+    NASSERT(cluster.mdel(keys, ok) &&
+                std::count(ok.begin(), ok.end(), true) == num_iterations,
+            "TEST CLUSTER: Batch delete missed keys");
+    for (int n = 0; n < 3; n++) {
+      NASSERT(servers[n]->store.size() == 0,
+              "TEST CLUSTER: Keys left behind after the batch delete");
+    }
+
+    nodes_io.stop();
+    nodes_thread.join();
+    return true;
+  }
+
+  // Verify many threads sharing a kvpool each get their own responses over
+  // its few connections, for single keys and batches alike
+  bool test_pool(int num_iterations = NUM_ITERS) {
+    const int num_threads = 16;
+    const size_t num_connections = 2;
+    kvclient observer(client_io_service, host, client_port);
+    std::map<std::string, std::string> before, after;
+    NASSERT(observer.stats(before), "TEST POOL: Stats failed");
+
+    kvpool pool(host, client_port, num_connections);
+    NASSERT(observer.stats(after) &&
+                std::stoul(after["connections"]) ==
+                    std::stoul(before["connections"]) + num_connections,
+            "TEST POOL: Pool opened the wrong number of connections");
+    std::string value;
+    NASSERT(!pool.get("", value), "TEST POOL: Empty key was sent");
+    // Empty batches succeed without a round trip, as in kvclient
+    std::vector<std::string> no_values = {"stale"};
+    std::vector<bool> no_results = {true};
+    NASSERT(pool.mget({}, no_values, no_results) && no_values.empty() &&
+                no_results.empty() && pool.mput({}, {}, no_results) &&
+                pool.mdel({}, no_results) && no_results.empty() &&
+                pool.usage().requests == 0,
+            "TEST POOL: Empty batch failed or was sent");
+
+    std::atomic<int> failures(0);
+    std::vector<std::thread> threads;
+    for (int t = 0; t < num_threads; t++) {
+      threads.emplace_back([&, t]() {
+        std::string prefix = "pool" + std::to_string(t) + "_";
+        std::vector<std::string> keys, values, found_values;
+        std::vector<bool> ok;
+        for (int i = 0; i < num_iterations / 4; i++) {
+          std::string key = prefix + std::to_string(i);
+          std::string expected = "value" + std::to_string(i * num_threads + t);
+          std::string found;
+          if (!pool.put(key, expected) || !pool.get(key, found) ||
+              found != expected) {
+            failures++;
+          }
+          if (i % 4 == 0 && (!pool.del(key) || pool.get(key, found))) {
+            failures++;
+          }
+          keys.push_back(prefix + "batch" + std::to_string(i));
+          values.push_back(expected);
+        }
+        if (!pool.mput(keys, values, ok) ||
+            !pool.mget(keys, found_values, ok) || found_values != values ||
+            std::count(ok.begin(), ok.end(), true) != int(keys.size()) ||
+            !pool.mdel(keys, ok) ||
+            std::count(ok.begin(), ok.end(), true) != int(keys.size())) {
+          failures++;
+        }
+      });
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+    NASSERT(failures == 0, "TEST POOL: A thread got the wrong response");
+
+    kvpool::usage_stats usage = pool.usage();
+    uint64_t expected_requests =
+        uint64_t(num_threads) * (num_iterations / 4 * 2 +
+                                 (num_iterations / 4 + 3) / 4 * 2 + 3);
+    NASSERT(usage.requests == expected_requests &&
+                usage.writes <= usage.requests,
+            "TEST POOL: Requests were miscounted");
+    for (int t = 0; t < num_threads; t++) {
+      std::string key = "pool" + std::to_string(t) + "_1";
+      NASSERT(server.store.get(key, value) &&
+                  value == "value" + std::to_string(num_threads + t),
+              "TEST POOL: Server holds the wrong value");
+    }
+    return true;
+  }
+
   // Wrap a supplied function
   bool test_wrapper(const std::string name, bool (Test::*func)(int)) {
     SetUp();
@@ -460,7 +2547,10 @@ public:
        const std::string &host,
        int server_port,
        const std::string &client_port)
-      : server(server_io_service, server_port) {
+      : server(server_io_service, server_port),
+        client_io_service(client_io_service),
+        host(host),
+        client_port(client_port) {
     // Create a single server and num_clients clients
     for (int i = 0; i < num_clients; i++) {
       clients.push_back(kvclient(client_io_service, host, client_port));
@@ -487,12 +2577,38 @@ public:
 
     // Run all tests
     test_wrapper(std::move("TEST_MESSAGE"), &Test::test_message);
+    test_wrapper(std::move("TEST_DELIMITERS"), &Test::test_delimiters);
     test_wrapper(std::move("TEST_GET"), &Test::test_get);
     test_wrapper(std::move("TEST_PUT"), &Test::test_put);
     test_wrapper(std::move("TEST_DELETE"), &Test::test_del);
     test_wrapper(std::move("TEST_STRESS_GET"), &Test::test_stress_get);
     test_wrapper(std::move("TEST_STRESS_PUT"), &Test::test_stress_put);
     test_wrapper(std::move("TEST_STRESS_DEL"), &Test::test_stress_del);
+    test_wrapper(std::move("TEST_STRESS_SHARDS"), &Test::test_stress_shards);
+    test_wrapper(std::move("TEST_STRESS_READERS"), &Test::test_stress_readers);
+    test_wrapper(std::move("TEST_BINARY"), &Test::test_binary);
+    test_wrapper(std::move("TEST_PIPELINE"), &Test::test_pipeline);
+    test_wrapper(std::move("TEST_BATCH"), &Test::test_batch);
+    test_wrapper(std::move("TEST_MEMORY"), &Test::test_memory);
+    test_wrapper(std::move("TEST_WAL"), &Test::test_wal);
+    test_wrapper(std::move("TEST_SNAPSHOT"), &Test::test_snapshot);
+    test_wrapper(std::move("TEST_SNAPSHOT_LOG"), &Test::test_snapshot_log);
+    test_wrapper(std::move("TEST_BULK_LOAD"), &Test::test_bulk_load);
+    test_wrapper(std::move("TEST_EVICTION"), &Test::test_eviction);
+    test_wrapper(std::move("TEST_TTL"), &Test::test_ttl);
+    test_wrapper(std::move("TEST_HISTOGRAM"), &Test::test_histogram);
+    test_wrapper(std::move("TEST_LOCK_USAGE"), &Test::test_lock_usage);
+    test_wrapper(std::move("TEST_STATS"), &Test::test_stats);
+    test_wrapper(std::move("TEST_HOT_KEYS"), &Test::test_hot_keys);
+    test_wrapper(std::move("TEST_SCAN"), &Test::test_scan);
+    test_wrapper(std::move("TEST_NEAR_CACHE"), &Test::test_near_cache);
+    test_wrapper(std::move("TEST_URING"), &Test::test_uring);
+    test_wrapper(std::move("TEST_PER_CORE"), &Test::test_per_core);
+    test_wrapper(std::move("TEST_REPLICATION"), &Test::test_replication);
+    test_wrapper(std::move("TEST_CLUSTER"), &Test::test_cluster);
+    test_wrapper(std::move("TEST_POOL"), &Test::test_pool);
+    test_wrapper(std::move("TEST_MANY_CONNECTIONS"),
+                 &Test::test_many_connections);
 
     std::cout << "All tests passed!" << std::endl;
   }
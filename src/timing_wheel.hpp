@@ -0,0 +1,145 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The timing_wheel class schedules values to fire at millisecond deadlines.
+ * It is hierarchical: four levels of 64 slots, each level's slot spanning a
+ * whole turn of the level below. Scheduling and firing cost O(1) per value;
+ * a value is moved down a level at most three times on its way to firing.
+ * Deadlines beyond the top level wait in its last slot and are placed again
+ * as the wheel turns.
+ *
+ * Work is bounded per call. advance turns the wheel by at most a fixed
+ * number of ticks, and expire fires at most a budget of due values, leaving
+ * the rest queued for the next call, so no call ever scans everything.
+ *
+ * A timing_wheel is not thread safe; callers protect it with their own lock.
+ */
+
+#ifndef TIMING_WHEEL_H
+#define TIMING_WHEEL_H
+
+#include <algorithm>
+#include <cstddef>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+template <typename T>
+class timing_wheel {
+private:
+  static constexpr int LEVELS = 4;
+  static constexpr int SLOT_BITS = 6;
+  static constexpr uint64_t SLOTS = 1 << SLOT_BITS;
+  static constexpr uint64_t SLOT_MASK = SLOTS - 1;
+  static constexpr uint64_t MAX_TICKS_PER_CALL = 4096;
+
+  struct entry {
+    uint64_t deadline; // In ticks
+    T value;
+  };
+
+  uint64_t tick_ms;
+  uint64_t current; // The last tick whose slot has fired
+  size_t count = 0; // Values scheduled and not yet fired
+  std::vector<entry> slots[LEVELS][SLOTS];
+  std::vector<entry> due; // Fired values waiting for expire
+  size_t due_head = 0;
+
+  // File an entry by how far its deadline is from the current tick
+  void place(entry &&e) {
+    if (e.deadline <= current) {
+      due.push_back(std::move(e));
+      return;
+    }
+    uint64_t delta = e.deadline - current;
+    for (int level = 0; level < LEVELS; level++) {
+      uint64_t span = uint64_t(1) << (SLOT_BITS * (level + 1));
+      if (delta < span || level == LEVELS - 1) {
+        uint64_t slot = delta < span ? e.deadline >> (SLOT_BITS * level)
+                                     : current >> (SLOT_BITS * level);
+        if (delta >= span) {
+          slot--; // Park far deadlines in the slot that turns last
+        }
+        slots[level][slot & SLOT_MASK].push_back(std::move(e));
+        return;
+      }
+    }
+  }
+
+  // Re-place every entry of a higher-level slot now that it is current
+  void cascade(int level, uint64_t slot) {
+    std::vector<entry> moving;
+    moving.swap(slots[level][slot]);
+    for (size_t i = 0; i < moving.size(); i++) {
+      place(std::move(moving[i]));
+    }
+  }
+
+public:
+  timing_wheel(uint64_t now_ms, uint64_t tick_ms = 10)
+      : tick_ms(tick_ms), current(now_ms / tick_ms) {}
+
+  // Schedule value to fire once now reaches deadline_ms
+  void schedule(uint64_t deadline_ms, T value) {
+    uint64_t deadline = (deadline_ms + tick_ms - 1) / tick_ms;
+    place({deadline, std::move(value)});
+    count++;
+  }
+
+  // Turn the wheel towards now_ms, moving values whose slot comes up into
+  // the due queue. Returns false if it stopped short to bound the work.
+  bool advance(uint64_t now_ms) {
+    uint64_t target = now_ms / tick_ms;
+    if (count == due.size() - due_head) {
+      current = std::max(current, target); // Nothing left on the wheel
+      return true;
+    }
+    for (uint64_t ticks = 0; current < target; ticks++) {
+      if (ticks == MAX_TICKS_PER_CALL) {
+        return false;
+      }
+      current++;
+      for (int level = 1; level < LEVELS; level++) {
+        // A higher slot comes up whenever every level below wraps to zero
+        if ((current & ((uint64_t(1) << (SLOT_BITS * level)) - 1)) != 0) {
+          break;
+        }
+        cascade(level, (current >> (SLOT_BITS * level)) & SLOT_MASK);
+      }
+      std::vector<entry> &slot = slots[0][current & SLOT_MASK];
+      for (size_t i = 0; i < slot.size(); i++) {
+        due.push_back(std::move(slot[i]));
+      }
+      slot.clear();
+    }
+    return true;
+  }
+
+  // Advance to now_ms and fire up to budget due values with fire(value).
+  // Returns the number fired.
+  template <typename Fire>
+  size_t expire(uint64_t now_ms, size_t budget, Fire &&fire) {
+    advance(now_ms);
+    size_t fired = 0;
+    while (fired < budget && due_head < due.size()) {
+      fire(due[due_head++].value);
+      fired++;
+    }
+    if (due_head == due.size()) {
+      due.clear();
+      due_head = 0;
+    }
+    count -= fired;
+    return fired;
+  }
+
+  // Values scheduled and not yet fired, including ones already due
+  size_t size() const { return count; }
+
+  // Whether a value is due or the wheel has ticks to turn before now_ms
+  bool pending(uint64_t now_ms) const {
+    return due_head < due.size() || (count > 0 && now_ms / tick_ms > current);
+  }
+};
+
+#endif
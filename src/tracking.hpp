@@ -0,0 +1,132 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The tracking_table class remembers which clients may hold which keys in a
+ * near cache, so the server can tell them when a key changes. Clients are
+ * named by number. A key is tracked from the moment a tracking client reads
+ * it until the next change to it, when every client tracking it is notified
+ * once and forgotten; reading the key again tracks it again.
+ *
+ * A read must be tracked before the store is read, and a change reported
+ * after the store is changed. Both take the key's stripe lock, so either
+ * the change finds the reader and notifies it, or the read comes after the
+ * change and sees the new value.
+ *
+ * The table is bounded: tracking a key into a full stripe forgets an older
+ * key, notifying its clients as though it had changed. Keys are split over
+ * NUM_STRIPES stripes, each under its own lock. While nothing is tracked a
+ * change costs a fence and an atomic load; the fences on both sides keep a
+ * change from skipping the table just as a reader starts tracking.
+ */
+
+#ifndef TRACKING_H
+#define TRACKING_H
+
+#include "epoch.hpp"
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <string_view>
+#include <unordered_map>
+#include <vector>
+
+class tracking_table {
+public:
+  static constexpr size_t NUM_STRIPES = 64;
+
+private:
+  // Lets a stripe find a std::string key from a std::string_view
+  struct key_hash {
+    using is_transparent = void;
+    size_t operator()(std::string_view key) const {
+      return std::hash<std::string_view>{}(key);
+    }
+  };
+
+  using client_map = std::unordered_map<std::string,
+                                        std::vector<uint64_t>,
+                                        key_hash,
+                                        std::equal_to<>>;
+
+  struct alignas(CACHE_LINE_SIZE) stripe {
+    std::mutex lock;
+    client_map clients;
+  };
+
+  std::unique_ptr<stripe[]> stripes;
+  size_t stripe_limit;
+  std::atomic<size_t> tracked{0};
+
+  stripe &stripe_for(std::string_view key) {
+    return stripes[key_hash{}(key) % NUM_STRIPES];
+  }
+
+  // Forget the entry at it and notify its clients. Requires the stripe
+  // lock.
+  template <typename Notify>
+  void forget_locked(stripe &s, client_map::iterator it, Notify &notify) {
+    for (uint64_t client : it->second) {
+      notify(client, std::string_view(it->first));
+    }
+    s.clients.erase(it);
+    tracked.fetch_sub(1, std::memory_order_relaxed);
+  }
+
+public:
+  // Track up to about max_keys keys
+  explicit tracking_table(size_t max_keys = 1 << 20)
+      : stripes(new stripe[NUM_STRIPES]),
+        stripe_limit(std::max<size_t>(max_keys / NUM_STRIPES, 1)) {}
+
+  // Remember that client may cache key. If the key's stripe is full another
+  // key is forgotten first, calling notify(client, key) for each of its
+  // clients.
+  template <typename Notify>
+  void track(std::string_view key, uint64_t client, Notify &&notify) {
+    stripe &s = stripe_for(key);
+    {
+      std::lock_guard<std::mutex> lock(s.lock);
+      client_map::iterator it = s.clients.find(key);
+      if (it == s.clients.end()) {
+        if (s.clients.size() >= stripe_limit) {
+          forget_locked(s, s.clients.begin(), notify);
+        }
+        it = s.clients.emplace(std::string(key), std::vector<uint64_t>())
+                 .first;
+        tracked.fetch_add(1, std::memory_order_relaxed);
+      }
+      if (std::find(it->second.begin(), it->second.end(), client) ==
+          it->second.end()) {
+        it->second.push_back(client);
+      }
+    }
+    // Publish the entry before the caller reads the store
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+  }
+
+  // Report a change to key: call notify(client, key) for every client
+  // tracking it, then forget them
+  template <typename Notify>
+  void invalidate(std::string_view key, Notify &&notify) {
+    // Order the caller's change to the store before the check
+    std::atomic_thread_fence(std::memory_order_seq_cst);
+    if (tracked.load(std::memory_order_relaxed) == 0) {
+      return;
+    }
+    stripe &s = stripe_for(key);
+    std::lock_guard<std::mutex> lock(s.lock);
+    client_map::iterator it = s.clients.find(key);
+    if (it != s.clients.end()) {
+      forget_locked(s, it, notify);
+    }
+  }
+
+  // Keys tracked for at least one client
+  size_t size() const { return tracked.load(std::memory_order_relaxed); }
+};
+
+#endif
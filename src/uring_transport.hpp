@@ -0,0 +1,544 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The uring_transport class serves kvserver connections from Linux io_uring
+ * rings instead of the Asio reactor, which spends a readiness wait, a recv,
+ * and a send on every request. Each of its threads owns one ring and the
+ * connections that ring accepts. The ring keeps a multishot accept armed on
+ * the listening socket and a multishot recv on every connection, drawing
+ * buffers from a provided buffer ring only when data arrives, so neither
+ * is resubmitted per request. A thread takes every completion that is
+ * ready, then handles the requests of each connection that received any in
+ * one batch, queueing the responses' sends on the ring, and submits all of
+ * them and waits for the next completions in one io_uring_enter. At high
+ * connection counts that is one system call for many requests.
+ *
+ * Requests are handled by the same kvhandler as the Asio sessions, so the
+ * protocols, batching, metrics, write-ahead log, and near cache tracking
+ * behave identically. Work from other threads, such as a log reporting a
+ * batch durable or an invalidation for a tracking client, is posted to a
+ * ring's task queue and wakes it through an eventfd the ring keeps a read
+ * pending on.
+ */
+
+#ifndef URING_TRANSPORT_H
+#define URING_TRANSPORT_H
+
+#include "io_ring.hpp"
+#include "kvhandler.hpp"
+
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+
+#include <atomic>
+#include <functional>
+#include <future>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+class uring_loop;
+
+// A connection served by a uring_loop. Its multishot recv stays armed while
+// a batch is being handled and sent, so requests keep arriving in the
+// buffer; past MAX_BUFFERED unhandled bytes the recv is cancelled until the
+// session catches up. Only one send is in flight at a time, carrying a
+// batch's responses and any invalidations queued meanwhile.
+class uring_session : public kvhandler {
+private:
+  friend class uring_loop;
+  static constexpr size_t MAX_BUFFERED = 1 << 22;
+
+  uring_loop &loop;
+  int fd;
+  bool receiving = false; // A multishot recv is armed
+  bool paused = false;    // The recv was cancelled for backpressure
+  bool sending = false;   // A send is in flight
+  bool syncing = false;   // Waiting for the log to make a batch durable
+  bool eof = false;       // The client will send nothing more
+  bool closing = false;
+  bool ready = false; // Queued to act once the loop's completions are taken
+  size_t sent = 0; // Bytes of response already sent
+
+  std::shared_ptr<uring_session> self() {
+    return std::static_pointer_cast<uring_session>(shared_from_this());
+  }
+
+  bool busy() const { return sending || syncing; }
+
+  void start();
+  void handle_recv(const io_uring_cqe &cqe);
+  void handle_send(int result);
+  void make_ready();
+  void handle_ready();
+  void process();
+  void send();
+  void resume();
+  void close();
+  void finish();
+  void schedule_pushes() override;
+
+public:
+  uring_session(uring_loop &loop,
+                int fd,
+                kvstore &store,
+                server_metrics &metrics,
+                client_tracking &tracking)
+      : kvhandler(store, metrics, tracking), loop(loop), fd(fd) {}
+
+  ~uring_session() {
+    ::close(fd);
+    metrics.connection_closed();
+  }
+};
+
+// One ring and its thread. Completions are tagged with the session they
+// belong to and the operation that finished in the low bits of user_data.
+class uring_loop {
+private:
+  friend class uring_session;
+  static constexpr unsigned RING_ENTRIES = 1024;
+  static constexpr uint16_t BUFFER_GROUP = 0;
+  static constexpr unsigned BUFFER_COUNT = 1024;
+  static constexpr unsigned BUFFER_SIZE = 4096;
+
+  enum operation : uint64_t { ACCEPT = 1, RECV, SEND, WAKE, CANCEL };
+  static constexpr uint64_t OPERATION_MASK = 7;
+
+  kvstore &store;
+  server_metrics &metrics;
+  client_tracking &tracking;
+  int listener;
+  int wake_fd;
+  uint64_t wake_value = 0; // Read from wake_fd by the ring
+  std::unique_ptr<io_ring> ring;
+  std::unique_ptr<buffer_ring> buffers;
+  std::unordered_map<uring_session *, std::shared_ptr<uring_session>>
+      sessions;
+  std::vector<uring_session *> ready; // Sessions with completions to act on
+  size_t in_flight = 0; // Operations whose last completion is pending
+  bool stopping = false;
+  bool wake_cancelled = false; // Stopped, and nothing is left to post work
+
+  std::mutex task_lock; // Guards tasks and stopped
+  std::vector<std::function<void()>> tasks;
+  std::vector<std::function<void()>> running;
+  std::atomic<bool> woken{false}; // A wakeup is already pending
+  bool stopped = false;           // Tasks posted now are dropped
+
+  // A submission entry for user_data, submitting queued ones if the
+  // submission queue is full
+  io_uring_sqe *prepare(uring_session *session, operation op) {
+    io_uring_sqe *sqe = ring->get_sqe();
+    while (!sqe) {
+      ring->enter(0);
+      metrics.ring_entered();
+      sqe = ring->get_sqe();
+    }
+    sqe->user_data = reinterpret_cast<uint64_t>(session) | op;
+    in_flight++;
+    return sqe;
+  }
+
+  void arm_accept() {
+    io_uring_sqe *sqe = prepare(nullptr, ACCEPT);
+    sqe->opcode = IORING_OP_ACCEPT;
+    sqe->fd = listener;
+    sqe->ioprio = IORING_ACCEPT_MULTISHOT;
+    sqe->accept_flags = SOCK_CLOEXEC;
+  }
+
+  void arm_wake() {
+    io_uring_sqe *sqe = prepare(nullptr, WAKE);
+    sqe->opcode = IORING_OP_READ;
+    sqe->fd = wake_fd;
+    sqe->addr = reinterpret_cast<uint64_t>(&wake_value);
+    sqe->len = sizeof(wake_value);
+    sqe->off = uint64_t(-1);
+  }
+
+  void arm_recv(uring_session *session) {
+    io_uring_sqe *sqe = prepare(session, RECV);
+    sqe->opcode = IORING_OP_RECV;
+    sqe->fd = session->fd;
+    sqe->ioprio = IORING_RECV_MULTISHOT;
+    sqe->flags = IOSQE_BUFFER_SELECT;
+    sqe->buf_group = buffers->id();
+  }
+
+  void submit_send(uring_session *session, const char *data, size_t size) {
+    io_uring_sqe *sqe = prepare(session, SEND);
+    sqe->opcode = IORING_OP_SEND;
+    sqe->fd = session->fd;
+    sqe->addr = reinterpret_cast<uint64_t>(data);
+    sqe->len = unsigned(std::min<size_t>(size, UINT32_MAX));
+    sqe->msg_flags = MSG_NOSIGNAL;
+  }
+
+  // Cancel the operation tagged session and op
+  void cancel(uring_session *session, operation op) {
+    io_uring_sqe *sqe = prepare(nullptr, CANCEL);
+    sqe->opcode = IORING_OP_ASYNC_CANCEL;
+    sqe->addr = reinterpret_cast<uint64_t>(session) | op;
+  }
+
+  void release(uring_session *session) { sessions.erase(session); }
+
+  void accepted(int fd) {
+    std::shared_ptr<uring_session> session = std::make_shared<uring_session>(
+        *this, fd, store, metrics, tracking);
+    sessions[session.get()] = session;
+    session->start();
+  }
+
+  void run_tasks() {
+    woken.store(false, std::memory_order_relaxed);
+    {
+      std::lock_guard<std::mutex> lock(task_lock);
+      running.swap(tasks);
+    }
+    for (std::function<void()> &task : running) {
+      task();
+    }
+    running.clear();
+  }
+
+  void handle(const io_uring_cqe &cqe) {
+    uring_session *session =
+        reinterpret_cast<uring_session *>(cqe.user_data & ~OPERATION_MASK);
+    bool more = cqe.flags & IORING_CQE_F_MORE;
+    if (!more) {
+      in_flight--;
+    }
+    switch (cqe.user_data & OPERATION_MASK) {
+    case ACCEPT:
+      if (cqe.res >= 0 && stopping) {
+        ::close(cqe.res);
+      } else if (cqe.res >= 0) {
+        accepted(cqe.res);
+      }
+      if (!more && !stopping) {
+        arm_accept();
+      }
+      break;
+    case WAKE:
+      run_tasks();
+      if (!wake_cancelled) {
+        arm_wake();
+      }
+      break;
+    case RECV:
+      session->handle_recv(cqe);
+      break;
+    case SEND:
+      session->handle_send(cqe.res);
+      break;
+    }
+  }
+
+  // Close every session and stop accepting; the loop ends once their
+  // operations and log waits have all finished
+  void stop() {
+    stopping = true;
+    cancel(nullptr, ACCEPT);
+    std::vector<std::shared_ptr<uring_session>> open;
+    for (auto &entry : sessions) {
+      open.push_back(entry.second);
+    }
+    for (std::shared_ptr<uring_session> &session : open) {
+      session->close();
+    }
+  }
+
+public:
+  uring_loop(int listener,
+             kvstore &store,
+             server_metrics &metrics,
+             client_tracking &tracking)
+      : store(store),
+        metrics(metrics),
+        tracking(tracking),
+        listener(listener),
+        wake_fd(eventfd(0, EFD_CLOEXEC)) {
+    if (wake_fd < 0) {
+      throw std::system_error(errno, std::system_category(), "eventfd");
+    }
+  }
+
+  uring_loop(const uring_loop &) = delete;
+  uring_loop &operator=(const uring_loop &) = delete;
+
+  ~uring_loop() { ::close(wake_fd); }
+
+  // Run fn on the loop's thread. Safe from any thread; once the loop has
+  // stopped, fn is dropped.
+  void post(std::function<void()> fn) {
+    {
+      std::lock_guard<std::mutex> lock(task_lock);
+      if (stopped) {
+        return;
+      }
+      tasks.push_back(std::move(fn));
+    }
+    if (!woken.exchange(true, std::memory_order_relaxed)) {
+      eventfd_write(wake_fd, 1);
+    }
+  }
+
+  // Serve until a stop is posted. The ring is created on this thread, which
+  // alone may submit to it; started is set once it is, or to the error
+  // that prevented it.
+  void run(std::promise<void> &started) {
+    try {
+      ring = std::make_unique<io_ring>(RING_ENTRIES);
+      buffers = std::make_unique<buffer_ring>(
+          *ring, BUFFER_GROUP, BUFFER_COUNT, BUFFER_SIZE);
+    } catch (...) {
+      started.set_exception(std::current_exception());
+      return;
+    }
+    started.set_value();
+
+    arm_accept();
+    arm_wake();
+    while (!stopping || in_flight > 0) {
+      if (stopping && sessions.empty() && !wake_cancelled) {
+        cancel(nullptr, WAKE);
+        wake_cancelled = true;
+      }
+      int error = ring->enter(1);
+      metrics.ring_entered();
+      if (error < 0) {
+        throw std::system_error(
+            -error, std::system_category(), "io_uring_enter");
+      }
+      ring->for_each_completion(
+          [this](const io_uring_cqe &cqe) { handle(cqe); });
+      for (size_t i = 0; i < ready.size(); i++) {
+        ready[i]->handle_ready();
+      }
+      ready.clear();
+    }
+    {
+      std::lock_guard<std::mutex> lock(task_lock);
+      stopped = true;
+      tasks.clear();
+    }
+    buffers.reset();
+    ring.reset();
+  }
+
+  void request_stop() {
+    post([this]() { stop(); });
+  }
+};
+
+inline void uring_session::start() {
+  metrics.connection_opened();
+  loop.arm_recv(this);
+  receiving = true;
+}
+
+inline void uring_session::handle_recv(const io_uring_cqe &cqe) {
+  if (!(cqe.flags & IORING_CQE_F_MORE)) {
+    receiving = false;
+  }
+  if (cqe.res > 0) {
+    reserve(cqe.res);
+    std::memcpy(buffer.data() + tail, loop.buffers->buffer(cqe), cqe.res);
+    loop.buffers->recycle(cqe);
+    tail += cqe.res;
+    metrics.bytes_received(cqe.res);
+  } else if (cqe.res == 0) {
+    eof = true;
+  } else if (cqe.res != -ENOBUFS && cqe.res != -ECANCELED) {
+    metrics.connection_error(
+        boost::system::error_code(-cqe.res, boost::system::system_category()));
+    eof = true;
+  }
+  make_ready();
+}
+
+inline void uring_session::handle_send(int result) {
+  sending = false;
+  if (closing) {
+    make_ready();
+    return;
+  }
+  if (result < 0) {
+    metrics.connection_error(
+        boost::system::error_code(-result, boost::system::system_category()));
+    close();
+    return;
+  }
+  sent += result;
+  if (sent < response.size()) {
+    sending = true; // A short send; send the rest
+    loop.submit_send(this, response.data() + sent, response.size() - sent);
+    return;
+  }
+  metrics.bytes_sent(sent);
+  make_ready();
+}
+
+// Act once every completion of this pass is taken, so all the data the
+// pass received is handled in one batch
+inline void uring_session::make_ready() {
+  if (!ready) {
+    ready = true;
+    loop.ready.push_back(this);
+  }
+}
+
+inline void uring_session::handle_ready() {
+  ready = false;
+  if (closing) {
+    finish();
+  } else if (!busy()) {
+    process();
+  } else if (receiving && !paused && tail - head > MAX_BUFFERED) {
+    paused = true; // Stop reading until the responses go out
+    loop.cancel(this, uring_loop::RECV);
+  } else if (!receiving && !paused && !eof) {
+    loop.arm_recv(this); // The buffer ring ran dry; recv again
+    receiving = true;
+  }
+}
+
+// Handle every complete request in the buffer, then send their responses
+// together, or wait for more if none is complete
+inline void uring_session::process() {
+  size_t wanted;
+  if (!process_buffered(wanted)) {
+    close(); // Drop the connection
+    return;
+  }
+  if (response.empty() && eof) {
+    close();
+    return;
+  }
+
+  wal *log = durable_log();
+  if (log) {
+    // Acknowledge nothing until the batch's records are durable
+    syncing = true;
+    std::shared_ptr<uring_session> session = self();
+    log->on_durable(log->tail(), [session](bool ok) {
+      session->loop.post([session, ok]() {
+        session->syncing = false;
+        if (session->closing) {
+          session->finish();
+        } else if (ok) {
+          session->send();
+        } else {
+          session->close();
+        }
+      });
+    });
+    return;
+  }
+  send();
+}
+
+// Send the batched responses with any queued invalidations after them
+inline void uring_session::send() {
+  if (pushing) {
+    take_pushes(response);
+  }
+  if (response.empty()) {
+    resume();
+    return;
+  }
+  sent = 0;
+  sending = true;
+  loop.submit_send(this, response.data(), response.size());
+}
+
+// The session is idle; read again if reading was paused
+inline void uring_session::resume() {
+  paused = false;
+  if (!receiving && !eof) {
+    loop.arm_recv(this);
+    receiving = true;
+  }
+}
+
+// Shut the socket down, which ends the recv and any send, and free the
+// session once they and any log wait have finished
+inline void uring_session::close() {
+  if (closing) {
+    return;
+  }
+  closing = true;
+  stop_tracking();
+  shutdown(fd, SHUT_RDWR);
+  finish();
+}
+
+inline void uring_session::finish() {
+  if (!receiving && !sending && !syncing && !ready) {
+    loop.release(this); // May destroy the session
+  }
+}
+
+inline void uring_session::schedule_pushes() {
+  std::shared_ptr<uring_session> session = self();
+  loop.post([session]() {
+    if (!session->closing && !session->busy()) {
+      session->process(); // Its send carries the queued invalidations
+    }
+  });
+}
+
+// A uring_loop on each of a pool of threads, all accepting from one
+// listening socket, which the caller keeps open until the transport is
+// destroyed
+class uring_transport {
+private:
+  std::vector<std::unique_ptr<uring_loop>> loops;
+  std::vector<std::thread> threads;
+
+  void stop() {
+    for (std::unique_ptr<uring_loop> &loop : loops) {
+      loop->request_stop();
+    }
+    for (std::thread &thread : threads) {
+      thread.join();
+    }
+  }
+
+public:
+  // Serve connections accepted on listener with num_threads rings. Throws
+  // std::system_error if a ring cannot be set up.
+  uring_transport(int listener,
+                  size_t num_threads,
+                  kvstore &store,
+                  server_metrics &metrics,
+                  client_tracking &tracking) {
+    try {
+      for (size_t i = 0; i < std::max<size_t>(num_threads, 1); i++) {
+        loops.push_back(
+            std::make_unique<uring_loop>(listener, store, metrics, tracking));
+        std::promise<void> ready;
+        std::future<void> started = ready.get_future();
+        threads.emplace_back(
+            [loop = loops.back().get(), ready = std::move(ready)]() mutable {
+              loop->run(ready);
+            });
+        started.get();
+      }
+    } catch (...) {
+      stop(); // A loop that failed to start has already returned
+      throw;
+    }
+  }
+
+  uring_transport(const uring_transport &) = delete;
+  uring_transport &operator=(const uring_transport &) = delete;
+
+  ~uring_transport() { stop(); }
+};
+
+#endif
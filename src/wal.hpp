@@ -0,0 +1,499 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The wal class is an append-only write-ahead log of PUT, DEL, and CLEAR
+ * records. Appends only copy the record into a pending buffer; a dedicated
+ * writer thread hands everything pending to the file in one write and, per
+ * the sync policy, one fdatasync, so concurrent writers share each sync.
+ * Callers that must not acknowledge a write before it is durable register
+ * a callback with on_durable.
+ *
+ * The file starts with an 8-byte magic and the sequence number of the
+ * record before its first, followed by records of the form
+ *
+ *   checksum (4) | type (1) | key length (4) | value length (4) | key | value
+ *
+ * with big-endian integers and an FNV-1a checksum of everything after it.
+ * Records are numbered from 1 across the log's whole life, so a snapshot can
+ * name the last record it holds; truncate_through then drops the records up
+ * to it, and replay skips them. Replay stops at the first torn or corrupt
+ * record and truncates the log there, which is where a crash mid-write
+ * leaves it. Replication streams changes to replicas in the same record
+ * format.
+ */
+
+#ifndef WAL_H
+#define WAL_H
+
+#include "message.hpp"
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include <cerrno>
+#include <chrono>
+#include <condition_variable>
+#include <cstdio>
+#include <cstring>
+#include <functional>
+#include <iostream>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <thread>
+#include <utility>
+#include <vector>
+
+class wal {
+public:
+  enum sync_policy {
+    SYNC_ALWAYS,   // fdatasync every batch before acknowledging it
+    SYNC_INTERVAL, // fdatasync at most once per interval
+    SYNC_NEVER,    // Acknowledge once written; the OS decides when to sync
+  };
+
+  enum record_type : uint8_t {
+    RECORD_PUT = 1,
+    RECORD_DEL = 2,
+    RECORD_CLEAR = 3,
+    RECORD_PUT_TTL = 4, // The value is followed by its 8-byte expiry time
+  };
+
+  using durable_callback = std::function<void(bool ok)>;
+
+  // A record parsed in place; key and value view the parsed bytes
+  struct record {
+    record_type type;
+    std::string_view key;
+    std::string_view value;
+  };
+
+  static constexpr size_t RECORD_HEADER_SIZE = 13;
+
+private:
+  using clock = std::chrono::steady_clock;
+
+  static constexpr char MAGIC[8] = {'K', 'V', 'W', 'A', 'L', '0', '0', '2'};
+  static constexpr size_t HEADER_SIZE = 16;
+
+  const std::string path;
+  int fd;
+  sync_policy policy;
+  clock::duration interval;
+
+  std::mutex lock;
+  std::condition_variable wake;     // Signals the writer
+  std::condition_variable progress; // Signals threads blocked in flush
+  std::string pending;              // Records not yet handed to the writer
+  std::string writing;              // The batch the writer is writing
+  uint64_t appended = 0;            // Sequence number of the newest record
+  uint64_t written = 0;             // Newest record handed to the file
+  uint64_t durable = 0;             // Newest record the policy considers safe
+  uint64_t base = 0;                // The record before the file's first
+  bool busy = false;                // The writer is using fd outside the lock
+  std::vector<std::pair<uint64_t, durable_callback>> waiters;
+  clock::time_point last_sync;
+  bool failed = false;
+  bool stopping = false;
+  uint64_t batches = 0;
+  uint64_t syncs = 0;
+  std::thread writer;
+
+  static uint32_t checksum(const char *data, size_t length) {
+    uint32_t hash = 2166136261u;
+    for (size_t i = 0; i < length; i++) {
+      hash = (hash ^ static_cast<unsigned char>(data[i])) * 16777619u;
+    }
+    return hash;
+  }
+
+  static bool write_all(int fd, const std::string &data) {
+    size_t done = 0;
+    while (done < data.size()) {
+      ssize_t n = ::write(fd, data.data() + done, data.size() - done);
+      if (n < 0) {
+        if (errno == EINTR) {
+          continue;
+        }
+        return false;
+      }
+      done += n;
+    }
+    return true;
+  }
+
+  // Sync the directory holding path, so a file renamed into it stays there
+  // after a crash
+  static bool sync_directory(const std::string &path) {
+    size_t slash = path.rfind('/');
+    std::string directory = slash == std::string::npos ? "."
+                            : slash == 0              ? "/"
+                                                      : path.substr(0, slash);
+    int dir = ::open(directory.c_str(), O_RDONLY | O_DIRECTORY);
+    if (dir < 0) {
+      return false;
+    }
+    bool ok = fsync(dir) == 0;
+    ::close(dir);
+    return ok;
+  }
+
+  // Writer thread: move pending records to the file, sync per the policy,
+  // and release the callbacks the sync covered
+  void run() {
+    std::unique_lock<std::mutex> guard(lock);
+    for (;;) {
+      if (pending.empty() && written == durable) {
+        if (stopping) {
+          return;
+        }
+        wake.wait(guard);
+        continue;
+      }
+      bool due = clock::now() >= last_sync + interval;
+      if (pending.empty() && policy == SYNC_INTERVAL && !due && !stopping) {
+        // Only a sync is outstanding; sleep until it is due or records arrive
+        wake.wait_until(guard, last_sync + interval);
+        continue;
+      }
+
+      writing.swap(pending);
+      uint64_t batch_end = appended;
+      bool sync = policy == SYNC_ALWAYS ||
+                  (policy == SYNC_INTERVAL && (due || stopping));
+      busy = true;
+      guard.unlock();
+
+      bool ok = writing.empty() || write_all(fd, writing);
+      if (ok && sync) {
+        ok = fdatasync(fd) == 0;
+      }
+      writing.clear();
+
+      guard.lock();
+      busy = false;
+      batches++;
+      if (!ok && !failed) {
+        std::cerr << "wal: " << std::strerror(errno) << std::endl;
+        failed = true;
+      }
+      written = batch_end;
+      if (sync) {
+        syncs++;
+        last_sync = clock::now();
+      }
+      if (sync || policy == SYNC_NEVER || failed) {
+        durable = batch_end;
+      }
+      release_waiters(guard);
+    }
+  }
+
+  // The header of a file whose first record follows record before
+  static std::string file_header(uint64_t before) {
+    std::string out(MAGIC, sizeof(MAGIC));
+    out.resize(HEADER_SIZE);
+    binary_header::write_u32(&out[8], uint32_t(before >> 32));
+    binary_header::write_u32(&out[12], uint32_t(before));
+    return out;
+  }
+
+  // Empty the file and number its records from after record before
+  void reset(uint64_t before) {
+    if (ftruncate(fd, 0) != 0 || !write_all(fd, file_header(before))) {
+      throw std::runtime_error("wal: cannot initialize log");
+    }
+    base = appended = written = durable = before;
+  }
+
+  // Run every callback whose record is now durable, outside the lock
+  void release_waiters(std::unique_lock<std::mutex> &guard) {
+    std::vector<durable_callback> ready;
+    size_t kept = 0;
+    for (size_t i = 0; i < waiters.size(); i++) {
+      if (waiters[i].first <= durable) {
+        ready.push_back(std::move(waiters[i].second));
+      } else {
+        waiters[kept++] = std::move(waiters[i]);
+      }
+    }
+    waiters.resize(kept);
+    bool ok = !failed;
+    progress.notify_all();
+
+    guard.unlock();
+    for (size_t i = 0; i < ready.size(); i++) {
+      ready[i](ok);
+    }
+    guard.lock();
+  }
+
+public:
+  // Append a record to out in the log's format
+  static void encode(std::string &out,
+                     record_type type,
+                     std::string_view key,
+                     std::string_view value) {
+    size_t offset = out.size();
+    out.resize(offset + RECORD_HEADER_SIZE);
+    char *header = &out[offset];
+    header[4] = static_cast<char>(type);
+    binary_header::write_u32(header + 5, key.size());
+    binary_header::write_u32(header + 9, value.size());
+    out.append(key.data(), key.size());
+    out.append(value.data(), value.size());
+    uint32_t sum = checksum(&out[offset + 4], out.size() - offset - 4);
+    binary_header::write_u32(&out[offset], sum);
+  }
+
+  // Parse the record at the start of data into r, returning its size, or 0
+  // if data holds only part of it. intact is set to whether its checksum
+  // matches; a record that fails it is not parsed.
+  static size_t parse(std::string_view data, record &r, bool &intact) {
+    if (data.size() < RECORD_HEADER_SIZE) {
+      return 0;
+    }
+    uint64_t key_length = binary_header::read_u32(data.data() + 5);
+    uint64_t value_length = binary_header::read_u32(data.data() + 9);
+    uint64_t size = RECORD_HEADER_SIZE + key_length + value_length;
+    if (size > data.size()) {
+      return 0;
+    }
+    intact = binary_header::read_u32(data.data()) ==
+             checksum(data.data() + 4, size - 4);
+    if (intact) {
+      r.type = static_cast<record_type>(data[4]);
+      r.key = data.substr(RECORD_HEADER_SIZE, key_length);
+      r.value = data.substr(RECORD_HEADER_SIZE + key_length, value_length);
+    }
+    return size;
+  }
+
+  // Open or create the log at path. Call replay before the first append.
+  wal(const std::string &path,
+      sync_policy policy = SYNC_ALWAYS,
+      std::chrono::milliseconds interval = std::chrono::milliseconds(10))
+      : path(path),
+        fd(::open(path.c_str(), O_RDWR | O_CREAT | O_APPEND, 0644)),
+        policy(policy),
+        interval(interval),
+        last_sync(clock::now()) {
+    if (fd < 0) {
+      throw std::runtime_error("wal: cannot open " + path + ": " +
+                               std::strerror(errno));
+    }
+    writer = std::thread(&wal::run, this);
+  }
+
+  wal(const wal &) = delete;
+  wal &operator=(const wal &) = delete;
+
+  // Write and sync everything appended, then stop the writer
+  ~wal() {
+    {
+      std::lock_guard<std::mutex> guard(lock);
+      stopping = true;
+    }
+    wake.notify_one();
+    writer.join();
+    fdatasync(fd); // A clean shutdown leaves nothing unsynced
+    ::close(fd);
+  }
+
+  // Apply every intact record after record after in order with apply(type,
+  // key, value), then cut off any torn tail. after is the last record a
+  // snapshot the store was loaded from holds, or 0 without one; the log must
+  // not have been truncated past it. Returns the number of records applied.
+  template <typename Apply>
+  size_t replay(Apply &&apply, uint64_t after = 0) {
+    std::lock_guard<std::mutex> guard(lock);
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      throw std::runtime_error("wal: cannot stat log");
+    }
+    size_t length = st.st_size;
+    if (length < sizeof(MAGIC)) {
+      // New or torn before the magic was written; start over
+      reset(after);
+      return 0;
+    }
+
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      throw std::runtime_error("wal: cannot map log");
+    }
+    const char *data = static_cast<const char *>(mapped);
+    if (std::memcmp(data, MAGIC, sizeof(MAGIC)) == 0 && length < HEADER_SIZE) {
+      // Torn before the rest of the header was written
+      munmap(mapped, length);
+      reset(after);
+      return 0;
+    } else if (std::memcmp(data, MAGIC, sizeof(MAGIC)) != 0) {
+      munmap(mapped, length);
+      throw std::runtime_error("wal: not a write-ahead log");
+    }
+    base = uint64_t(binary_header::read_u32(data + 8)) << 32 |
+           binary_header::read_u32(data + 12);
+    if (base > after) {
+      munmap(mapped, length);
+      throw std::runtime_error(
+          "wal: log was truncated after record " + std::to_string(base) +
+          "; load the snapshot that holds the records before it");
+    }
+
+    size_t offset = HEADER_SIZE;
+    uint64_t sequence = base;
+    size_t applied = 0;
+    record r;
+    bool intact = false;
+    for (size_t size;
+         (size = parse(std::string_view(data + offset, length - offset),
+                       r,
+                       intact)) &&
+         intact;
+         offset += size) {
+      if (++sequence > after) {
+        apply(r.type, r.key, r.value);
+        applied++;
+      }
+    }
+    munmap(mapped, length);
+
+    if (sequence < after) {
+      // The snapshot holds every record here, and some that never reached
+      // the file; number later records after the snapshot's
+      reset(after);
+      return 0;
+    }
+    if (offset < length && ftruncate(fd, offset) != 0) {
+      throw std::runtime_error("wal: cannot truncate torn tail");
+    }
+    appended = written = durable = sequence;
+    return applied;
+  }
+
+  // Drop every record up to and including sequence, which a snapshot now
+  // holds, by rewriting the log with only the later ones and renaming it
+  // into place. Appends wait while the records that follow sequence are
+  // copied, which are only those made while the snapshot was written.
+  // Returns false, leaving the log as it was, if it cannot be rewritten,
+  // or if the rename could not be synced.
+  bool truncate_through(uint64_t sequence) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (sequence > appended) {
+      return false;
+    }
+    // Wait for the records to reach the file and the writer to let go of it
+    progress.wait(guard,
+                  [&]() { return (written >= sequence && !busy) || failed; });
+    if (failed) {
+      return false;
+    }
+    if (sequence <= base) {
+      return true;
+    }
+
+    struct stat st;
+    if (fstat(fd, &st) != 0) {
+      return false;
+    }
+    size_t length = st.st_size;
+    void *mapped = mmap(nullptr, length, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped == MAP_FAILED) {
+      return false;
+    }
+    const char *data = static_cast<const char *>(mapped);
+    size_t offset = HEADER_SIZE;
+    record r;
+    bool intact = false;
+    for (uint64_t skipped = base; skipped < sequence; skipped++) {
+      size_t size =
+          parse(std::string_view(data + offset, length - offset), r, intact);
+      if (!size || !intact) {
+        munmap(mapped, length);
+        return false;
+      }
+      offset += size;
+    }
+    std::string kept = file_header(sequence);
+    kept.append(data + offset, length - offset);
+    munmap(mapped, length);
+
+    std::string temp_path = path + ".tmp";
+    int rewritten =
+        ::open(temp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_APPEND, 0644);
+    if (rewritten < 0) {
+      return false;
+    }
+    if (!write_all(rewritten, kept) || fdatasync(rewritten) != 0 ||
+        std::rename(temp_path.c_str(), path.c_str()) != 0) {
+      ::close(rewritten);
+      std::remove(temp_path.c_str());
+      return false;
+    }
+    ::close(fd);
+    fd = rewritten;
+    base = sequence;
+    return sync_directory(path);
+  }
+
+  // Queue a record and return its sequence number. Callers order records by
+  // appending while they hold the lock that orders the change itself.
+  uint64_t append(record_type type,
+                  std::string_view key,
+                  std::string_view value = std::string_view()) {
+    std::lock_guard<std::mutex> guard(lock);
+    bool idle = pending.empty();
+    encode(pending, type, key, value);
+    if (idle) {
+      wake.notify_one();
+    }
+    return ++appended;
+  }
+
+  // Sequence number of the newest record appended so far
+  uint64_t tail() {
+    std::lock_guard<std::mutex> guard(lock);
+    return appended;
+  }
+
+  // Call done(ok) once record sequence is durable, from the writer thread,
+  // or immediately if it already is. ok is false if the log has failed.
+  void on_durable(uint64_t sequence, durable_callback done) {
+    std::unique_lock<std::mutex> guard(lock);
+    if (sequence <= durable || failed) {
+      bool ok = !failed;
+      guard.unlock();
+      done(ok);
+      return;
+    }
+    waiters.emplace_back(sequence, std::move(done));
+  }
+
+  // Block until everything appended so far is durable
+  bool flush() {
+    std::unique_lock<std::mutex> guard(lock);
+    uint64_t target = appended;
+    if (policy == SYNC_INTERVAL) {
+      wake.notify_one();
+    }
+    progress.wait(guard, [&]() { return durable >= target || failed; });
+    return !failed;
+  }
+
+  // Writes issued and fdatasyncs completed, for measuring group commit
+  uint64_t batch_count() {
+    std::lock_guard<std::mutex> guard(lock);
+    return batches;
+  }
+
+  uint64_t sync_count() {
+    std::lock_guard<std::mutex> guard(lock);
+    return syncs;
+  }
+};
+
+#endif
@@ -0,0 +1,81 @@
+/*
+ * Nicole ElChaar, CSE 411, Fall 2022
+ *
+ * The key_chooser class picks which key each generated request touches,
+ * uniformly or with Zipfian skew, for the load generator and the
+ * microbenchmarks alike.
+ */
+
+#ifndef WORKLOAD_H
+#define WORKLOAD_H
+
+#include <algorithm>
+#include <cmath>
+#include <cstdint>
+#include <random>
+#include <string>
+
+// Chooses key indices uniformly or by the Zipfian generator of Gray et al.,
+// "Quickly Generating Billion-Record Synthetic Databases", as YCSB does.
+// Ranks are scrambled so the popular keys spread over every shard.
+class key_chooser {
+private:
+  size_t num_keys;
+  double theta;
+  double zeta_n = 0;
+  double alpha = 0;
+  double eta = 0;
+
+  static double zeta(size_t n, double theta) {
+    double sum = 0;
+    for (size_t i = 1; i <= n; i++) {
+      sum += 1 / std::pow(double(i), theta);
+    }
+    return sum;
+  }
+
+  static uint64_t scramble(uint64_t rank) {
+    uint64_t hash = 14695981039346656037ull;
+    for (int i = 0; i < 8; i++) {
+      hash = (hash ^ (rank & 0xff)) * 1099511628211ull;
+      rank >>= 8;
+    }
+    return hash;
+  }
+
+public:
+  key_chooser(size_t num_keys, double theta)
+      : num_keys(num_keys), theta(theta) {
+    if (theta > 0) {
+      zeta_n = zeta(num_keys, theta);
+      alpha = 1 / (1 - theta);
+      eta = (1 - std::pow(2.0 / num_keys, 1 - theta)) /
+            (1 - zeta(2, theta) / zeta_n);
+    }
+  }
+
+  template <typename Random>
+  size_t next(Random &random) const {
+    std::uniform_real_distribution<double> uniform(0, 1);
+    if (theta <= 0) {
+      return std::uniform_int_distribution<size_t>(0, num_keys - 1)(random);
+    }
+    double u = uniform(random);
+    double uz = u * zeta_n;
+    size_t rank;
+    if (uz < 1) {
+      rank = 0;
+    } else if (uz < 1 + std::pow(0.5, theta)) {
+      rank = 1;
+    } else {
+      rank = size_t(num_keys * std::pow(eta * u - eta + 1, alpha));
+    }
+    return scramble(std::min(rank, num_keys - 1)) % num_keys;
+  }
+
+  static std::string key(size_t index) {
+    return "bench" + std::to_string(index);
+  }
+};
+
+#endif